@@ -0,0 +1,833 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include <matrix.h>
+#include <neuron.h>
+#include <random.h>
+#include <synthetic.h>
+#include <pool.h>
+#include <half.h>
+#include <augment.h>
+#include <strassen.h>
+#include <expr.h>
+#include <tune.h>
+
+/*
+ * Benchmark suite for the matrix kernels and for training throughput.
+ *
+ * Every benchmark is warmed up, then timed for at least --min-time
+ * seconds; the median and 95th percentile of the time per call are
+ * reported. A human-readable table goes to stderr and the results are
+ * written as JSON (to stdout, or to the file given with --json) so they
+ * can be tracked across commits.
+ *
+ * Training is benchmarked on synthetic MNIST-shaped data, so the suite
+ * runs without the data set, with the tuned settings and mini batch size
+ * of each network if it has any (see tune.h) and the kernels' settings
+ * restored afterwards.
+ */
+
+#ifndef GLIA_COMMIT
+#define GLIA_COMMIT "unknown"
+#endif
+
+#define MAX_RESULTS 256
+/* Each timed sample repeats the call until it takes at least this long,
+ * so clock resolution does not matter for tiny kernels. */
+#define SAMPLE_TARGET_NS 100000.0
+#define MIN_SAMPLES 5
+#define MAX_SAMPLES 10000
+/* Timed epochs of each training benchmark: with 20, the 95th percentile
+ * is not just the slowest one. */
+#define SGD_REPS 20
+
+typedef struct {
+	char name[48];
+	char shape[48];
+	int n_samples;
+	long calls_per_sample;
+	double median_ns;
+	double p95_ns;
+	double min_ns;
+	/* floating point ops and bytes touched per call (0 if meaningless) */
+	double flops;
+	double bytes;
+} BenchResult;
+
+/* Error of a product against one accumulated in long double. */
+typedef struct {
+	char name[48];
+	char shape[48];
+	int crossover;
+	/* largest error, relative to the largest element of the product */
+	double max_error;
+} AccuracyResult;
+
+typedef struct {
+	char network[48];
+	int n_train;
+	int mini_batch_size;
+	int n_epochs;
+	double median_s;
+	double p95_s;
+	double samples_per_sec;
+	double accuracy;
+} TrainResult;
+
+/* State shared by the benchmarked functions. */
+typedef struct {
+	Matrix *a, *b;
+	Network *net;
+	double *input, *output;
+	SparseVector *sparse_input;
+	ParamBuffer *nabla;
+	MatrixList delta_weights, delta_biases;
+	/* half_gemm operands: n x stride weights times batch vectors */
+	HalfFormat format;
+	uint16_t *half_w;
+	float *half_x, *half_out;
+	int half_n, half_stride, half_batch;
+	Augmenter *augmenter;
+	Dropout *dropout;
+	/* of matrix_prod_strassen */
+	int crossover;
+	/* of the layers */
+	Matrix *bias;
+} BenchCtx;
+
+typedef void (*bench_fn)(BenchCtx *ctx);
+
+static double min_time = 0.5;
+static int max_size = 4096;
+static int max_gemm_size = 512;
+static int max_strassen_size = 1024;
+static int train_samples = 10000;
+/* of --threads, 0 if not given */
+static int threads = 0;
+static char *filter = NULL;
+
+static BenchResult results[MAX_RESULTS];
+static int n_results = 0;
+static TrainResult train_results[8];
+static int n_train_results = 0;
+static AccuracyResult accuracy_results[32];
+static int n_accuracy_results = 0;
+
+static int sizes[] = {10, 32, 64, 128, 256, 512, 1024, 2048, 4096};
+static int n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Percentile p (0..1) of n sorted values. */
+static double percentile(double *sorted, int n, double p)
+{
+	int i = (int)(p * n + 0.999999) - 1;
+	if (i < 0) {
+		i = 0;
+	}
+	if (i >= n) {
+		i = n - 1;
+	}
+	return sorted[i];
+}
+
+static int skip(char *name)
+{
+	return filter != NULL && strstr(name, filter) == NULL;
+}
+
+/* Time fn(ctx) and store the result. */
+static void run_bench(char *name, char *shape, bench_fn fn, BenchCtx *ctx,
+					  double flops, double bytes)
+{
+	int n = 0;
+	long i, calls;
+	double t0, t, start, elapsed;
+	double *samples = malloc(sizeof(double) * MAX_SAMPLES);
+	BenchResult *r;
+
+	/* First call doubles as calibration of the calls per sample. */
+	t0 = now_ns();
+	fn(ctx);
+	t = now_ns() - t0;
+	calls = t >= SAMPLE_TARGET_NS ? 1 : (long)(SAMPLE_TARGET_NS / (t + 1)) + 1;
+
+	/* Warmup: a tenth of the time budget. */
+	start = now_ns();
+	do {
+		for (i = 0; i < calls; i++) {
+			fn(ctx);
+		}
+	} while (now_ns() - start < min_time * 1e8);
+
+	start = now_ns();
+	do {
+		t0 = now_ns();
+		for (i = 0; i < calls; i++) {
+			fn(ctx);
+		}
+		samples[n++] = (now_ns() - t0) / calls;
+		elapsed = now_ns() - start;
+	} while (n < MAX_SAMPLES && (n < MIN_SAMPLES || elapsed < min_time * 1e9));
+
+	qsort(samples, n, sizeof(double), cmp_double);
+	r = &results[n_results++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	snprintf(r->shape, sizeof(r->shape), "%s", shape);
+	r->n_samples = n;
+	r->calls_per_sample = calls;
+	r->median_ns = percentile(samples, n, 0.5);
+	r->p95_ns = percentile(samples, n, 0.95);
+	r->min_ns = samples[0];
+	r->flops = flops;
+	r->bytes = bytes;
+	fprintf(stderr, "%-34s %-16s %12.0f %12.0f %9.3f %9.3f\n",
+			r->name, r->shape, r->median_ns, r->p95_ns,
+			flops / r->median_ns, bytes / r->median_ns);
+	free(samples);
+}
+
+/*** Benchmarked functions ***/
+
+static void do_matrix_prod_optim(BenchCtx *ctx)
+{
+	free_matrix(matrix_prod_optim(ctx->a, ctx->b));
+}
+
+static void do_matrix_prod_blocked(BenchCtx *ctx)
+{
+	free_matrix(matrix_prod_blocked(ctx->a, ctx->b));
+}
+
+static void do_matrix_prod_strassen(BenchCtx *ctx)
+{
+	free_matrix(matrix_prod_strassen(ctx->a, ctx->b, ctx->crossover));
+}
+
+/* What follows the product in a layer applied to a batch, a =
+ * sigmoid(z + bias): with eager calls (a pass adding the bias in place,
+ * then a pass into a new matrix) and as a fused expression (one pass).
+ * The bias is tiny, so that z barely changes over the calls. */
+static void do_layer_eager(BenchCtx *ctx)
+{
+	matrix_add_columnwise(ctx->a, ctx->bias);
+	free_matrix(sigmoid_vect(ctx->a));
+}
+
+static void do_layer_fused(BenchCtx *ctx)
+{
+	ExprGraph g;
+	expr_reset(&g);
+	free_matrix(expr_eval(&g, expr_sigmoid(&g, expr_add_columnwise(&g,
+					expr_matrix(&g, ctx->a), expr_matrix(&g, ctx->bias)))));
+}
+
+static void do_transpose(BenchCtx *ctx)
+{
+	free_matrix(transpose(ctx->a));
+}
+
+static void do_matrix_add(BenchCtx *ctx)
+{
+	matrix_add(ctx->a, ctx->b);
+}
+
+static void do_sigmoid_vect(BenchCtx *ctx)
+{
+	free_matrix(sigmoid_vect(ctx->a));
+}
+
+static void do_sigmoid_prime_vect(BenchCtx *ctx)
+{
+	free_matrix(sigmoid_prime_vect(ctx->a));
+}
+
+static void do_sigmoid_prime_from_sigmoid_vect(BenchCtx *ctx)
+{
+	free_matrix(sigmoid_prime_from_sigmoid_vect(ctx->a));
+}
+
+static void do_feedforward(BenchCtx *ctx)
+{
+	free_matrix(feedforward(ctx->net, ctx->input));
+}
+
+static void do_backpropagate(BenchCtx *ctx)
+{
+	int i;
+	backpropagate(ctx->net, ctx->input, ctx->output,
+				  ctx->delta_weights, ctx->delta_biases);
+	for (i = 0; i < ctx->net->n_layers - 1; i++) {
+		free_matrix(ctx->delta_weights[i]);
+		free_matrix(ctx->delta_biases[i]);
+	}
+}
+
+static void do_backpropagate_sparse(BenchCtx *ctx)
+{
+	int i;
+	backpropagate_sparse(ctx->net, ctx->sparse_input, ctx->output,
+						 ctx->delta_weights, ctx->delta_biases);
+	for (i = 0; i < ctx->net->n_layers - 1; i++) {
+		free_matrix(ctx->delta_weights[i]);
+		free_matrix(ctx->delta_biases[i]);
+	}
+}
+
+static void do_backpropagate_accumulate(BenchCtx *ctx)
+{
+	backpropagate_accumulate(ctx->net, ctx->input, NULL, ctx->output,
+							 ctx->nabla);
+}
+
+static void do_backpropagate_dropout(BenchCtx *ctx)
+{
+	backpropagate_dropout(ctx->net, ctx->input, NULL, ctx->output,
+						  ctx->nabla, ctx->dropout);
+}
+
+static void do_half_gemm(BenchCtx *ctx)
+{
+	half_gemm(ctx->format, ctx->half_w, ctx->half_n, ctx->half_stride,
+			  ctx->half_x, ctx->half_batch, ctx->half_out);
+}
+
+static void do_augment_image(BenchCtx *ctx)
+{
+	augment_image(ctx->augmenter, ctx->input, ctx->output);
+}
+
+/*** Suites ***/
+
+static Matrix *random_matrix(int n_rows, int n_cols)
+{
+	Matrix *m = create_matrix(n_rows, n_cols);
+	matrix_fill_random(m);
+	return m;
+}
+
+static void bench_square(char *name, bench_fn fn, int limit,
+						 double flops_per_elem, double bytes_per_elem)
+{
+	int i, n;
+	char shape[48];
+	BenchCtx ctx = {0};
+	if (skip(name)) {
+		return;
+	}
+	for (i = 0; i < n_sizes; i++) {
+		n = sizes[i];
+		if (n > limit) {
+			break;
+		}
+		ctx.a = random_matrix(n, n);
+		ctx.b = random_matrix(n, n);
+		snprintf(shape, sizeof(shape), "%dx%d", n, n);
+		run_bench(name, shape, fn, &ctx, flops_per_elem * n * n,
+				  bytes_per_elem * n * n);
+		free_matrix(ctx.a);
+		free_matrix(ctx.b);
+	}
+}
+
+static void bench_gemm(void)
+{
+	int i, n;
+	char shape[48];
+	BenchCtx ctx = {0};
+	/* Square products: (n x n) * (n x n) */
+	if (!skip("matrix_prod_optim")) {
+		for (i = 0; i < n_sizes && sizes[i] <= max_gemm_size; i++) {
+			n = sizes[i];
+			ctx.a = random_matrix(n, n);
+			ctx.b = random_matrix(n, n);
+			snprintf(shape, sizeof(shape), "%dx%dx%d", n, n, n);
+			run_bench("matrix_prod_optim", shape, do_matrix_prod_optim,
+					  &ctx, 2.0 * n * n * n, 3.0 * 8 * n * n);
+			free_matrix(ctx.a);
+			free_matrix(ctx.b);
+		}
+	}
+	/* Matrix-vector products (n x n) * (n x 1), as used by the network. */
+	if (!skip("matrix_prod_optim_gemv")) {
+		for (i = 0; i < n_sizes && sizes[i] <= max_size; i++) {
+			n = sizes[i];
+			ctx.a = random_matrix(n, n);
+			ctx.b = random_matrix(n, 1);
+			snprintf(shape, sizeof(shape), "%dx%dx1", n, n);
+			run_bench("matrix_prod_optim_gemv", shape, do_matrix_prod_optim,
+					  &ctx, 2.0 * n * n, 8.0 * (n * n + 2 * n));
+			free_matrix(ctx.a);
+			free_matrix(ctx.b);
+		}
+	}
+}
+
+/* a x b accumulated in long double, rounded to double. */
+static Matrix *reference_product(Matrix *a, Matrix *b)
+{
+	int i, j, s;
+	long double sum;
+	Matrix *ref = create_matrix(a->n_rows, b->n_cols);
+	for (i = 0; i < a->n_rows; i++) {
+		for (j = 0; j < b->n_cols; j++) {
+			sum = 0;
+			for (s = 0; s < a->n_cols; s++) {
+				sum += (long double)a->data[i][s] * b->data[s][j];
+			}
+			ref->data[i][j] = sum;
+		}
+	}
+	return ref;
+}
+
+/* Largest error of res against ref, relative to the largest element of
+ * ref, stored as a result.
+ */
+static void product_accuracy(char *name, int crossover, Matrix *ref,
+							 Matrix *res)
+{
+	int i;
+	double err = 0, scale = 0;
+	AccuracyResult *r = &accuracy_results[n_accuracy_results++];
+	for (i = 0; i < ref->n_rows * ref->n_cols; i++) {
+		err = fmax(err, fabs(res->data[0][i] - ref->data[0][i]));
+		scale = fmax(scale, fabs(ref->data[0][i]));
+	}
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	snprintf(r->shape, sizeof(r->shape), "%dx%d", ref->n_rows, ref->n_cols);
+	r->crossover = crossover;
+	r->max_error = err / scale;
+	fprintf(stderr, "%-34s %-16s crossover %4d  max relative error %.3g\n",
+			r->name, r->shape, crossover, r->max_error);
+}
+
+/* Large square products: the blocked classical kernel against
+ * Strassen-Winograd with crossovers from 32 to n / 2, to find the
+ * crossover (the smallest n at which one level pays off, and the
+ * fastest crossover above it), then the errors of both against a long
+ * double product, on elements in [-0.5, 0.5] so that sums cancel.
+ */
+static void bench_strassen(void)
+{
+	int i, n, c;
+	char shape[48], name[48];
+	Matrix *ref, *res;
+	BenchCtx ctx = {0};
+	if (skip("matrix_prod_strassen") && skip("matrix_prod_blocked")) {
+		return;
+	}
+	for (n = 128; n <= max_strassen_size; n *= 2) {
+		ctx.a = random_matrix(n, n);
+		ctx.b = random_matrix(n, n);
+		for (i = 0; i < n * n; i++) {
+			ctx.a->data[0][i] -= 0.5;
+			ctx.b->data[0][i] -= 0.5;
+		}
+		snprintf(shape, sizeof(shape), "%dx%dx%d", n, n, n);
+		run_bench("matrix_prod_blocked", shape, do_matrix_prod_blocked,
+				  &ctx, 2.0 * n * n * n, 3.0 * 8 * n * n);
+		for (c = 32; c <= n / 2; c *= 2) {
+			ctx.crossover = c;
+			snprintf(name, sizeof(name), "matrix_prod_strassen_%d", c);
+			/* Flops of the classical product, for comparison */
+			run_bench(name, shape, do_matrix_prod_strassen, &ctx,
+					  2.0 * n * n * n, 3.0 * 8 * n * n);
+		}
+		if (n <= 1024) {
+			ref = reference_product(ctx.a, ctx.b);
+			res = matrix_prod_blocked(ctx.a, ctx.b);
+			product_accuracy("matrix_prod_blocked", 0, ref, res);
+			free_matrix(res);
+			for (c = 32; c <= n / 2; c *= 2) {
+				res = matrix_prod_strassen(ctx.a, ctx.b, c);
+				product_accuracy("matrix_prod_strassen", c, ref, res);
+				free_matrix(res);
+			}
+			free_matrix(ref);
+		}
+		free_matrix(ctx.a);
+		free_matrix(ctx.b);
+	}
+}
+
+/* A layer of n x n weights applied to a batch of 64 inputs, with double
+ * weights (matrix_prod_optim) and with 16-bit ones (half_gemm): the
+ * large layers are bound by the bandwidth of the weights.
+ */
+static void bench_half(void)
+{
+	int i, j, n, batch = 64;
+	long seed = 42;
+	char shape[48];
+	BenchCtx ctx = {0};
+	HalfFormat format;
+	for (i = 0; i < n_sizes && sizes[i] <= max_size; i++) {
+		n = sizes[i];
+		snprintf(shape, sizeof(shape), "%dx%dx%d", n, n, batch);
+		if (!skip("matrix_prod_optim_batch")) {
+			ctx.a = random_matrix(n, n);
+			ctx.b = random_matrix(n, batch);
+			run_bench("matrix_prod_optim_batch", shape, do_matrix_prod_optim,
+					  &ctx, 2.0 * n * n * batch,
+					  8.0 * (n * n + 2.0 * n * batch));
+			free_matrix(ctx.a);
+			free_matrix(ctx.b);
+		}
+		for (format = HALF_FP16; format <= HALF_BF16; format++) {
+			char name[48];
+			snprintf(name, sizeof(name), "half_gemm_%s",
+					 half_format_name(format));
+			if (skip(name)) {
+				continue;
+			}
+			ctx.format = format;
+			ctx.half_n = n;
+			ctx.half_stride = half_stride(n);
+			ctx.half_batch = batch;
+			ctx.half_w = half_alloc(2L * n * ctx.half_stride);
+			ctx.half_x = half_alloc(4L * batch * ctx.half_stride);
+			ctx.half_out = malloc(sizeof(float) * batch * n);
+			for (j = 0; j < n * ctx.half_stride; j++) {
+				ctx.half_w[j] = float_to_half(format,
+												   2 * rand0(&seed) - 1);
+			}
+			for (j = 0; j < batch * ctx.half_stride; j++) {
+				ctx.half_x[j] = rand0(&seed);
+			}
+			run_bench(name, shape, do_half_gemm, &ctx, 2.0 * n * n * batch,
+					  2.0 * n * n + 8.0 * n * batch);
+			free(ctx.half_w);
+			free(ctx.half_x);
+			free(ctx.half_out);
+		}
+	}
+}
+
+/* The bias and sigmoid of layers of n units for a batch of 64 (as in
+ * feedforward_batch), eager against fused.
+ */
+static void bench_layer(void)
+{
+	int i, j, n, batch = 64;
+	char shape[48];
+	BenchCtx ctx = {0};
+	for (i = 0; i < n_sizes && sizes[i] <= max_size; i++) {
+		n = sizes[i];
+		ctx.a = random_matrix(n, batch);
+		ctx.bias = random_matrix(n, 1);
+		for (j = 0; j < n; j++) {
+			ctx.bias->data[j][0] *= 1e-12;
+		}
+		snprintf(shape, sizeof(shape), "%dx%d", n, batch);
+		if (!skip("layer_eager")) {
+			run_bench("layer_eager", shape, do_layer_eager, &ctx, 0,
+					  8.0 * 5 * n * batch);
+		}
+		if (!skip("layer_fused")) {
+			run_bench("layer_fused", shape, do_layer_fused, &ctx, 0,
+					  8.0 * 2 * n * batch);
+		}
+		free_matrix(ctx.a);
+		free_matrix(ctx.bias);
+	}
+}
+
+static void bench_network(int hidden)
+{
+	int i, in, out;
+	char shape[48];
+	double flops_ff = 0, flops_bp = 0, flops_sp;
+	double *sparse_input;
+	double rates[2] = {0.2, 0.5};
+	BenchCtx ctx = {0};
+	long seed = 42;
+	if (hidden > max_size) {
+		return;
+	}
+	ctx.net = create_network(3, 784, hidden, 10);
+	ctx.input = malloc(sizeof(double) * 784);
+	ctx.output = calloc(10, sizeof(double));
+	ctx.output[3] = 1.0;
+	for (i = 0; i < 784; i++) {
+		ctx.input[i] = rand0(&seed);
+	}
+	ctx.delta_weights = malloc(sizeof(Matrix *) * (ctx.net->n_layers - 1));
+	ctx.delta_biases = malloc(sizeof(Matrix *) * (ctx.net->n_layers - 1));
+	for (i = 0; i < ctx.net->n_layers - 1; i++) {
+		in = ctx.net->sizes[i];
+		out = ctx.net->sizes[i+1];
+		flops_ff += 2.0 * in * out;
+		/* forward + weight gradient + error propagation */
+		flops_bp += 2.0 * in * out + in * out + (i > 0 ? 2.0 * in * out : 0);
+	}
+	snprintf(shape, sizeof(shape), "784-%d-10", hidden);
+	if (!skip("feedforward")) {
+		run_bench("feedforward", shape, do_feedforward, &ctx, flops_ff,
+				  8.0 * ctx.net->params->size);
+	}
+	if (!skip("backpropagate")) {
+		run_bench("backpropagate", shape, do_backpropagate, &ctx, flops_bp,
+				  16.0 * ctx.net->params->size);
+	}
+	/* The same adding the gradient straight to a ParamBuffer */
+	if (!skip("backpropagate_accumulate")) {
+		ctx.nabla = create_param_buffer(ctx.net->n_layers, ctx.net->sizes);
+		run_bench("backpropagate_accumulate", shape,
+				  do_backpropagate_accumulate, &ctx, flops_bp,
+				  16.0 * ctx.net->params->size);
+		free_param_buffer(ctx.nabla);
+	}
+	/* The same with dropout of 20% of the inputs and half the hidden
+	 * units, its masks drawn for every call */
+	if (!skip("backpropagate_dropout")) {
+		ctx.nabla = create_param_buffer(ctx.net->n_layers, ctx.net->sizes);
+		ctx.dropout = create_dropout(ctx.net, rates, 42);
+		run_bench("backpropagate_dropout", shape, do_backpropagate_dropout,
+				  &ctx, flops_bp, 16.0 * ctx.net->params->size);
+		destroy_dropout(ctx.dropout);
+		free_param_buffer(ctx.nabla);
+	}
+	/* The same with an MNIST-like input (~20% nonzeros): the first layer
+	 * only does the work of its nonzero inputs. */
+	if (!skip("backpropagate_sparse")) {
+		sparse_input = calloc(784, sizeof(double));
+		for (i = 0; i < 784; i++) {
+			if (rand0(&seed) < 0.2) {
+				sparse_input[i] = rand0(&seed);
+			}
+		}
+		ctx.sparse_input = array_to_sparse_vector(sparse_input, 784);
+		flops_sp = flops_bp - 3.0 * (784 - ctx.sparse_input->nnz) * hidden;
+		run_bench("backpropagate_sparse", shape, do_backpropagate_sparse,
+				  &ctx, flops_sp, 16.0 * ctx.net->params->size);
+		free_sparse_vector(ctx.sparse_input);
+		free(sparse_input);
+	}
+	free(ctx.delta_weights);
+	free(ctx.delta_biases);
+	free(ctx.input);
+	free(ctx.output);
+	destroy_network(ctx.net);
+}
+
+/* Augmentation of one 28x28 image, to compare with the time it is
+ * trained for (backpropagate): affine warp only, plus elastic distortion,
+ * plus noise.
+ */
+static void bench_augment(void)
+{
+	int i;
+	long seed = 42;
+	char *names[] = {"augment_affine", "augment_elastic", "augment_noise"};
+	AugmentOptions opts = {28, 28, 2.0, 15.0, 0.1, 0.1, 0.0, 0.0, 0.0};
+	BenchCtx ctx = {0};
+	ctx.input = malloc(sizeof(double) * 784);
+	ctx.output = malloc(sizeof(double) * 784);
+	for (i = 0; i < 784; i++) {
+		ctx.input[i] = rand0(&seed);
+	}
+	for (i = 0; i < 3; i++) {
+		if (i == 1) {
+			opts.elastic_alpha = 34.0;
+			opts.elastic_sigma = 4.0;
+		} else if (i == 2) {
+			opts.noise = 0.1;
+		}
+		if (skip(names[i])) {
+			continue;
+		}
+		ctx.augmenter = create_augmenter(&opts, 42);
+		run_bench(names[i], "28x28", do_augment_image, &ctx, 0,
+				  8.0 * 784 * 2);
+		destroy_augmenter(ctx.augmenter);
+	}
+	free(ctx.input);
+	free(ctx.output);
+}
+
+/* End-to-end training throughput: epochs of SGD_epoch after an untimed
+ * warm-up one, without the evaluation SGD does after each.
+ */
+static void bench_sgd(int hidden)
+{
+	int rep, mini_batch_size;
+	double times[SGD_REPS], t0;
+	TrainResult *r;
+	TrainData *data;
+	Network *net;
+	SGDWorkspace *ws;
+	TuneConfig saved, tuned;
+	if (skip("SGD") || hidden > max_size) {
+		return;
+	}
+	data = create_synthetic_data(train_samples, train_samples / 10,
+								 784, 10, 0.2, 1234);
+	net = create_network(3, 784, hidden, 10);
+	tune_current(&saved);
+	tune_load(net);
+	if (threads > 0) {
+		pool_set_threads(threads);
+	}
+	tune_current(&tuned);
+	mini_batch_size = tuned.mini_batch_size;
+	ws = create_sgd_workspace(net, data, mini_batch_size, 42);
+	SGD_epoch(net, data, ws, 0.5, 5.0, 0);
+	for (rep = 0; rep < SGD_REPS; rep++) {
+		t0 = now_ns();
+		SGD_epoch(net, data, ws, 0.5, 5.0, 0);
+		times[rep] = (now_ns() - t0) / 1e9;
+	}
+	qsort(times, SGD_REPS, sizeof(double), cmp_double);
+	r = &train_results[n_train_results++];
+	snprintf(r->network, sizeof(r->network), "784-%d-10", hidden);
+	r->n_train = data->n_train;
+	r->mini_batch_size = mini_batch_size;
+	r->n_epochs = SGD_REPS;
+	r->median_s = percentile(times, SGD_REPS, 0.5);
+	r->p95_s = percentile(times, SGD_REPS, 0.95);
+	r->samples_per_sec = data->n_train / r->median_s;
+	r->accuracy = test_accuracy(net, data);
+	fprintf(stderr, "%-34s %-16s %10.0f samples/s  (accuracy %.2f%%)\n",
+			"SGD", r->network, r->samples_per_sec, 100 * r->accuracy);
+	tune_apply(&saved);
+	free_sgd_workspace(ws);
+	destroy_network(net);
+	free_training_data(data);
+}
+
+static void write_json(FILE *f)
+{
+	int i;
+	BenchResult *r;
+	TrainResult *t;
+	fprintf(f, "{\n  \"commit\": \"%s\",\n  \"timestamp\": %ld,\n",
+			GLIA_COMMIT, (long)time(NULL));
+	fprintf(f, "  \"min_time_s\": %g,\n  \"threads\": %d,\n", min_time,
+			pool_threads());
+	fprintf(f, "  \"kernels\": [");
+	for (i = 0; i < n_results; i++) {
+		r = &results[i];
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"shape\": \"%s\", "
+				"\"samples\": %d, \"calls_per_sample\": %ld, "
+				"\"median_ns\": %.1f, \"p95_ns\": %.1f, \"min_ns\": %.1f, "
+				"\"gflops\": %.4f, \"gbytes_per_s\": %.4f}",
+				i ? "," : "", r->name, r->shape, r->n_samples,
+				r->calls_per_sample, r->median_ns, r->p95_ns, r->min_ns,
+				r->flops / r->median_ns, r->bytes / r->median_ns);
+	}
+	fprintf(f, "\n  ],\n  \"accuracy\": [");
+	for (i = 0; i < n_accuracy_results; i++) {
+		fprintf(f, "%s\n    {\"name\": \"%s\", \"shape\": \"%s\", "
+				"\"crossover\": %d, \"max_relative_error\": %.3e}",
+				i ? "," : "", accuracy_results[i].name,
+				accuracy_results[i].shape, accuracy_results[i].crossover,
+				accuracy_results[i].max_error);
+	}
+	fprintf(f, "\n  ],\n  \"training\": [");
+	for (i = 0; i < n_train_results; i++) {
+		t = &train_results[i];
+		fprintf(f, "%s\n    {\"name\": \"SGD\", \"network\": \"%s\", "
+				"\"n_train\": %d, \"mini_batch_size\": %d, \"epochs\": %d, "
+				"\"median_s\": %.4f, \"p95_s\": %.4f, "
+				"\"samples_per_sec\": %.1f, \"accuracy\": %.4f}",
+				i ? "," : "", t->network, t->n_train, t->mini_batch_size,
+				t->n_epochs, t->median_s, t->p95_s, t->samples_per_sec,
+				t->accuracy);
+	}
+	fprintf(f, "\n  ]\n}\n");
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --min-time S       seconds to time each benchmark (default %g)\n"
+			"  --max-size N       largest matrix/layer size (default %d)\n"
+			"  --max-gemm-size N  largest square product (default %d)\n"
+			"  --max-strassen-size N\n"
+			"                     largest Strassen product (default %d)\n"
+			"  --train-samples N  synthetic training set size (default %d)\n"
+			"  --filter NAME      only run benchmarks whose name contains NAME\n"
+			"  --threads N        threads of the kernels (default: all CPUs)\n"
+			"  --json FILE        write the JSON results to FILE, not stdout\n",
+			prog, min_time, max_size, max_gemm_size, max_strassen_size,
+			train_samples);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	char *json_path = NULL;
+	FILE *f;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+			min_time = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-size") && i + 1 < argc) {
+			max_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-gemm-size") && i + 1 < argc) {
+			max_gemm_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-strassen-size") && i + 1 < argc) {
+			max_strassen_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--train-samples") && i + 1 < argc) {
+			train_samples = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+			pool_set_threads(threads);
+		} else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+			json_path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	fprintf(stderr, "%-34s %-16s %12s %12s %9s %9s\n", "benchmark", "shape",
+			"median ns", "p95 ns", "GFLOP/s", "GB/s");
+	bench_gemm();
+	bench_strassen();
+	bench_square("transpose", do_transpose, max_size, 0, 16);
+	bench_square("matrix_add", do_matrix_add, max_size, 1, 24);
+	bench_square("sigmoid_vect", do_sigmoid_vect, max_size, 0, 16);
+	bench_square("sigmoid_prime_vect", do_sigmoid_prime_vect, max_size, 0, 16);
+	bench_square("sigmoid_prime_from_sigmoid_vect",
+				 do_sigmoid_prime_from_sigmoid_vect, max_size, 2, 16);
+	bench_half();
+	bench_layer();
+	bench_network(30);
+	bench_network(128);
+	bench_network(512);
+	bench_network(2048);
+	bench_augment();
+	bench_sgd(30);
+	bench_sgd(128);
+
+	if (json_path != NULL) {
+		f = fopen(json_path, "w");
+		if (!f) {
+			fprintf(stderr, "Could not open %s.\n", json_path);
+			return 1;
+		}
+		write_json(f);
+		fclose(f);
+	} else {
+		write_json(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <neuron.h>
+#include <synthetic.h>
+
+/*
+ * Topology-specialized kernels against the generic path.
+ *
+ * The kernels of the 784-30-10 network are generated by bin/specialize
+ * at build time (see specialize.h and the Makefile): 'spec' takes the
+ * parameters as an argument, 'spec_const' has random weights embedded.
+ * A generic Network gets the embedded weights, then both paths run over
+ * the same samples: feedforward against spec_feedforward and
+ * spec_const_feedforward_embedded, backpropagate_accumulate against
+ * spec_backprop. Prints their time per sample and the speedups, after
+ * checking that they agree (exit status 1 if they do not).
+ */
+
+#include <spec.c>
+#include <spec_const.c>
+
+#define N_SAMPLES 1000
+
+/* Largest relative difference allowed between the two paths */
+#define TOLERANCE 1e-12
+
+static double min_time = 0.5;
+
+static struct {
+	Network *net;
+	TrainData *data;
+	ParamBuffer *nabla;
+	double *flat_nabla;
+	double out[64];
+} ctx;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void generic_forward(int i)
+{
+	free_matrix(feedforward(ctx.net, ctx.data->inputs_training[i]));
+}
+
+static void spec_forward_run(int i)
+{
+	spec_feedforward(ctx.net->params->data, ctx.data->inputs_training[i],
+					 ctx.out);
+}
+
+static void embedded_forward(int i)
+{
+	spec_const_feedforward_embedded(ctx.data->inputs_training[i], ctx.out);
+}
+
+static void generic_backprop(int i)
+{
+	backpropagate_accumulate(ctx.net, ctx.data->inputs_training[i], NULL,
+							 ctx.data->labels_training[i], ctx.nabla);
+}
+
+static void spec_backprop_run(int i)
+{
+	spec_backprop(ctx.net->params->data, ctx.data->inputs_training[i],
+				  ctx.data->labels_training[i], ctx.flat_nabla);
+}
+
+/* Nanoseconds per sample of run, over passes on the samples for at
+ * least min_time seconds after one warm-up pass. */
+static double time_per_sample(void (*run)(int))
+{
+	int i;
+	long n = 0;
+	double start, t;
+	for (i = 0; i < N_SAMPLES; i++) {
+		run(i);
+	}
+	start = now_ns();
+	do {
+		for (i = 0; i < N_SAMPLES; i++) {
+			run(i);
+		}
+		n += N_SAMPLES;
+		t = now_ns() - start;
+	} while (t < min_time * 1e9);
+	return t / n;
+}
+
+/* Largest difference between a and b, relative to the largest |b|. */
+static double max_rel_diff(double *a, double *b, long n)
+{
+	long i;
+	double diff = 0.0, norm = 0.0;
+	for (i = 0; i < n; i++) {
+		diff = fmax(diff, fabs(a[i] - b[i]));
+		norm = fmax(norm, fabs(b[i]));
+	}
+	return norm > 0.0 ? diff / norm : diff;
+}
+
+/* Runs both paths over every sample and returns the largest relative
+ * difference of their outputs and gradients. */
+static double compare(void)
+{
+	int i, n_out = ctx.net->sizes[ctx.net->n_layers - 1];
+	double worst = 0.0;
+	Matrix *a;
+	memset(ctx.nabla->data, 0, sizeof(double) * ctx.nabla->size);
+	memset(ctx.flat_nabla, 0, sizeof(double) * spec_N_PARAMS);
+	for (i = 0; i < N_SAMPLES; i++) {
+		a = feedforward(ctx.net, ctx.data->inputs_training[i]);
+		spec_forward_run(i);
+		worst = fmax(worst, max_rel_diff(ctx.out, a->data[0], n_out));
+		embedded_forward(i);
+		worst = fmax(worst, max_rel_diff(ctx.out, a->data[0], n_out));
+		free_matrix(a);
+		generic_backprop(i);
+		spec_backprop_run(i);
+	}
+	return fmax(worst, max_rel_diff(ctx.flat_nabla, ctx.nabla->data,
+									spec_N_PARAMS));
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --min-time S     seconds to time each kernel (default %g)\n"
+			"  --check          only check that the two paths agree\n",
+			prog, min_time);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, check_only = 0;
+	int sizes[spec_N_LAYERS] = spec_SIZES;
+	double diff, t_ff, t_spec, t_emb, t_bp, t_spec_bp;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+			min_time = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--check")) {
+			check_only = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	ctx.net = create_network_from_sizes(spec_N_LAYERS, sizes);
+	if (ctx.net->params->size != spec_N_PARAMS ||
+		spec_N_PARAMS != spec_const_N_PARAMS) {
+		fprintf(stderr, "specialized ERROR: the generated kernels do not "
+				"match.\n");
+		return 1;
+	}
+	memcpy(ctx.net->params->data, spec_const_params,
+		   sizeof(double) * spec_N_PARAMS);
+	ctx.data = create_synthetic_data(N_SAMPLES, 0, sizes[0],
+									 sizes[spec_N_LAYERS - 1], 0.2, 1234);
+	ctx.nabla = create_param_buffer(spec_N_LAYERS, sizes);
+	ctx.flat_nabla = calloc(spec_N_PARAMS, sizeof(double));
+
+	diff = compare();
+	printf("%s: largest relative difference %.3g\n",
+		   diff <= TOLERANCE ? "OK" : "FAIL", diff);
+	if (diff > TOLERANCE || check_only) {
+		goto out;
+	}
+
+	t_ff = time_per_sample(generic_forward);
+	t_spec = time_per_sample(spec_forward_run);
+	t_emb = time_per_sample(embedded_forward);
+	t_bp = time_per_sample(generic_backprop);
+	t_spec_bp = time_per_sample(spec_backprop_run);
+	printf("%-28s %10s %8s\n", "kernel (784-30-10)", "ns/sample", "speedup");
+	printf("%-28s %10.0f %8s\n", "feedforward", t_ff, "");
+	printf("%-28s %10.0f %7.2fx\n", "spec_feedforward", t_spec,
+		   t_ff / t_spec);
+	printf("%-28s %10.0f %7.2fx\n", "spec_feedforward_embedded", t_emb,
+		   t_ff / t_emb);
+	printf("%-28s %10.0f %8s\n", "backpropagate_accumulate", t_bp, "");
+	printf("%-28s %10.0f %7.2fx\n", "spec_backprop", t_spec_bp,
+		   t_bp / t_spec_bp);
+
+out:
+	free(ctx.flat_nabla);
+	free_param_buffer(ctx.nabla);
+	free_training_data(ctx.data);
+	destroy_network(ctx.net);
+	return diff > TOLERANCE;
+}
@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <dist.h>
+#include <vector.h>
+
+/*
+ * Data-parallel training over several processes: every process (rank)
+ * holds a copy of the network and trains on its own shard of the data;
+ * after each mini batch the gradients are summed with a ring all-reduce
+ * and every rank applies the same update.
+ *
+ * The ranks talk through Unix domain sockets in a directory shared by
+ * all of them, so they must run on the same host.
+ */
+
+/* How long ring_connect waits for the next rank to show up. */
+#define RING_CONNECT_TIMEOUT_MS 30000
+
+static void socket_path(struct sockaddr_un *addr, char *dir, int rank)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/rank-%d.sock",
+			 dir, rank);
+}
+
+/* Join the ring of n_ranks processes as 'rank', through sockets in
+ * 'dir'. Every rank must call it with the same dir and n_ranks; it
+ * blocks until both neighbours are connected. Returns NULL on error.
+ */
+Ring *ring_connect(char *dir, int rank, int n_ranks)
+{
+	int listen_fd, waited = 0;
+	struct sockaddr_un own, next;
+	struct timespec pause = {0, 1000000};
+	Ring *ring = malloc(sizeof(Ring));
+	ring->rank = rank;
+	ring->n_ranks = n_ranks;
+	ring->send_fd = -1;
+	ring->recv_fd = -1;
+	ring->buf = NULL;
+	ring->buf_size = 0;
+	if (n_ranks <= 1) {
+		return ring;
+	}
+
+	socket_path(&own, dir, rank);
+	socket_path(&next, dir, (rank + 1) % n_ranks);
+	unlink(own.sun_path);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0 ||
+		bind(listen_fd, (struct sockaddr *)&own, sizeof(own)) < 0 ||
+		listen(listen_fd, 1) < 0) {
+		fprintf(stderr, "ring_connect ERROR: cannot listen on %s: %s\n",
+				own.sun_path, strerror(errno));
+		goto fail;
+	}
+	/* Connect to the next rank, which may not be listening yet */
+	for (;;) {
+		ring->send_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (connect(ring->send_fd, (struct sockaddr *)&next,
+					sizeof(next)) == 0) {
+			break;
+		}
+		close(ring->send_fd);
+		ring->send_fd = -1;
+		if ((errno != ENOENT && errno != ECONNREFUSED) ||
+			waited++ >= RING_CONNECT_TIMEOUT_MS) {
+			fprintf(stderr, "ring_connect ERROR: cannot connect to %s: %s\n",
+					next.sun_path, strerror(errno));
+			goto fail;
+		}
+		nanosleep(&pause, NULL);
+	}
+	/* And wait for the previous one */
+	ring->recv_fd = accept(listen_fd, NULL, NULL);
+	if (ring->recv_fd < 0) {
+		fprintf(stderr, "ring_connect ERROR: accept failed: %s\n",
+				strerror(errno));
+		goto fail;
+	}
+	close(listen_fd);
+	unlink(own.sun_path);
+	fcntl(ring->send_fd, F_SETFL, O_NONBLOCK);
+	fcntl(ring->recv_fd, F_SETFL, O_NONBLOCK);
+	return ring;
+
+fail:
+	if (listen_fd >= 0) {
+		close(listen_fd);
+	}
+	unlink(own.sun_path);
+	ring_close(ring);
+	return NULL;
+}
+
+/* Leave the ring and free it. */
+void ring_close(Ring *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+	if (ring->send_fd >= 0) {
+		close(ring->send_fd);
+	}
+	if (ring->recv_fd >= 0) {
+		close(ring->recv_fd);
+	}
+	free(ring->buf);
+	free(ring);
+}
+
+/* Send n_send doubles to the next rank while receiving n_recv from the
+ * previous one. Both directions progress together, so that no rank
+ * blocks on a full socket while its neighbour does the same. Returns 1
+ * on success, 0 on error.
+ */
+static int ring_exchange(Ring *ring, double *send_data, long n_send,
+						 double *recv_data, long n_recv)
+{
+	char *out = (char *)send_data, *in = (char *)recv_data;
+	size_t to_send = n_send * sizeof(double);
+	size_t to_recv = n_recv * sizeof(double);
+	ssize_t k;
+	struct pollfd fds[2];
+	while (to_send > 0 || to_recv > 0) {
+		fds[0].fd = to_send > 0 ? ring->send_fd : -1;
+		fds[0].events = POLLOUT;
+		fds[1].fd = to_recv > 0 ? ring->recv_fd : -1;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[0].revents & (POLLERR | POLLHUP) ||
+			(fds[1].revents & (POLLERR | POLLHUP) &&
+			 !(fds[1].revents & POLLIN))) {
+			break;
+		}
+		if (fds[0].revents & POLLOUT) {
+			k = send(ring->send_fd, out, to_send, MSG_NOSIGNAL);
+			if (k < 0 && errno != EAGAIN && errno != EINTR) {
+				break;
+			}
+			if (k > 0) {
+				out += k;
+				to_send -= k;
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			k = read(ring->recv_fd, in, to_recv);
+			if (k == 0 || (k < 0 && errno != EAGAIN && errno != EINTR)) {
+				break;
+			}
+			if (k > 0) {
+				in += k;
+				to_recv -= k;
+			}
+		}
+	}
+	if (to_send > 0 || to_recv > 0) {
+		fprintf(stderr, "Rank %d: lost the connection to the ring.\n",
+				ring->rank);
+		return 0;
+	}
+	return 1;
+}
+
+static double *ring_buffer(Ring *ring, long n)
+{
+	if (ring->buf_size < n) {
+		free(ring->buf);
+		ring->buf = malloc(sizeof(double) * (n > 0 ? n : 1));
+		ring->buf_size = n;
+	}
+	return ring->buf;
+}
+
+/* Sum 'data' (n doubles) over all the ranks, in place, with the
+ * bandwidth-optimal ring algorithm: the data is split in n_ranks chunks;
+ * in n_ranks - 1 reduce-scatter steps each rank adds the chunk received
+ * from the previous rank to its own and passes it on, until every rank
+ * holds one fully reduced chunk, and in n_ranks - 1 all-gather steps
+ * those chunks go around the ring. Every rank sends and receives about
+ * 2 * n doubles, whatever the number of ranks. Returns 1 on success, 0
+ * on error.
+ */
+int ring_allreduce(Ring *ring, double *data, long n)
+{
+	int step, r = ring->rank, p = ring->n_ranks;
+	int send_c, recv_c;
+	long off[p + 1];
+	double *tmp;
+	if (p <= 1) {
+		return 1;
+	}
+	for (step = 0; step <= p; step++) {
+		off[step] = n * step / p;
+	}
+	tmp = ring_buffer(ring, n / p + 1);
+	for (step = 0; step < p - 1; step++) {
+		send_c = ((r - step) % p + p) % p;
+		recv_c = ((r - step - 1) % p + p) % p;
+		if (!ring_exchange(ring, data + off[send_c],
+						   off[send_c+1] - off[send_c], tmp,
+						   off[recv_c+1] - off[recv_c])) {
+			return 0;
+		}
+		vector_axpy(data + off[recv_c], 1.0, tmp,
+					off[recv_c+1] - off[recv_c]);
+	}
+	for (step = 0; step < p - 1; step++) {
+		send_c = ((r + 1 - step) % p + p) % p;
+		recv_c = ((r - step) % p + p) % p;
+		if (!ring_exchange(ring, data + off[send_c],
+						   off[send_c+1] - off[send_c], data + off[recv_c],
+						   off[recv_c+1] - off[recv_c])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Copy 'data' (n doubles) of rank 'root' to all the other ranks, passing
+ * it along the ring. Returns 1 on success, 0 on error.
+ */
+int ring_broadcast(Ring *ring, double *data, long n, int root)
+{
+	int p = ring->n_ranks;
+	int pos = ((ring->rank - root) % p + p) % p;
+	if (p <= 1) {
+		return 1;
+	}
+	/* Position pos in the ring (from root) receives, then forwards unless
+	 * it is the last one */
+	if (pos > 0 && !ring_exchange(ring, NULL, 0, data, n)) {
+		return 0;
+	}
+	if (pos < p - 1 && !ring_exchange(ring, data, n, NULL, 0)) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Data-parallel version of network_update_mini_batch: the gradients of
+ * the mini batch of this rank are summed with those of all the others
+ * (in nabla, a ParamBuffer shaped like net->params), and the update is
+ * computed from the global sum, so every rank applies the same one.
+ * Returns the norm of the mean gradient, or -1 on communication error.
+ */
+double distributed_update_mini_batch(Ring *ring, Network *net,
+									 TrainData *mini_batch,
+									 ParamBuffer *nabla,
+									 double learning_rate, double lambda,
+									 int N_total, double max_grad_norm)
+{
+	double n = mini_batch->n_train;
+	vector_zero(nabla->data, nabla->size);
+	network_gradient(net, mini_batch, nabla);
+	if (!ring_allreduce(ring, nabla->data, nabla->size) ||
+		!ring_allreduce(ring, &n, 1)) {
+		return -1;
+	}
+	return network_apply_gradient(net, nabla, (int)n, learning_rate, lambda,
+								  N_total, max_grad_norm);
+}
+
+/* Stochastic gradient descent over all the ranks of the ring. Each rank
+ * calls it with the whole training set and trains on its own shard of
+ * it, n_train / n_ranks samples; the parameters of rank 0 are first
+ * copied to all the others. A step thus sees n_ranks * mini_batch_size
+ * samples. Rank 0 reports the progress. The shard is copied first, so
+ * that it lives on the NUMA node of the rank (if the process is pinned
+ * to one). Returns 1 on success, 0 on error.
+ */
+int SGD_distributed(Ring *ring, Network *net, TrainData *data, int epochs,
+					int mini_batch_size, double learning_rate, double lambda)
+{
+	int epoch, batch, ok;
+	int shard_size = data->n_train / ring->n_ranks;
+	int n_mini_batches = shard_size / mini_batch_size;
+	TrainData *shard, *mini_batch;
+	ParamBuffer *nabla;
+	ok = ring_broadcast(ring, net->params->data, net->params->size, 0);
+	mini_batch = subset_training_data(data, ring->rank * shard_size,
+									  shard_size);
+	/* Only the training samples: rank 0 tests on data */
+	mini_batch->n_test = 0;
+	shard = copy_training_data(mini_batch, 0);
+	free(mini_batch);
+	nabla = create_param_buffer(net->n_layers, net->sizes);
+	for (epoch = 0; ok && epoch < epochs; epoch++) {
+		shuffle_training_data(shard);
+		for (batch = 0; ok && batch < n_mini_batches; batch++) {
+			mini_batch = subset_training_data(shard,
+											  batch * mini_batch_size,
+											  mini_batch_size);
+			ok = distributed_update_mini_batch(ring, net, mini_batch, nabla,
+							learning_rate, lambda, data->n_train, 0) >= 0;
+			free(mini_batch);
+		}
+		if (ok && ring->rank == 0) {
+			fprintf(stderr, "Epoch %d finished.\n", epoch);
+			fprintf(stderr, "Accuracy after epoch %d: %.2f%%\n", epoch,
+					100 * test_accuracy(net, data));
+		}
+	}
+	free_param_buffer(nabla);
+	free_training_data(shard);
+	return ok;
+}
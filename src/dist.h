@@ -0,0 +1,37 @@
+#include <neuron.h>
+
+#ifndef DIST_H
+#define DIST_H
+
+/* Ring struct. Connects the n_ranks processes of a data-parallel
+ * training in a ring over Unix sockets: each one sends to the next rank
+ * and receives from the previous one. Must be closed with
+ * ring_close(the_ring);
+ */
+typedef struct {
+	int rank;
+	int n_ranks;
+	/* socket to rank + 1 and from rank - 1 (-1 with a single rank) */
+	int send_fd;
+	int recv_fd;
+	/* receive buffer, grown as needed */
+	double *buf;
+	long buf_size;
+} Ring;
+
+Ring *ring_connect(char *dir, int rank, int n_ranks);
+
+void ring_close(Ring *ring);
+
+int ring_allreduce(Ring *ring, double *data, long n);
+
+int ring_broadcast(Ring *ring, double *data, long n, int root);
+
+double distributed_update_mini_batch(Ring *ring, Network *net,
+		TrainData *mini_batch, ParamBuffer *nabla, double learning_rate,
+		double lambda, int N_total, double max_grad_norm);
+
+int SGD_distributed(Ring *ring, Network *net, TrainData *data, int epochs,
+		int mini_batch_size, double learning_rate, double lambda);
+
+#endif // DIST_H
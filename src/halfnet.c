@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <utils.h>
+#include <half.h>
+#include <halfnet.h>
+
+/*
+ * 16-bit weight copies of a Network (fp16 or bf16) and the inference
+ * path that runs them.
+ */
+
+/* Samples run through the 16-bit kernels at once by the batched path. */
+#define HALF_BATCH 64
+
+/* Make a 16-bit copy of the weights of net in 'format'. */
+HalfNetwork *create_half_network(Network *net, HalfFormat format)
+{
+	int l;
+	HalfNetwork *h = malloc(sizeof(HalfNetwork));
+	h->n_layers = net->n_layers;
+	h->format = format;
+	h->sizes = malloc(sizeof(int) * net->n_layers);
+	h->strides = malloc(sizeof(int) * net->n_layers);
+	h->weights = malloc(sizeof(uint16_t *) * (net->n_layers - 1));
+	h->biases = malloc(sizeof(float *) * (net->n_layers - 1));
+	arrncpy(h->sizes, net->sizes, net->n_layers);
+	for (l = 0; l < h->n_layers; l++) {
+		h->strides[l] = half_stride(h->sizes[l]);
+	}
+	for (l = 0; l < h->n_layers - 1; l++) {
+		h->weights[l] = half_alloc(2L * h->sizes[l+1] * h->strides[l]);
+		h->biases[l] = malloc(sizeof(float) * h->sizes[l+1]);
+	}
+	half_network_update(h, net);
+	return h;
+}
+
+/* Round the current weights and biases of net (which must have the
+ * layers h was made from) into h.
+ */
+void half_network_update(HalfNetwork *h, Network *net)
+{
+	int l, r;
+	for (l = 0; l < h->n_layers - 1; l++) {
+		for (r = 0; r < h->sizes[l+1]; r++) {
+			half_from_doubles(h->format, net->weights[l]->data[r],
+							  h->weights[l] + (long)r * h->strides[l],
+							  h->sizes[l]);
+			h->biases[l][r] = net->biases[l]->data[r][0];
+		}
+	}
+}
+
+/* Free the memory allocated for a HalfNetwork. */
+void destroy_half_network(HalfNetwork *h)
+{
+	int l;
+	if (h == NULL) {
+		return;
+	}
+	for (l = 0; l < h->n_layers - 1; l++) {
+		free(h->weights[l]);
+		free(h->biases[l]);
+	}
+	free(h->weights);
+	free(h->biases);
+	free(h->strides);
+	free(h->sizes);
+	free(h);
+}
+
+/* Run n (at most HALF_BATCH) inputs through the network. x and next_x
+ * are workspaces of n * max stride floats, acc of n * max size floats.
+ */
+static void feedforward_chunk(HalfNetwork *h, double **inputs, int n,
+							  double **outputs, float *x, float *next_x,
+							  float *acc)
+{
+	int i, l, r, c, rows, last;
+	float a, *tmp;
+
+	memset(x, 0, sizeof(float) * n * h->strides[0]);
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < h->sizes[0]; c++) {
+			x[(long)i * h->strides[0] + c] = inputs[i][c];
+		}
+	}
+	for (l = 0; l < h->n_layers - 1; l++) {
+		rows = h->sizes[l+1];
+		last = (l == h->n_layers - 2);
+		half_gemm(h->format, h->weights[l], rows, h->strides[l], x, n, acc);
+		if (!last) {
+			memset(next_x, 0, sizeof(float) * n * h->strides[l+1]);
+		}
+		/* Bias and sigmoid, straight into the next layer's input */
+		for (i = 0; i < n; i++) {
+			for (r = 0; r < rows; r++) {
+				a = 1.0f / (1.0f + expf(-(acc[(long)i * rows + r] +
+										  h->biases[l][r])));
+				if (last) {
+					outputs[i][r] = a;
+				} else {
+					next_x[(long)i * h->strides[l+1] + r] = a;
+				}
+			}
+		}
+		tmp = x;
+		x = next_x;
+		next_x = tmp;
+	}
+}
+
+/* Batched 16-bit inference: outputs[i] (arrays of sizes[n_layers-1]
+ * doubles) gets the output of the network for inputs[i].
+ */
+void half_feedforward_batch(HalfNetwork *h, double **inputs, int n,
+							double **outputs)
+{
+	int l, start, chunk;
+	int max_stride = 0, max_size = 0;
+	float *x, *next_x, *acc;
+	for (l = 0; l < h->n_layers; l++) {
+		max_stride = h->strides[l] > max_stride ? h->strides[l] : max_stride;
+		max_size = h->sizes[l] > max_size ? h->sizes[l] : max_size;
+	}
+	chunk = n < HALF_BATCH ? n : HALF_BATCH;
+	x = half_alloc(sizeof(float) * chunk * max_stride);
+	next_x = half_alloc(sizeof(float) * chunk * max_stride);
+	acc = malloc(sizeof(float) * chunk * max_size);
+	for (start = 0; start < n; start += chunk) {
+		if (n - start < chunk) {
+			chunk = n - start;
+		}
+		feedforward_chunk(h, inputs + start, chunk, outputs + start,
+						  x, next_x, acc);
+	}
+	free(x);
+	free(next_x);
+	free(acc);
+}
+
+/* 16-bit inference of a single input; output gets sizes[n_layers-1]
+ * doubles.
+ */
+void half_feedforward(HalfNetwork *h, double *input, double *output)
+{
+	half_feedforward_batch(h, &input, 1, &output);
+}
+
+/* Like test_accuracy, for a 16-bit network. */
+double half_test_accuracy(HalfNetwork *h, TrainData *data)
+{
+	int i, n_ok = 0;
+	int s = h->sizes[h->n_layers - 1];
+	double **outputs = malloc(sizeof(double *) * data->n_test);
+	for (i = 0; i < data->n_test; i++) {
+		outputs[i] = malloc(sizeof(double) * s);
+	}
+	half_feedforward_batch(h, data->inputs_testing, data->n_test, outputs);
+	for (i = 0; i < data->n_test; i++) {
+		if (argmax(outputs[i], s) == argmax(data->labels_testing[i], s)) {
+			n_ok += 1;
+		}
+		free(outputs[i]);
+	}
+	free(outputs);
+	return ((double)n_ok) / ((double)(data->n_test));
+}
+
+/* Bytes taken by the parameters of a 16-bit network (weights without
+ * the row padding, plus float biases).
+ */
+long half_network_bytes(HalfNetwork *h)
+{
+	int l;
+	long bytes = 0;
+	for (l = 0; l < h->n_layers - 1; l++) {
+		bytes += 2L * h->sizes[l+1] * h->sizes[l];
+		bytes += sizeof(float) * h->sizes[l+1];
+	}
+	return bytes;
+}
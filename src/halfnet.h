@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <neuron.h>
+#include <half.h>
+
+#ifndef HALFNET_H
+#define HALFNET_H
+
+/* Copy of a Network with 16-bit weights (fp16 or bf16, see lib/half.h),
+ * for inference. Must be freed with destroy_half_network(the_network);
+ *
+ * Products are accumulated in float and the activations between layers
+ * are kept as floats. The Network it was made from stays the master
+ * copy: train that one, in double precision, and call
+ * half_network_update to round its new weights again.
+ */
+typedef struct {
+	int n_layers;
+	int *sizes;
+	HalfFormat format;
+	/* row length of the weights of each layer: sizes[l] padded */
+	int *strides;
+	/* weights[l]: sizes[l+1] rows of strides[l] 16-bit values */
+	uint16_t **weights;
+	float **biases;
+} HalfNetwork;
+
+HalfNetwork *create_half_network(Network *net, HalfFormat format);
+
+void half_network_update(HalfNetwork *h, Network *net);
+
+void destroy_half_network(HalfNetwork *h);
+
+void half_feedforward(HalfNetwork *h, double *input, double *output);
+
+void half_feedforward_batch(HalfNetwork *h, double **inputs, int n,
+							double **outputs);
+
+double half_test_accuracy(HalfNetwork *h, TrainData *data);
+
+long half_network_bytes(HalfNetwork *h);
+
+#endif // HALFNET_H
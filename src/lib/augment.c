@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <augment.h>
+
+/* Create an augmenter for opts, its random numbers starting from seed. */
+Augmenter *create_augmenter(AugmentOptions *opts, uint64_t seed)
+{
+	int j, w = opts->width, h = opts->height, r = 0;
+	double sum = 0.0;
+	Augmenter *a = calloc(1, sizeof(Augmenter));
+	a->opts = *opts;
+	rng_seed(&a->rng, seed);
+	a->padded = calloc((long)(w + 3) * (h + 3), sizeof(float));
+	a->map_x = malloc(sizeof(float) * w * h);
+	a->map_y = malloc(sizeof(float) * w * h);
+	a->noise = malloc(sizeof(float) * 4 * w * h);
+	if (opts->elastic_alpha > 0 && opts->elastic_sigma > 0) {
+		/* Gaussian truncated at 2 sigma, normalized */
+		r = (int)ceil(2 * opts->elastic_sigma);
+		a->kernel = malloc(sizeof(float) * (2 * r + 1));
+		for (j = -r; j <= r; j++) {
+			a->kernel[j + r] = exp(-0.5 * j * j / (opts->elastic_sigma *
+												   opts->elastic_sigma));
+			sum += a->kernel[j + r];
+		}
+		for (j = 0; j <= 2 * r; j++) {
+			a->kernel[j] /= sum;
+		}
+		a->field = malloc(sizeof(float) * ((w + 2 * r) * (h + 2 * r) + 2 * r));
+		a->smooth = malloc(sizeof(float) * (w + 2 * r) * (h + 2 * r));
+	}
+	a->radius = r;
+	return a;
+}
+
+/* Free the memory allocated for an Augmenter. */
+void destroy_augmenter(Augmenter *a)
+{
+	int i;
+	if (a == NULL) {
+		return;
+	}
+	for (i = 0; i < a->n_images; i++) {
+		free(a->images[i]);
+	}
+	free(a->images);
+	free(a->padded);
+	free(a->map_x);
+	free(a->map_y);
+	free(a->noise);
+	free(a->kernel);
+	free(a->field);
+	free(a->smooth);
+	free(a);
+}
+
+/* Uniform in [-1, 1). */
+static float rng_symmetric(Rng *rng)
+{
+	return 2 * rng_float(rng) - 1;
+}
+
+/* dst[i] = sum_j k[j] * src[i + j * step], for i < n and j < taps. Each
+ * group of 4 taps is one long pass over the arrays, which vectorizes
+ * well.
+ */
+static void convolve(float *restrict dst, const float *restrict src, long n,
+					 const float *restrict k, int taps, long step)
+{
+	long i;
+	int j = 0;
+	const float *s;
+	for (i = 0; i < n; i++) {
+		dst[i] = 0;
+	}
+	for (; j + 4 <= taps; j += 4) {
+		s = src + j * step;
+		for (i = 0; i < n; i++) {
+			dst[i] += k[j] * s[i] + k[j + 1] * s[i + step] +
+					  k[j + 2] * s[i + 2 * step] + k[j + 3] * s[i + 3 * step];
+		}
+	}
+	for (; j < taps; j++) {
+		s = src + j * step;
+		for (i = 0; i < n; i++) {
+			dst[i] += k[j] * s[i];
+		}
+	}
+}
+
+/* Add to map alpha times a random field uniform in [-1, 1], smoothed by
+ * the Gaussian kernel (separably: rows, then columns). The field covers
+ * radius pixels around the image, so the edges get the same smoothing.
+ * Both passes run over the whole field as one array: the columns they
+ * compute past the width of the image are garbage, and skipped.
+ */
+static void add_elastic(Augmenter *a, float *map, float alpha)
+{
+	int x, y, w = a->opts.width, h = a->opts.height, r = a->radius;
+	int fw = w + 2 * r, fh = h + 2 * r;
+	float *field = a->field, *smooth = a->smooth;
+	long i, n = (long)fw * fh;
+	rng_uniform(&a->rng, field, n + 2 * r);
+	for (i = 0; i < n + 2 * r; i++) {
+		field[i] = 2 * field[i] - 1;
+	}
+	convolve(smooth, field, n, a->kernel, 2 * r + 1, 1);
+	convolve(field, smooth, (long)h * fw, a->kernel, 2 * r + 1, fw);
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			map[(long)y * w + x] += alpha * field[(long)y * fw + x];
+		}
+	}
+}
+
+/* dst[j] = the padded image (see Augmenter) sampled bilinearly at
+ * (map_x[j], map_y[j]), plus noise[j], clamped to [0, 1]. Coordinates are
+ * clamped to the zero border so the loop needs no bounds tests, and
+ * vectorizes with gathers.
+ */
+static void resample(const float *restrict padded, int w, int h,
+					 const float *restrict map_x, const float *restrict map_y,
+					 const float *restrict noise, double *restrict dst)
+{
+	int j, x0, y0, base, pw = w + 3, n = w * h;
+	float sx, sy, fx, fy, v;
+	for (j = 0; j < n; j++) {
+		sx = map_x[j] > -1.0f ? map_x[j] : -1.0f;
+		sx = sx < w ? sx : w;
+		sy = map_y[j] > -1.0f ? map_y[j] : -1.0f;
+		sy = sy < h ? sy : h;
+		/* floor, by truncation of a nonnegative value */
+		x0 = (int)(sx + 1) - 1;
+		y0 = (int)(sy + 1) - 1;
+		fx = sx - x0;
+		fy = sy - y0;
+		base = (y0 + 1) * pw + x0 + 1;
+		v = (padded[base] * (1 - fx) + padded[base + 1] * fx) * (1 - fy) +
+			(padded[base + pw] * (1 - fx) + padded[base + pw + 1] * fx) * fy;
+		v += noise[j];
+		v = v > 0.0f ? v : 0.0f;
+		dst[j] = v < 1.0f ? v : 1.0f;
+	}
+}
+
+/* Write to dst (width * height pixels) a randomly augmented copy of src.
+ * Pixels outside the source image are black, and the result is clamped
+ * to [0, 1].
+ */
+void augment_image(Augmenter *a, const double *src, double *dst)
+{
+	int x, y, w = a->opts.width, h = a->opts.height, pw = w + 3;
+	long i, n = (long)w * h;
+	AugmentOptions *o = &a->opts;
+	float theta, s, k, tx, ty, c, sn, m00, m01, m10, m11, bx, by;
+	float cx = (w - 1) / 2.0f, cy = (h - 1) / 2.0f;
+	float *p = a->padded + pw + 1;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			p[(long)y * pw + x] = src[(long)y * w + x];
+		}
+	}
+
+	/* Affine part of the map from output to source pixels: the inverse
+	 * transform, drawn directly since the parameters are symmetric */
+	theta = rng_symmetric(&a->rng) * o->max_rotation * (float)M_PI / 180;
+	s = 1 + rng_symmetric(&a->rng) * o->max_scale;
+	k = rng_symmetric(&a->rng) * o->max_shear;
+	tx = rng_symmetric(&a->rng) * o->max_shift;
+	ty = rng_symmetric(&a->rng) * o->max_shift;
+	c = cosf(theta);
+	sn = sinf(theta);
+	m00 = c / s;
+	m01 = (c * k - sn) / s;
+	m10 = sn / s;
+	m11 = (sn * k + c) / s;
+	for (y = 0; y < h; y++) {
+		bx = m01 * (y - cy) + cx - tx;
+		by = m11 * (y - cy) + cy - ty;
+		for (x = 0; x < w; x++) {
+			a->map_x[(long)y * w + x] = m00 * (x - cx) + bx;
+			a->map_y[(long)y * w + x] = m10 * (x - cx) + by;
+		}
+	}
+	if (a->radius > 0) {
+		add_elastic(a, a->map_x, o->elastic_alpha);
+		add_elastic(a, a->map_y, o->elastic_alpha);
+	}
+
+	/* Noise: sums of 4 uniforms scaled to a standard deviation of 1 */
+	if (o->noise > 0) {
+		rng_uniform(&a->rng, a->noise, 4 * n);
+		for (i = 0; i < n; i++) {
+			a->noise[i] = (a->noise[i] + a->noise[n + i] +
+						   a->noise[2 * n + i] + a->noise[3 * n + i] - 2) *
+						  (1.7320508f * o->noise);
+		}
+	} else {
+		memset(a->noise, 0, sizeof(float) * n);
+	}
+
+	resample(a->padded, w, h, a->map_x, a->map_y, a->noise, dst);
+}
+
+/* Augment the n images of inputs into buffers of the augmenter; returns
+ * their array, valid until the next call.
+ */
+double **augment_batch(Augmenter *a, double **inputs, int n)
+{
+	int i;
+	if (n > a->n_images) {
+		a->images = realloc(a->images, sizeof(double *) * n);
+		for (i = a->n_images; i < n; i++) {
+			a->images[i] = malloc(sizeof(double) * a->opts.width *
+								  a->opts.height);
+		}
+		a->n_images = n;
+	}
+	for (i = 0; i < n; i++) {
+		augment_image(a, inputs[i], a->images[i]);
+	}
+	return a->images;
+}
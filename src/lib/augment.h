@@ -0,0 +1,70 @@
+#include <random.h>
+
+#ifndef AUGMENT_H
+#define AUGMENT_H
+
+/* Data augmentation of grey-level images (pixels in [0, 1], row by row,
+ * black background), applied on the fly to the samples of each mini
+ * batch so that no augmented copy of the data set is ever stored.
+ *
+ * Every image gets its own random affine warp (shift, rotation, scale,
+ * shear) combined with an elastic distortion (a random displacement
+ * field smoothed by a Gaussian, as in Simard et al. 2003) into one map
+ * of source coordinates, resampled bilinearly, plus Gaussian noise. The
+ * kernels work on float rows laid out for the compiler to vectorize,
+ * and the random numbers come from the Augmenter's own Rng, so that each
+ * thread can run its own Augmenter.
+ */
+
+/* AugmentOptions struct. A zero field disables that transformation. */
+typedef struct {
+	int width;
+	int height;
+	/* shift in pixels, uniform in [-max_shift, max_shift] on each axis */
+	double max_shift;
+	/* rotation in degrees, uniform in [-max_rotation, max_rotation] */
+	double max_rotation;
+	/* scale factor uniform in [1 - max_scale, 1 + max_scale] */
+	double max_scale;
+	/* horizontal shear factor, uniform in [-max_shear, max_shear] */
+	double max_shear;
+	/* elastic distortion: largest displacement in pixels (before the
+	 * smoothing) and standard deviation of the smoothing in pixels */
+	double elastic_alpha;
+	double elastic_sigma;
+	/* standard deviation of the noise added to every pixel */
+	double noise;
+} AugmentOptions;
+
+/* Augmenter struct. The state of the augmentation of one thread. Must be
+ * freed with destroy_augmenter(the_augmenter);
+ */
+typedef struct {
+	AugmentOptions opts;
+	Rng rng;
+	/* source image with a zero border (1 pixel top and left, 2 bottom
+	 * and right) */
+	float *padded;
+	/* source coordinates of every output pixel */
+	float *map_x, *map_y;
+	/* elastic distortion: Gaussian kernel of 2 * radius + 1 taps, random
+	 * field over the image plus radius pixels on each side (and 2 * radius
+	 * floats of slack), and the field smoothed horizontally */
+	int radius;
+	float *kernel, *field, *smooth;
+	/* noise of one image */
+	float *noise;
+	/* augmented images handed out by augment_batch */
+	int n_images;
+	double **images;
+} Augmenter;
+
+Augmenter *create_augmenter(AugmentOptions *opts, uint64_t seed);
+
+void destroy_augmenter(Augmenter *a);
+
+void augment_image(Augmenter *a, const double *src, double *dst);
+
+double **augment_batch(Augmenter *a, double **inputs, int n);
+
+#endif // AUGMENT_H
@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <expr.h>
+#include <numa.h>
+#include <pool.h>
+#include <profile.h>
+
+/* Instructions of a program: a node shared by several operations of a
+ * tree is compiled once per use. */
+#define MAX_INSTRS (4 * EXPR_MAX_NODES)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef enum {
+	/* push the tile of a matrix of the shape of the result */
+	OP_LOAD,
+	/* push the tile of a column vector, repeated along the rows */
+	OP_LOAD_ROWS,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_SCALE,
+	OP_SIGMOID,
+	OP_SIGMOID_PRIME
+} InstrOp;
+
+typedef struct {
+	InstrOp op;
+	const double *src;
+	double alpha;
+} Instr;
+
+/* The compiled elementwise pass of one node, and the matrices computed
+ * for it. */
+typedef struct {
+	int n_instrs;
+	int depth;
+	Instr instrs[MAX_INSTRS];
+	long n;
+	int n_cols;
+	double *out;
+	/* products and vectors evaluated for the pass, by node */
+	Matrix *temps[EXPR_MAX_NODES];
+} Program;
+
+/* Forget all the nodes of g. */
+void expr_reset(ExprGraph *g)
+{
+	g->n_nodes = 0;
+}
+
+static int valid(ExprGraph *g, int node)
+{
+	return node >= 0 && node < g->n_nodes;
+}
+
+static int new_node(ExprGraph *g, ExprOp op, int n_rows, int n_cols, int a,
+					int b)
+{
+	ExprNode *e;
+	if (g->n_nodes == EXPR_MAX_NODES) {
+		fprintf(stderr, "expr ERROR: more than %d nodes.\n", EXPR_MAX_NODES);
+		return -1;
+	}
+	e = &g->nodes[g->n_nodes];
+	e->op = op;
+	e->n_rows = n_rows;
+	e->n_cols = n_cols;
+	e->a = a;
+	e->b = b;
+	e->mat = NULL;
+	e->alpha = 0.0;
+	return g->n_nodes++;
+}
+
+/* A leaf: the matrix itself, which must not change before the
+ * evaluation. */
+int expr_matrix(ExprGraph *g, Matrix *mat)
+{
+	int node = new_node(g, EXPR_MATRIX, mat->n_rows, mat->n_cols, -1, -1);
+	if (node >= 0) {
+		g->nodes[node].mat = mat;
+	}
+	return node;
+}
+
+/* The matrix product a x b. */
+int expr_prod(ExprGraph *g, int a, int b)
+{
+	ExprNode *x, *y;
+	if (!valid(g, a) || !valid(g, b)) {
+		return -1;
+	}
+	x = &g->nodes[a];
+	y = &g->nodes[b];
+	if (x->n_cols != y->n_rows) {
+		fprintf(stderr, "expr_prod ERROR: cannot multiply a %dx%d matrix "
+				"and a %dx%d matrix.\n", x->n_rows, x->n_cols, y->n_rows,
+				y->n_cols);
+		return -1;
+	}
+	return new_node(g, EXPR_PROD, x->n_rows, y->n_cols, a, b);
+}
+
+static int elementwise(ExprGraph *g, ExprOp op, int a, int b, char *fn,
+					   char *operation)
+{
+	ExprNode *x, *y;
+	if (!valid(g, a) || !valid(g, b)) {
+		return -1;
+	}
+	x = &g->nodes[a];
+	y = &g->nodes[b];
+	if (x->n_rows != y->n_rows || x->n_cols != y->n_cols) {
+		fprintf(stderr, "%s ERROR: cannot compute the %s of a %dx%d matrix "
+				"and a %dx%d matrix. They must have the same shapes.\n", fn,
+				operation, x->n_rows, x->n_cols, y->n_rows, y->n_cols);
+		return -1;
+	}
+	return new_node(g, op, x->n_rows, x->n_cols, a, b);
+}
+
+/* a + b, entrywise. */
+int expr_add(ExprGraph *g, int a, int b)
+{
+	return elementwise(g, EXPR_ADD, a, b, "expr_add", "sum");
+}
+
+/* a - b, entrywise. */
+int expr_sub(ExprGraph *g, int a, int b)
+{
+	return elementwise(g, EXPR_SUB, a, b, "expr_sub", "difference");
+}
+
+/* a * b, entrywise (Hadamard product). */
+int expr_mul(ExprGraph *g, int a, int b)
+{
+	return elementwise(g, EXPR_MUL, a, b, "expr_mul", "entrywise product");
+}
+
+/* a plus the column vector v added to each of its columns, like
+ * matrix_add_columnwise. */
+int expr_add_columnwise(ExprGraph *g, int a, int v)
+{
+	ExprNode *x, *y;
+	if (!valid(g, a) || !valid(g, v)) {
+		return -1;
+	}
+	x = &g->nodes[a];
+	y = &g->nodes[v];
+	if (y->n_rows != x->n_rows || y->n_cols != 1) {
+		fprintf(stderr, "expr_add_columnwise ERROR: cannot add a %dx%d "
+				"matrix to the columns of a %dx%d matrix.\n", y->n_rows,
+				y->n_cols, x->n_rows, x->n_cols);
+		return -1;
+	}
+	return new_node(g, EXPR_ADD_COLUMNWISE, x->n_rows, x->n_cols, a, v);
+}
+
+/* a * alpha. */
+int expr_scale(ExprGraph *g, int a, double alpha)
+{
+	int node;
+	if (!valid(g, a)) {
+		return -1;
+	}
+	node = new_node(g, EXPR_SCALE, g->nodes[a].n_rows, g->nodes[a].n_cols,
+					a, -1);
+	if (node >= 0) {
+		g->nodes[node].alpha = alpha;
+	}
+	return node;
+}
+
+static int unary(ExprGraph *g, ExprOp op, int a)
+{
+	if (!valid(g, a)) {
+		return -1;
+	}
+	return new_node(g, op, g->nodes[a].n_rows, g->nodes[a].n_cols, a, -1);
+}
+
+/* The sigmoid of every element of a, like sigmoid_vect. */
+int expr_sigmoid(ExprGraph *g, int a)
+{
+	return unary(g, EXPR_SIGMOID, a);
+}
+
+/* The derivative of the sigmoid at every element of a, like
+ * sigmoid_prime_vect. */
+int expr_sigmoid_prime(ExprGraph *g, int a)
+{
+	return unary(g, EXPR_SIGMOID_PRIME, a);
+}
+
+static Matrix *eval(ExprGraph *g, int node, Matrix *out);
+
+/* The matrix of a node read as a whole (an operand of a product, a
+ * vector added columnwise): its own if it is a leaf, else evaluated once
+ * into temps[node]. NULL on error.
+ */
+static Matrix *operand(ExprGraph *g, int node, Matrix **temps)
+{
+	if (g->nodes[node].op == EXPR_MATRIX) {
+		return g->nodes[node].mat;
+	}
+	if (temps[node] == NULL) {
+		temps[node] = eval(g, node, NULL);
+	}
+	return temps[node];
+}
+
+static Matrix *eval_prod(ExprGraph *g, int node)
+{
+	ExprNode *e = &g->nodes[node];
+	Matrix *temps[EXPR_MAX_NODES] = {NULL};
+	Matrix *a, *b, *res = NULL;
+	a = operand(g, e->a, temps);
+	b = a == NULL ? NULL : operand(g, e->b, temps);
+	if (b != NULL) {
+		res = matrix_prod_optim(a, b);
+	}
+	free_matrix(temps[e->a]);
+	if (e->b != e->a) {
+		free_matrix(temps[e->b]);
+	}
+	return res;
+}
+
+static int emit(Program *p, InstrOp op, const double *src, double alpha)
+{
+	Instr *in;
+	if (p->n_instrs == MAX_INSTRS) {
+		fprintf(stderr, "expr ERROR: more than %d operations in a pass.\n",
+				MAX_INSTRS);
+		return 0;
+	}
+	in = &p->instrs[p->n_instrs++];
+	in->op = op;
+	in->src = src;
+	in->alpha = alpha;
+	if (op == OP_LOAD || op == OP_LOAD_ROWS) {
+		if (++p->depth > EXPR_MAX_STACK) {
+			fprintf(stderr, "expr ERROR: more than %d operands live at "
+					"once.\n", EXPR_MAX_STACK);
+			return 0;
+		}
+	} else if (op == OP_ADD || op == OP_SUB || op == OP_MUL) {
+		p->depth--;
+	}
+	return 1;
+}
+
+/* Append to p the program computing node, whose operands are
+ * evaluated first if they are products. Returns 0 on error.
+ */
+static int compile(ExprGraph *g, int node, Program *p)
+{
+	ExprNode *e = &g->nodes[node];
+	Matrix *m;
+	switch (e->op) {
+	case EXPR_MATRIX:
+	case EXPR_PROD:
+		m = operand(g, node, p->temps);
+		return m != NULL && emit(p, OP_LOAD, m->data[0], 0);
+	case EXPR_ADD:
+		return compile(g, e->a, p) && compile(g, e->b, p) &&
+			emit(p, OP_ADD, NULL, 0);
+	case EXPR_SUB:
+		return compile(g, e->a, p) && compile(g, e->b, p) &&
+			emit(p, OP_SUB, NULL, 0);
+	case EXPR_MUL:
+		return compile(g, e->a, p) && compile(g, e->b, p) &&
+			emit(p, OP_MUL, NULL, 0);
+	case EXPR_ADD_COLUMNWISE:
+		if (!compile(g, e->a, p)) {
+			return 0;
+		}
+		m = operand(g, e->b, p->temps);
+		return m != NULL && emit(p, OP_LOAD_ROWS, m->data[0], 0) &&
+			emit(p, OP_ADD, NULL, 0);
+	case EXPR_SCALE:
+		return compile(g, e->a, p) && emit(p, OP_SCALE, NULL, e->alpha);
+	case EXPR_SIGMOID:
+		return compile(g, e->a, p) && emit(p, OP_SIGMOID, NULL, 0);
+	case EXPR_SIGMOID_PRIME:
+		return compile(g, e->a, p) && emit(p, OP_SIGMOID_PRIME, NULL, 0);
+	}
+	return 0;
+}
+
+/* Run the program over tiles [begin, end). */
+static void run_tiles(void *arg, long begin, long end)
+{
+	Program *p = arg;
+	double stack[EXPR_MAX_STACK][EXPR_TILE];
+	double *x, *y = NULL, s;
+	const double *src;
+	long tile, start, row, col;
+	int i, j, t, len, sp;
+	for (tile = begin; tile < end; tile++) {
+		start = tile * EXPR_TILE;
+		len = MIN(p->n - start, EXPR_TILE);
+		sp = 0;
+		for (i = 0; i < p->n_instrs; i++) {
+			Instr *in = &p->instrs[i];
+			if (in->op == OP_LOAD || in->op == OP_LOAD_ROWS) {
+				x = stack[sp++];
+			} else if (in->op == OP_ADD || in->op == OP_SUB ||
+					   in->op == OP_MUL) {
+				sp--;
+				x = stack[sp - 1];
+				y = stack[sp];
+			} else {
+				x = stack[sp - 1];
+			}
+			switch (in->op) {
+			case OP_LOAD:
+				src = in->src + start;
+				for (t = 0; t < len; t++) {
+					x[t] = src[t];
+				}
+				break;
+			case OP_LOAD_ROWS:
+				/* Row by row, each part a fill the compiler vectorizes */
+				row = start / p->n_cols;
+				col = start % p->n_cols;
+				for (t = 0; t < len; row++, col = 0) {
+					j = t + MIN(p->n_cols - col, len - t);
+					for (; t < j; t++) {
+						x[t] = in->src[row];
+					}
+				}
+				break;
+			case OP_ADD:
+				for (t = 0; t < len; t++) {
+					x[t] = x[t] + y[t];
+				}
+				break;
+			case OP_SUB:
+				for (t = 0; t < len; t++) {
+					x[t] = x[t] - y[t];
+				}
+				break;
+			case OP_MUL:
+				for (t = 0; t < len; t++) {
+					x[t] = x[t] * y[t];
+				}
+				break;
+			case OP_SCALE:
+				for (t = 0; t < len; t++) {
+					x[t] = x[t] * in->alpha;
+				}
+				break;
+			case OP_SIGMOID:
+				for (t = 0; t < len; t++) {
+					x[t] = 1.0 / (1.0 + exp(-x[t]));
+				}
+				break;
+			case OP_SIGMOID_PRIME:
+				for (t = 0; t < len; t++) {
+					s = 1.0 / (1.0 + exp(-x[t]));
+					x[t] = s * (1.0 - s);
+				}
+				break;
+			}
+		}
+		x = p->out + start;
+		for (t = 0; t < len; t++) {
+			x[t] = stack[0][t];
+		}
+	}
+}
+
+/* Evaluate node into out, or into a new matrix if out is NULL. */
+static Matrix *eval(ExprGraph *g, int node, Matrix *out)
+{
+	ExprNode *e = &g->nodes[node];
+	Program program = {0}, *p = &program;
+	long n_tiles;
+	int i, n_loads = 0;
+	if (e->op == EXPR_PROD && out == NULL) {
+		return eval_prod(g, node);
+	}
+	if (!compile(g, node, p)) {
+		out = NULL;
+		goto done;
+	}
+	/* Work in place in a product of the shape of the result */
+	for (i = 0; i < EXPR_MAX_NODES && out == NULL; i++) {
+		if (p->temps[i] != NULL && g->nodes[i].op == EXPR_PROD &&
+			g->nodes[i].n_rows == e->n_rows &&
+			g->nodes[i].n_cols == e->n_cols) {
+			out = p->temps[i];
+			p->temps[i] = NULL;
+		}
+	}
+	if (out == NULL) {
+		out = create_matrix_view(numa_alloc_huge(sizeof(double) * e->n_rows *
+												 e->n_cols),
+								 e->n_rows, e->n_cols);
+	}
+	p->n = (long)e->n_rows * e->n_cols;
+	p->n_cols = e->n_cols;
+	p->out = out->data[0];
+	for (i = 0; i < p->n_instrs; i++) {
+		n_loads += p->instrs[i].op == OP_LOAD;
+	}
+	PROF_BYTES(8L * (n_loads + 1) * p->n);
+	n_tiles = (p->n + EXPR_TILE - 1) / EXPR_TILE;
+	parallel_for(0, n_tiles, pool_grain(n_tiles, 4.0 * EXPR_TILE *
+										p->n_instrs), run_tiles, p);
+done:
+	for (i = 0; i < EXPR_MAX_NODES; i++) {
+		free_matrix(p->temps[i]);
+	}
+	return out;
+}
+
+/* The value of node, as a new matrix. Returns NULL on error. */
+Matrix *expr_eval(ExprGraph *g, int node)
+{
+	if (!valid(g, node)) {
+		return NULL;
+	}
+	return eval(g, node, NULL);
+}
+
+/* Store the value of node into out, which must have its shape and may be
+ * one of its operands: every product is computed before out is written.
+ * Returns 1 on success, 0 on error.
+ */
+int expr_eval_into(ExprGraph *g, int node, Matrix *out)
+{
+	ExprNode *e;
+	if (!valid(g, node)) {
+		return 0;
+	}
+	e = &g->nodes[node];
+	if (e->n_rows != out->n_rows || e->n_cols != out->n_cols) {
+		fprintf(stderr, "expr_eval_into ERROR: cannot store a %dx%d "
+				"matrix into a %dx%d one.\n", e->n_rows, e->n_cols,
+				out->n_rows, out->n_cols);
+		return 0;
+	}
+	return eval(g, node, out) != NULL;
+}
@@ -0,0 +1,93 @@
+#include <matrix.h>
+
+#ifndef EXPR_H
+#define EXPR_H
+
+/* Deferred matrix expressions.
+ *
+ * Operations are recorded as nodes of a small graph instead of being run
+ * one after the other, each over the whole matrix into a new one. When a
+ * node is evaluated, its products are computed with matrix_prod_optim,
+ * and every tree of elementwise operations above them is compiled to a
+ * short postfix program run in a single pass, tile by tile: each operand
+ * is read once and the result written once, the intermediate values
+ * staying in tiles of EXPR_TILE doubles. The pass works in place in the
+ * output of a product when it has the shape of the result, so that
+ * sigmoid(W x + b) allocates nothing but the product.
+ *
+ * The elementwise operations round exactly as their eager counterparts
+ * (matrix_add, sigmoid_vect, ...), so the results are the same bits.
+ *
+ * Nodes are ints, -1 standing for an error: an operation on -1 gives -1,
+ * and evaluating it NULL (or 0), so that a whole expression can be built
+ * before checking it. A graph lives on the stack and owns no memory:
+ *
+ *     ExprGraph g = {0};
+ *     int z = expr_add(&g, expr_prod(&g, expr_matrix(&g, w),
+ *                                    expr_matrix(&g, x)),
+ *                      expr_matrix(&g, b));
+ *     Matrix *a = expr_eval(&g, expr_sigmoid(&g, z));
+ */
+
+/* Nodes of a graph at most. */
+#define EXPR_MAX_NODES 64
+
+/* Values of an elementwise pass held at once (the depth of its program's
+ * stack), and doubles per tile. */
+#define EXPR_MAX_STACK 8
+#define EXPR_TILE 256
+
+typedef enum {
+	EXPR_MATRIX,
+	EXPR_PROD,
+	EXPR_ADD,
+	EXPR_SUB,
+	EXPR_MUL,
+	EXPR_ADD_COLUMNWISE,
+	EXPR_SCALE,
+	EXPR_SIGMOID,
+	EXPR_SIGMOID_PRIME
+} ExprOp;
+
+typedef struct {
+	ExprOp op;
+	int n_rows;
+	int n_cols;
+	/* operands, -1 if unused */
+	int a, b;
+	/* the matrix of EXPR_MATRIX, the factor of EXPR_SCALE */
+	Matrix *mat;
+	double alpha;
+} ExprNode;
+
+/* ExprGraph struct. Empty when zeroed or after expr_reset. */
+typedef struct {
+	int n_nodes;
+	ExprNode nodes[EXPR_MAX_NODES];
+} ExprGraph;
+
+void expr_reset(ExprGraph *g);
+
+int expr_matrix(ExprGraph *g, Matrix *mat);
+
+int expr_prod(ExprGraph *g, int a, int b);
+
+int expr_add(ExprGraph *g, int a, int b);
+
+int expr_sub(ExprGraph *g, int a, int b);
+
+int expr_mul(ExprGraph *g, int a, int b);
+
+int expr_add_columnwise(ExprGraph *g, int a, int v);
+
+int expr_scale(ExprGraph *g, int a, double alpha);
+
+int expr_sigmoid(ExprGraph *g, int a);
+
+int expr_sigmoid_prime(ExprGraph *g, int a);
+
+Matrix *expr_eval(ExprGraph *g, int node);
+
+int expr_eval_into(ExprGraph *g, int node, Matrix *out);
+
+#endif // EXPR_H
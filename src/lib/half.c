@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX512F__) || defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+#include <half.h>
+#include <profile.h>
+#include <pool.h>
+
+/* Round n up to a multiple of HALF_STRIDE_ALIGN. */
+int half_stride(int n)
+{
+	return (n + HALF_STRIDE_ALIGN - 1) / HALF_STRIDE_ALIGN * HALF_STRIDE_ALIGN;
+}
+
+/* Allocate n_bytes of zeroed memory aligned to 64 bytes (at least 64
+ * bytes). Must be freed with free(). Returns NULL if the allocation
+ * fails.
+ */
+void *half_alloc(long n_bytes)
+{
+	long size = n_bytes > 0 ? (n_bytes + 63) / 64 * 64 : 64;
+	void *p = aligned_alloc(64, size);
+	if (p == NULL) {
+		fprintf(stderr, "half_alloc ERROR: cannot allocate %ld bytes.\n",
+				size);
+		return NULL;
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+static uint16_t float_to_fp16(float f)
+{
+	uint32_t x, sign, mant, h, rem, halfway;
+	int e, shift;
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	e = (int)((x >> 23) & 0xff);
+	mant = x & 0x7fffff;
+	if (e == 0xff) {
+		/* infinity, or a quiet NaN keeping the top of its payload */
+		return sign | 0x7c00 | (mant != 0 ? 0x200 | (mant >> 13) : 0);
+	}
+	e = e - 127 + 15;
+	if (e >= 31) {
+		return sign | 0x7c00;
+	}
+	if (e <= 0) {
+		/* Subnormal: mantissa with its implicit bit, shifted into place */
+		if (e < -10) {
+			return sign;
+		}
+		mant |= 0x800000;
+		shift = 14 - e;
+		h = mant >> shift;
+		rem = mant & ((1u << shift) - 1);
+		halfway = 1u << (shift - 1);
+		if (rem > halfway || (rem == halfway && (h & 1))) {
+			h++;
+		}
+		return sign | h;
+	}
+	h = ((uint32_t)e << 10) | (mant >> 13);
+	rem = mant & 0x1fff;
+	/* A carry out of the mantissa rightly bumps the exponent */
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+		h++;
+	}
+	return sign | h;
+}
+
+static float fp16_to_float(uint16_t h)
+{
+	uint32_t x, sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f, mant = h & 0x3ff;
+	float f;
+	if (e == 0x1f) {
+		x = sign | 0x7f800000 | (mant << 13);
+	} else if (e != 0) {
+		x = sign | ((e + 112) << 23) | (mant << 13);
+	} else if (mant == 0) {
+		x = sign;
+	} else {
+		/* Subnormal: normalize it */
+		e = 113;
+		while (!(mant & 0x400)) {
+			mant <<= 1;
+			e--;
+		}
+		x = sign | (e << 23) | ((mant & 0x3ff) << 13);
+	}
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static uint16_t float_to_bf16(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	if ((x & 0x7fffffff) > 0x7f800000) {
+		return (x >> 16) | 0x40;
+	}
+	x += 0x7fff + ((x >> 16) & 1);
+	return x >> 16;
+}
+
+static float bf16_to_float(uint16_t h)
+{
+	uint32_t x = (uint32_t)h << 16;
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+/* x rounded to the nearest 16-bit value (ties to even). */
+uint16_t float_to_half(HalfFormat format, float x)
+{
+	return format == HALF_FP16 ? float_to_fp16(x) : float_to_bf16(x);
+}
+
+float half_to_float(HalfFormat format, uint16_t h)
+{
+	return format == HALF_FP16 ? fp16_to_float(h) : bf16_to_float(h);
+}
+
+/* dst[i] = src[i] rounded to float, then to 16 bits. */
+void half_from_doubles(HalfFormat format, const double *src, uint16_t *dst,
+					   long n)
+{
+	long i = 0;
+#if defined(__AVX512F__)
+	__m512 v;
+	for (; format == HALF_FP16 && i + 16 <= n; i += 16) {
+		v = _mm512_insertf32x8(_mm512_castps256_ps512(
+				_mm512_cvtpd_ps(_mm512_loadu_pd(src + i))),
+				_mm512_cvtpd_ps(_mm512_loadu_pd(src + i + 8)), 1);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm512_cvtps_ph(v,
+				_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+	}
+#if defined(__AVX512BF16__)
+	for (; format == HALF_BF16 && i + 16 <= n; i += 16) {
+		v = _mm512_insertf32x8(_mm512_castps256_ps512(
+				_mm512_cvtpd_ps(_mm512_loadu_pd(src + i))),
+				_mm512_cvtpd_ps(_mm512_loadu_pd(src + i + 8)), 1);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+							(__m256i)_mm512_cvtneps_pbh(v));
+	}
+#endif
+#elif defined(__F16C__)
+	__m256 v;
+	for (; format == HALF_FP16 && i + 8 <= n; i += 8) {
+		v = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(src + i + 4)),
+							_mm256_cvtpd_ps(_mm256_loadu_pd(src + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(v,
+				_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] = float_to_half(format, (float)src[i]);
+	}
+}
+
+void half_to_floats(HalfFormat format, const uint16_t *src, float *dst,
+					long n)
+{
+	long i;
+	for (i = 0; i < n; i++) {
+		dst[i] = half_to_float(format, src[i]);
+	}
+}
+
+/* Vectors of VEC_LANES floats: load_half converts as many 16-bit values
+ * on the way in.
+ */
+#if defined(__AVX512F__)
+
+#define VEC_LANES 16
+typedef __m512 vec;
+
+static inline vec load_half(HalfFormat format, const uint16_t *p)
+{
+	__m256i h = _mm256_loadu_si256((const __m256i *)p);
+	if (format == HALF_FP16) {
+		return _mm512_cvtph_ps(h);
+	}
+	return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h),
+												 16));
+}
+
+#define vec_zero() _mm512_setzero_ps()
+#define vec_load(p) _mm512_loadu_ps(p)
+#define vec_fma(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define vec_sum(a) _mm512_reduce_add_ps(a)
+
+#elif defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+
+#define VEC_LANES 8
+typedef __m256 vec;
+
+static inline vec load_half(HalfFormat format, const uint16_t *p)
+{
+	__m128i h = _mm_loadu_si128((const __m128i *)p);
+	if (format == HALF_FP16) {
+		return _mm256_cvtph_ps(h);
+	}
+	return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h),
+												 16));
+}
+
+static inline float vec_sum(vec a)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(a),
+						  _mm256_extractf128_ps(a, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
+}
+
+#define vec_zero() _mm256_setzero_ps()
+#define vec_load(p) _mm256_loadu_ps(p)
+#define vec_fma(a, b, c) _mm256_fmadd_ps(a, b, c)
+
+#else
+
+#define VEC_LANES 1
+typedef float vec;
+
+static inline vec load_half(HalfFormat format, const uint16_t *p)
+{
+	return half_to_float(format, *p);
+}
+
+#define vec_zero() 0.0f
+#define vec_load(p) (*(p))
+#define vec_fma(a, b, c) ((a) * (b) + (c))
+#define vec_sum(a) (a)
+
+#endif
+
+/* Name of the kernel selected at compile time (bf16 values are widened
+ * to float by shifts, so it is the same for both formats).
+ */
+const char *half_kernel_name(void)
+{
+#if defined(__AVX512F__)
+	return "avx512f";
+#elif defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+	return "avx2-f16c";
+#else
+	return "scalar";
+#endif
+}
+
+const char *half_format_name(HalfFormat format)
+{
+	return format == HALF_FP16 ? "fp16" : "bf16";
+}
+
+typedef struct {
+	const uint16_t *w;
+	const float *x;
+	int n_rows, stride, n;
+	float *out;
+} HalfGemmArgs;
+
+/* Rows [begin, end) of the weights for half_gemm. Each row is converted
+ * once for 4 inputs at a time. Inlined into one copy per format, so the
+ * format tests go away.
+ */
+static inline __attribute__((always_inline))
+void gemm_rows(HalfGemmArgs *k, HalfFormat format, long begin, long end)
+{
+	int r, i, c, stride = k->stride;
+	const uint16_t *row;
+	const float *x0, *x1, *x2, *x3;
+	vec w, a0, a1, a2, a3;
+	for (r = begin; r < end; r++) {
+		row = k->w + (long)r * stride;
+		for (i = 0; i + 4 <= k->n; i += 4) {
+			x0 = k->x + (long)i * stride;
+			x1 = x0 + stride;
+			x2 = x1 + stride;
+			x3 = x2 + stride;
+			a0 = a1 = a2 = a3 = vec_zero();
+			for (c = 0; c < stride; c += VEC_LANES) {
+				w = load_half(format, row + c);
+				a0 = vec_fma(w, vec_load(x0 + c), a0);
+				a1 = vec_fma(w, vec_load(x1 + c), a1);
+				a2 = vec_fma(w, vec_load(x2 + c), a2);
+				a3 = vec_fma(w, vec_load(x3 + c), a3);
+			}
+			k->out[(long)i * k->n_rows + r] = vec_sum(a0);
+			k->out[(long)(i + 1) * k->n_rows + r] = vec_sum(a1);
+			k->out[(long)(i + 2) * k->n_rows + r] = vec_sum(a2);
+			k->out[(long)(i + 3) * k->n_rows + r] = vec_sum(a3);
+		}
+		for (; i < k->n; i++) {
+			x0 = k->x + (long)i * stride;
+			a0 = vec_zero();
+			for (c = 0; c < stride; c += VEC_LANES) {
+				a0 = vec_fma(load_half(format, row + c), vec_load(x0 + c), a0);
+			}
+			k->out[(long)i * k->n_rows + r] = vec_sum(a0);
+		}
+	}
+}
+
+static void gemm_rows_fp16(void *arg, long begin, long end)
+{
+	gemm_rows(arg, HALF_FP16, begin, end);
+}
+
+static void gemm_rows_bf16(void *arg, long begin, long end)
+{
+	gemm_rows(arg, HALF_BF16, begin, end);
+}
+
+/* out[i][r] = sum_c w[r][c] * x[i][c]: the n_rows rows of w (16-bit
+ * values in 'format') times n float vectors, which lie one after the
+ * other in x. Rows of w and vectors of x have 'stride' elements (see
+ * half_stride), out gets n rows of n_rows floats. Split by rows over the
+ * thread pool.
+ */
+void half_gemm(HalfFormat format, const uint16_t *w, int n_rows, int stride,
+			   const float *x, int n, float *out)
+{
+	HalfGemmArgs k = {w, x, n_rows, stride, n, out};
+	PROF_FLOPS(2L * n_rows * stride * n);
+	PROF_BYTES(2L * n_rows * stride + 4L * n * stride + 4L * n * n_rows);
+	parallel_for(0, n_rows, pool_grain(n_rows, 2.0 * stride * n),
+				 format == HALF_FP16 ? gemm_rows_fp16 : gemm_rows_bf16, &k);
+}
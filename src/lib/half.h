@@ -0,0 +1,52 @@
+#include <stdint.h>
+
+#ifndef HALF_H
+#define HALF_H
+
+/* 16-bit floating point kernels: weights stored as IEEE half precision
+ * (fp16: 5 exponent bits, 10 mantissa bits) or bfloat16 (bf16: the top
+ * half of a float, 8 exponent bits, 7 mantissa bits), converted to float
+ * as they are loaded and multiplied with float activations, accumulating
+ * in float. Storing the weights in half the bytes of a float (a quarter
+ * of a double) halves the memory traffic of the bandwidth-bound
+ * products.
+ *
+ * Rounding to 16 bits is to nearest even, vectorized with F16C or
+ * AVX-512 for fp16 and with AVX-512 BF16 for bf16 when compiled for
+ * them (which flushes subnormal floats to zero, unlike the scalar path).
+ * The products widen fp16 with vcvtph2ps and bf16 with a shift as they
+ * load the weights.
+ *
+ * Rows are stored with a stride that is a multiple of HALF_STRIDE_ALIGN
+ * elements, padded with zeros, so the kernels need no tail loops.
+ */
+
+#define HALF_STRIDE_ALIGN 16
+
+typedef enum {
+	HALF_FP16,
+	HALF_BF16
+} HalfFormat;
+
+int half_stride(int n);
+
+void *half_alloc(long n_bytes);
+
+uint16_t float_to_half(HalfFormat format, float x);
+
+float half_to_float(HalfFormat format, uint16_t h);
+
+void half_from_doubles(HalfFormat format, const double *src, uint16_t *dst,
+					   long n);
+
+void half_to_floats(HalfFormat format, const uint16_t *src, float *dst,
+					long n);
+
+void half_gemm(HalfFormat format, const uint16_t *w, int n_rows, int stride,
+			   const float *x, int n, float *out);
+
+const char *half_format_name(HalfFormat format);
+
+const char *half_kernel_name(void);
+
+#endif // HALF_H
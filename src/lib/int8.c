@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX512VNNI__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <int8.h>
+#include <profile.h>
+#include <pool.h>
+
+/* Round n up to a multiple of INT8_STRIDE_ALIGN. */
+int int8_stride(int n)
+{
+	return (n + INT8_STRIDE_ALIGN - 1) / INT8_STRIDE_ALIGN * INT8_STRIDE_ALIGN;
+}
+
+/* Allocate n_bytes of zeroed memory aligned to INT8_STRIDE_ALIGN (at
+ * least one INT8_STRIDE_ALIGN block). Must be freed with free(). Returns
+ * NULL if the allocation fails.
+ */
+void *int8_alloc(long n_bytes)
+{
+	long size = n_bytes > 0 ? (n_bytes + INT8_STRIDE_ALIGN - 1) /
+				INT8_STRIDE_ALIGN * INT8_STRIDE_ALIGN : INT8_STRIDE_ALIGN;
+	void *p = aligned_alloc(INT8_STRIDE_ALIGN, size);
+	if (p == NULL) {
+		fprintf(stderr, "int8_alloc ERROR: cannot allocate %ld bytes.\n",
+				size);
+		return NULL;
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+/* Reference kernel: out[r] = sum_c w[r][c] * x[c] */
+void int8_gemv_scalar(const int8_t *w, int n_rows, int stride,
+					  const uint8_t *x, int32_t *out)
+{
+	int r, c;
+	int32_t acc;
+	for (r = 0; r < n_rows; r++) {
+		acc = 0;
+		for (c = 0; c < stride; c++) {
+			acc += (int32_t)w[(long)r * stride + c] * x[c];
+		}
+		out[r] = acc;
+	}
+}
+
+#if defined(__AVX512VNNI__)
+
+/* vpdpbusd: 4 u8*s8 products summed into each 32-bit lane. */
+static int32_t dot_row(const int8_t *w, const uint8_t *x, int stride)
+{
+	int c;
+	__m512i acc = _mm512_setzero_si512();
+	for (c = 0; c < stride; c += 64) {
+		acc = _mm512_dpbusd_epi32(acc,
+				_mm512_loadu_si512((const void *)(x + c)),
+				_mm512_loadu_si512((const void *)(w + c)));
+	}
+	return _mm512_reduce_add_epi32(acc);
+}
+
+#elif defined(__AVX2__)
+
+/* pmaddubsw: u8*s8 products summed by pairs into 16-bit lanes (which
+ * cannot saturate with 7-bit activations), widened to 32 bits with
+ * pmaddwd.
+ */
+static int32_t dot_row(const int8_t *w, const uint8_t *x, int stride)
+{
+	int c;
+	__m256i prod;
+	__m256i ones = _mm256_set1_epi16(1);
+	__m256i acc = _mm256_setzero_si256();
+	__m128i s;
+	for (c = 0; c < stride; c += 32) {
+		prod = _mm256_maddubs_epi16(
+				_mm256_loadu_si256((const __m256i *)(x + c)),
+				_mm256_loadu_si256((const __m256i *)(w + c)));
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(prod, ones));
+	}
+	s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+					  _mm256_extracti128_si256(acc, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(s);
+}
+
+#else
+
+static int32_t dot_row(const int8_t *w, const uint8_t *x, int stride)
+{
+	int c;
+	int32_t acc = 0;
+	for (c = 0; c < stride; c++) {
+		acc += (int32_t)w[c] * x[c];
+	}
+	return acc;
+}
+
+#endif
+
+/* Name of the kernel selected at compile time. */
+const char *int8_kernel_name(void)
+{
+#if defined(__AVX512VNNI__)
+	return "avx512-vnni";
+#elif defined(__AVX2__)
+	return "avx2";
+#else
+	return "scalar";
+#endif
+}
+
+/* out[r] = sum_c w[r][c] * x[c], for the n_rows rows of w. Both w's rows
+ * and x have 'stride' elements.
+ */
+void int8_gemv(const int8_t *w, int n_rows, int stride, const uint8_t *x,
+			   int32_t *out)
+{
+	int r;
+	PROF_FLOPS(2L * n_rows * stride);
+	PROF_BYTES((long)n_rows * stride + stride + 4L * n_rows);
+	for (r = 0; r < n_rows; r++) {
+		out[r] = dot_row(w + (long)r * stride, x, stride);
+	}
+}
+
+typedef struct {
+	const int8_t *w;
+	const uint8_t *x;
+	int n_rows, stride, n;
+	int32_t *out;
+} Int8GemmArgs;
+
+/* Rows [begin, end) of the weights for int8_gemm. */
+static void int8_gemm_rows(void *arg, long begin, long end)
+{
+	Int8GemmArgs *k = arg;
+	int r, i;
+	const int8_t *row;
+	for (r = begin; r < end; r++) {
+		row = k->w + (long)r * k->stride;
+		for (i = 0; i < k->n; i++) {
+			k->out[(long)i * k->n_rows + r] = dot_row(row,
+							k->x + (long)i * k->stride, k->stride);
+		}
+	}
+}
+
+/* Batched int8_gemv: x holds n vectors of 'stride' elements one after
+ * the other, and out gets n rows of n_rows results. Each row of w is
+ * reused for the whole batch while it is in cache. Large batches are
+ * split by rows over the thread pool.
+ */
+void int8_gemm(const int8_t *w, int n_rows, int stride, const uint8_t *x,
+			   int n, int32_t *out)
+{
+	Int8GemmArgs k = {w, x, n_rows, stride, n, out};
+	PROF_FLOPS(2L * n_rows * stride * n);
+	PROF_BYTES((long)n_rows * stride + (long)n * stride + 4L * n * n_rows);
+	/* int8 products are cheaper than the flops pool_grain counts */
+	parallel_for(0, n_rows, pool_grain(n_rows, 0.25 * stride * n),
+				 int8_gemm_rows, &k);
+}
@@ -0,0 +1,35 @@
+#include <stdint.h>
+
+#ifndef INT8_H
+#define INT8_H
+
+/* Integer kernels for quantized inference: signed 8-bit weights times
+ * unsigned 8-bit activations, accumulated in 32 bits.
+ *
+ * Activations must be in [0, 127] (7 bits): then the AVX2 pmaddubsw
+ * path, which sums pairs of products in saturating 16-bit lanes, can
+ * never saturate, and every kernel gives exactly the same result.
+ *
+ * Rows are stored with a stride that is a multiple of INT8_STRIDE_ALIGN
+ * bytes, padded with zeros, so the kernels need no tail loops.
+ */
+
+#define INT8_STRIDE_ALIGN 64
+#define INT8_MAX_ACTIVATION 127
+
+int int8_stride(int n);
+
+void *int8_alloc(long n_bytes);
+
+void int8_gemv(const int8_t *w, int n_rows, int stride, const uint8_t *x,
+			   int32_t *out);
+
+void int8_gemv_scalar(const int8_t *w, int n_rows, int stride,
+					  const uint8_t *x, int32_t *out);
+
+void int8_gemm(const int8_t *w, int n_rows, int stride, const uint8_t *x,
+			   int n, int32_t *out);
+
+const char *int8_kernel_name(void);
+
+#endif // INT8_H
@@ -1,10 +1,28 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <time.h>
 
 #include <random.h>
 #include <matrix.h>
+#include <profile.h>
+#include <pool.h>
+#include <numa.h>
+#include <strassen.h>
+#include <math.h>
+
+/* Operands of a kernel split by rows over the pool. */
+typedef struct {
+	Matrix *a, *b, *res;
+	double alpha;
+	/* base seed of the random fills */
+	unsigned long seed;
+} RowsArgs;
+
+/* Seed of row i of a random fill from the base seed: each row has its
+ * own stream, so the result does not depend on the number of threads. */
+#define ROW_SEED(seed, i) ((seed) + (unsigned long)(i) * 2654435761UL)
 
 #define SAME_SHAPE_CHECK(fn, operation, a, b, rval) \
 	if (a->n_rows != b->n_rows || a->n_cols != b->n_cols) { \
@@ -12,7 +30,6 @@
 		return rval; \
 	}
 
-#define COPY_MATRIX_SHAPE(mat) create_matrix(mat->n_rows, mat->n_cols);
 #define ABS(x) (((x) >= 0) ? (x) : -(x))
 #define MATRIX_CMP_PREC 1e-8
 
@@ -21,71 +38,123 @@
  */
 Matrix *create_matrix_zeros(int n_rows, int n_cols)
 {
-	int i, j;
-	Matrix *mat = malloc(sizeof(Matrix));
-	mat->n_rows = n_rows;
-	mat->n_cols = n_cols;
-	mat->data = malloc(sizeof(double *)*n_rows);
-	for (i = 0; i < n_rows; i++) {
-		mat->data[i] = malloc(sizeof(double)*n_cols);
-		for (j = 0; j < n_cols; j++) {
-			mat->data[i][j] = 0.0;
-		}
-	}
-	matrix_fill(mat, 0);
-	return mat;
+	return create_matrix(n_rows, n_cols);
 }
 
 /* Allocate memory for a matrix with n_rows rows and n_cols columns,
  * return a pointer to it. Must be freed with free_matrix(the_matrix)
+ *
+ * NOTE: the elements are stored contiguously, row after row, in a single
+ * block pointed to by data[0]. data[i] points to the start of row i.
+ * Large blocks are backed by huge pages (see numa_alloc_huge).
  */
 Matrix *create_matrix(int n_rows, int n_cols)
+{
+	Matrix *mat = create_matrix_view(
+		numa_alloc_huge(sizeof(double) * n_rows * n_cols), n_rows, n_cols);
+	matrix_fill(mat, 0);
+	return mat;
+}
+
+/* Create a n_rows x n_cols matrix whose elements live in 'buffer', which
+ * must hold at least n_rows * n_cols doubles, stored row after row.
+ * The buffer is not copied: writes to the matrix go to the buffer.
+ * Must be freed with free_matrix_view(the_matrix), which leaves the
+ * buffer untouched.
+ */
+Matrix *create_matrix_view(double *buffer, int n_rows, int n_cols)
 {
 	int i;
 	Matrix *mat = malloc(sizeof(Matrix));
+	PROF_ALLOC();
 	mat->n_rows = n_rows;
 	mat->n_cols = n_cols;
-	mat->data = malloc(sizeof(double *)*n_rows);
-	for (i = 0; i < n_rows; i++) {
-		mat->data[i] = malloc(sizeof(double)*n_cols);
+	mat->data = malloc(sizeof(double *) * (n_rows > 0 ? n_rows : 1));
+	mat->data[0] = buffer;
+	for (i = 1; i < n_rows; i++) {
+		mat->data[i] = buffer + (long)i * n_cols;
 	}
-	matrix_fill(mat, 0);
 	return mat;
 }
 
 
+/* Rows [begin, end) of res = alpha. */
+static void fill_rows(void *arg, long begin, long end)
+{
+	RowsArgs *k = arg;
+	int i, j, nc = k->res->n_cols;
+	for (i = begin; i < end; i++) {
+		for (j = 0; j < nc; j++) {
+			k->res->data[i][j] = k->alpha;
+		}
+	}
+}
+
 /* Given a matrix and a double, fill all the matrix with this value. */
 void matrix_fill(Matrix *mat, double value)
 {
-	int i, j;
-	for (i = 0; i < mat->n_rows; i++) {
-		for (j = 0; j < mat->n_cols; j++) {
-			mat->data[i][j] = value;
+	RowsArgs k = {NULL, NULL, mat, value, 0};
+	PROF_BYTES(8L * mat->n_rows * mat->n_cols);
+	parallel_for(0, mat->n_rows, pool_grain(mat->n_rows, mat->n_cols),
+				 fill_rows, &k);
+}
+
+/* Rows [begin, end) of res, uniform in [0, 1]. */
+static void random_rows(void *arg, long begin, long end)
+{
+	RowsArgs *k = arg;
+	int i, j, nc = k->res->n_cols;
+	unsigned int seed;
+	for (i = begin; i < end; i++) {
+		seed = ROW_SEED(k->seed, i);
+		for (j = 0; j < nc; j++) {
+			k->res->data[i][j] = (double)rand_r(&seed) / (double)RAND_MAX;
 		}
 	}
 }
 
-/* Fill with uniform randoms between 0 and 1 */
+/* Fill with uniform randoms between 0 and 1. The rows are drawn in
+ * parallel, from a seed taken from rand(): srand still makes the fill
+ * reproducible. */
 void matrix_fill_random(Matrix *mat)
 {
-	int i, j;
-	for (i = 0; i < mat->n_rows; i++) {
-		for (j = 0; j < mat->n_cols; j++) {
-			mat->data[i][j] = (double)rand() / (double)RAND_MAX ;
+	RowsArgs k = {NULL, NULL, mat, 0.0, (unsigned long)rand()};
+	parallel_for(0, mat->n_rows, pool_grain(mat->n_rows, 10.0 * mat->n_cols),
+				 random_rows, &k);
+}
+
+/* Rows [begin, end) of res, gaussian (Box-Muller on rand0, both values
+ * of each pair used). */
+static void gaussian_rows(void *arg, long begin, long end)
+{
+	RowsArgs *k = arg;
+	int i, j, nc = k->res->n_cols;
+	long seed;
+	double x1, x2, r, fac;
+	for (i = begin; i < end; i++) {
+		seed = ROW_SEED(k->seed, i) % 2147483647L;
+		for (j = 0; j < nc; j += 2) {
+			do {
+				x1 = rand0(&seed) * 2 - 1;
+				x2 = rand0(&seed) * 2 - 1;
+				r = x1 * x1 + x2 * x2;
+			} while (r >= 1 || r == 0);
+			fac = sqrt(-2 * log(r) / r);
+			k->res->data[i][j] = x1 * fac;
+			if (j + 1 < nc) {
+				k->res->data[i][j+1] = x2 * fac;
+			}
 		}
 	}
 }
 
-/* Fill with gaussian randoms between 0 and 1 */
+/* Fill with gaussian randoms (mean 0, variance 1), seeded from the time;
+ * the rows are drawn in parallel. */
 void matrix_fill_gaussian_random(Matrix *mat)
 {
-	int i, j;
-	long seed = time(NULL);
-	for (i = 0; i < mat->n_rows; i++) {
-		for (j = 0; j < mat->n_cols; j++) {
-			mat->data[i][j] = gauss0(&seed);
-		}
-	}
+	RowsArgs k = {NULL, NULL, mat, 0.0, (unsigned long)time(NULL)};
+	parallel_for(0, mat->n_rows, pool_grain(mat->n_rows, 30.0 * mat->n_cols),
+				 gaussian_rows, &k);
 }
 
 /* Free the memory allocated for a matrix */
@@ -94,9 +163,15 @@ void free_matrix(Matrix *mat)
 	if (mat == NULL) {
 		return;
 	}
-	int i;
-	for (i = 0; i < mat->n_rows; i++) {
-		free(mat->data[i]);
+	free(mat->data[0]);
+	free_matrix_view(mat);
+}
+
+/* Free a matrix created with create_matrix_view. Its buffer is not freed. */
+void free_matrix_view(Matrix *mat)
+{
+	if (mat == NULL) {
+		return;
 	}
 	free(mat->data);
 	free(mat);
@@ -109,10 +184,12 @@ Matrix *matrix_prod(Matrix *a, Matrix *b)
 	int i, j, nc, nr, s;
 	nc = b->n_cols;
 	nr = a->n_rows;
-	/* if (a->n_cols != b->n_rows) { */
-	/* 	fprintf(stderr, "matrix_prod ERROR: cannot multiply a %dx%d matrix and a %dx%d matrix.\n", a->n_rows, a->n_cols, b->n_rows, b->n_cols); */
-	/* 	return NULL; */
-	/* } */
+	if (a->n_cols != b->n_rows) {
+		fprintf(stderr, "matrix_prod ERROR: cannot multiply a %dx%d matrix and a %dx%d matrix.\n", a->n_rows, a->n_cols, b->n_rows, b->n_cols);
+		return NULL;
+	}
+	PROF_FLOPS(2L * nr * nc * a->n_cols);
+	PROF_BYTES(8L * (nr * a->n_cols + a->n_cols * nc + nr * nc));
 	Matrix *res = create_matrix(nr, nc);
 	double val;
 	for (i = 0; i < nr; i++) {
@@ -127,23 +204,14 @@ Matrix *matrix_prod(Matrix *a, Matrix *b)
 	return res;
 }
 
-/* Like matrix_prod, but uglier code & optimized */
-Matrix *matrix_prod_optim(Matrix *a, Matrix *b)
+/* Rows [begin, end) of res = a x b. */
+static void prod_rows(void *arg, long begin, long end)
 {
-	int i, j, nc, nr, s;
-	nc = b->n_cols;
-	nr = a->n_rows;
-	/* if (a->n_cols != b->n_rows) { */
-	/* 	fprintf(stderr, "matrix_prod ERROR: cannot multiply a %dx%d matrix and a %dx%d matrix.\n", a->n_rows, a->n_cols, b->n_rows, b->n_cols); */
-	/* 	return NULL; */
-	/* } */
-	Matrix *res = malloc(sizeof(Matrix));
-	res->n_rows = nr;
-	res->n_cols = nc;
-	res->data = malloc(sizeof(double)*nr);
+	RowsArgs *k = arg;
+	Matrix *a = k->a, *b = k->b, *res = k->res;
+	int i, j, s, nc = b->n_cols;
 	double val;
-	for (i = 0; i < nr; i++) {
-		res->data[i] = malloc(sizeof(double) * nc);
+	for (i = begin; i < end; i++) {
 		for (j = 0; j < nc; j++) {
 			val = 0.0;
 			for (s = 0; s < a->n_cols; s++) {
@@ -152,6 +220,58 @@ Matrix *matrix_prod_optim(Matrix *a, Matrix *b)
 			res->data[i][j] = val;
 		}
 	}
+}
+
+/* Columns of b from which matrix_prod_optim uses gemm_blocked, 0 for
+ * never */
+static atomic_int blocked_min_cols = 0;
+
+/* Make matrix_prod_optim use the blocked kernel of gemm_blocked for
+ * products of at least min_cols columns (0 for never, the default):
+ * with enough of them its vectorized panels beat the dot products of
+ * the row kernel. The tuner (tune.h) measures the crossover.
+ */
+void matrix_prod_set_blocked(int min_cols)
+{
+	atomic_store(&blocked_min_cols, min_cols > 0 ? min_cols : 0);
+}
+
+int matrix_prod_blocked_min_cols(void)
+{
+	return atomic_load(&blocked_min_cols);
+}
+
+/* Like matrix_prod, but uglier code & optimized. Large products are
+ * split by rows over the thread pool. Products whose dimensions are all
+ * above the Strassen crossover, when it is enabled (see
+ * strassen_set_crossover), go to matrix_prod_strassen, and those with
+ * enough columns to gemm_blocked once enabled (see
+ * matrix_prod_set_blocked).
+ */
+Matrix *matrix_prod_optim(Matrix *a, Matrix *b)
+{
+	int nc, nr, crossover = strassen_crossover();
+	int min_cols = atomic_load(&blocked_min_cols);
+	nc = b->n_cols;
+	nr = a->n_rows;
+	if (a->n_cols != b->n_rows) {
+		fprintf(stderr, "matrix_prod_optim ERROR: cannot multiply a %dx%d matrix and a %dx%d matrix.\n", a->n_rows, a->n_cols, b->n_rows, b->n_cols);
+		return NULL;
+	}
+	if (crossover > 0 && nr > crossover && nc > crossover &&
+		a->n_cols > crossover) {
+		return matrix_prod_strassen(a, b, crossover);
+	}
+	if (min_cols > 0 && nc >= min_cols) {
+		return matrix_prod_blocked(a, b);
+	}
+	PROF_FLOPS(2L * nr * nc * a->n_cols);
+	PROF_BYTES(8L * (nr * a->n_cols + a->n_cols * nc + nr * nc));
+	Matrix *res = create_matrix_view(numa_alloc_huge(sizeof(double) * nr * nc),
+									 nr, nc);
+	RowsArgs k = {a, b, res, 0, 0};
+	parallel_for(0, nr, pool_grain(nr, 2.0 * nc * a->n_cols), prod_rows,
+				 &k);
 	return res;
 }
 
@@ -163,6 +283,8 @@ Matrix *entrywise_product(Matrix *a, Matrix *b)
 {
 	SAME_SHAPE_CHECK("entrywise_product", "entrywise product", a, b, NULL);
 	int i, j;
+	PROF_FLOPS((long)a->n_rows * a->n_cols);
+	PROF_BYTES(24L * a->n_rows * a->n_cols);
 	Matrix *res = create_matrix(a->n_cols, a->n_rows);
 	for (i = 0; i < a->n_rows; i++) {
 		for (j = 0; j < a->n_cols; j++) {
@@ -176,6 +298,8 @@ int matrix_entrywise_product(Matrix *a, Matrix *b)
 {
 	SAME_SHAPE_CHECK("matrix_entrywise_product", "entrywise product", a, b, 0);
 	int i, j;
+	PROF_FLOPS((long)a->n_rows * a->n_cols);
+	PROF_BYTES(24L * a->n_rows * a->n_cols);
 	for (i = 0; i < a->n_rows; i++) {
 		for (j = 0; j < a->n_cols; j++) {
 			a->data[i][j] *= b->data[i][j];
@@ -189,6 +313,8 @@ int matrix_add(Matrix *a, Matrix *b)
 {
 	/* SAME_SHAPE_CHECK("matrix_add", "matrix addition", a, b, 0); */
 	int i, j;
+	PROF_FLOPS((long)a->n_rows * a->n_cols);
+	PROF_BYTES(24L * a->n_rows * a->n_cols);
 	for (i = 0; i < a->n_rows; i++) {
 		for (j = 0; j < a->n_cols; j++) {
 			a->data[i][j] += b->data[i][j];
@@ -202,6 +328,8 @@ int matrix_substract(Matrix *a, Matrix *b)
 	SAME_SHAPE_CHECK("matrix_substract", "matrix substraction", a, b,
 					 0);
 	int i, j;
+	PROF_FLOPS((long)a->n_rows * a->n_cols);
+	PROF_BYTES(24L * a->n_rows * a->n_cols);
 	for (i = 0; i < a->n_rows; i++) {
 		for (j = 0; j < a->n_cols; j++) {
 			a->data[i][j] -= b->data[i][j];
@@ -209,10 +337,66 @@ int matrix_substract(Matrix *a, Matrix *b)
 	}
 }
 
+/* Add the column vector v (a n_rows x 1 matrix) to every column of a:
+ * a is altered. Used to add biases to a batch of column vectors.
+ */
+int matrix_add_columnwise(Matrix *a, Matrix *v)
+{
+	int i, j;
+	double b;
+	PROF_FLOPS((long)a->n_rows * a->n_cols);
+	PROF_BYTES(16L * a->n_rows * a->n_cols);
+	for (i = 0; i < a->n_rows; i++) {
+		b = v->data[i][0];
+		for (j = 0; j < a->n_cols; j++) {
+			a->data[i][j] += b;
+		}
+	}
+	return 1;
+}
+
+/* Rows [begin, end) of res += alpha * (a x b^T), a and b being column
+ * vectors. */
+static void ger_rows(void *arg, long begin, long end)
+{
+	RowsArgs *k = arg;
+	int i, j, nc = k->res->n_cols;
+	double s;
+	double *restrict row, *restrict yv = k->b->data[0];
+	for (i = begin; i < end; i++) {
+		s = k->alpha * k->a->data[i][0];
+		row = k->res->data[i];
+		for (j = 0; j < nc; j++) {
+			row[j] += s * yv[j];
+		}
+	}
+}
+
+/* Rank-1 update (BLAS GER): a += alpha * (x x y^T), with x and y
+ * column vectors of a->n_rows and a->n_cols elements. a is altered.
+ * Accumulates an outer product without building it or transposing y.
+ */
+int matrix_ger(Matrix *a, double alpha, Matrix *x, Matrix *y)
+{
+	if (x->n_rows != a->n_rows || y->n_rows != a->n_cols ||
+		x->n_cols != 1 || y->n_cols != 1) {
+		fprintf(stderr, "matrix_ger ERROR: cannot add the outer product of a %dx%d and a %dx%d matrix to a %dx%d matrix.\n", x->n_rows, x->n_cols, y->n_rows, y->n_cols, a->n_rows, a->n_cols);
+		return 0;
+	}
+	RowsArgs k = {x, y, a, alpha, 0};
+	PROF_FLOPS(2L * a->n_rows * a->n_cols);
+	PROF_BYTES(16L * a->n_rows * a->n_cols + 8L * (a->n_rows + a->n_cols));
+	parallel_for(0, a->n_rows, pool_grain(a->n_rows, 2.0 * a->n_cols),
+				 ger_rows, &k);
+	return 1;
+}
+
 /* Scalar product. */
 void matrix_multiply(Matrix *mat, double val)
 {
 	int i, j;
+	PROF_FLOPS((long)mat->n_rows * mat->n_cols);
+	PROF_BYTES(16L * mat->n_rows * mat->n_cols);
 	for (i = 0; i < mat->n_rows; i++) {
 		for (j = 0; j < mat->n_cols; j++) {
 			mat->data[i][j] *= val;
@@ -300,29 +484,55 @@ void matrix_to_array(Matrix *mat, double *array)
 	}
 }
 
+/* Rows [begin, end) of res = a^T. */
+static void transpose_rows(void *arg, long begin, long end)
+{
+	RowsArgs *k = arg;
+	int i, j, rows = k->a->n_rows;
+	for (j = begin; j < end; j++) {
+		for (i = 0; i < rows; i++) {
+			k->res->data[j][i] = k->a->data[i][j];
+		}
+	}
+}
+
+/* The transpose of mat; large ones are split by rows of the result over
+ * the thread pool. */
 Matrix *transpose(Matrix *mat)
 {
-	int i, j;
 	int rows = mat->n_rows;
 	int cols = mat->n_cols;
-	Matrix *T = create_matrix(cols, rows);
-	for (i = 0; i < rows; i++) {
-		for (j = 0; j < cols; j++) {
-			T->data[j][i] = mat->data[i][j];
-		}
-	}
+	Matrix *T = create_matrix_view(numa_alloc_huge(sizeof(double) * rows *
+												   cols), cols, rows);
+	RowsArgs k = {mat, NULL, T, 0.0, 0};
+	PROF_BYTES(16L * rows * cols);
+	parallel_for(0, cols, pool_grain(cols, rows), transpose_rows, &k);
 	return T;
 }
 
-Matrix *matrix_copy(Matrix *mat)
+/* Rows [begin, end) of res = a. */
+static void copy_rows(void *arg, long begin, long end)
 {
-	Matrix *new = COPY_MATRIX_SHAPE(mat);
-	int i, j;
-	for (i = 0; i < new->n_rows; i++) {
-		for (j = 0; j < new->n_cols; j++) {
-			new->data[i][j] = mat->data[i][j];
+	RowsArgs *k = arg;
+	int i, j, nc = k->res->n_cols;
+	for (i = begin; i < end; i++) {
+		for (j = 0; j < nc; j++) {
+			k->res->data[i][j] = k->a->data[i][j];
 		}
 	}
+}
+
+/* A copy of mat; large ones are copied by rows over the thread pool. */
+Matrix *matrix_copy(Matrix *mat)
+{
+	Matrix *new = create_matrix_view(numa_alloc_huge(sizeof(double) *
+													 mat->n_rows *
+													 mat->n_cols),
+									 mat->n_rows, mat->n_cols);
+	RowsArgs k = {mat, NULL, new, 0.0, 0};
+	PROF_BYTES(16L * new->n_rows * new->n_cols);
+	parallel_for(0, new->n_rows, pool_grain(new->n_rows, new->n_cols),
+				 copy_rows, &k);
 	return new;
 }
 
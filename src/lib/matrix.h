@@ -19,12 +19,20 @@ Matrix *create_matrix(int n_rows, int n_cols);
 
 Matrix *create_matrix_zeros(int n_rows, int n_cols);
 
+Matrix *create_matrix_view(double *buffer, int n_rows, int n_cols);
+
 void free_matrix(Matrix *mat);
 
+void free_matrix_view(Matrix *mat);
+
 Matrix *matrix_prod(Matrix *a, Matrix *b);
 
 Matrix *matrix_prod_optim(Matrix *a, Matrix *b);
 
+void matrix_prod_set_blocked(int min_cols);
+
+int matrix_prod_blocked_min_cols(void);
+
 void matrix_multiply(Matrix *mat, double val);
 
 Matrix *entrywise_product(Matrix *a, Matrix *b);
@@ -35,6 +43,10 @@ int matrix_add(Matrix *a, Matrix *b);
 
 int matrix_substract(Matrix *a, Matrix *b);
 
+int matrix_add_columnwise(Matrix *a, Matrix *v);
+
+int matrix_ger(Matrix *a, double alpha, Matrix *x, Matrix *y);
+
 int matrix_cmp(Matrix *a, Matrix *b);
 
 void matrix_assign(Matrix *mat, ...);
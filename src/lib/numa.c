@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <numa.h>
+
+/* Memory policies of mbind (from linux/mempolicy.h) */
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MPOL_MF_MOVE (1 << 1)
+
+#define NUMA_MAX_NODES 64
+
+static struct {
+	int n_nodes;
+	/* sysfs number of each node */
+	int id[NUMA_MAX_NODES];
+	/* usable CPUs of each node, in increasing order */
+	int n_cpus[NUMA_MAX_NODES];
+	int *cpus[NUMA_MAX_NODES];
+	/* node of every CPU, -1 if it is not usable */
+	int node_of[CPU_SETSIZE];
+} topo;
+
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+
+/* Parse a sysfs CPU list ("0-3,8,10-11") into 'set'. Returns 0 if it
+ * could not be read.
+ */
+static int read_cpulist(char *path, cpu_set_t *set)
+{
+	int a, b, n;
+	char buf[4096], *p = buf;
+	FILE *f = fopen(path, "r");
+	CPU_ZERO(set);
+	if (f == NULL) {
+		return 0;
+	}
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		buf[0] = '\0';
+	}
+	fclose(f);
+	while (sscanf(p, "%d%n", &a, &n) == 1) {
+		p += n;
+		b = a;
+		if (*p == '-' && sscanf(p + 1, "%d%n", &b, &n) == 1) {
+			p += n + 1;
+		}
+		for (; a <= b && a < CPU_SETSIZE; a++) {
+			CPU_SET(a, set);
+		}
+		if (*p != ',') {
+			break;
+		}
+		p++;
+	}
+	return 1;
+}
+
+/* Add the usable CPUs of 'set' as a new node, number 'id' in sysfs. */
+static void add_node(int id, cpu_set_t *set, cpu_set_t *allowed)
+{
+	int cpu, node = topo.n_nodes, n = 0;
+	topo.id[node] = id;
+	topo.cpus[node] = malloc(sizeof(int) * CPU_SETSIZE);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, set) && CPU_ISSET(cpu, allowed)) {
+			topo.cpus[node][n++] = cpu;
+			topo.node_of[cpu] = node;
+		}
+	}
+	topo.n_cpus[node] = n;
+	topo.n_nodes++;
+}
+
+/* Read the topology. Nodes without usable CPUs are left out, and if none
+ * is found (no sysfs) all the usable CPUs make up node 0.
+ */
+static void read_topology(void)
+{
+	int node, cpu;
+	char path[128];
+	cpu_set_t allowed, set;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		topo.node_of[cpu] = -1;
+	}
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) &&
+				 cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &allowed);
+		}
+	}
+	for (node = 0; node < NUMA_MAX_NODES && topo.n_nodes < NUMA_MAX_NODES;
+		 node++) {
+		snprintf(path, sizeof(path),
+				 "/sys/devices/system/node/node%d/cpulist", node);
+		if (!read_cpulist(path, &set)) {
+			continue;
+		}
+		CPU_AND(&set, &set, &allowed);
+		if (CPU_COUNT(&set) > 0) {
+			add_node(node, &set, &allowed);
+		}
+	}
+	if (topo.n_nodes == 0) {
+		add_node(0, &allowed, &allowed);
+	}
+}
+
+static void init_topology(void)
+{
+	pthread_once(&topo_once, read_topology);
+}
+
+/* Number of NUMA nodes with CPUs this process may use (at least 1). */
+int numa_node_count(void)
+{
+	init_topology();
+	return topo.n_nodes;
+}
+
+/* Copy to cpus (at most max) the usable CPUs of 'node'; returns how many
+ * it has.
+ */
+int numa_node_cpus(int node, int *cpus, int max)
+{
+	init_topology();
+	if (node < 0 || node >= topo.n_nodes) {
+		return 0;
+	}
+	memcpy(cpus, topo.cpus[node],
+		   sizeof(int) * (topo.n_cpus[node] < max ? topo.n_cpus[node] : max));
+	return topo.n_cpus[node];
+}
+
+/* Node of 'cpu', -1 if this process may not use it. */
+int numa_node_of_cpu(int cpu)
+{
+	init_topology();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? topo.node_of[cpu] : -1;
+}
+
+/* Node of the CPU the calling thread is running on (0 if unknown). */
+int numa_current_node(void)
+{
+	int node = numa_node_of_cpu(sched_getcpu());
+	return node >= 0 ? node : 0;
+}
+
+/* Pin the calling thread to the CPU of worker 'index': workers go to the
+ * nodes in turn, and through the CPUs of each node, so that n workers
+ * spread evenly over the nodes. Returns the node, or -1 on failure.
+ */
+int numa_pin_thread(int index)
+{
+	int node, cpu;
+	cpu_set_t set;
+	init_topology();
+	node = index % topo.n_nodes;
+	cpu = topo.cpus[node][index / topo.n_nodes % topo.n_cpus[node]];
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		return -1;
+	}
+	return node;
+}
+
+/* Let the calling thread run on any CPU of 'node' only. Returns 1 on
+ * success, 0 on failure.
+ */
+int numa_pin_node(int node)
+{
+	int i;
+	cpu_set_t set;
+	init_topology();
+	if (node < 0 || node >= topo.n_nodes) {
+		return 0;
+	}
+	CPU_ZERO(&set);
+	for (i = 0; i < topo.n_cpus[node]; i++) {
+		CPU_SET(topo.cpus[node][i], &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/* Return a copy of the CPU affinity of the calling thread, to give back
+ * with numa_restore_affinity once it has been pinned. NULL on failure.
+ */
+void *numa_save_affinity(void)
+{
+	cpu_set_t *set = malloc(sizeof(cpu_set_t));
+	if (pthread_getaffinity_np(pthread_self(), sizeof(*set), set) != 0) {
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+/* Set the CPU affinity of the calling thread back to 'saved' (from
+ * numa_save_affinity, may be NULL), and free it.
+ */
+void numa_restore_affinity(void *saved)
+{
+	if (saved != NULL) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), saved);
+	}
+	free(saved);
+}
+
+/* Set the memory policy of the whole pages in [p, p + n_bytes), moving
+ * those already touched. Returns 1 on success (or if there is nothing
+ * to do), 0 on failure.
+ */
+static int set_policy(void *p, long n_bytes, int mode, unsigned long *mask)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned long start = ((unsigned long)p + page - 1) / page * page;
+	unsigned long end = ((unsigned long)p + n_bytes) / page * page;
+	if (end <= start) {
+		return 1;
+	}
+	return syscall(SYS_mbind, start, end - start, mode, mask,
+				   (unsigned long)NUMA_MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+}
+
+/* Bind the whole pages of [p, p + n_bytes) to the memory of 'node'. Does
+ * nothing with a single node. Returns 1 on success, 0 on failure.
+ */
+int numa_bind(void *p, long n_bytes, int node)
+{
+	unsigned long mask;
+	init_topology();
+	if (topo.n_nodes <= 1) {
+		return 1;
+	}
+	if (node < 0 || node >= topo.n_nodes) {
+		return 0;
+	}
+	mask = 1UL << topo.id[node];
+	return set_policy(p, n_bytes, MPOL_BIND, &mask);
+}
+
+/* Spread the whole pages of [p, p + n_bytes) over the memory of all the
+ * nodes, page by page: for data every thread reads. Does nothing with a
+ * single node. Returns 1 on success, 0 on failure.
+ */
+int numa_interleave(void *p, long n_bytes)
+{
+	int node;
+	unsigned long mask = 0;
+	init_topology();
+	if (topo.n_nodes <= 1) {
+		return 1;
+	}
+	for (node = 0; node < topo.n_nodes; node++) {
+		mask |= 1UL << topo.id[node];
+	}
+	return set_policy(p, n_bytes, MPOL_INTERLEAVE, &mask);
+}
+
+/* Like malloc, but from n_bytes on NUMA_HUGE_MIN the block is aligned to
+ * and rounded up to huge pages, which the kernel is asked to back it
+ * with (a hint: it is ignored where transparent huge pages are
+ * disabled). Must be freed with free().
+ */
+void *numa_alloc_huge(long n_bytes)
+{
+	long size;
+	void *p;
+	if (n_bytes < NUMA_HUGE_MIN) {
+		return malloc(n_bytes > 0 ? n_bytes : 1);
+	}
+	size = (n_bytes + NUMA_HUGE_PAGE - 1) / NUMA_HUGE_PAGE * NUMA_HUGE_PAGE;
+	p = aligned_alloc(NUMA_HUGE_PAGE, size);
+	if (p != NULL) {
+		madvise(p, size, MADV_HUGEPAGE);
+	}
+	return p;
+}
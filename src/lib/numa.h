@@ -0,0 +1,45 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+/* NUMA placement, without libnuma.
+ *
+ * The topology is read once from sysfs (the cpulist of every node under
+ * /sys/devices/system/node), restricted to the CPUs this process may run
+ * on. Threads are pinned with the affinity calls, memory is bound to a
+ * node or interleaved over all of them with the mbind system call, and
+ * large allocations ask for transparent huge pages with madvise.
+ *
+ * Everything degrades gracefully: without sysfs, or on a machine with a
+ * single node, there is one node holding every usable CPU, binding and
+ * interleaving do nothing, and pinning only sets the affinity.
+ */
+
+/* Size of a transparent huge page on x86-64. */
+#define NUMA_HUGE_PAGE (2L << 20)
+
+/* Allocations of at least this many bytes are backed by huge pages. */
+#define NUMA_HUGE_MIN (4L << 20)
+
+int numa_node_count(void);
+
+int numa_node_cpus(int node, int *cpus, int max);
+
+int numa_node_of_cpu(int cpu);
+
+int numa_current_node(void);
+
+int numa_pin_thread(int index);
+
+int numa_pin_node(int node);
+
+void *numa_save_affinity(void);
+
+void numa_restore_affinity(void *saved);
+
+int numa_bind(void *p, long n_bytes, int node);
+
+int numa_interleave(void *p, long n_bytes);
+
+void *numa_alloc_huge(long n_bytes);
+
+#endif // NUMA_H
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <pool.h>
+#include <numa.h>
+
+typedef struct {
+	pool_fn fn;
+	void *arg;
+	PoolGroup *group;
+} PoolTask;
+
+/* Deque of tasks: its owner pushes and pops at 'bottom', thieves take
+ * from 'top'. tasks is used as a ring buffer.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	long top;
+	long bottom;
+	PoolTask tasks[POOL_DEQUE_SIZE];
+} PoolDeque;
+
+static struct {
+	/* threads, the calling one included: threads[0] is unused */
+	int n_threads;
+	pthread_t *threads;
+	PoolDeque *deques;
+	/* tasks in all the deques, for idle threads to sleep on */
+	atomic_long n_queued;
+	atomic_int stop;
+	/* pin the threads over the NUMA nodes ($GLIA_PIN) */
+	int pin;
+	pthread_mutex_t sleep_lock;
+	pthread_cond_t wake;
+} pool;
+
+/* Serializes starting and stopping the pool. */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int pool_started;
+
+/* Deque of the current thread: 0 for threads outside the pool. */
+static __thread int pool_self;
+
+static int push(PoolDeque *d, PoolTask *t)
+{
+	int ok;
+	pthread_mutex_lock(&d->lock);
+	ok = d->bottom - d->top < POOL_DEQUE_SIZE;
+	if (ok) {
+		d->tasks[d->bottom % POOL_DEQUE_SIZE] = *t;
+		d->bottom++;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return ok;
+}
+
+/* Take a task from the bottom (own == 1) or the top of a deque. */
+static int take(PoolDeque *d, PoolTask *t, int own)
+{
+	int ok;
+	pthread_mutex_lock(&d->lock);
+	ok = d->bottom > d->top;
+	if (ok && own) {
+		d->bottom--;
+		*t = d->tasks[d->bottom % POOL_DEQUE_SIZE];
+	} else if (ok) {
+		*t = d->tasks[d->top % POOL_DEQUE_SIZE];
+		d->top++;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return ok;
+}
+
+/* Run one queued task, our own newest one or else the oldest one of
+ * another deque. Returns 0 if there was none.
+ */
+static int run_one(void)
+{
+	int i, self = pool_self;
+	PoolTask t;
+	int found = take(&pool.deques[self], &t, 1);
+	for (i = 1; !found && i < pool.n_threads; i++) {
+		found = take(&pool.deques[(self + i) % pool.n_threads], &t, 0);
+	}
+	if (!found) {
+		return 0;
+	}
+	atomic_fetch_sub(&pool.n_queued, 1);
+	t.fn(t.arg);
+	atomic_fetch_sub(&t.group->pending, 1);
+	return 1;
+}
+
+static void *worker_main(void *arg)
+{
+	pool_self = (int)(long)arg;
+	if (pool.pin) {
+		numa_pin_thread(pool_self);
+	}
+	while (!atomic_load(&pool.stop)) {
+		if (run_one()) {
+			continue;
+		}
+		pthread_mutex_lock(&pool.sleep_lock);
+		while (!atomic_load(&pool.stop) && atomic_load(&pool.n_queued) == 0) {
+			pthread_cond_wait(&pool.wake, &pool.sleep_lock);
+		}
+		pthread_mutex_unlock(&pool.sleep_lock);
+	}
+	return NULL;
+}
+
+/* Stop the worker threads and free the pool. Called with pool_lock. */
+static void pool_stop(void)
+{
+	int i;
+	if (!atomic_load(&pool_started)) {
+		return;
+	}
+	pthread_mutex_lock(&pool.sleep_lock);
+	atomic_store(&pool.stop, 1);
+	pthread_cond_broadcast(&pool.wake);
+	pthread_mutex_unlock(&pool.sleep_lock);
+	for (i = 1; i < pool.n_threads; i++) {
+		pthread_join(pool.threads[i], NULL);
+	}
+	for (i = 0; i < pool.n_threads; i++) {
+		pthread_mutex_destroy(&pool.deques[i].lock);
+	}
+	pthread_mutex_destroy(&pool.sleep_lock);
+	pthread_cond_destroy(&pool.wake);
+	free(pool.threads);
+	free(pool.deques);
+	atomic_store(&pool_started, 0);
+}
+
+/* Start the pool with n_threads threads. Called with pool_lock. */
+static void pool_start(int n_threads)
+{
+	int i;
+	pool.n_threads = n_threads < 1 ? 1 : n_threads;
+	pool.threads = malloc(sizeof(pthread_t) * pool.n_threads);
+	pool.deques = malloc(sizeof(PoolDeque) * pool.n_threads);
+	for (i = 0; i < pool.n_threads; i++) {
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+		pool.deques[i].top = 0;
+		pool.deques[i].bottom = 0;
+	}
+	atomic_store(&pool.n_queued, 0);
+	atomic_store(&pool.stop, 0);
+	pool.pin = getenv("GLIA_PIN") != NULL;
+	pthread_mutex_init(&pool.sleep_lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	for (i = 1; i < pool.n_threads; i++) {
+		if (pthread_create(&pool.threads[i], NULL, worker_main,
+						   (void *)(long)i) != 0) {
+			fprintf(stderr, "pool ERROR: could not start thread %d, using "
+					"%d threads.\n", i, i);
+			pool.n_threads = i;
+			break;
+		}
+	}
+	atomic_store(&pool_started, 1);
+}
+
+/* Default number of threads: $GLIA_THREADS, else the online CPUs. */
+static int default_threads(void)
+{
+	char *env = getenv("GLIA_THREADS");
+	long n = env != NULL ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+/* Use n_threads threads from now on (the calling one included); n_threads
+ * <= 0 restores the default. Must not be called while parallel work is
+ * running.
+ */
+void pool_set_threads(int n_threads)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_stop();
+	pool_start(n_threads > 0 ? n_threads : default_threads());
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* Number of threads of the pool, starting it if needed. */
+int pool_threads(void)
+{
+	if (!atomic_load(&pool_started)) {
+		pthread_mutex_lock(&pool_lock);
+		if (!atomic_load(&pool_started)) {
+			pool_start(default_threads());
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+	return pool.n_threads;
+}
+
+void pool_group_init(PoolGroup *group)
+{
+	atomic_init(&group->pending, 0);
+}
+
+/* Queue fn(arg) as part of group, to be run by any thread of the pool.
+ * arg must stay valid until pool_join(group) returns.
+ */
+void pool_fork(PoolGroup *group, pool_fn fn, void *arg)
+{
+	PoolTask t = {fn, arg, group};
+	if (pool_threads() <= 1) {
+		fn(arg);
+		return;
+	}
+	/* Counted before it is visible, so that a thief running it at once
+	 * never takes the counters below zero */
+	atomic_fetch_add(&group->pending, 1);
+	atomic_fetch_add(&pool.n_queued, 1);
+	if (!push(&pool.deques[pool_self], &t)) {
+		atomic_fetch_sub(&group->pending, 1);
+		atomic_fetch_sub(&pool.n_queued, 1);
+		fn(arg);
+		return;
+	}
+	pthread_mutex_lock(&pool.sleep_lock);
+	pthread_cond_signal(&pool.wake);
+	pthread_mutex_unlock(&pool.sleep_lock);
+}
+
+/* Wait until all the tasks forked in group have run, running queued
+ * tasks (of any group) meanwhile.
+ */
+void pool_join(PoolGroup *group)
+{
+	while (atomic_load(&group->pending) > 0) {
+		if (!run_one()) {
+			sched_yield();
+		}
+	}
+}
+
+/* Grain (items per task) for n items costing work_per_item flops each:
+ * enough tasks to balance the load over the threads, none smaller than
+ * POOL_MIN_TASK_WORK. Below 2 * POOL_MIN_TASK_WORK of work in total,
+ * parallel_for runs inline.
+ */
+long pool_grain(long n, double work_per_item)
+{
+	long grain = n / (4L * pool_threads());
+	long min_grain = (long)(POOL_MIN_TASK_WORK / work_per_item) + 1;
+	return grain > min_grain ? grain : min_grain;
+}
+
+typedef struct {
+	pool_range_fn fn;
+	void *arg;
+	long begin;
+	long end;
+	long grain;
+} RangeTask;
+
+/* Run a range, forking its second half until it is at most one grain. */
+static void split_range(void *task)
+{
+	RangeTask *t = task, half;
+	PoolGroup group;
+	if (t->end - t->begin <= t->grain) {
+		t->fn(t->arg, t->begin, t->end);
+		return;
+	}
+	pool_group_init(&group);
+	half = *t;
+	half.begin = t->begin + (t->end - t->begin) / 2;
+	pool_fork(&group, split_range, &half);
+	t->end = half.begin;
+	split_range(t);
+	pool_join(&group);
+}
+
+/* Call fn(arg, b, e) over subranges [b, e) covering [begin, end), of at
+ * most 'grain' items (see pool_grain; <= 0 picks one for cheap items),
+ * in parallel. fn must be safe to run concurrently on disjoint ranges.
+ */
+void parallel_for(long begin, long end, long grain, pool_range_fn fn,
+				  void *arg)
+{
+	RangeTask t = {fn, arg, begin, end, grain};
+	if (end <= begin) {
+		return;
+	}
+	if (grain <= 0) {
+		t.grain = pool_grain(end - begin, 1);
+	}
+	if (pool_threads() <= 1) {
+		fn(arg, begin, end);
+		return;
+	}
+	split_range(&t);
+}
@@ -0,0 +1,52 @@
+#include <stdatomic.h>
+
+#ifndef POOL_H
+#define POOL_H
+
+/* Work-stealing thread pool.
+ *
+ * Every thread of the pool owns a deque of tasks: it pushes and pops its
+ * own tasks at the bottom, and when it runs out steals from the top of
+ * the others'. Threads outside the pool share deque 0. Waiting for tasks
+ * (pool_join) runs queued tasks instead of blocking, so fork/join can be
+ * nested freely.
+ *
+ * The number of threads (the calling thread included) comes from
+ * pool_set_threads, else the GLIA_THREADS environment variable, else the
+ * number of online CPUs. With a single thread everything runs inline.
+ * If the GLIA_PIN environment variable is set, the threads of the pool
+ * are pinned to CPUs spread over the NUMA nodes (see numa_pin_thread);
+ * the calling thread is left alone.
+ */
+
+/* Smallest amount of work (in flops, roughly) worth a task of its own:
+ * kernels doing less than twice this run inline. */
+#define POOL_MIN_TASK_WORK 50000
+
+/* Tasks each deque can hold; pool_fork runs a task inline when full. */
+#define POOL_DEQUE_SIZE 1024
+
+/* Tasks forked together, waited for with pool_join. */
+typedef struct {
+	atomic_long pending;
+} PoolGroup;
+
+typedef void (*pool_fn)(void *arg);
+typedef void (*pool_range_fn)(void *arg, long begin, long end);
+
+void pool_set_threads(int n_threads);
+
+int pool_threads(void);
+
+void pool_group_init(PoolGroup *group);
+
+void pool_fork(PoolGroup *group, pool_fn fn, void *arg);
+
+void pool_join(PoolGroup *group);
+
+long pool_grain(long n, double work_per_item);
+
+void parallel_for(long begin, long end, long grain, pool_range_fn fn,
+				  void *arg);
+
+#endif // POOL_H
@@ -0,0 +1,79 @@
+#include <time.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include <profile.h>
+
+ProfileCounters prof_counters;
+
+static const char *phase_names[PROF_N_PHASES] = {
+	"shuffle", "batch", "forward", "backward", "update", "eval"
+};
+
+/* Tick counter and wall clock at the last prof_reset, used to convert
+ * ticks into seconds. */
+static uint64_t start_ticks;
+static double start_ns;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Current value of the cycle counter (or of the monotonic clock in ns
+ * if there is no rdtsc).
+ */
+uint64_t prof_ticks(void)
+{
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return (uint64_t)now_ns();
+#endif
+}
+
+/* Zero all the counters and start a new measuring period. */
+void prof_reset(void)
+{
+	memset(&prof_counters, 0, sizeof(prof_counters));
+	start_ns = now_ns();
+	start_ticks = prof_ticks();
+}
+
+/* Print the counters accumulated since the last prof_reset, for an
+ * epoch in which n_samples samples were trained on. Throughput figures
+ * exclude evaluation: its time, and the FLOPs and bytes counted within
+ * PROF_EVAL.
+ */
+void prof_report(FILE *stream, int epoch, long n_samples)
+{
+	int i;
+	double elapsed_ns = now_ns() - start_ns;
+	double ticks_per_ns = (prof_ticks() - start_ticks) / elapsed_ns;
+	double eval_s = prof_counters.ticks[PROF_EVAL] / ticks_per_ns / 1e9;
+	double total_s = elapsed_ns / 1e9;
+	double train_s = total_s - eval_s;
+	double phase_s;
+	uint64_t flops = prof_counters.flops -
+		prof_counters.phase_flops[PROF_EVAL];
+	uint64_t bytes = prof_counters.bytes -
+		prof_counters.phase_bytes[PROF_EVAL];
+
+	fprintf(stream, "Epoch %d profile: %ld samples in %.3f s "
+			"(+%.3f s eval): %.1f samples/s, %.3f GFLOP/s, %.3f GB/s, "
+			"%lu matrix allocations\n",
+			epoch, n_samples, train_s, eval_s, n_samples / train_s,
+			flops / 1e9 / train_s, bytes / 1e9 / train_s,
+			(unsigned long)prof_counters.allocs);
+	for (i = 0; i < PROF_N_PHASES; i++) {
+		phase_s = prof_counters.ticks[i] / ticks_per_ns / 1e9;
+		fprintf(stream, "  %-10s %10.3f ms %6.1f%%\n", phase_names[i],
+				phase_s * 1e3, 100 * phase_s / total_s);
+	}
+}
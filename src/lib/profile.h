@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/* Low-overhead instrumentation of the training hot path.
+ *
+ * Compile with -DGLIA_PROFILE (make PROFILE=1) to enable it. Otherwise
+ * every PROF_* macro expands to nothing and costs nothing.
+ *
+ * Phases are timed with rdtsc on x86 (clock_gettime elsewhere) and the
+ * kernels count their FLOPs, bytes moved and matrix allocations. SGD
+ * prints a per-epoch report with prof_report.
+ *
+ * NOTE: the counters are global and not atomic: when several threads
+ * train at once they are approximate.
+ */
+
+enum prof_phase {
+	PROF_SHUFFLE,
+	PROF_BATCH,
+	PROF_FORWARD,
+	/* includes adding the gradients up (backpropagate_accumulate) */
+	PROF_BACKWARD,
+	PROF_UPDATE,
+	PROF_EVAL,
+	PROF_N_PHASES
+};
+
+typedef struct {
+	uint64_t ticks[PROF_N_PHASES];
+	uint64_t allocs;
+	uint64_t flops;
+	uint64_t bytes;
+	/* the part of flops and bytes counted within each phase */
+	uint64_t phase_flops[PROF_N_PHASES];
+	uint64_t phase_bytes[PROF_N_PHASES];
+} ProfileCounters;
+
+extern ProfileCounters prof_counters;
+
+uint64_t prof_ticks(void);
+
+void prof_reset(void);
+
+void prof_report(FILE *stream, int epoch, long n_samples);
+
+#ifdef GLIA_PROFILE
+#define PROF_BEGIN(phase) \
+	uint64_t prof_flops0_##phase = prof_counters.flops; \
+	uint64_t prof_bytes0_##phase = prof_counters.bytes; \
+	uint64_t prof_t0_##phase = prof_ticks()
+#define PROF_END(phase) \
+	(prof_counters.ticks[phase] += prof_ticks() - prof_t0_##phase, \
+	 prof_counters.phase_flops[phase] += \
+		prof_counters.flops - prof_flops0_##phase, \
+	 prof_counters.phase_bytes[phase] += \
+		prof_counters.bytes - prof_bytes0_##phase)
+#define PROF_ALLOC() (prof_counters.allocs++)
+#define PROF_FLOPS(n) (prof_counters.flops += (uint64_t)(n))
+#define PROF_BYTES(n) (prof_counters.bytes += (uint64_t)(n))
+#define PROF_RESET() prof_reset()
+#define PROF_REPORT(epoch, n_samples) prof_report(stderr, epoch, n_samples)
+#else
+#define PROF_BEGIN(phase)
+#define PROF_END(phase)
+#define PROF_ALLOC()
+#define PROF_FLOPS(n)
+#define PROF_BYTES(n)
+#define PROF_RESET()
+#define PROF_REPORT(epoch, n_samples)
+#endif
+
+#endif // PROFILE_H
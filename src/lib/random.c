@@ -1,5 +1,12 @@
 #include <stdlib.h> // For random(), RAND_MAX
 #include <math.h>
+#include <string.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include <random.h>
 
 
 #define IA 16807
@@ -70,3 +77,143 @@ long random_in_range(long min, long max)
 {
     return min + rand_lim(max - min);
 }
+
+/* splitmix64, to spread a seed over the states of an Rng. */
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(Rng *rng, uint64_t seed)
+{
+    int l;
+    for (l = 0; l < RNG_LANES; l++) {
+        rng->s0[l] = splitmix64(&seed);
+        rng->s1[l] = splitmix64(&seed);
+    }
+}
+
+/* One step of each of the RNG_LANES xorshift128+ generators. */
+static inline void rng_step(uint64_t *s0, uint64_t *s1, uint64_t *out)
+{
+    int l;
+    uint64_t x, y;
+    for (l = 0; l < RNG_LANES; l++) {
+        x = s0[l];
+        y = s1[l];
+        s0[l] = y;
+        x ^= x << 23;
+        s1[l] = x ^ y ^ (x >> 17) ^ (y >> 26);
+        out[l] = s1[l] + y;
+    }
+}
+
+/* Fill out with n random 64-bit words, RNG_LANES at a time. The state is
+ * kept in locals meanwhile, so the lanes stay in vector registers.
+ */
+void rng_bits(Rng *rng, uint64_t *out, long n)
+{
+    long i;
+    uint64_t s0[RNG_LANES], s1[RNG_LANES], last[RNG_LANES];
+    memcpy(s0, rng->s0, sizeof(s0));
+    memcpy(s1, rng->s1, sizeof(s1));
+    for (i = 0; i + RNG_LANES <= n; i += RNG_LANES) {
+        rng_step(s0, s1, out + i);
+    }
+    if (i < n) {
+        rng_step(s0, s1, last);
+        memcpy(out + i, last, sizeof(uint64_t) * (n - i));
+    }
+    memcpy(rng->s0, s0, sizeof(s0));
+    memcpy(rng->s1, s1, sizeof(s1));
+}
+
+/* Fill out with n floats uniformly distributed in [0, 1), two from each
+ * 64-bit word.
+ */
+void rng_uniform(Rng *rng, float *out, long n)
+{
+    long i, j, m;
+    uint64_t bits[32];
+    for (i = 0; i < n; i += 64) {
+        m = n - i < 64 ? n - i : 64;
+        rng_bits(rng, bits, m < 32 ? m : 32);
+        /* top 24 bits of each half: every value is exact in a float */
+        for (j = 0; j < m && j < 32; j++) {
+            out[i + j] = (int32_t)(bits[j] >> 40) * (1.0f / 16777216);
+        }
+        for (j = 32; j < m; j++) {
+            out[i + j] = (int32_t)((bits[j - 32] >> 8) & 0xffffff) *
+                         (1.0f / 16777216);
+        }
+    }
+}
+
+/* Pack into a word the 64 bits r[b] < t: with one compare to a mask
+ * register per 16 values with AVX-512, a compare and a movemask per 8
+ * with AVX2 (on 31-bit values, the compare being signed).
+ */
+static inline uint64_t pack_below(const uint32_t *r, uint32_t t)
+{
+    int b;
+    uint64_t m = 0;
+#if defined(__AVX512F__)
+    __m512i tv = _mm512_set1_epi32((int)t);
+    for (b = 0; b < 64; b += 16) {
+        m |= (uint64_t)_mm512_cmplt_epu32_mask(
+                _mm512_loadu_si512((const void *)(r + b)), tv) << b;
+    }
+#elif defined(__AVX2__)
+    __m256i tv = _mm256_set1_epi32((int)(t >> 1)), v;
+    for (b = 0; b < 64; b += 8) {
+        v = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(r + b)), 1);
+        m |= (uint64_t)(uint32_t)_mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpgt_epi32(tv, v))) << b;
+    }
+#else
+    for (b = 0; b < 64; b++) {
+        m |= (uint64_t)(r[b] < t) << b;
+    }
+#endif
+    return m;
+}
+
+/* Fill mask with n random bits packed 64 to a word (bit i of the word i /
+ * 64), each set with probability 'keep'. The bits past n in the last word
+ * are cleared.
+ */
+void rng_mask(Rng *rng, uint64_t *mask, long n, double keep)
+{
+    long i, words = (n + 63) / 64;
+    int j, m;
+    uint64_t bits[8 * 32];
+    uint32_t r[8 * 64], t;
+    t = keep <= 0 ? 0 : (uint32_t)(keep * 4294967296.0);
+    /* 8 words of the mask (512 bits) at a time */
+    for (i = 0; i < words; i += 8) {
+        m = words - i < 8 ? words - i : 8;
+        if (keep >= 1) {
+            memset(mask + i, 0xff, sizeof(uint64_t) * m);
+            continue;
+        }
+        rng_bits(rng, bits, 32 * m);
+        memcpy(r, bits, sizeof(uint64_t) * 32 * m);
+        for (j = 0; j < m; j++) {
+            mask[i + j] = pack_below(r + 64 * j, t);
+        }
+    }
+    if (n % 64 != 0) {
+        mask[words - 1] &= ((uint64_t)1 << (n % 64)) - 1;
+    }
+}
+
+/* A single float in [0, 1). */
+float rng_float(Rng *rng)
+{
+    float x;
+    rng_uniform(rng, &x, 1);
+    return x;
+}
@@ -1,9 +1,28 @@
+#include <stdint.h>
+
 #ifndef __RANDOM_H
 #define __RANDOM_H
 
+/* Number of xorshift128+ generators an Rng runs side by side. */
+#define RNG_LANES 8
+
+/* Fast generator for filling arrays: RNG_LANES independent xorshift128+
+ * streams stepped together, so that the loops over them vectorize. Not
+ * thread-safe: give each thread its own.
+ */
+typedef struct {
+    uint64_t s0[RNG_LANES];
+    uint64_t s1[RNG_LANES];
+} Rng;
+
 float rand0(long *seed);
 int rand_lim(int limit);
 float gauss0(long *seed);
 long random_in_range(long min, long max);
+void rng_seed(Rng *rng, uint64_t seed);
+void rng_bits(Rng *rng, uint64_t *out, long n);
+void rng_uniform(Rng *rng, float *out, long n);
+float rng_float(Rng *rng);
+void rng_mask(Rng *rng, uint64_t *mask, long n, double keep);
 
 #endif // RANDOM_H
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sparse.h>
+#include <profile.h>
+#include <pool.h>
+
+/* Build the CSR form of a dense matrix, keeping only its nonzeros. */
+SparseMatrix *matrix_to_sparse(Matrix *mat)
+{
+	int i, j;
+	long k = 0;
+	SparseMatrix *sp = malloc(sizeof(SparseMatrix));
+	sp->n_rows = mat->n_rows;
+	sp->n_cols = mat->n_cols;
+	sp->nnz = 0;
+	for (i = 0; i < mat->n_rows; i++) {
+		for (j = 0; j < mat->n_cols; j++) {
+			sp->nnz += mat->data[i][j] != 0.0;
+		}
+	}
+	sp->row_ptr = malloc(sizeof(long) * (mat->n_rows + 1));
+	sp->col_idx = malloc(sizeof(int) * (sp->nnz > 0 ? sp->nnz : 1));
+	sp->values = malloc(sizeof(double) * (sp->nnz > 0 ? sp->nnz : 1));
+	for (i = 0; i < mat->n_rows; i++) {
+		sp->row_ptr[i] = k;
+		for (j = 0; j < mat->n_cols; j++) {
+			if (mat->data[i][j] != 0.0) {
+				sp->col_idx[k] = j;
+				sp->values[k] = mat->data[i][j];
+				k++;
+			}
+		}
+	}
+	sp->row_ptr[mat->n_rows] = k;
+	return sp;
+}
+
+/* Free the memory allocated for a sparse matrix. */
+void free_sparse_matrix(SparseMatrix *mat)
+{
+	if (mat == NULL) {
+		return;
+	}
+	free(mat->row_ptr);
+	free(mat->col_idx);
+	free(mat->values);
+	free(mat);
+}
+
+/* Dense copy of a sparse matrix. */
+Matrix *sparse_to_matrix(SparseMatrix *mat)
+{
+	int i;
+	long k;
+	Matrix *res = create_matrix(mat->n_rows, mat->n_cols);
+	for (i = 0; i < mat->n_rows; i++) {
+		for (k = mat->row_ptr[i]; k < mat->row_ptr[i+1]; k++) {
+			res->data[i][mat->col_idx[k]] = mat->values[k];
+		}
+	}
+	return res;
+}
+
+typedef struct {
+	SparseMatrix *a;
+	Matrix *b, *res;
+} SparseProdArgs;
+
+/* Rows [begin, end) of res = a x b. */
+static void sparse_prod_rows(void *arg, long begin, long end)
+{
+	SparseProdArgs *k = arg;
+	SparseMatrix *a = k->a;
+	int i, j, nc = k->b->n_cols;
+	long p;
+	double v, *res_row, *b_row;
+	for (i = begin; i < end; i++) {
+		res_row = k->res->data[i];
+		for (p = a->row_ptr[i]; p < a->row_ptr[i+1]; p++) {
+			v = a->values[p];
+			b_row = k->b->data[a->col_idx[p]];
+			for (j = 0; j < nc; j++) {
+				res_row[j] += v * b_row[j];
+			}
+		}
+	}
+}
+
+/* Product of a sparse and a dense matrix: (a x b), like
+ * matrix_prod_optim. With b a column vector this is SpMV; with several
+ * columns (a batch of inputs) it is SpMM, and each nonzero of a is
+ * applied to a whole row of b at once. Large products are split by rows
+ * over the thread pool.
+ */
+Matrix *sparse_prod(SparseMatrix *a, Matrix *b)
+{
+	int nc = b->n_cols;
+	if (a->n_cols != b->n_rows) {
+		fprintf(stderr, "sparse_prod ERROR: cannot multiply a %dx%d matrix and a %dx%d matrix.\n", a->n_rows, a->n_cols, b->n_rows, b->n_cols);
+		return NULL;
+	}
+	Matrix *res = create_matrix(a->n_rows, nc);
+	SparseProdArgs k = {a, b, res};
+	if (a->n_rows == 0) {
+		return res;
+	}
+	PROF_FLOPS(2 * a->nnz * nc);
+	PROF_BYTES(12 * a->nnz + 8L * nc * (a->nnz + a->n_rows));
+	parallel_for(0, a->n_rows,
+				 pool_grain(a->n_rows, 2.0 * nc * (a->nnz + 1) / a->n_rows),
+				 sparse_prod_rows, &k);
+	return res;
+}
+
+/* Bytes taken by the CSR arrays of a sparse matrix. */
+long sparse_matrix_bytes(SparseMatrix *mat)
+{
+	return sizeof(long) * (mat->n_rows + 1) +
+		   (sizeof(int) + sizeof(double)) * mat->nnz;
+}
+
+/* Allocate a sparse vector of size n with room for n nonzeros, so it can
+ * hold any vector of that size (see sparse_vector_set). It starts empty.
+ */
+SparseVector *create_sparse_vector(int n)
+{
+	SparseVector *v = malloc(sizeof(SparseVector));
+	v->n = n;
+	v->nnz = 0;
+	v->idx = malloc(sizeof(int) * (n > 0 ? n : 1));
+	v->values = malloc(sizeof(double) * (n > 0 ? n : 1));
+	return v;
+}
+
+/* Store the nonzeros of array (of size v->n) in v, which must have room
+ * for all of them. Returns their number.
+ */
+int sparse_vector_set(SparseVector *v, double *array)
+{
+	int i, k = 0;
+	for (i = 0; i < v->n; i++) {
+		if (array[i] != 0.0) {
+			v->idx[k] = i;
+			v->values[k] = array[i];
+			k++;
+		}
+	}
+	v->nnz = k;
+	return k;
+}
+
+/* Sparse copy of a dense array of size n, with no spare room. */
+SparseVector *array_to_sparse_vector(double *array, int n)
+{
+	SparseVector *v = create_sparse_vector(n);
+	sparse_vector_set(v, array);
+	v->idx = realloc(v->idx, sizeof(int) * (v->nnz > 0 ? v->nnz : 1));
+	v->values = realloc(v->values,
+						sizeof(double) * (v->nnz > 0 ? v->nnz : 1));
+	return v;
+}
+
+/* Free the memory allocated for a sparse vector. */
+void free_sparse_vector(SparseVector *v)
+{
+	if (v == NULL) {
+		return;
+	}
+	free(v->idx);
+	free(v->values);
+	free(v);
+}
+
+/* Product of a dense matrix and a sparse column vector: (a x x), an
+ * a->n_rows x 1 matrix. Only the columns of a at the nonzeros of x are
+ * read.
+ */
+Matrix *matrix_prod_sparse_vector(Matrix *a, SparseVector *x)
+{
+	int i, k, nnz = x->nnz;
+	int *restrict idx = x->idx;
+	double *restrict values = x->values;
+	double *restrict row, sum;
+	Matrix *res = create_matrix(a->n_rows, 1);
+	PROF_FLOPS(2L * a->n_rows * nnz);
+	PROF_BYTES(8L * a->n_rows * (nnz + 1) + 12L * nnz);
+	for (i = 0; i < a->n_rows; i++) {
+		row = a->data[i];
+		sum = 0.0;
+		for (k = 0; k < nnz; k++) {
+			sum += row[idx[k]] * values[k];
+		}
+		res->data[i][0] = sum;
+	}
+	return res;
+}
+
+/* a += alpha * (y x x^T), with y a column vector of size a->n_rows and x
+ * sparse of size a->n_cols: only the columns of a at the nonzeros of x
+ * are touched.
+ */
+void matrix_add_outer_sparse(Matrix *a, double alpha, Matrix *y,
+							 SparseVector *x)
+{
+	int i, k, nnz = x->nnz;
+	int *restrict idx = x->idx;
+	double *restrict values = x->values;
+	double *restrict row, s;
+	PROF_FLOPS(2L * a->n_rows * nnz);
+	PROF_BYTES(16L * a->n_rows * nnz + 12L * nnz);
+	for (i = 0; i < a->n_rows; i++) {
+		row = a->data[i];
+		s = alpha * y->data[i][0];
+		for (k = 0; k < nnz; k++) {
+			row[idx[k]] += s * values[k];
+		}
+	}
+}
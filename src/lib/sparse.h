@@ -0,0 +1,53 @@
+#include <matrix.h>
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+/* Sparse matrix in CSR (compressed sparse row) format: the nonzeros of
+ * row i are values[row_ptr[i] .. row_ptr[i+1]-1], in the columns given
+ * by col_idx. Must be freed with free_sparse_matrix(the_matrix);
+ */
+typedef struct {
+	int n_rows;
+	int n_cols;
+	long nnz;
+	long *row_ptr;
+	int *col_idx;
+	double *values;
+} SparseMatrix;
+
+SparseMatrix *matrix_to_sparse(Matrix *mat);
+
+void free_sparse_matrix(SparseMatrix *mat);
+
+Matrix *sparse_to_matrix(SparseMatrix *mat);
+
+Matrix *sparse_prod(SparseMatrix *a, Matrix *b);
+
+long sparse_matrix_bytes(SparseMatrix *mat);
+
+/* Sparse vector of size n: its nonzeros are values[0 .. nnz-1], at the
+ * (increasing) positions idx[0 .. nnz-1]. Must be freed with
+ * free_sparse_vector(the_vector);
+ */
+typedef struct {
+	int n;
+	int nnz;
+	int *idx;
+	double *values;
+} SparseVector;
+
+SparseVector *create_sparse_vector(int n);
+
+int sparse_vector_set(SparseVector *v, double *array);
+
+SparseVector *array_to_sparse_vector(double *array, int n);
+
+void free_sparse_vector(SparseVector *v);
+
+Matrix *matrix_prod_sparse_vector(Matrix *a, SparseVector *x);
+
+void matrix_add_outer_sparse(Matrix *a, double alpha, Matrix *y,
+							 SparseVector *x);
+
+#endif // SPARSE_H
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include <strassen.h>
+#include <numa.h>
+#include <pool.h>
+#include <profile.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* 0 when disabled, -1 until read from the environment */
+static atomic_int crossover = -1;
+
+/* Blocking of gemm_blocked (see gemm_set_blocking) */
+static atomic_int block_k = GEMM_BLOCK_K;
+static atomic_int block_n = GEMM_BLOCK_N;
+
+/* Use Strassen-Winograd in matrix_prod_optim for products whose three
+ * dimensions are all above 'crossover'; 0 disables it, a negative value
+ * takes STRASSEN_CROSSOVER. By default it is disabled, unless the
+ * GLIA_STRASSEN environment variable is set: to 1 for the default
+ * crossover, or to the crossover itself.
+ */
+void strassen_set_crossover(int c)
+{
+	atomic_store(&crossover, c < 0 ? STRASSEN_CROSSOVER : c);
+}
+
+/* The crossover used by matrix_prod_optim, 0 if Strassen is disabled. */
+int strassen_crossover(void)
+{
+	int c = atomic_load(&crossover);
+	char *env;
+	if (c < 0) {
+		env = getenv("GLIA_STRASSEN");
+		c = env == NULL ? 0 : atoi(env);
+		c = c == 1 ? STRASSEN_CROSSOVER : MAX(c, 0);
+		atomic_store(&crossover, c);
+	}
+	return c;
+}
+
+/* Set the blocking of gemm_blocked: panels of b of block_k rows and
+ * block_n columns. Values <= 0 restore GEMM_BLOCK_K and GEMM_BLOCK_N.
+ */
+void gemm_set_blocking(int k, int n)
+{
+	atomic_store(&block_k, k > 0 ? k : GEMM_BLOCK_K);
+	atomic_store(&block_n, n > 0 ? n : GEMM_BLOCK_N);
+}
+
+/* The blocking of gemm_blocked, in *k and *n. */
+void gemm_blocking(int *k, int *n)
+{
+	*k = atomic_load(&block_k);
+	*n = atomic_load(&block_n);
+}
+
+/* Operands of gemm_blocked, split by rows over the pool. */
+typedef struct {
+	int n, k;
+	int block_k, block_n;
+	const double *a, *b;
+	double *c;
+	long lda, ldb, ldc;
+	int accumulate;
+} GemmArgs;
+
+/* Rows [begin, end) of c (+)= a x b. Four rows of c are updated from
+ * each row of b loaded, in a loop the compiler vectorizes. */
+static void gemm_rows(void *arg, long begin, long end)
+{
+	GemmArgs *g = arg;
+	int i, j, s, kk, jj, nb, kb;
+	long lda = g->lda, ldb = g->ldb, ldc = g->ldc;
+	double a0, a1, a2, a3;
+	const double *restrict bs;
+	double *restrict c0, *restrict c1, *restrict c2, *restrict c3;
+	if (!g->accumulate) {
+		for (i = begin; i < end; i++) {
+			for (j = 0; j < g->n; j++) {
+				g->c[i * ldc + j] = 0.0;
+			}
+		}
+	}
+	for (kk = 0; kk < g->k; kk += g->block_k) {
+		kb = MIN(g->block_k, g->k - kk);
+		for (jj = 0; jj < g->n; jj += g->block_n) {
+			nb = MIN(g->block_n, g->n - jj);
+			for (i = begin; i + 4 <= end; i += 4) {
+				c0 = g->c + i * ldc + jj;
+				c1 = c0 + ldc;
+				c2 = c1 + ldc;
+				c3 = c2 + ldc;
+				for (s = kk; s < kk + kb; s++) {
+					bs = g->b + s * ldb + jj;
+					a0 = g->a[i * lda + s];
+					a1 = g->a[(i + 1) * lda + s];
+					a2 = g->a[(i + 2) * lda + s];
+					a3 = g->a[(i + 3) * lda + s];
+					for (j = 0; j < nb; j++) {
+						c0[j] += a0 * bs[j];
+						c1[j] += a1 * bs[j];
+						c2[j] += a2 * bs[j];
+						c3[j] += a3 * bs[j];
+					}
+				}
+			}
+			for (; i < end; i++) {
+				c0 = g->c + i * ldc + jj;
+				for (s = kk; s < kk + kb; s++) {
+					bs = g->b + s * ldb + jj;
+					a0 = g->a[i * lda + s];
+					for (j = 0; j < nb; j++) {
+						c0[j] += a0 * bs[j];
+					}
+				}
+			}
+		}
+	}
+}
+
+/* Classical product of the m x k matrix a and the k x n matrix b, stored
+ * row after row with strides lda and ldb, into (accumulate == 0) or
+ * added to (accumulate != 0) the m x n matrix c, of stride ldc, panel of
+ * b by panel (see gemm_set_blocking). Large products are split by rows
+ * over the thread pool.
+ */
+void gemm_blocked(int m, int n, int k, const double *a, long lda,
+				  const double *b, long ldb, double *c, long ldc,
+				  int accumulate)
+{
+	GemmArgs g = {n, k, 0, 0, a, b, c, lda, ldb, ldc, accumulate};
+	if (m <= 0 || n <= 0) {
+		return;
+	}
+	gemm_blocking(&g.block_k, &g.block_n);
+	/* Blocks of 4 rows, as gemm_rows likes them */
+	parallel_for(0, m, (pool_grain(m, 2.0 * n * k) + 3) & ~3L, gemm_rows,
+				 &g);
+}
+
+/* z = x + y, or x - y if sign < 0, over m x n blocks; z may be x or y. */
+static void add(int m, int n, const double *x, long ldx, const double *y,
+				long ldy, double *z, long ldz, int sign)
+{
+	int i, j;
+	for (i = 0; i < m; i++) {
+		if (sign < 0) {
+			for (j = 0; j < n; j++) {
+				z[i * ldz + j] = x[i * ldx + j] - y[i * ldy + j];
+			}
+		} else {
+			for (j = 0; j < n; j++) {
+				z[i * ldz + j] = x[i * ldx + j] + y[i * ldy + j];
+			}
+		}
+	}
+}
+
+static int use_classical(int m, int n, int k, int crossover)
+{
+	return crossover <= 0 || m <= crossover || n <= crossover ||
+		k <= crossover;
+}
+
+/* Doubles of workspace needed by strassen for an m x k times k x n
+ * product: X and Y of this level plus what the next level needs, the
+ * products of a level being computed one after the other.
+ */
+long strassen_workspace_size(int m, int n, int k, int crossover)
+{
+	long mh = m / 2, nh = n / 2, kh = k / 2;
+	if (use_classical(m, n, k, crossover)) {
+		return 0;
+	}
+	return mh * MAX(kh, nh) + kh * nh +
+		strassen_workspace_size(mh, nh, kh, crossover);
+}
+
+/* c = a x b (m x k times k x n, with strides), in ws. */
+static void strassen(int m, int n, int k, const double *a, long lda,
+					 const double *b, long ldb, double *c, long ldc,
+					 int crossover, double *ws)
+{
+	int mh = m / 2, nh = n / 2, kh = k / 2;
+	int me = 2 * mh, ne = 2 * nh, ke = 2 * kh;
+	const double *a11, *a12, *a21, *a22, *b11, *b12, *b21, *b22;
+	double *c11, *c12, *c21, *c22, *x, *y, *next;
+	long ldx = MAX(kh, nh), ldy = nh;
+	if (use_classical(m, n, k, crossover)) {
+		gemm_blocked(m, n, k, a, lda, b, ldb, c, ldc, 0);
+		return;
+	}
+	a11 = a;
+	a12 = a + kh;
+	a21 = a + mh * lda;
+	a22 = a21 + kh;
+	b11 = b;
+	b12 = b + nh;
+	b21 = b + kh * ldb;
+	b22 = b21 + nh;
+	c11 = c;
+	c12 = c + nh;
+	c21 = c + mh * ldc;
+	c22 = c21 + nh;
+	x = ws;
+	y = x + mh * ldx;
+	next = y + kh * ldy;
+
+	/* S3 = A11 - A21, T3 = B22 - B12, P7 = S3 T3 */
+	add(mh, kh, a11, lda, a21, lda, x, ldx, -1);
+	add(kh, nh, b22, ldb, b12, ldb, y, ldy, -1);
+	strassen(mh, nh, kh, x, ldx, y, ldy, c21, ldc, crossover, next);
+	/* S1 = A21 + A22, T1 = B12 - B11, P5 = S1 T1 */
+	add(mh, kh, a21, lda, a22, lda, x, ldx, 1);
+	add(kh, nh, b12, ldb, b11, ldb, y, ldy, -1);
+	strassen(mh, nh, kh, x, ldx, y, ldy, c22, ldc, crossover, next);
+	/* S2 = S1 - A11, T2 = B22 - T1, P6 = S2 T2 */
+	add(mh, kh, x, ldx, a11, lda, x, ldx, -1);
+	add(kh, nh, b22, ldb, y, ldy, y, ldy, -1);
+	strassen(mh, nh, kh, x, ldx, y, ldy, c12, ldc, crossover, next);
+	/* S4 = A12 - S2, P3 = S4 B22 */
+	add(mh, kh, a12, lda, x, ldx, x, ldx, -1);
+	strassen(mh, nh, kh, x, ldx, b22, ldb, c11, ldc, crossover, next);
+	/* P1 = A11 B11 */
+	strassen(mh, nh, kh, a11, lda, b11, ldb, x, ldx, crossover, next);
+	/* U2 = P1 + P6, U3 = U2 + P7, U4 = U2 + P5, U7 = U3 + P5 (C22),
+	 * U5 = U4 + P3 (C12) */
+	add(mh, nh, c12, ldc, x, ldx, c12, ldc, 1);
+	add(mh, nh, c21, ldc, c12, ldc, c21, ldc, 1);
+	add(mh, nh, c12, ldc, c22, ldc, c12, ldc, 1);
+	add(mh, nh, c22, ldc, c21, ldc, c22, ldc, 1);
+	add(mh, nh, c12, ldc, c11, ldc, c12, ldc, 1);
+	/* T4 = T2 - B21, P4 = A22 T4, U6 = U3 - P4 (C21) */
+	add(kh, nh, y, ldy, b21, ldb, y, ldy, -1);
+	strassen(mh, nh, kh, a22, lda, y, ldy, c11, ldc, crossover, next);
+	add(mh, nh, c21, ldc, c11, ldc, c21, ldc, -1);
+	/* P2 = A12 B21, U1 = P1 + P2 (C11) */
+	strassen(mh, nh, kh, a12, lda, b21, ldb, c11, ldc, crossover, next);
+	add(mh, nh, c11, ldc, x, ldx, c11, ldc, 1);
+
+	/* Peeling: the last column of a and row of b, then the last column
+	 * and row of c, for the odd dimensions */
+	if (k > ke) {
+		gemm_blocked(me, ne, 1, a + ke, lda, b + ke * ldb, ldb, c, ldc, 1);
+	}
+	if (n > ne) {
+		gemm_blocked(me, 1, k, a, lda, b + ne, ldb, c + ne, ldc, 0);
+	}
+	if (m > me) {
+		gemm_blocked(1, n, k, a + me * lda, lda, b, ldb, c + me * ldc, ldc,
+					 0);
+	}
+}
+
+static Matrix *prod_check(Matrix *a, Matrix *b, char *fn)
+{
+	if (a->n_cols != b->n_rows) {
+		fprintf(stderr, "%s ERROR: cannot multiply a %dx%d matrix and a "
+				"%dx%d matrix.\n", fn, a->n_rows, a->n_cols, b->n_rows,
+				b->n_cols);
+		return NULL;
+	}
+	PROF_FLOPS(2L * a->n_rows * b->n_cols * a->n_cols);
+	PROF_BYTES(8L * (a->n_rows * a->n_cols + a->n_cols * b->n_cols +
+					 a->n_rows * b->n_cols));
+	return create_matrix_view(numa_alloc_huge(sizeof(double) * a->n_rows *
+											  b->n_cols),
+							  a->n_rows, b->n_cols);
+}
+
+/* a x b with the classical blocked kernel. Returns NULL if the shapes do
+ * not match.
+ */
+Matrix *matrix_prod_blocked(Matrix *a, Matrix *b)
+{
+	Matrix *res = prod_check(a, b, "matrix_prod_blocked");
+	if (res != NULL) {
+		gemm_blocked(a->n_rows, b->n_cols, a->n_cols, a->data[0], a->n_cols,
+					 b->data[0], b->n_cols, res->data[0], res->n_cols, 0);
+	}
+	return res;
+}
+
+/* a x b with Strassen-Winograd down to products with a dimension of at
+ * most 'crossover' (<= 0 for STRASSEN_CROSSOVER). Returns NULL if the
+ * shapes do not match.
+ */
+Matrix *matrix_prod_strassen(Matrix *a, Matrix *b, int crossover)
+{
+	int m = a->n_rows, n = b->n_cols, k = a->n_cols;
+	double *ws;
+	Matrix *res = prod_check(a, b, "matrix_prod_strassen");
+	if (res == NULL) {
+		return NULL;
+	}
+	if (crossover <= 0) {
+		crossover = STRASSEN_CROSSOVER;
+	}
+	ws = numa_alloc_huge(sizeof(double) *
+						 MAX(strassen_workspace_size(m, n, k, crossover), 1));
+	strassen(m, n, k, a->data[0], k, b->data[0], n, res->data[0], n,
+			 crossover, ws);
+	free(ws);
+	return res;
+}
@@ -0,0 +1,50 @@
+#include <matrix.h>
+
+#ifndef STRASSEN_H
+#define STRASSEN_H
+
+/* Strassen-Winograd matrix product: 7 half-size products and 15
+ * additions per level instead of 8 products, recursing down to a blocked
+ * classical kernel once a dimension is at most the crossover. Odd
+ * dimensions are peeled off and fixed up with the classical kernel.
+ *
+ * Each level needs two temporaries, X (m/2 x max(k/2, n/2)) and Y
+ * (k/2 x n/2), the quadrants of the result holding the other
+ * intermediates (the schedule of Boyer, Dumas, Pernet and Zhou). They
+ * are carved from one workspace allocated per product, at most a third
+ * of m * max(k, n) + k * n doubles over all the levels.
+ *
+ * The error bound grows faster with the depth than the classical one
+ * (about 18^depth against a constant), so the product is only used by
+ * matrix_prod_optim when enabled: see strassen_set_crossover.
+ */
+
+/* Crossover measured with bench (matrix_prod_strassen_*): one level pays
+ * off from 256 on, and recursing down to 128 was the fastest at 512 and
+ * 1024 (within 12% of 64 at 2048), with half the error of 64. */
+#define STRASSEN_CROSSOVER 128
+
+/* Default blocking of the classical kernel: a GEMM_BLOCK_K x GEMM_BLOCK_N
+ * panel of b (256 KB) stays in the L2 cache while every row of a goes
+ * over it. The tuner (tune.h) may pick another for the host. */
+#define GEMM_BLOCK_K 128
+#define GEMM_BLOCK_N 256
+
+void strassen_set_crossover(int crossover);
+
+int strassen_crossover(void);
+
+void gemm_set_blocking(int block_k, int block_n);
+
+void gemm_blocking(int *block_k, int *block_n);
+
+long strassen_workspace_size(int m, int n, int k, int crossover);
+
+void gemm_blocked(int m, int n, int k, const double *a, long lda,
+		const double *b, long ldb, double *c, long ldc, int accumulate);
+
+Matrix *matrix_prod_blocked(Matrix *a, Matrix *b);
+
+Matrix *matrix_prod_strassen(Matrix *a, Matrix *b, int crossover);
+
+#endif // STRASSEN_H
@@ -1,9 +1,14 @@
 #include <stdio.h>
 
 #define TEST_RES 0
+
+/* Number of failed ASSERTs, to be used as the exit status. */
+static int test_failures = 0;
+
 #define ASSERT(MSG, ...) \
 	if ( __VA_ARGS__ ) { \
 		printf("[OK]    %s\n", MSG); \
 	} else { \
 		printf("[FAIL]  %s\n", MSG); \
+		test_failures++; \
 	}
@@ -14,12 +14,10 @@ void arrncpy_double(double *dst, double *src, int n)
 /* Return index of the maximum of an array */
 int argmax(double *array, int n)
 {
-	double max = 0;
-	int index = n;
-	for (; n >= 0; n--) {
-		if (array[n] > max) {
-			max = array[n];
-			index = n;
+	int i, index = 0;
+	for (i = 1; i < n; i++) {
+		if (array[i] > array[index]) {
+			index = i;
 		}
 	}
 	return index;
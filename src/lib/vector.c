@@ -0,0 +1,107 @@
+#include <string.h>
+#include <math.h>
+
+#include <vector.h>
+#include <profile.h>
+
+/* Set the n elements of x to zero. */
+void vector_zero(double *x, long n)
+{
+	memset(x, 0, sizeof(double) * n);
+}
+
+/* Copy n elements from src to dst (they must not overlap). */
+void vector_copy(double *restrict dst, const double *restrict src, long n)
+{
+	memcpy(dst, src, sizeof(double) * n);
+}
+
+/* x = a * x */
+void vector_scale(double *restrict x, double a, long n)
+{
+	long i;
+	PROF_FLOPS(n);
+	PROF_BYTES(16 * n);
+	for (i = 0; i < n; i++) {
+		x[i] *= a;
+	}
+}
+
+/* y = y + a * x */
+void vector_axpy(double *restrict y, double a, const double *restrict x,
+				 long n)
+{
+	long i;
+	PROF_FLOPS(2 * n);
+	PROF_BYTES(24 * n);
+	for (i = 0; i < n; i++) {
+		y[i] += a * x[i];
+	}
+}
+
+/* x = x * y, element by element. */
+void vector_entrywise_product(double *restrict x, const double *restrict y,
+							  long n)
+{
+	long i;
+	PROF_FLOPS(n);
+	PROF_BYTES(24 * n);
+	for (i = 0; i < n; i++) {
+		x[i] *= y[i];
+	}
+}
+
+/* Dot product of x and y. */
+double vector_dot(const double *restrict x, const double *restrict y, long n)
+{
+	long i;
+	double s = 0.0;
+	PROF_FLOPS(2 * n);
+	PROF_BYTES(16 * n);
+	for (i = 0; i < n; i++) {
+		s += x[i] * y[i];
+	}
+	return s;
+}
+
+/* Euclidean (L2) norm of x. */
+double vector_norm(const double *x, long n)
+{
+	return sqrt(vector_dot(x, x, n));
+}
+
+/* If the L2 norm of x is larger than max_norm, rescale x so its norm is
+ * exactly max_norm. A max_norm <= 0 disables clipping. Returns the norm
+ * of x before clipping.
+ */
+double vector_clip_norm(double *x, double max_norm, long n)
+{
+	double norm = vector_norm(x, n);
+	if (max_norm > 0 && norm > max_norm) {
+		vector_scale(x, max_norm / norm, n);
+	}
+	return norm;
+}
+
+/* dst = element-wise mean of the n_srcs arrays in srcs. dst may be
+ * srcs[0], but none of the other sources.
+ */
+void vector_average(double *dst, double **srcs, int n_srcs, long n)
+{
+	int k;
+	long i;
+	double *acc;
+	if (n_srcs <= 0) {
+		return;
+	}
+	if (dst != srcs[0]) {
+		vector_copy(dst, srcs[0], n);
+	}
+	for (k = 1; k < n_srcs; k++) {
+		acc = srcs[k];
+		for (i = 0; i < n; i++) {
+			dst[i] += acc[i];
+		}
+	}
+	vector_scale(dst, 1.0 / n_srcs, n);
+}
@@ -0,0 +1,28 @@
+#ifndef VECTOR_H
+#define VECTOR_H
+
+/* Operations over flat arrays of doubles. They are written as single
+ * loops over restrict-qualified pointers so the compiler can vectorize
+ * them; used for whole-model operations on contiguous parameter and
+ * gradient buffers.
+ */
+
+void vector_zero(double *x, long n);
+
+void vector_copy(double *dst, const double *src, long n);
+
+void vector_scale(double *x, double a, long n);
+
+void vector_axpy(double *y, double a, const double *x, long n);
+
+void vector_entrywise_product(double *x, const double *y, long n);
+
+double vector_dot(const double *x, const double *y, long n);
+
+double vector_norm(const double *x, long n);
+
+double vector_clip_norm(double *x, double max_norm, long n);
+
+void vector_average(double *dst, double **srcs, int n_srcs, long n);
+
+#endif // VECTOR_H
@@ -0,0 +1,12 @@
+#include <neuron.h>
+
+#ifndef MNIST_H
+#define MNIST_H
+
+double **load_labels(char *path, int *n_items);
+
+double **load_images(char *path, int *n_items, int *n_rows, int *n_cols);
+
+TrainData *mnist_load(char *path);
+
+#endif // MNIST_H
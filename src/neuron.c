@@ -3,11 +3,19 @@
 #include <time.h>
 #include <math.h>
 #include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <utils.h>
 #include <neuron.h>
 #include <matrix.h>
+#include <vector.h>
 #include <random.h>
+#include <profile.h>
+#include <numa.h>
+#include <expr.h>
+#include <pool.h>
 
 #define DEBUG(mat) matrix_print_shape(mat); matrix_print(mat);
 
@@ -21,13 +29,23 @@
 void free_training_data(TrainData *data)
 {
 	int i;
-	for (i = 0; i < data->n_train; i++) {
-		free(data->inputs_training[i]);
-		free(data->labels_training[i]);
+	if (data->block != NULL) {
+		free(data->block);
+	} else {
+		for (i = 0; i < data->n_train; i++) {
+			free(data->inputs_training[i]);
+			free(data->labels_training[i]);
+		}
+		for (i = 0; i < data->n_test; i++) {
+			free(data->inputs_testing[i]);
+			free(data->labels_testing[i]);
+		}
 	}
-	for (i = 0; i < data->n_test; i++) {
-		free(data->inputs_testing[i]);
-		free(data->labels_testing[i]);
+	if (data->sparse_inputs_training != NULL) {
+		for (i = 0; i < data->n_train; i++) {
+			free_sparse_vector(data->sparse_inputs_training[i]);
+		}
+		free(data->sparse_inputs_training);
 	}
 	free(data->inputs_training);
 	free(data->inputs_testing);
@@ -44,6 +62,7 @@ void shuffle_training_data(TrainData *data)
     int i;
     long j;
 	double *tmp_label, *tmp_inputs;
+	SparseVector *tmp_sparse;
 	srand(time(NULL));
     for (i = 0; i < data->n_train - 1; i++) {
 	    j = random_in_range(i, data->n_train - 1);
@@ -55,9 +74,46 @@ void shuffle_training_data(TrainData *data)
 		tmp_inputs = data->inputs_training[i];
 		data->inputs_training[i] = data->inputs_training[j];
 		data->inputs_training[j] = tmp_inputs;
+		/* And their sparse copies, if any */
+		if (data->sparse_inputs_training != NULL) {
+			tmp_sparse = data->sparse_inputs_training[i];
+			data->sparse_inputs_training[i] = data->sparse_inputs_training[j];
+			data->sparse_inputs_training[j] = tmp_sparse;
+		}
     }
 }
 
+/* Store a sparse copy of every training input (sparse_inputs_training),
+ * so backpropagation can use them directly, if on average at most a
+ * fraction max_density of the inputs is nonzero. Returns 1 if it did.
+ * The copies are kept in sync by shuffle_training_data and
+ * subset_training_data, and freed with the rest of the data.
+ */
+int compress_training_inputs(TrainData *data, double max_density)
+{
+	int i, j;
+	long nnz = 0;
+	if (data->sparse_inputs_training != NULL) {
+		return 1;
+	}
+	for (i = 0; i < data->n_train; i++) {
+		for (j = 0; j < data->inputs_size; j++) {
+			nnz += data->inputs_training[i][j] != 0.0;
+		}
+	}
+	if (data->n_train == 0 ||
+		nnz > max_density * data->inputs_size * (double)data->n_train) {
+		return 0;
+	}
+	data->sparse_inputs_training = malloc(sizeof(SparseVector *) *
+										  data->n_train);
+	for (i = 0; i < data->n_train; i++) {
+		data->sparse_inputs_training[i] = array_to_sparse_vector(
+			data->inputs_training[i], data->inputs_size);
+	}
+	return 1;
+}
+
 /* Given a struct TrainData, a 'start' index and a number of items 'n',
  * return a subset of 'n' consecutive items, starting from 'start'.
  *
@@ -76,14 +132,117 @@ TrainData *subset_training_data(TrainData *data, int start, int n)
 	ndata->n_train = n;
 	ndata->n_test = data->n_test;
 	ndata->inputs_size = data->inputs_size;
+	ndata->outputs_size = data->outputs_size;
 	// Load testing
 	ndata->inputs_testing = data->inputs_testing;
 	ndata->labels_testing = data->labels_testing;
 	ndata->inputs_training = data->inputs_training + start;
 	ndata->labels_training = data->labels_training + start;
+	ndata->sparse_inputs_training = data->sparse_inputs_training == NULL ?
+		NULL : data->sparse_inputs_training + start;
+	ndata->block = NULL;
 	return ndata;
 }
 
+/* Return a deep copy of data (training and testing samples, in their
+ * current order) packed in a single block, backed by huge pages if it is
+ * large. The block is spread page by page over the NUMA nodes if
+ * interleave is nonzero, for data every training thread reads; otherwise
+ * its pages go to the node of the calling thread, which writes them
+ * first. The sparse inputs are not copied. Must be freed with
+ * free_training_data(the_copy);
+ */
+TrainData *copy_training_data(TrainData *data, int interleave)
+{
+	int i, n = data->n_train + data->n_test;
+	long row = data->inputs_size + data->outputs_size;
+	long n_bytes = sizeof(double) * row * n;
+	double *p;
+	TrainData *copy = malloc(sizeof(TrainData));
+	*copy = *data;
+	copy->inputs_training = malloc(sizeof(double *) * (data->n_train + 1));
+	copy->labels_training = malloc(sizeof(double *) * (data->n_train + 1));
+	copy->inputs_testing = malloc(sizeof(double *) * (data->n_test + 1));
+	copy->labels_testing = malloc(sizeof(double *) * (data->n_test + 1));
+	copy->sparse_inputs_training = NULL;
+	copy->block = numa_alloc_huge(n_bytes);
+	if (interleave) {
+		numa_interleave(copy->block, n_bytes);
+	}
+	p = copy->block;
+	for (i = 0; i < data->n_train; i++, p += row) {
+		copy->inputs_training[i] = p;
+		copy->labels_training[i] = p + data->inputs_size;
+		memcpy(p, data->inputs_training[i],
+			   sizeof(double) * data->inputs_size);
+		memcpy(p + data->inputs_size, data->labels_training[i],
+			   sizeof(double) * data->outputs_size);
+	}
+	for (i = 0; i < data->n_test; i++, p += row) {
+		copy->inputs_testing[i] = p;
+		copy->labels_testing[i] = p + data->inputs_size;
+		memcpy(p, data->inputs_testing[i],
+			   sizeof(double) * data->inputs_size);
+		memcpy(p + data->inputs_size, data->labels_testing[i],
+			   sizeof(double) * data->outputs_size);
+	}
+	return copy;
+}
+
+/* Allocate a zeroed ParamBuffer for a network with n_layers layers of
+ * the given sizes.
+ */
+ParamBuffer *create_param_buffer(int n_layers, int *sizes)
+{
+	int i;
+	long offset;
+	ParamBuffer *buf = malloc(sizeof(ParamBuffer));
+	buf->n_layers = n_layers;
+	buf->n_weights = 0;
+	buf->size = 0;
+	for (i = 0; i < n_layers - 1; i++) {
+		buf->n_weights += (long)sizes[i+1] * sizes[i];
+		buf->size += sizes[i+1];
+	}
+	buf->size += buf->n_weights;
+	/* Zeroed here rather than by calloc, so that the pages are placed on
+	 * the node of the calling thread */
+	buf->data = numa_alloc_huge(sizeof(double) * buf->size);
+	memset(buf->data, 0, sizeof(double) * buf->size);
+	buf->weights = malloc(sizeof(Matrix *)*(n_layers - 1));
+	buf->biases = malloc(sizeof(Matrix *)*(n_layers - 1));
+
+	offset = 0;
+	for (i = 0; i < n_layers - 1; i++) {
+		buf->weights[i] = create_matrix_view(buf->data + offset,
+											 sizes[i+1], sizes[i]);
+		offset += (long)sizes[i+1] * sizes[i];
+	}
+	for (i = 0; i < n_layers - 1; i++) {
+		buf->biases[i] = create_matrix_view(buf->data + offset,
+											sizes[i+1], 1);
+		offset += sizes[i+1];
+	}
+	return buf;
+}
+
+/* Free the memory allocated for a ParamBuffer, views included. */
+void free_param_buffer(ParamBuffer *buf)
+{
+	if (buf == NULL) {
+		return;
+	}
+	int i;
+	for (i = 0; i < buf->n_layers - 1; i++) {
+		free_matrix_view(buf->weights[i]);
+		free_matrix_view(buf->biases[i]);
+	}
+	free(buf->weights);
+	free(buf->biases);
+	free(buf->data);
+	free(buf);
+}
+
 /* Initialize & return a pointer to a new network:
  * n_layers: number of layers of the net, including input and output.
  * sizes: array of int. sizes[i] indicates the number of neurons in
@@ -98,21 +257,27 @@ Network *create_network(int n_layers, ...)
 		sizes[i] = va_arg(ap, int);
 	}
 	va_end(ap);
+	return create_network_from_sizes(n_layers, sizes);
+}
+
+/* Like create_network, but taking the sizes of the layers as an array. */
+Network *create_network_from_sizes(int n_layers, int *sizes)
+{
+	int i;
 	Network *net = malloc(sizeof(Network));
 	net->n_layers = n_layers;
 
 	net->sizes = malloc(sizeof(int) * n_layers);
-	net->weights = malloc(sizeof(Matrix *)*(n_layers - 1));
-	net->biases = malloc(sizeof(Matrix *)*(n_layers - 1));
+	net->params = create_param_buffer(n_layers, sizes);
+	net->weights = net->params->weights;
+	net->biases = net->params->biases;
 
 	arrncpy(net->sizes, sizes, n_layers);
 
 	for (i = 0; i < n_layers - 1; i++) {
-		net->weights[i] = create_matrix(sizes[i+1], sizes[i]);
 		/* Fill it with a gaussian (mean 0 variance 1) */
 		matrix_fill_gaussian_random(net->weights[i]);
 		/* matrix_fill(net->weights[i], 0.1); */
-		net->biases[i] = create_matrix(sizes[i+1], 1);
 		/* Fill it with a gaussian (mean 0 variance 1) */
 		/* matrix_fill(net->biases[i], 0.1); */
 		matrix_fill_gaussian_random(net->biases[i]);
@@ -126,46 +291,663 @@ void destroy_network(Network *net)
 	if (net == NULL) {
 		return;
 	}
-	int i;
-	for (i = 0; i < (net->n_layers)-1; i++) {
-		free_matrix(net->weights[i]);
-		free_matrix(net->biases[i]);
-	}
-	free(net->weights);
-	free(net->biases);
+	free_param_buffer(net->params);
 	free(net->sizes);
 	free(net);
 }
 
+/* Create n_replicas replicas of net (one per NUMA node if n_replicas <=
+ * 0), their parameters bound to the memory of their node. A single
+ * replica is net itself. net must not be modified while they are used,
+ * except through network_replicas_update.
+ */
+NetworkReplicas *create_network_replicas(Network *net, int n_replicas)
+{
+	int i;
+	NetworkReplicas *r = malloc(sizeof(NetworkReplicas));
+	r->n_replicas = n_replicas > 0 ? n_replicas : numa_node_count();
+	r->source = net;
+	r->nets = malloc(sizeof(Network *) * r->n_replicas);
+	if (r->n_replicas == 1) {
+		r->nets[0] = net;
+		return r;
+	}
+	for (i = 0; i < r->n_replicas; i++) {
+		r->nets[i] = create_network_from_sizes(net->n_layers, net->sizes);
+		numa_bind(r->nets[i]->params->data,
+				  sizeof(double) * net->params->size,
+				  i % numa_node_count());
+	}
+	network_replicas_update(r);
+	return r;
+}
+
+/* Copy the parameters of the source network to all the replicas. */
+void network_replicas_update(NetworkReplicas *r)
+{
+	int i;
+	for (i = 0; i < r->n_replicas; i++) {
+		if (r->nets[i] != r->source) {
+			vector_copy(r->nets[i]->params->data, r->source->params->data,
+						r->source->params->size);
+		}
+	}
+}
+
+/* The replica to use on 'node' (see numa_current_node). */
+Network *network_replica(NetworkReplicas *r, int node)
+{
+	return r->nets[node % r->n_replicas];
+}
+
+/* Free the replicas (not their source). */
+void destroy_network_replicas(NetworkReplicas *r)
+{
+	int i;
+	if (r == NULL) {
+		return;
+	}
+	for (i = 0; i < r->n_replicas; i++) {
+		if (r->nets[i] != r->source) {
+			destroy_network(r->nets[i]);
+		}
+	}
+	free(r->nets);
+	free(r);
+}
+
+/* Save a network to a file: a "GLIA" magic, the number of layers, their
+ * sizes and then all the parameters (see ParamBuffer), in the byte order
+ * of this machine. Returns 1 on success, 0 on error.
+ */
+int save_network(Network *net, char *path)
+{
+	int32_t n_layers = net->n_layers, size;
+	int i, ok;
+	FILE *stream = fopen(path, "wb");
+	if (!stream) {
+		fprintf(stderr, "Could not write file %s.\n", path);
+		return 0;
+	}
+	ok = fwrite(NETWORK_FILE_MAGIC, 4, 1, stream) == 1;
+	ok = ok && fwrite(&n_layers, 4, 1, stream) == 1;
+	for (i = 0; i < n_layers; i++) {
+		size = net->sizes[i];
+		ok = ok && fwrite(&size, 4, 1, stream) == 1;
+	}
+	ok = ok && fwrite(net->params->data, sizeof(double), net->params->size,
+					  stream) == (size_t)net->params->size;
+	ok = (fclose(stream) == 0) && ok;
+	if (!ok) {
+		fprintf(stderr, "Error writing file %s.\n", path);
+	}
+	return ok;
+}
+
+/* Load a network saved with save_network. Returns NULL on error. */
+Network *load_network(char *path)
+{
+	char magic[4];
+	int32_t n_layers;
+	int i, ok;
+	Network *net = NULL;
+	FILE *stream = fopen(path, "rb");
+	if (!stream) {
+		fprintf(stderr, "Could not load file %s.\n", path);
+		return NULL;
+	}
+	ok = fread(magic, 4, 1, stream) == 1 &&
+		 memcmp(magic, NETWORK_FILE_MAGIC, 4) == 0 &&
+		 fread(&n_layers, 4, 1, stream) == 1 &&
+		 n_layers >= 2 && n_layers <= 255;
+	if (ok) {
+		int32_t sizes[n_layers];
+		ok = fread(sizes, 4, n_layers, stream) == (size_t)n_layers;
+		for (i = 0; ok && i < n_layers; i++) {
+			ok = sizes[i] > 0;
+		}
+		if (ok) {
+			net = create_network_from_sizes(n_layers, sizes);
+			ok = fread(net->params->data, sizeof(double), net->params->size,
+					   stream) == (size_t)net->params->size;
+		}
+	}
+	fclose(stream);
+	if (!ok) {
+		fprintf(stderr, "%s is not a valid network file.\n", path);
+		destroy_network(net);
+		return NULL;
+	}
+	return net;
+}
+
 /* Perform stochastic gradient descent. */
 void SGD(Network *net, TrainData *data, int n_epochs,
 		 int mini_batch_size, double learning_rate, double lambda)
 {
+	SGD_with_options(net, data, n_epochs, mini_batch_size, learning_rate,
+					 lambda, NULL);
+}
+
+/* One epoch of SGD, shared by all the threads training it. */
+typedef struct {
+	Network *net;
+	TrainData *data;
+	SGDOptions *opts;
+	int mini_batch_size;
+	int n_mini_batches;
+	double learning_rate;
+	double lambda;
+	/* next mini batch to train on */
+	atomic_int next_batch;
+	/* With several workers (else NULL): decay[d] is the L2 factor of d
+	 * mini batches, and the weight decay of the mini batches before
+	 * decayed[k] has been applied to weight k (see sgd_apply_sparse) */
+	double *decay;
+	int *decayed;
+} SGDEpoch;
+
+/* A thread training an SGDEpoch. */
+typedef struct {
+	SGDEpoch *epoch;
+	pthread_t thread;
+	/* rank among the workers, 0 for the calling thread */
+	int index;
+	/* NULL unless the mini batches are augmented */
+	Augmenter *augmenter;
+	/* NULL unless there is dropout */
+	Dropout *dropout;
+	/* sum of the gradients of the current mini batch, allocated by the
+	 * worker itself on its first mini batch */
+	ParamBuffer *nabla;
+	/* sum of the gradient norms of its mini batches */
+	double norm_sum;
+} SGDWorker;
+
+/* The scoring of a snapshot of the weights on a background thread (see
+ * SGDOptions.async_eval).
+ */
+typedef struct {
+	Network *snapshot;
+	TrainData *data;
+	/* where to store the accuracy, NULL if nowhere */
+	double *accuracies;
+	int epoch;
+	pthread_t thread;
+	int running;
+} SGDEvaluator;
+
+static void *sgd_evaluate(void *arg)
+{
+	SGDEvaluator *ev = arg;
+	double acc = test_accuracy(ev->snapshot, ev->data);
+	fprintf(stderr, "Accuracy after epoch %d: %.2f%%\n", ev->epoch,
+			acc * 100);
+	if (ev->accuracies != NULL) {
+		ev->accuracies[ev->epoch] = acc;
+	}
+	return NULL;
+}
+
+/* Wait for the snapshot being scored, if any. */
+static void sgd_evaluate_wait(SGDEvaluator *ev)
+{
+	if (ev->running) {
+		pthread_join(ev->thread, NULL);
+		ev->running = 0;
+	}
+}
+
+/* Score the weights of net after the given epoch, in the background:
+ * only the copy into the snapshot is done by the caller, once the
+ * previous snapshot has been scored.
+ */
+static void sgd_evaluate_async(SGDEvaluator *ev, Network *net, int epoch)
+{
+	sgd_evaluate_wait(ev);
+	vector_copy(ev->snapshot->params->data, net->params->data,
+				net->params->size);
+	ev->epoch = epoch;
+	if (pthread_create(&ev->thread, NULL, sgd_evaluate, ev) == 0) {
+		ev->running = 1;
+	} else {
+		sgd_evaluate(ev);
+	}
+}
+
+/* Apply to weight k of e the weight decay and mask of the mini batches
+ * before 'batch' that it has not had yet (see sgd_apply_sparse).
+ */
+static void sgd_catch_up_weight(SGDEpoch *e, long k, int batch)
+{
+	int d = batch - e->decayed[k];
+	if (d > 0) {
+		e->net->params->data[k] *= e->decay[d];
+		if (e->opts->weight_mask != NULL) {
+			e->net->params->data[k] *= pow(e->opts->weight_mask[k], d);
+		}
+		e->decayed[k] = batch;
+	}
+}
+
+/* Bring up to date, before mini batch 'batch' is trained on, the weights
+ * its gradient reads: those out of the inputs that are nonzero in some
+ * sample, and those of the other layers.
+ */
+static void sgd_catch_up(SGDEpoch *e, TrainData *mini_batch, int batch)
+{
+	int i, j, s, n_in = e->net->sizes[0], n_out = e->net->sizes[1];
+	long k;
+	for (i = 0; i < n_in; i++) {
+		for (s = 0; s < mini_batch->n_train &&
+				 mini_batch->inputs_training[s][i] == 0.0; s++);
+		if (s < mini_batch->n_train) {
+			for (j = 0; j < n_out; j++) {
+				sgd_catch_up_weight(e, (long)j * n_in + i, batch);
+			}
+		}
+	}
+	for (k = (long)n_in * n_out; k < e->net->params->n_weights; k++) {
+		sgd_catch_up_weight(e, k, batch);
+	}
+}
+
+/* The update of network_apply_gradient for mini batch 'batch' of e,
+ * written only where nabla is nonzero: weights out of inputs that are
+ * zero in the whole mini batch (or out of dropped units) and the biases
+ * of units with no error are left alone. Their weight decay, a plain
+ * scaling, is deferred until a later mini batch reads them
+ * (sgd_catch_up) or until sgd_flush_decay at the end of the epoch, and
+ * so is the weight mask: with one worker the result is, up to rounding,
+ * that of network_apply_gradient. Returns the L2 norm of the mean
+ * gradient, before clipping.
+ */
+static double sgd_apply_sparse(SGDEpoch *e, ParamBuffer *nabla, int n,
+							   int batch)
+{
+	long k;
+	double norm, eta_over_n = -e->learning_rate / (double)n;
+	double *w = e->net->params->data, *mask = e->opts->weight_mask;
+	PROF_BEGIN(PROF_UPDATE);
+	norm = vector_clip_norm(nabla->data, e->opts->max_grad_norm * n,
+							nabla->size) / n;
+	for (k = 0; k < nabla->n_weights; k++) {
+		if (nabla->data[k] != 0.0) {
+			sgd_catch_up_weight(e, k, batch);
+			/* Unless a worker on a later mini batch got there first */
+			if (e->decayed[k] == batch) {
+				w[k] *= e->decay[1];
+				e->decayed[k] = batch + 1;
+			}
+			w[k] += eta_over_n * nabla->data[k];
+			if (mask != NULL) {
+				w[k] *= mask[k];
+			}
+		}
+	}
+	for (k = nabla->n_weights; k < nabla->size; k++) {
+		if (nabla->data[k] != 0.0) {
+			w[k] += eta_over_n * nabla->data[k];
+		}
+	}
+	PROF_END(PROF_UPDATE);
+	return norm;
+}
+
+/* Apply the weight decay and mask deferred by sgd_apply_sparse, once the
+ * workers of the epoch are done, and restart the stamps for the next.
+ */
+static void sgd_flush_decay(SGDEpoch *e)
+{
+	long k;
+	for (k = 0; k < e->net->params->n_weights; k++) {
+		sgd_catch_up_weight(e, k, e->n_mini_batches);
+		e->decayed[k] = 0;
+	}
+}
 
-	int epoch, start, batch;
-    int	n_mini_batches = data->n_train / mini_batch_size;
-	double acc;
+/* Train on mini batches of the epoch until there are none left. With
+ * several workers the weights are read and updated with no locking at
+ * all (Hogwild), each worker writing only the entries its mini batch has
+ * a gradient for (sgd_apply_sparse). Where the mini batches of two
+ * workers overlap the races are real: an update may be lost, or computed
+ * from weights that the other worker is changing. SGD absorbs these as
+ * noise when the overlap is small, as with sparse inputs; with dense
+ * inputs nearly every weight is shared, and accuracy per epoch may drop
+ * as workers are added.
+ */
+static void *sgd_worker(void *arg)
+{
+	SGDWorker *w = arg;
+	SGDEpoch *e = w->epoch;
+	int batch;
 	TrainData *mini_batch;
+	if (e->opts->pin_threads) {
+		numa_pin_thread(w->index);
+	}
+	if (w->nabla == NULL) {
+		/* After pinning, so that its pages are on the worker's node */
+		w->nabla = create_param_buffer(e->net->n_layers, e->net->sizes);
+	}
+	while ((batch = atomic_fetch_add_explicit(&e->next_batch, 1,
+						memory_order_relaxed)) < e->n_mini_batches) {
+		PROF_BEGIN(PROF_BATCH);
+		mini_batch = subset_training_data(e->data,
+										  batch * e->mini_batch_size,
+										  e->mini_batch_size);
+		if (w->augmenter != NULL) {
+			mini_batch->inputs_training = augment_batch(w->augmenter,
+								mini_batch->inputs_training, mini_batch->n_train);
+			mini_batch->sparse_inputs_training = NULL;
+		}
+		PROF_END(PROF_BATCH);
+		if (e->decayed != NULL) {
+			sgd_catch_up(e, mini_batch, batch);
+		}
+		/* As network_update_mini_batch, in the worker's own buffer */
+		vector_zero(w->nabla->data, w->nabla->size);
+		network_gradient_dropout(e->net, mini_batch, w->nabla, w->dropout);
+		if (e->decayed != NULL) {
+			w->norm_sum += sgd_apply_sparse(e, w->nabla,
+											mini_batch->n_train, batch);
+		} else {
+			w->norm_sum += network_apply_gradient(e->net, w->nabla,
+								mini_batch->n_train, e->learning_rate,
+								e->lambda, e->data->n_train,
+								e->opts->max_grad_norm);
+		}
+		if (e->decayed == NULL && e->opts->weight_mask != NULL) {
+			vector_entrywise_product(e->net->params->data,
+									 e->opts->weight_mask,
+									 e->net->params->n_weights);
+		}
+		free(mini_batch);
+	}
+	return NULL;
+}
+
+/* Free the buffers of the n workers. */
+static void free_sgd_workers(SGDWorker *workers, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		destroy_augmenter(workers[i].augmenter);
+		destroy_dropout(workers[i].dropout);
+		free_param_buffer(workers[i].nabla);
+	}
+}
+
+/* Perform stochastic gradient descent, with the extra settings in opts
+ * (which may be NULL). Does not train if opts->augment is for images
+ * whose width * height is not the size of the inputs.
+ */
+void SGD_with_options(Network *net, TrainData *data, int n_epochs,
+					  int mini_batch_size, double learning_rate,
+					  double lambda, SGDOptions *opts)
+{
+	int epoch, i;
+	int n_threads, n_started;
+	double acc, norm_sum;
+	void *affinity = NULL;
+	SGDOptions defaults = {0};
+	SGDEpoch e;
+	SGDEvaluator ev = {0};
+	if (opts == NULL) {
+		opts = &defaults;
+	}
+	if (opts->augment != NULL &&
+		opts->augment->width * opts->augment->height != data->inputs_size) {
+		fprintf(stderr, "Invalid augmentation of %dx%d images for inputs of "
+				"size %d.\n", opts->augment->width, opts->augment->height,
+				data->inputs_size);
+		return;
+	}
+	n_threads = opts->n_threads > 1 ? opts->n_threads : 1;
+	SGDWorker workers[n_threads];
+	e.net = net;
+	e.data = data;
+	e.opts = opts;
+	e.mini_batch_size = mini_batch_size;
+	e.n_mini_batches = data->n_train / mini_batch_size;
+	e.learning_rate = learning_rate;
+	e.lambda = lambda;
+	for (i = 0; i < n_threads; i++) {
+		workers[i].index = i;
+		workers[i].augmenter = opts->augment == NULL ? NULL :
+			create_augmenter(opts->augment, (uint64_t)rand() * (i + 1));
+		workers[i].dropout = opts->dropout == NULL ? NULL :
+			create_dropout(net, opts->dropout, (uint64_t)rand() * (i + 1));
+		workers[i].nabla = NULL;
+		if (opts->dropout != NULL && workers[i].dropout == NULL) {
+			free_sgd_workers(workers, i + 1);
+			return;
+		}
+	}
+	e.decay = NULL;
+	e.decayed = NULL;
+	if (n_threads > 1) {
+		e.decay = malloc(sizeof(double) * (e.n_mini_batches + 1));
+		e.decay[0] = 1.0;
+		for (i = 1; i <= e.n_mini_batches; i++) {
+			e.decay[i] = e.decay[i - 1] *
+				(1 - learning_rate * lambda / (double)data->n_train);
+		}
+		e.decayed = calloc(net->params->n_weights, sizeof(int));
+	}
+	if (opts->pin_threads) {
+		/* this thread is workers[0], pinned as well */
+		affinity = numa_save_affinity();
+	}
+	if (opts->async_eval) {
+		ev.snapshot = create_network_from_sizes(net->n_layers, net->sizes);
+		ev.data = data;
+		ev.accuracies = opts->accuracies;
+	}
 	/* Loop through each epoch */
 	for (epoch = 0; epoch < n_epochs; epoch++) {
+		PROF_RESET();
+		PROF_BEGIN(PROF_SHUFFLE);
 		shuffle_training_data(data);
-		for (batch = 0; batch < n_mini_batches; batch++) {
-			start = batch * mini_batch_size;
-			mini_batch = subset_training_data(data, start,
-			                                  mini_batch_size);
-			network_update_mini_batch(net, mini_batch, learning_rate,
-									  lambda, data->n_train);
-			free(mini_batch);
+		PROF_END(PROF_SHUFFLE);
+		atomic_store(&e.next_batch, 0);
+		/* workers[0] is this thread */
+		for (i = 0; i < n_threads; i++) {
+			workers[i].epoch = &e;
+			workers[i].norm_sum = 0.0;
+		}
+		for (n_started = 1; n_started < n_threads; n_started++) {
+			if (pthread_create(&workers[n_started].thread, NULL, sgd_worker,
+							   &workers[n_started]) != 0) {
+				fprintf(stderr, "Could not start thread %d, training with "
+						"%d threads.\n", n_started, n_started);
+				break;
+			}
+		}
+		sgd_worker(&workers[0]);
+		norm_sum = workers[0].norm_sum;
+		for (i = 1; i < n_started; i++) {
+			pthread_join(workers[i].thread, NULL);
+			norm_sum += workers[i].norm_sum;
+		}
+		if (e.decayed != NULL) {
+			sgd_flush_decay(&e);
 		}
 		fprintf(stderr, "Epoch %d finished.\n", epoch);
-		acc = test_accuracy(net, data);
-		fprintf(stderr, "Accuracy: %.2f%%\n", acc * 100);
+		if (opts->report_grad_norm && e.n_mini_batches > 0) {
+			fprintf(stderr, "Mean gradient norm: %f\n",
+					norm_sum / e.n_mini_batches);
+		}
+		PROF_BEGIN(PROF_EVAL);
+		if (opts->async_eval) {
+			sgd_evaluate_async(&ev, net, epoch);
+		} else {
+			acc = test_accuracy(net, data);
+			fprintf(stderr, "Accuracy after epoch %d: %.2f%%\n", epoch,
+					acc * 100);
+			if (opts->accuracies != NULL) {
+				opts->accuracies[epoch] = acc;
+			}
+		}
+		PROF_END(PROF_EVAL);
+		PROF_REPORT(epoch, (long)e.n_mini_batches * mini_batch_size);
+	}
+	if (opts->async_eval) {
+		sgd_evaluate_wait(&ev);
+		destroy_network(ev.snapshot);
+	}
+	if (opts->pin_threads) {
+		numa_restore_affinity(affinity);
+	}
+	free(e.decay);
+	free(e.decayed);
+	free_sgd_workers(workers, n_threads);
+}
+
+/* Create the dropout state of a training thread of net: unit of layer l
+ * (l < n_layers - 1) dropped with probability rates[l] (copied), masks
+ * drawn from 'seed'. Returns NULL if a rate is not in [0, 1).
+ */
+Dropout *create_dropout(Network *net, double *rates, uint64_t seed)
+{
+	int l;
+	Dropout *d;
+	for (l = 0; l < net->n_layers - 1; l++) {
+		if (!(rates[l] >= 0 && rates[l] < 1)) {
+			fprintf(stderr, "Invalid dropout rate %g for layer %d.\n",
+					rates[l], l);
+			return NULL;
+		}
+	}
+	d = malloc(sizeof(Dropout));
+	d->n_layers = net->n_layers;
+	d->rates = malloc(sizeof(double) * (net->n_layers - 1));
+	d->masks = malloc(sizeof(uint64_t *) * (net->n_layers - 1));
+	rng_seed(&d->rng, seed);
+	for (l = 0; l < net->n_layers - 1; l++) {
+		d->rates[l] = rates[l];
+		d->masks[l] = rates[l] == 0 ? NULL :
+			malloc(sizeof(uint64_t) * ((net->sizes[l] + 63) / 64));
+	}
+	return d;
+}
+
+/* Free the memory allocated for a Dropout. */
+void destroy_dropout(Dropout *d)
+{
+	int l;
+	if (d == NULL) {
+		return;
+	}
+	for (l = 0; l < d->n_layers - 1; l++) {
+		free(d->masks[l]);
+	}
+	free(d->masks);
+	free(d->rates);
+	free(d);
+}
+
+/* Create the workspace of a training run of net on data with mini
+ * batches of mini_batch_size samples, its shuffles starting from 'seed'.
+ */
+SGDWorkspace *create_sgd_workspace(Network *net, TrainData *data,
+								   int mini_batch_size, long seed)
+{
+	int i;
+	SGDWorkspace *ws = malloc(sizeof(SGDWorkspace));
+	ws->mini_batch_size = mini_batch_size;
+	ws->seed = seed;
+	ws->index = malloc(sizeof(int) * (data->n_train > 0 ? data->n_train : 1));
+	for (i = 0; i < data->n_train; i++) {
+		ws->index[i] = i;
 	}
+	ws->batch = *data;
+	ws->batch.n_train = mini_batch_size;
+	ws->batch.inputs_training = malloc(sizeof(double *) * mini_batch_size);
+	ws->batch.labels_training = malloc(sizeof(double *) * mini_batch_size);
+	ws->batch.sparse_inputs_training = data->sparse_inputs_training == NULL ?
+		NULL : malloc(sizeof(SparseVector *) * mini_batch_size);
+	ws->nabla = create_param_buffer(net->n_layers, net->sizes);
+	ws->augmenter = NULL;
+	ws->dropout = NULL;
+	return ws;
 }
 
-void network_update_mini_batch(Network *net, TrainData *mini_batch,
-							   double learning_rate, double lambda,
-							   int N_total)
+/* Free the memory allocated for an SGDWorkspace (not the data). */
+void free_sgd_workspace(SGDWorkspace *ws)
+{
+	if (ws == NULL) {
+		return;
+	}
+	free(ws->index);
+	free(ws->batch.inputs_training);
+	free(ws->batch.labels_training);
+	free(ws->batch.sparse_inputs_training);
+	free_param_buffer(ws->nabla);
+	destroy_augmenter(ws->augmenter);
+	destroy_dropout(ws->dropout);
+	free(ws);
+}
+
+/* One epoch of stochastic gradient descent that does not modify 'data':
+ * the samples are visited in the order of ws->index, reshuffled first,
+ * and the mini batches point into the data. Several threads may train
+ * different networks on the same data at once, each with its own
+ * workspace. Returns the mean gradient norm of the mini batches, or -1
+ * without training if the images of ws->augmenter do not have the size of
+ * the inputs.
+ */
+double SGD_epoch(Network *net, TrainData *data, SGDWorkspace *ws,
+				 double learning_rate, double lambda, double max_grad_norm)
+{
+	int i, j, k, tmp, batch;
+	int n = data->n_train, size = ws->mini_batch_size;
+	int n_mini_batches = n / size;
+	double norm_sum = 0.0;
+	TrainData mini_batch;
+	if (ws->augmenter != NULL &&
+		ws->augmenter->opts.width * ws->augmenter->opts.height !=
+		data->inputs_size) {
+		fprintf(stderr, "Invalid augmentation of %dx%d images for inputs of "
+				"size %d.\n", ws->augmenter->opts.width,
+				ws->augmenter->opts.height, data->inputs_size);
+		return -1;
+	}
+	/* Fisher & Yates, with the workspace's own generator */
+	for (i = 0; i < n - 1; i++) {
+		j = i + (int)(rand0(&ws->seed) * (n - i));
+		j = j < n ? j : n - 1;
+		tmp = ws->index[i];
+		ws->index[i] = ws->index[j];
+		ws->index[j] = tmp;
+	}
+	for (batch = 0; batch < n_mini_batches; batch++) {
+		for (i = 0; i < size; i++) {
+			k = ws->index[batch * size + i];
+			ws->batch.inputs_training[i] = data->inputs_training[k];
+			ws->batch.labels_training[i] = data->labels_training[k];
+			if (ws->batch.sparse_inputs_training != NULL) {
+				ws->batch.sparse_inputs_training[i] =
+					data->sparse_inputs_training[k];
+			}
+		}
+		mini_batch = ws->batch;
+		if (ws->augmenter != NULL) {
+			mini_batch.inputs_training = augment_batch(ws->augmenter,
+									ws->batch.inputs_training, size);
+			mini_batch.sparse_inputs_training = NULL;
+		}
+		vector_zero(ws->nabla->data, ws->nabla->size);
+		network_gradient_dropout(net, &mini_batch, ws->nabla, ws->dropout);
+		norm_sum += network_apply_gradient(net, ws->nabla, size,
+										   learning_rate, lambda, n,
+										   max_grad_norm);
+	}
+	return n_mini_batches > 0 ? norm_sum / n_mini_batches : 0.0;
+}
+
+double network_update_mini_batch(Network *net, TrainData *mini_batch,
+								 double learning_rate, double lambda,
+								 int N_total, double max_grad_norm)
 {
 	/* 
 	 * Update the weights and biases of the network using a mini batch of
@@ -178,6 +960,10 @@ void network_update_mini_batch(Network *net, TrainData *mini_batch,
 	 * mini_batch -> a subset of the training set.
 	 * learning_rate -> the learning rate (eta).
 	 * lambda -> the regularization parameter (for L2 regularization).
+	 * N_total -> number of items in the whole training set.
+	 * max_grad_norm -> if > 0, clip the L2 norm of the mean gradient to it.
+	 *
+	 * Returns the L2 norm of the mean gradient, before clipping.
 	 * **********************************************************************
 	 *
 	 * Explanation of the procedure:
@@ -214,104 +1000,328 @@ void network_update_mini_batch(Network *net, TrainData *mini_batch,
 	 * In the current implementation, we first modify W according to the first
 	 * term, then update it normally using the gradients.
 	 *
+	 * Both the parameters and the gradients live in contiguous ParamBuffers
+	 * laid out the same way (all the weights first, then all the biases),
+	 * so each of these steps is a single pass over one buffer.
+	 *
 	 */
-	int i, j;
-	double eta_over_n, l2_term;
-	MatrixList nabla_weights, nabla_biases; // Cumulative gradients.
-	MatrixList delta_weights, delta_biases; // Temporal gradients.
-
-	nabla_weights = malloc(sizeof(Matrix *) * (net->n_layers - 1));
-	nabla_biases = malloc(sizeof(Matrix *) * (net->n_layers - 1));
-	delta_weights = malloc(sizeof(Matrix *) * (net->n_layers - 1));
-	delta_biases = malloc(sizeof(Matrix *) * (net->n_layers - 1));
+	double norm;
+	ParamBuffer *nabla; // Cumulative gradients.
 
 	/* Initialize gradient of weights and biases as zero. */
-	for (i = 0; i < net->n_layers - 1; i++) {
-		nabla_weights[i] = create_matrix_zeros(net->sizes[i+1],
-										 net->sizes[i]);
-		nabla_biases[i] = create_matrix_zeros(net->sizes[i+1], 1);
-	}
-	/* backpropagate, calculate gradient for each training input & add
-	 * it to the cumulative gradient.
-	 */
-	for (i = 0; i < mini_batch->n_train; i++) {
-		/* 1. Calculate the gradient for a single input */
-		backpropagate(net, mini_batch->inputs_training[i],
-						   mini_batch->labels_training[i],
-						   delta_weights,
-						   delta_biases);
-		/* 2. Add it to the cumulative gradients. */
-		for (j = 0; j < net->n_layers - 1; j++) {
-			matrix_add(nabla_weights[j], delta_weights[j]);
-			matrix_add(nabla_biases[j], delta_biases[j]);
+	nabla = create_param_buffer(net->n_layers, net->sizes);
+	network_gradient(net, mini_batch, nabla);
+	norm = network_apply_gradient(net, nabla, mini_batch->n_train,
+								  learning_rate, lambda, N_total,
+								  max_grad_norm);
+	free_param_buffer(nabla);
+	return norm;
+}
 
-			free_matrix(delta_weights[j]);
-			free_matrix(delta_biases[j]);
+/* Backpropagate every input of mini_batch, adding its gradient straight
+ * to nabla, which ends up holding their sum (plus what it held before).
+ */
+void network_gradient(Network *net, TrainData *mini_batch,
+					  ParamBuffer *nabla)
+{
+	network_gradient_dropout(net, mini_batch, nabla, NULL);
+}
+
+/* Like network_gradient, with the dropout of 'dropout' (if not NULL):
+ * every input gets new masks.
+ */
+void network_gradient_dropout(Network *net, TrainData *mini_batch,
+							  ParamBuffer *nabla, Dropout *dropout)
+{
+	int i;
+	SparseVector *sparse_input, *workspace;
+	int max_nnz = SPARSE_INPUT_MAX_DENSITY * net->sizes[0];
+	int dense = dropout != NULL && dropout->masks[0] != NULL;
+
+	workspace = create_sparse_vector(net->sizes[0]);
+	for (i = 0; i < mini_batch->n_train; i++) {
+		/* Through the sparse path if the input is sparse enough (only then
+		 * does its first weight gradient have whole zero columns), unless
+		 * the inputs have dropout, applied to a dense copy */
+		sparse_input = NULL;
+		if (!dense && mini_batch->sparse_inputs_training != NULL) {
+			sparse_input = mini_batch->sparse_inputs_training[i];
+		} else if (!dense && sparse_vector_set(workspace,
+						mini_batch->inputs_training[i]) <= max_nnz) {
+			sparse_input = workspace;
 		}
+		backpropagate_dropout(net, mini_batch->inputs_training[i],
+							  sparse_input, mini_batch->labels_training[i],
+							  nabla, dropout);
 	}
+	free_sparse_vector(workspace);
+}
+
+/* Update the parameters of net with nabla, the sum of the gradients of n
+ * inputs, as described in network_update_mini_batch. nabla is clipped in
+ * place. Returns the L2 norm of the mean gradient, before clipping.
+ */
+double network_apply_gradient(Network *net, ParamBuffer *nabla, int n,
+							  double learning_rate, double lambda,
+							  int N_total, double max_grad_norm)
+{
+	double eta_over_n, l2_term, norm;
+	/* nabla holds the sum of N gradients: clip it to N * max_grad_norm so
+	 * the limit applies to the mean gradient. */
+	PROF_BEGIN(PROF_UPDATE);
+	norm = vector_clip_norm(nabla->data, max_grad_norm * n,
+							nabla->size) / n;
+
 	/* Update weights with the formula:
 	 * W = (1 - eta*lambda/N_TOTAL)*W - (eta/N)*(nabla_weights) */
 
 	l2_term = (1 - learning_rate * lambda / (double)N_total);
-	eta_over_n = -learning_rate / (double)(mini_batch->n_train);
-	for (j = 0; j < net->n_layers - 1; j++) {
-		/* First: apply the first term: W = W * (1 - eta*lambda/N_TOTAL) */
-		matrix_multiply(net->weights[j], l2_term); 
-		/* Second: substract the gradient (add -(eta/N)*nabla_weight) */
-		matrix_multiply(nabla_weights[j], eta_over_n);
-		matrix_add(net->weights[j], nabla_weights[j]);
-
-		matrix_multiply(nabla_biases[j], eta_over_n);
-		matrix_add(net->biases[j], nabla_biases[j]);
-	}
-	for (i = 0; i < net->n_layers - 1; i++) {
-		free_matrix(nabla_weights[i]);
-		free_matrix(nabla_biases[i]);
-	}
-	free(nabla_weights);
-	free(nabla_biases);
-	free(delta_weights);
-	free(delta_biases);
+	eta_over_n = -learning_rate / (double)n;
+	/* First: apply the first term to all the weights (not the biases):
+	 * W = W * (1 - eta*lambda/N_TOTAL) */
+	vector_scale(net->params->data, l2_term, net->params->n_weights);
+	/* Second: substract the gradient of weights and biases
+	 * (add -(eta/N)*nabla) */
+	vector_axpy(net->params->data, eta_over_n, nabla->data,
+				net->params->size);
+	PROF_END(PROF_UPDATE);
+	return norm;
 }
 
 /* Set the inputs of the network and propagate until getting the output. */
 Matrix *feedforward(Network *net, double *input)
 {
 	Matrix *as = array_to_matrix(input, net->sizes[0]);
-	Matrix *zs;
+	Matrix *next;
+	ExprGraph g;
 	int i;
 	for (i = 0; i < net->n_layers - 1; i++) {
-		zs = matrix_prod_optim(net->weights[i], as);
-		matrix_add(zs, net->biases[i]);
-		as = sigmoid_vect(zs);
-		free_matrix(zs);
+		/* sigmoid(W as + b), in one pass after the product */
+		expr_reset(&g);
+		next = expr_eval(&g, expr_sigmoid(&g, expr_add(&g,
+					expr_prod(&g, expr_matrix(&g, net->weights[i]),
+							  expr_matrix(&g, as)),
+					expr_matrix(&g, net->biases[i]))));
+		free_matrix(as);
+		as = next;
 	}
 	return as;
 }
 
-void backpropagate(Network *net, double *inputs, double *outputs,
-				   MatrixList delta_weights, MatrixList delta_biases)
+/* Batches smaller than this go through feedforward_batch one input at a
+ * time (see feedforward_set_batch_crossover) */
+static atomic_int batch_crossover = 0;
+
+/* Make feedforward_batch run batches of fewer than n inputs sample by
+ * sample, through feedforward; n <= 1 always batches (the default). Where
+ * the products of small batches are slower than as many matrix-vector
+ * products depends on the host: the tuner (tune.h) measures it.
+ */
+void feedforward_set_batch_crossover(int n)
+{
+	atomic_store(&batch_crossover, n > 1 ? n : 0);
+}
+
+int feedforward_batch_crossover(void)
+{
+	return atomic_load(&batch_crossover);
+}
+
+/* feedforward_batch one column at a time. */
+static Matrix *feedforward_columns(Network *net, Matrix *inputs)
+{
+	int i, j, n_out = net->sizes[net->n_layers - 1];
+	double *input = malloc(sizeof(double) * inputs->n_rows);
+	Matrix *res = create_matrix(n_out, inputs->n_cols), *out;
+	for (j = 0; j < inputs->n_cols; j++) {
+		for (i = 0; i < inputs->n_rows; i++) {
+			input[i] = inputs->data[i][j];
+		}
+		out = feedforward(net, input);
+		for (i = 0; i < n_out; i++) {
+			res->data[i][j] = out->data[i][0];
+		}
+		free_matrix(out);
+	}
+	free(input);
+	return res;
+}
+
+/* Feedforward a batch of inputs at once: each column of 'inputs'
+ * (sizes[0] x n) is an input, and each column of the returned matrix
+ * (sizes[n_layers-1] x n) the corresponding output.
+ */
+Matrix *feedforward_batch(Network *net, Matrix *inputs)
 {
+	Matrix *as = inputs;
+	Matrix *next;
+	ExprGraph g;
 	int i;
-	Matrix *errors, *errors_new, *weights_T,
-		   *sigma_prime, *as_T, *outs;
+	if (inputs->n_cols < atomic_load(&batch_crossover)) {
+		return feedforward_columns(net, inputs);
+	}
+	for (i = 0; i < net->n_layers - 1; i++) {
+		expr_reset(&g);
+		next = expr_eval(&g, expr_sigmoid(&g, expr_add_columnwise(&g,
+					expr_prod(&g, expr_matrix(&g, net->weights[i]),
+							  expr_matrix(&g, as)),
+					expr_matrix(&g, net->biases[i]))));
+		if (as != inputs) {
+			free_matrix(as);
+		}
+		as = next;
+	}
+	return as;
+}
+
+/* Add to nabla the gradient of the cost with respect to the weights of a
+ * layer, given the errors of its outputs and its input as: the rank-1
+ * update nabla += errors x as^T. If the input is sparse (sparse_as !=
+ * NULL, as is then unused) only the columns at its nonzeros are touched.
+ */
+static void add_weights_gradient(Matrix *nabla, Matrix *errors, Matrix *as,
+								 SparseVector *sparse_as)
+{
+	if (sparse_as != NULL) {
+		matrix_add_outer_sparse(nabla, 1.0, errors, sparse_as);
+	} else {
+		matrix_ger(nabla, 1.0, errors, as);
+	}
+}
+
+/* Bit i of a dropout mask. */
+#define MASK_BIT(mask, i) (((mask)[(i) >> 6] >> ((i) & 63)) & 1)
+
+/* Factor of unit i of a layer with dropout mask 'mask' (NULL if none):
+ * 'scale' if it is kept, 0 if it is dropped.
+ */
+#define DROPOUT_FACTOR(mask, i, scale) \
+	((mask) == NULL ? 1.0 : MASK_BIT(mask, i) ? (scale) : 0.0)
+
+/* Draw new masks for every layer with dropout. */
+static void draw_dropout_masks(Network *net, Dropout *d)
+{
+	int l;
+	for (l = 0; l < d->n_layers - 1; l++) {
+		if (d->masks[l] != NULL) {
+			rng_mask(&d->rng, d->masks[l], net->sizes[l], 1 - d->rates[l]);
+		}
+	}
+}
+
+/* The n inputs as a column vector, with the dropout of mask (kept values
+ * multiplied by scale) applied as they are copied.
+ */
+static Matrix *dropout_array_to_matrix(double *inputs, int n,
+									   const uint64_t *mask, double scale)
+{
+	int i;
+	Matrix *as = create_matrix(n, 1);
+	double *a = as->data[0];
+	for (i = 0; i < n; i++) {
+		a[i] = inputs[i] * DROPOUT_FACTOR(mask, i, scale);
+	}
+	return as;
+}
+
+/* sigmoid_vect of the column vector zs, with the dropout of mask (kept
+ * units multiplied by scale) applied in the same pass.
+ */
+static Matrix *sigmoid_dropout_vect(Matrix *zs, const uint64_t *mask,
+									double scale)
+{
+	int i, n = zs->n_rows;
+	Matrix *as = create_matrix(n, 1);
+	double *a = as->data[0], *z = zs->data[0];
+	PROF_BYTES(16L * n);
+	for (i = 0; i < n; i++) {
+		a[i] = sigmoid(z[i]) * DROPOUT_FACTOR(mask, i, scale);
+	}
+	return as;
+}
+
+/* errors *= sigmoid_prime(zs) entrywise (column vectors), with the
+ * dropout of mask (kept units multiplied by scale) applied in the same
+ * pass: the errors of dropped units become 0.
+ */
+static void sigmoid_prime_dropout(Matrix *errors, Matrix *zs,
+								  const uint64_t *mask, double scale)
+{
+	int i, n = zs->n_rows;
+	double s, *e = errors->data[0], *z = zs->data[0];
+	PROF_BYTES(24L * n);
+	for (i = 0; i < n; i++) {
+		s = sigmoid(z[i]);
+		e[i] *= s * (1.0 - s) * DROPOUT_FACTOR(mask, i, scale);
+	}
+}
+
+/* Backpropagation of one input, given either dense (inputs) or sparse
+ * (sparse_inputs): the gradient of every layer is added to nabla_weights
+ * and nabla_biases as soon as it is known, without being stored. With
+ * dropout (not NULL) it draws new masks, and the activations of the
+ * layers and their errors go through them; if the input layer has
+ * dropout, inputs must be given and sparse_inputs is ignored.
+ */
+static void backpropagate_into(Network *net, double *inputs,
+							   SparseVector *sparse_inputs, double *outputs,
+							   MatrixList nabla_weights,
+							   MatrixList nabla_biases, Dropout *dropout)
+{
+	int i;
+	Matrix *errors, *errors_new, *weights_T, *outs;
+	uint64_t *masks[net->n_layers];
+	double scales[net->n_layers];
 	/* Feedforward pass */
+	PROF_BEGIN(PROF_FORWARD);
 	MatrixList zs = malloc(sizeof(Matrix *)*net->n_layers);
 	MatrixList as = malloc(sizeof(Matrix *)*net->n_layers);
-	as[0] = array_to_matrix(inputs, net->sizes[0]);
+	for (i = 0; i < net->n_layers; i++) {
+		masks[i] = NULL;
+		scales[i] = 1.0;
+	}
+	if (dropout != NULL) {
+		draw_dropout_masks(net, dropout);
+		for (i = 0; i < net->n_layers - 1; i++) {
+			masks[i] = dropout->masks[i];
+			scales[i] = 1.0 / (1.0 - dropout->rates[i]);
+		}
+	}
 	zs[0] = create_matrix(1, 1); // unused
+	if (masks[0] != NULL) {
+		sparse_inputs = NULL;
+		as[0] = dropout_array_to_matrix(inputs, net->sizes[0], masks[0],
+										scales[0]);
+		zs[1] = matrix_prod_optim(net->weights[0], as[0]);
+	} else if (sparse_inputs != NULL) {
+		/* Only the weights of the nonzero inputs matter */
+		as[0] = NULL;
+		zs[1] = matrix_prod_sparse_vector(net->weights[0], sparse_inputs);
+	} else {
+		as[0] = array_to_matrix(inputs, net->sizes[0]);
+		zs[1] = matrix_prod_optim(net->weights[0], as[0]);
+	}
 	for (i = 0; i < net->n_layers - 1; i++) {
-		zs[i+1] = matrix_prod_optim(net->weights[i], as[i]);
+		if (i > 0) {
+			zs[i+1] = matrix_prod_optim(net->weights[i], as[i]);
+		}
 		matrix_add(zs[i+1], net->biases[i]);
-		as[i+1] = sigmoid_vect(zs[i+1]);
+		if (masks[i+1] != NULL) {
+			as[i+1] = sigmoid_dropout_vect(zs[i+1], masks[i+1],
+										   scales[i+1]);
+		} else {
+			as[i+1] = sigmoid_vect(zs[i+1]);
+		}
 	}
+	PROF_END(PROF_FORWARD);
+	PROF_BEGIN(PROF_BACKWARD);
 	/* Calculate errors in last layer */
 	outs = array_to_matrix(outputs, net->sizes[net->n_layers-1]);
 	errors = cost_derivative(outs, as[net->n_layers-1]);
 
-    delta_biases[net->n_layers-2] = matrix_copy(errors);
-	as_T = transpose(as[net->n_layers-2]);
-    delta_weights[net->n_layers-2] = matrix_prod_optim(errors, as_T);
+	matrix_add(nabla_biases[net->n_layers-2], errors);
+	add_weights_gradient(nabla_weights[net->n_layers-2], errors,
+		as[net->n_layers-2], net->n_layers == 2 ? sparse_inputs : NULL);
 
 	free_matrix(outs);
 	/* Backpropagate */
@@ -319,18 +1329,14 @@ void backpropagate(Network *net, double *inputs, double *outputs,
 		weights_T = transpose(net->weights[i+1]);
 		/* Errors in current layer */
 		errors_new = matrix_prod_optim(weights_T, errors);
-		sigma_prime = sigmoid_prime_vect(zs[i+1]);
+		sigmoid_prime_dropout(errors_new, zs[i+1], masks[i+1], scales[i+1]);
 
-		matrix_entrywise_product(errors_new, sigma_prime); 
-		as_T = transpose(as[i]);
-
-		delta_weights[i] = matrix_prod_optim(errors_new, as_T);
-		delta_biases[i] = matrix_copy(errors_new);
+		add_weights_gradient(nabla_weights[i], errors_new, as[i],
+							 i == 0 ? sparse_inputs : NULL);
+		matrix_add(nabla_biases[i], errors_new);
 
 		free_matrix(errors);
 		free_matrix(weights_T);
-		free_matrix(as_T);
-		free_matrix(sigma_prime);
 
 		errors = errors_new;
 	}
@@ -341,6 +1347,69 @@ void backpropagate(Network *net, double *inputs, double *outputs,
 	}
 	free(zs);
 	free(as);
+	PROF_END(PROF_BACKWARD);
+}
+
+/* Compute the gradient of the cost for one input (inputs, with expected
+ * outputs 'outputs'), storing in delta_weights and delta_biases one new
+ * matrix per layer, which the caller must free.
+ */
+void backpropagate(Network *net, double *inputs, double *outputs,
+				   MatrixList delta_weights, MatrixList delta_biases)
+{
+	int i;
+	for (i = 0; i < net->n_layers - 1; i++) {
+		delta_weights[i] = create_matrix(net->sizes[i+1], net->sizes[i]);
+		delta_biases[i] = create_matrix(net->sizes[i+1], 1);
+	}
+	backpropagate_into(net, inputs, NULL, outputs, delta_weights,
+					   delta_biases, NULL);
+}
+
+/* Like backpropagate, for a sparse input: the first layer only reads the
+ * weights of its nonzeros, and only computes those columns of
+ * delta_weights[0], all its other columns being zero.
+ */
+void backpropagate_sparse(Network *net, SparseVector *inputs,
+						  double *outputs, MatrixList delta_weights,
+						  MatrixList delta_biases)
+{
+	int i;
+	for (i = 0; i < net->n_layers - 1; i++) {
+		delta_weights[i] = create_matrix(net->sizes[i+1], net->sizes[i]);
+		delta_biases[i] = create_matrix(net->sizes[i+1], 1);
+	}
+	backpropagate_into(net, NULL, inputs, outputs, delta_weights,
+					   delta_biases, NULL);
+}
+
+/* Like backpropagate, but adding the gradient to the one accumulated in
+ * nabla (a ParamBuffer shaped like net->params) instead of returning it,
+ * with one rank-1 update per layer and no temporary gradient matrices.
+ * If sparse_inputs is not NULL it is used instead of inputs (see
+ * backpropagate_sparse), and only the columns of nabla->weights[0] at
+ * its nonzeros are touched.
+ */
+void backpropagate_accumulate(Network *net, double *inputs,
+							  SparseVector *sparse_inputs, double *outputs,
+							  ParamBuffer *nabla)
+{
+	backpropagate_into(net, sparse_inputs != NULL ? NULL : inputs,
+					   sparse_inputs, outputs, nabla->weights,
+					   nabla->biases, NULL);
+}
+
+/* Like backpropagate_accumulate, training with the dropout of 'dropout'
+ * (none if NULL): new masks are drawn for this input, and left in
+ * dropout->masks. If the input layer has dropout, inputs must be given;
+ * sparse_inputs is then ignored.
+ */
+void backpropagate_dropout(Network *net, double *inputs,
+						   SparseVector *sparse_inputs, double *outputs,
+						   ParamBuffer *nabla, Dropout *dropout)
+{
+	backpropagate_into(net, inputs, sparse_inputs, outputs, nabla->weights,
+					   nabla->biases, dropout);
 }
 
 /* Sigmoid function */
@@ -355,16 +1424,33 @@ double sigmoid_prime(double x)
 	return sigmoid(x) * (1.0 - sigmoid(x));
 }
 
-/* Vectorized version of the sigmoid function */
-Matrix *sigmoid_vect(Matrix *mat)
+typedef struct {
+	Matrix *in, *out;
+} SigmoidArgs;
+
+/* Rows [begin, end) of out = sigmoid(in). */
+static void sigmoid_rows(void *arg, long begin, long end)
 {
-	int i, j;
-	Matrix *newmat = create_matrix(mat->n_rows, mat->n_cols);
-	for (i = 0; i < mat->n_rows; i++) {
-		for (j = 0; j < mat->n_cols; j++) {
-			newmat->data[i][j] = sigmoid(mat->data[i][j]);
+	SigmoidArgs *k = arg;
+	int i, j, nc = k->in->n_cols;
+	for (i = begin; i < end; i++) {
+		for (j = 0; j < nc; j++) {
+			k->out->data[i][j] = sigmoid(k->in->data[i][j]);
 		}
 	}
+}
+
+/* Vectorized version of the sigmoid function. Large matrices are split
+ * by rows over the thread pool. */
+Matrix *sigmoid_vect(Matrix *mat)
+{
+	Matrix *newmat = create_matrix_view(numa_alloc_huge(sizeof(double) *
+			mat->n_rows * mat->n_cols), mat->n_rows, mat->n_cols);
+	SigmoidArgs k = {mat, newmat};
+	PROF_BYTES(16L * mat->n_rows * mat->n_cols);
+	/* exp is about 20 flops */
+	parallel_for(0, mat->n_rows, pool_grain(mat->n_rows, 20.0 * mat->n_cols),
+				 sigmoid_rows, &k);
 	return newmat;
 }
 
@@ -373,6 +1459,7 @@ Matrix *sigmoid_prime_vect(Matrix *mat)
 {
 	int i, j;
 	Matrix *newmat = create_matrix(mat->n_rows, mat->n_cols);
+	PROF_BYTES(16L * mat->n_rows * mat->n_cols);
 	for (i = 0; i < mat->n_rows; i++) {
 		for (j = 0; j < mat->n_cols; j++) {
 			newmat->data[i][j] = sigmoid_prime(mat->data[i][j]);
@@ -385,6 +1472,8 @@ Matrix *sigmoid_prime_from_sigmoid_vect(Matrix *mat)
 {
 	int i, j;
 	Matrix *newmat = create_matrix(mat->n_rows, mat->n_cols);
+	PROF_FLOPS(2L * mat->n_rows * mat->n_cols);
+	PROF_BYTES(16L * mat->n_rows * mat->n_cols);
 	for (i = 0; i < mat->n_rows; i++) {
 		for (j = 0; j < mat->n_cols; j++) {
 			newmat->data[i][j] = mat->data[i][j]*(1 - mat->data[i][j]);
@@ -413,6 +1502,7 @@ double test_accuracy(Network *net, TrainData *data)
 			n_ok += 1;
 		}
 	}
+	free(output);
 	return ((double)n_ok) / ((double)(data->n_test));
 }
 
@@ -423,8 +1513,8 @@ double test_accuracy(Network *net, TrainData *data)
  */
 Matrix *cost_derivative(Matrix *outputs, Matrix *activs)
 {
-	Matrix *errs = create_matrix(outputs->n_rows, outputs->n_cols);
-	matrix_add(errs, activs);
-	matrix_substract(errs, outputs);
-	return errs;
+	ExprGraph g;
+	expr_reset(&g);
+	return expr_eval(&g, expr_sub(&g, expr_matrix(&g, activs),
+								  expr_matrix(&g, outputs)));
 }
@@ -1,10 +1,19 @@
 #include <stdint.h>
 #include "random.h"
 #include <matrix.h>
+#include <sparse.h>
+#include <augment.h>
 
 #ifndef NEURON_H
 #define NEURON_H
 
+#define NETWORK_FILE_MAGIC "GLIA"
+
+/* Inputs with at most this fraction of nonzeros take the sparse path in
+ * the first layer of backpropagation (see backpropagate_sparse).
+ */
+#define SPARSE_INPUT_MAX_DENSITY 0.5
+
 /* TrainData struct. This struct holds the data necessary to perform
  * the training and testing of a neural network. It must be freed with
  * free_training_data(the_ata);
@@ -20,8 +29,34 @@ typedef struct {
 	double **labels_testing;
 	double **inputs_training;
 	double **labels_training;
+	/* Sparse copies of inputs_training (see compress_training_inputs),
+	 * or NULL. */
+	SparseVector **sparse_inputs_training;
+	/* If not NULL, the single block all the rows point into (see
+	 * copy_training_data), freed instead of the rows. */
+	void *block;
 } TrainData;
 
+/* ParamBuffer struct. Holds one matrix of weights and one of biases per
+ * layer of a network, all of them stored in a single contiguous buffer:
+ * first the weights of every layer, then the biases of every layer.
+ * The matrices are views into 'data', so whole-model operations can be
+ * done in one pass over it. Used for the parameters of a network and for
+ * their gradients. Must be freed with free_param_buffer(the_buffer);
+ */
+typedef struct {
+	/* number of layers of the network it belongs to */
+	int n_layers;
+	/* total number of doubles in data */
+	long size;
+	/* number of weights: data[0 .. n_weights-1] are the weights */
+	long n_weights;
+	double *data;
+	/* per-layer views into data */
+	MatrixList weights;
+	MatrixList biases;
+} ParamBuffer;
+
 /* Struct defining a neural network. Must be freed with
  * destroy_network(the_network);
  */
@@ -30,36 +65,201 @@ typedef struct network {
 	uint8_t n_layers;
 	/* size of the layers */
 	int *sizes;
-	/* weights of the network: array of matrices */
+	/* all the weights and biases, in one contiguous buffer */
+	ParamBuffer *params;
+	/* weights of the network: array of matrices (views into params) */
 	MatrixList weights;
-	/* biases of the network */
+	/* biases of the network (views into params) */
 	MatrixList biases;
 } Network;
 
+/* Optional settings for SGD_with_options. A zeroed struct gives the same
+ * behaviour as SGD.
+ */
+typedef struct {
+	/* If > 0, the mean gradient of each mini batch is rescaled so that
+	 * its L2 norm is at most max_grad_norm. */
+	double max_grad_norm;
+	/* If nonzero, print the average gradient norm after each epoch. */
+	int report_grad_norm;
+	/* If not NULL, params->n_weights values by which the weights are
+	 * multiplied after every update: 0 keeps a pruned weight at zero. */
+	double *weight_mask;
+	/* If > 1, train Hogwild-style: that many threads take mini batches
+	 * through a shared atomic index and update the weights concurrently,
+	 * without any locking, each writing only the parameters its mini
+	 * batch has a gradient for. Updates to shared parameters race and may
+	 * be lost, so dense inputs may need more epochs than serial SGD. */
+	int n_threads;
+	/* If not NULL, the inputs of every mini batch are augmented as it is
+	 * assembled (see lib/augment.h), each thread with its own
+	 * Augmenter; the data itself is left untouched. width * height must
+	 * be the size of the inputs. */
+	AugmentOptions *augment;
+	/* If not NULL, dropout rates of the n_layers - 1 layers that feed
+	 * another (the input layer and the hidden ones): during training each
+	 * unit of layer l is dropped with probability dropout[l] and the
+	 * others are scaled by 1 / (1 - dropout[l]) (inverted dropout), so
+	 * that inference needs no change. Each thread draws its own masks. */
+	double *dropout;
+	/* If nonzero, pin the training threads to CPUs spread over the NUMA
+	 * nodes (see numa_pin_thread), each allocating its own buffers after
+	 * it is pinned so that they live on its node. The calling thread gets
+	 * its CPU affinity back afterwards. */
+	int pin_threads;
+	/* If nonzero, the accuracy after each epoch is measured on a snapshot
+	 * of the weights, scored by a background thread while the next epoch
+	 * trains; training only waits if the previous snapshot is still being
+	 * scored, and for the last one before returning. Either way SGD prints
+	 * "Accuracy after epoch E: A%". With GLIA_PROFILE the FLOPs and bytes
+	 * of the background scoring are not in the eval phase: they count in
+	 * the epoch it overlaps, whose GFLOP/s and GB/s they inflate. */
+	int async_eval;
+	/* If not NULL, receives the n_epochs accuracies, in either mode. */
+	double *accuracies;
+} SGDOptions;
+
+/* Dropout struct. The dropout state of one training thread: the rates
+ * (see SGDOptions.dropout), its generator, and the masks of the input it
+ * last backpropagated, 1 bit per unit (set if the unit is kept), drawn
+ * in the forward pass and read again in the backward one. Must be freed
+ * with destroy_dropout(the_dropout);
+ */
+typedef struct {
+	int n_layers;
+	double *rates;
+	Rng rng;
+	/* masks[l], of (sizes[l] + 63) / 64 words; NULL if rates[l] is 0 */
+	uint64_t **masks;
+} Dropout;
+
+/* SGDWorkspace struct. The state of one training run by SGD_epoch: its
+ * own order of the training samples and its buffers, so that several
+ * runs can share one TrainData, which they only read. Must be freed with
+ * free_sgd_workspace(the_workspace);
+ */
+typedef struct {
+	int mini_batch_size;
+	/* order of the training samples in the current epoch */
+	int *index;
+	/* seed of the shuffles (see rand0) */
+	long seed;
+	/* the current mini batch, pointing into the shared data */
+	TrainData batch;
+	/* sum of the gradients of the current mini batch */
+	ParamBuffer *nabla;
+	/* if not NULL (it is NULL after create_sgd_workspace), augments the
+	 * inputs of every mini batch; freed with the workspace */
+	Augmenter *augmenter;
+	/* if not NULL (it is NULL after create_sgd_workspace), the dropout of
+	 * the run; freed with the workspace */
+	Dropout *dropout;
+} SGDWorkspace;
+
+/* NetworkReplicas struct. Read-only copies of a network for inference,
+ * each with its parameters in the memory of one NUMA node, so that the
+ * threads of every node read their weights locally. Must be freed with
+ * destroy_network_replicas(the_replicas);
+ */
+typedef struct {
+	int n_replicas;
+	/* the network copied, not owned */
+	Network *source;
+	/* replica i lives on node i % numa_node_count(); nets[0] is source
+	 * itself when there is a single replica */
+	Network **nets;
+} NetworkReplicas;
+
 /*** Prototypes ***/
 
 void free_training_data(TrainData *data);
 
 TrainData *subset_training_data(TrainData *data, int start, int end);
 
+TrainData *copy_training_data(TrainData *data, int interleave);
+
 void shuffle_training_data(TrainData *data);
 
+int compress_training_inputs(TrainData *data, double max_density);
+
+ParamBuffer *create_param_buffer(int n_layers, int *sizes);
+
+void free_param_buffer(ParamBuffer *buf);
+
 Network *create_network(int n_layers, ...);
 
+Network *create_network_from_sizes(int n_layers, int *sizes);
+
 void destroy_network(Network *net);
 
+NetworkReplicas *create_network_replicas(Network *net, int n_replicas);
+
+void network_replicas_update(NetworkReplicas *r);
+
+Network *network_replica(NetworkReplicas *r, int node);
+
+void destroy_network_replicas(NetworkReplicas *r);
+
+int save_network(Network *net, char *path);
+
+Network *load_network(char *path);
+
 void SGD(Network *net, TrainData *data, int epochs,
 	 int mini_batch_size, double learning_rate, double lambda);
 
-void network_update_mini_batch(Network *net,
+void SGD_with_options(Network *net, TrainData *data, int epochs,
+		int mini_batch_size, double learning_rate, double lambda,
+		SGDOptions *opts);
+
+Dropout *create_dropout(Network *net, double *rates, uint64_t seed);
+
+void destroy_dropout(Dropout *d);
+
+SGDWorkspace *create_sgd_workspace(Network *net, TrainData *data,
+		int mini_batch_size, long seed);
+
+void free_sgd_workspace(SGDWorkspace *ws);
+
+double SGD_epoch(Network *net, TrainData *data, SGDWorkspace *ws,
+		double learning_rate, double lambda, double max_grad_norm);
+
+double network_update_mini_batch(Network *net,
 		TrainData *mini_batch, double learning_rate, double lambda,
-		int N_total);
+		int N_total, double max_grad_norm);
+
+void network_gradient(Network *net, TrainData *mini_batch,
+		ParamBuffer *nabla);
+
+void network_gradient_dropout(Network *net, TrainData *mini_batch,
+		ParamBuffer *nabla, Dropout *dropout);
+
+double network_apply_gradient(Network *net, ParamBuffer *nabla, int n,
+		double learning_rate, double lambda, int N_total,
+		double max_grad_norm);
 
 Matrix *feedforward(Network *net, double *input);
 
+Matrix *feedforward_batch(Network *net, Matrix *inputs);
+
+void feedforward_set_batch_crossover(int n);
+
+int feedforward_batch_crossover(void);
+
 void backpropagate(Network *net, double *inputs, double *outputs,
 				   MatrixList delta_weigths, MatrixList delta_biases);
 
+void backpropagate_sparse(Network *net, SparseVector *inputs,
+						  double *outputs, MatrixList delta_weights,
+						  MatrixList delta_biases);
+
+void backpropagate_accumulate(Network *net, double *inputs,
+							  SparseVector *sparse_inputs, double *outputs,
+							  ParamBuffer *nabla);
+
+void backpropagate_dropout(Network *net, double *inputs,
+						   SparseVector *sparse_inputs, double *outputs,
+						   ParamBuffer *nabla, Dropout *dropout);
+
 double sigmoid(double x);
 double sigmoid_prime(double x);
 Matrix *sigmoid_vect(Matrix *mat);
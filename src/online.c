@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include <online.h>
+#include <vector.h>
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* A new network with the parameters of net. */
+static Network *copy_network(Network *net)
+{
+	Network *copy = create_network_from_sizes(net->n_layers, net->sizes);
+	vector_copy(copy->params->data, net->params->data, net->params->size);
+	return copy;
+}
+
+/* Start learning online from the parameters of net (copied: net is left
+ * alone), which are published first, with the settings of opts (NULL for
+ * the defaults).
+ */
+OnlineModel *create_online_model(Network *net, OnlineOptions *opts)
+{
+	int i;
+	OnlineModel *m = calloc(1, sizeof(OnlineModel));
+	if (opts != NULL) {
+		m->opts = *opts;
+	}
+	if (m->opts.mini_batch_size <= 0) {
+		m->opts.mini_batch_size = 10;
+	}
+	if (m->opts.learning_rate <= 0) {
+		m->opts.learning_rate = 0.5;
+	}
+	if (m->opts.publish_every <= 0) {
+		m->opts.publish_every = 1;
+	}
+	m->shadow = copy_network(net);
+	m->nabla = create_param_buffer(net->n_layers, net->sizes);
+	m->inputs = malloc(sizeof(double *) * m->opts.mini_batch_size);
+	m->labels = malloc(sizeof(double *) * m->opts.mini_batch_size);
+	for (i = 0; i < m->opts.mini_batch_size; i++) {
+		m->inputs[i] = malloc(sizeof(double) * net->sizes[0]);
+		m->labels[i] = malloc(sizeof(double) *
+							  net->sizes[net->n_layers - 1]);
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	/* Epoch 0 marks the readers not reading */
+	atomic_init(&m->epoch, 1);
+	for (i = 0; i < ONLINE_MAX_READERS; i++) {
+		atomic_init(&m->readers[i].epoch, 0);
+		atomic_init(&m->readers[i].in_use, 0);
+	}
+	atomic_init(&m->current, copy_network(net));
+	m->publish_ns = now_ns();
+	return m;
+}
+
+static void free_retired(OnlineRetired *r)
+{
+	OnlineRetired *next;
+	for (; r != NULL; r = next) {
+		next = r->next;
+		destroy_network(r->net);
+		free(r);
+	}
+}
+
+/* Free an online model, its published network included. No reader may
+ * still be using it.
+ */
+void destroy_online_model(OnlineModel *m)
+{
+	int i;
+	if (m == NULL) {
+		return;
+	}
+	for (i = 0; i < m->opts.mini_batch_size; i++) {
+		free(m->inputs[i]);
+		free(m->labels[i]);
+	}
+	free(m->inputs);
+	free(m->labels);
+	free_retired(m->retired);
+	free_retired(m->spare);
+	destroy_network(atomic_load(&m->current));
+	destroy_network(m->shadow);
+	free_param_buffer(m->nabla);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+/* Register a reading thread: returns its slot, to be given back with
+ * online_reader_release, or NULL if there are ONLINE_MAX_READERS already.
+ */
+OnlineReader *online_reader(OnlineModel *m)
+{
+	int i, expected;
+	for (i = 0; i < ONLINE_MAX_READERS; i++) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&m->readers[i].in_use, &expected,
+										   1)) {
+			return &m->readers[i];
+		}
+	}
+	fprintf(stderr, "online_reader ERROR: more than %d readers.\n",
+			ONLINE_MAX_READERS);
+	return NULL;
+}
+
+void online_reader_release(OnlineReader *r)
+{
+	if (r == NULL) {
+		return;
+	}
+	atomic_store(&r->epoch, 0);
+	atomic_store(&r->in_use, 0);
+}
+
+/* Return the latest published network, which stays valid (and unchanged)
+ * until online_read_end(r). Wait-free. Reads of one reader must not be
+ * nested.
+ */
+Network *online_read_begin(OnlineModel *m, OnlineReader *r)
+{
+	/* Announce the epoch before loading the pointer: a publication that
+	 * retires what we load comes after it in the (sequentially
+	 * consistent) order of the atomics, with an epoch at least ours */
+	atomic_store(&r->epoch, atomic_load(&m->epoch));
+	return atomic_load(&m->current);
+}
+
+void online_read_end(OnlineReader *r)
+{
+	atomic_store(&r->epoch, 0);
+}
+
+/* Move to the spare list the retired networks no reader can see: those
+ * retired in an epoch before that of every current read.
+ */
+static void reclaim(OnlineModel *m)
+{
+	int i;
+	unsigned long e, oldest = ULONG_MAX;
+	OnlineRetired **p, *r;
+	for (i = 0; i < ONLINE_MAX_READERS; i++) {
+		e = atomic_load(&m->readers[i].epoch);
+		if (e != 0 && e < oldest) {
+			oldest = e;
+		}
+	}
+	p = &m->retired;
+	while (*p != NULL) {
+		r = *p;
+		if (r->epoch < oldest) {
+			*p = r->next;
+			r->next = m->spare;
+			m->spare = r;
+		} else {
+			p = &r->next;
+		}
+	}
+}
+
+/* Publish a copy of the shadow network. Called with the lock. */
+static void publish(OnlineModel *m)
+{
+	OnlineRetired *r = m->spare;
+	Network *old;
+	if (r != NULL) {
+		m->spare = r->next;
+		vector_copy(r->net->params->data, m->shadow->params->data,
+					m->shadow->params->size);
+	} else {
+		r = malloc(sizeof(OnlineRetired));
+		r->net = copy_network(m->shadow);
+	}
+	old = atomic_exchange(&m->current, r->net);
+	/* r now carries the network it replaced */
+	r->net = old;
+	r->epoch = atomic_fetch_add(&m->epoch, 1);
+	r->next = m->retired;
+	m->retired = r;
+	reclaim(m);
+	m->n_published++;
+	m->updates_since_publish = 0;
+	m->publish_ns = now_ns();
+}
+
+/* Learn from one labelled sample: it is queued, and every
+ * mini_batch_size samples the shadow network takes a step of gradient
+ * descent on them, published as set in the options. Returns 1 if the
+ * sample led to a publication, else 0. Safe to call from several
+ * threads, which take turns.
+ */
+int online_learn(OnlineModel *m, double *input, double *label)
+{
+	int published = 0;
+	Network *net = m->shadow;
+	OnlineOptions *o = &m->opts;
+	TrainData batch = {0};
+	pthread_mutex_lock(&m->lock);
+	memcpy(m->inputs[m->n_pending], input, sizeof(double) * net->sizes[0]);
+	memcpy(m->labels[m->n_pending], label,
+		   sizeof(double) * net->sizes[net->n_layers - 1]);
+	if (++m->n_pending == o->mini_batch_size) {
+		batch.n_train = o->mini_batch_size;
+		batch.inputs_size = net->sizes[0];
+		batch.outputs_size = net->sizes[net->n_layers - 1];
+		batch.inputs_training = m->inputs;
+		batch.labels_training = m->labels;
+		vector_zero(m->nabla->data, m->nabla->size);
+		network_gradient(net, &batch, m->nabla);
+		network_apply_gradient(net, m->nabla, batch.n_train,
+							   o->learning_rate,
+							   o->n_total > 0 ? o->lambda : 0.0,
+							   o->n_total > 0 ? o->n_total : 1, 0.0);
+		m->n_pending = 0;
+		m->n_updates++;
+		m->updates_since_publish++;
+		if (m->updates_since_publish >= o->publish_every ||
+			(o->publish_interval_us > 0 &&
+			 now_ns() - m->publish_ns >= o->publish_interval_us * 1000)) {
+			publish(m);
+			published = 1;
+		}
+	}
+	pthread_mutex_unlock(&m->lock);
+	return published;
+}
+
+/* Publish the shadow network now, whatever the cadence. */
+void online_publish(OnlineModel *m)
+{
+	pthread_mutex_lock(&m->lock);
+	publish(m);
+	pthread_mutex_unlock(&m->lock);
+}
@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <neuron.h>
+
+#ifndef ONLINE_H
+#define ONLINE_H
+
+/*
+ * Online learning of a network that keeps serving predictions.
+ *
+ * The updates are made on a shadow copy of the network, private to the
+ * learner. Every so often (see OnlineOptions) the shadow is copied into a
+ * new network, published with an atomic pointer swap. Readers bracket
+ * their use of the published network with online_read_begin and
+ * online_read_end, which never block: a reader keeps the network it got
+ * for as long as it needs, whole, while newer ones are published.
+ *
+ * Old networks are freed by epoch-based reclamation: each reader
+ * announces in its slot the global epoch it started reading in, every
+ * publication retires the old network with the epoch it was replaced in
+ * and advances the epoch, and a retired network is reused once no reader
+ * is still in an epoch up to that one.
+ */
+
+/* Readers registered at most at the same time. */
+#define ONLINE_MAX_READERS 64
+
+/* OnlineOptions struct. Fields left to 0 take the defaults given. */
+typedef struct {
+	/* samples per update (default 10) */
+	int mini_batch_size;
+	/* (default 0.5) */
+	double learning_rate;
+	/* L2 regularization, scaled as for a data set of n_total samples
+	 * (none if n_total is 0) */
+	double lambda;
+	int n_total;
+	/* publish after this many updates (default 1)... */
+	int publish_every;
+	/* ...or as soon as an update ends publish_interval_us microseconds
+	 * after the last publication, if it is > 0 */
+	long publish_interval_us;
+} OnlineOptions;
+
+/* OnlineReader struct. The slot of one reading thread, padded to a cache
+ * line so that readers do not write to each other's lines.
+ */
+typedef struct {
+	/* epoch its current read began in, 0 when it is not reading */
+	atomic_ulong epoch;
+	atomic_int in_use;
+	char pad[64 - sizeof(atomic_ulong) - sizeof(atomic_int)];
+} OnlineReader;
+
+/* A network replaced by a publication, freed once no reader can see it. */
+typedef struct OnlineRetired {
+	Network *net;
+	unsigned long epoch;
+	struct OnlineRetired *next;
+} OnlineRetired;
+
+/* OnlineModel struct. Must be freed with destroy_online_model(the_model);
+ * once the readers are done.
+ */
+typedef struct {
+	OnlineOptions opts;
+	/* the network readers get */
+	_Atomic(Network *) current;
+	atomic_ulong epoch;
+	OnlineReader readers[ONLINE_MAX_READERS];
+	/* serializes the learners; the fields below are theirs */
+	pthread_mutex_t lock;
+	/* the network being trained */
+	Network *shadow;
+	ParamBuffer *nabla;
+	/* samples waiting for the next update */
+	double **inputs;
+	double **labels;
+	int n_pending;
+	long n_updates;
+	long n_published;
+	int updates_since_publish;
+	long publish_ns;
+	/* networks retired, newest first, and freed ones ready for reuse */
+	OnlineRetired *retired;
+	OnlineRetired *spare;
+} OnlineModel;
+
+OnlineModel *create_online_model(Network *net, OnlineOptions *opts);
+
+void destroy_online_model(OnlineModel *m);
+
+OnlineReader *online_reader(OnlineModel *m);
+
+void online_reader_release(OnlineReader *r);
+
+Network *online_read_begin(OnlineModel *m, OnlineReader *r);
+
+void online_read_end(OnlineReader *r);
+
+int online_learn(OnlineModel *m, double *input, double *label);
+
+void online_publish(OnlineModel *m);
+
+#endif // ONLINE_H
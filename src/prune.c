@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include <utils.h>
+#include <matrix.h>
+#include <prune.h>
+
+/*
+ * Magnitude pruning of a trained network, and inference with the pruned
+ * weights stored as sparse matrices.
+ */
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Zero the weights of the network (not the biases) whose magnitude is
+ * below a threshold. If sparsity > 0, the threshold is chosen instead so
+ * that this fraction of all the weights is zeroed: the same threshold is
+ * used for every layer (global magnitude pruning), working on the flat
+ * buffer of weights.
+ *
+ * If mask is not NULL it gets params->n_weights values: 1 for the weights
+ * kept, 0 for the pruned ones. Pass it as weight_mask in SGDOptions to
+ * fine-tune the pruned network without reviving pruned weights.
+ *
+ * Returns the threshold used.
+ */
+double prune_network(Network *net, double threshold, double sparsity,
+					 double *mask)
+{
+	long i, k, n = net->params->n_weights;
+	double *w = net->params->data;
+	double *mags;
+	if (sparsity > 0) {
+		mags = malloc(sizeof(double) * n);
+		for (i = 0; i < n; i++) {
+			mags[i] = fabs(w[i]);
+		}
+		qsort(mags, n, sizeof(double), cmp_double);
+		k = (long)(sparsity * n);
+		threshold = k >= n ? INFINITY : mags[k];
+		free(mags);
+	}
+	for (i = 0; i < n; i++) {
+		if (fabs(w[i]) < threshold) {
+			w[i] = 0.0;
+		}
+		if (mask != NULL) {
+			mask[i] = w[i] != 0.0;
+		}
+	}
+	return threshold;
+}
+
+/* Fraction of the weights of the network that are exactly zero. */
+double network_sparsity(Network *net)
+{
+	long i, zeros = 0, n = net->params->n_weights;
+	for (i = 0; i < n; i++) {
+		zeros += net->params->data[i] == 0.0;
+	}
+	return n > 0 ? (double)zeros / n : 0.0;
+}
+
+/* Build the sparse, inference-only version of a network. */
+SparseNetwork *sparsify_network(Network *net)
+{
+	int i;
+	if (net->n_layers < 2) {
+		return NULL;
+	}
+	SparseNetwork *snet = malloc(sizeof(SparseNetwork));
+	snet->n_layers = net->n_layers;
+	snet->sizes = malloc(sizeof(int) * net->n_layers);
+	arrncpy(snet->sizes, net->sizes, net->n_layers);
+	snet->weights = malloc(sizeof(SparseMatrix *) * (snet->n_layers - 1));
+	snet->biases = malloc(sizeof(Matrix *) * (snet->n_layers - 1));
+	for (i = 0; i < net->n_layers - 1; i++) {
+		snet->weights[i] = matrix_to_sparse(net->weights[i]);
+		snet->biases[i] = matrix_copy(net->biases[i]);
+	}
+	return snet;
+}
+
+/* Free the memory allocated for a sparse network. */
+void destroy_sparse_network(SparseNetwork *snet)
+{
+	if (snet == NULL) {
+		return;
+	}
+	int i;
+	for (i = 0; i < snet->n_layers - 1; i++) {
+		free_sparse_matrix(snet->weights[i]);
+		free_matrix(snet->biases[i]);
+	}
+	free(snet->weights);
+	free(snet->biases);
+	free(snet->sizes);
+	free(snet);
+}
+
+/* Like feedforward_batch (each column of inputs is an input), with
+ * sparse weights.
+ */
+Matrix *sparse_feedforward_batch(SparseNetwork *snet, Matrix *inputs)
+{
+	Matrix *as = inputs;
+	Matrix *zs;
+	int i;
+	for (i = 0; i < snet->n_layers - 1; i++) {
+		zs = sparse_prod(snet->weights[i], as);
+		matrix_add_columnwise(zs, snet->biases[i]);
+		if (as != inputs) {
+			free_matrix(as);
+		}
+		as = sigmoid_vect(zs);
+		free_matrix(zs);
+	}
+	return as;
+}
+
+/* Like feedforward, with sparse weights. */
+Matrix *sparse_feedforward(SparseNetwork *snet, double *input)
+{
+	Matrix *in = array_to_matrix(input, snet->sizes[0]);
+	Matrix *out = sparse_feedforward_batch(snet, in);
+	free_matrix(in);
+	return out;
+}
+
+/* Like test_accuracy, for a sparse network. */
+double sparse_test_accuracy(SparseNetwork *snet, TrainData *data)
+{
+	int i;
+	double *output;
+	Matrix *out_mat;
+	int n_ok = 0;
+	int s = data->outputs_size;
+	output = malloc(sizeof(double) * s);
+	for (i = 0; i < data->n_test; i++) {
+		out_mat = sparse_feedforward(snet, data->inputs_testing[i]);
+		matrix_to_array(out_mat, output);
+		free_matrix(out_mat);
+		if (argmax(output, s) == argmax(data->labels_testing[i], s)) {
+			n_ok += 1;
+		}
+	}
+	free(output);
+	return ((double)n_ok) / ((double)(data->n_test));
+}
+
+/* Bytes taken by the parameters of a sparse network. */
+long sparse_network_bytes(SparseNetwork *snet)
+{
+	int i;
+	long bytes = 0;
+	for (i = 0; i < snet->n_layers - 1; i++) {
+		bytes += sparse_matrix_bytes(snet->weights[i]);
+		bytes += sizeof(double) * snet->sizes[i+1];
+	}
+	return bytes;
+}
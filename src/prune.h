@@ -0,0 +1,35 @@
+#include <sparse.h>
+#include <neuron.h>
+
+#ifndef PRUNE_H
+#define PRUNE_H
+
+/* Inference-only copy of a (pruned) network with its weights in CSR
+ * format, so zeroed weights cost neither time nor memory. Must be freed
+ * with destroy_sparse_network(the_network);
+ */
+typedef struct {
+	int n_layers;
+	int *sizes;
+	SparseMatrix **weights;
+	MatrixList biases;
+} SparseNetwork;
+
+double prune_network(Network *net, double threshold, double sparsity,
+					 double *mask);
+
+double network_sparsity(Network *net);
+
+SparseNetwork *sparsify_network(Network *net);
+
+void destroy_sparse_network(SparseNetwork *snet);
+
+Matrix *sparse_feedforward(SparseNetwork *snet, double *input);
+
+Matrix *sparse_feedforward_batch(SparseNetwork *snet, Matrix *inputs);
+
+double sparse_test_accuracy(SparseNetwork *snet, TrainData *data);
+
+long sparse_network_bytes(SparseNetwork *snet);
+
+#endif // PRUNE_H
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <utils.h>
+#include <matrix.h>
+#include <int8.h>
+#include <quantize.h>
+
+/*
+ * Post-training int8 quantization of a Network, and the int8 inference
+ * path that runs it.
+ */
+
+/* Samples run through the int8 kernels at once by the batched path. */
+#define QUANTIZED_BATCH 64
+
+/* Allocate a QuantizedNetwork with room for the given layers. */
+static QuantizedNetwork *alloc_quantized_network(int n_layers, int *sizes)
+{
+	int l;
+	QuantizedNetwork *q = malloc(sizeof(QuantizedNetwork));
+	q->n_layers = n_layers;
+	q->sizes = malloc(sizeof(int) * n_layers);
+	q->strides = malloc(sizeof(int) * n_layers);
+	q->weights = malloc(sizeof(int8_t *) * (n_layers - 1));
+	q->w_scales = malloc(sizeof(float *) * (n_layers - 1));
+	q->biases = malloc(sizeof(float *) * (n_layers - 1));
+	q->a_scales = malloc(sizeof(float) * n_layers);
+	arrncpy(q->sizes, sizes, n_layers);
+	for (l = 0; l < n_layers; l++) {
+		q->strides[l] = int8_stride(sizes[l]);
+	}
+	for (l = 0; l < n_layers - 1; l++) {
+		q->weights[l] = int8_alloc((long)sizes[l+1] * q->strides[l]);
+		q->w_scales[l] = malloc(sizeof(float) * sizes[l+1]);
+		q->biases[l] = malloc(sizeof(float) * sizes[l+1]);
+	}
+	return q;
+}
+
+/* Free the memory allocated for a QuantizedNetwork. */
+void destroy_quantized_network(QuantizedNetwork *q)
+{
+	if (q == NULL) {
+		return;
+	}
+	int l;
+	for (l = 0; l < q->n_layers - 1; l++) {
+		free(q->weights[l]);
+		free(q->w_scales[l]);
+		free(q->biases[l]);
+	}
+	free(q->weights);
+	free(q->w_scales);
+	free(q->biases);
+	free(q->a_scales);
+	free(q->strides);
+	free(q->sizes);
+	free(q);
+}
+
+/* Largest activation of every layer (the input being layer 0) over the
+ * first n_calib training samples of calib.
+ */
+static void calibrate(Network *net, TrainData *calib, int n_calib,
+					  double *max_act)
+{
+	int i, l, r;
+	double v, min_input = 0.0;
+	Matrix *as, *zs;
+	for (l = 0; l < net->n_layers; l++) {
+		max_act[l] = 0.0;
+	}
+	for (i = 0; i < n_calib; i++) {
+		as = array_to_matrix(calib->inputs_training[i], net->sizes[0]);
+		for (l = 0; l < net->n_layers; l++) {
+			if (l > 0) {
+				zs = matrix_prod_optim(net->weights[l-1], as);
+				matrix_add(zs, net->biases[l-1]);
+				free_matrix(as);
+				as = sigmoid_vect(zs);
+				free_matrix(zs);
+			}
+			for (r = 0; r < as->n_rows; r++) {
+				v = as->data[r][0];
+				if (v > max_act[l]) {
+					max_act[l] = v;
+				}
+				if (l == 0 && v < min_input) {
+					min_input = v;
+				}
+			}
+		}
+		free_matrix(as);
+	}
+	if (min_input < 0) {
+		fprintf(stderr, "quantize_network WARNING: negative inputs (down "
+				"to %f) are clamped to 0 by the int8 path.\n", min_input);
+	}
+}
+
+/* Quantize a trained network to int8. The activation scales are
+ * calibrated on the first n_calib training samples of calib (use
+ * subset_training_data to calibrate on another slice).
+ */
+QuantizedNetwork *quantize_network(Network *net, TrainData *calib,
+								   int n_calib)
+{
+	int l, r, c;
+	double max_w, v;
+	double max_act[net->n_layers];
+	QuantizedNetwork *q = alloc_quantized_network(net->n_layers, net->sizes);
+	Matrix *w;
+
+	if (n_calib > calib->n_train) {
+		n_calib = calib->n_train;
+	}
+	calibrate(net, calib, n_calib, max_act);
+	for (l = 0; l < net->n_layers; l++) {
+		q->a_scales[l] = (max_act[l] > 0 ? max_act[l] : 1.0) /
+						 INT8_MAX_ACTIVATION;
+	}
+	for (l = 0; l < net->n_layers - 1; l++) {
+		w = net->weights[l];
+		for (r = 0; r < w->n_rows; r++) {
+			max_w = 0.0;
+			for (c = 0; c < w->n_cols; c++) {
+				v = fabs(w->data[r][c]);
+				if (v > max_w) {
+					max_w = v;
+				}
+			}
+			q->w_scales[l][r] = (max_w > 0 ? max_w : 1.0) / 127;
+			for (c = 0; c < w->n_cols; c++) {
+				q->weights[l][(long)r * q->strides[l] + c] =
+					(int8_t)lrint(w->data[r][c] / q->w_scales[l][r]);
+			}
+			q->biases[l][r] = net->biases[l]->data[r][0];
+		}
+	}
+	return q;
+}
+
+/* Quantize n activations with the given scale, clamping to the 7-bit
+ * range of the int8 kernels.
+ */
+static void quantize_activations(double *a, int n, float scale, uint8_t *q)
+{
+	int i;
+	long v;
+	for (i = 0; i < n; i++) {
+		v = lrint(a[i] / scale);
+		q[i] = v < 0 ? 0 : (v > INT8_MAX_ACTIVATION ? INT8_MAX_ACTIVATION : v);
+	}
+}
+
+/* Run n (at most QUANTIZED_BATCH) inputs through the network. x and
+ * next_x are workspaces of n * max stride bytes, acc of n * max size
+ * int32.
+ */
+static void feedforward_chunk(QuantizedNetwork *q, double **inputs, int n,
+							  double **outputs, uint8_t *x, uint8_t *next_x,
+							  int32_t *acc)
+{
+	int i, l, r, rows, last;
+	long v;
+	float in_scale, out_scale, z, a;
+	uint8_t *tmp;
+
+	memset(x, 0, (long)n * q->strides[0]);
+	for (i = 0; i < n; i++) {
+		quantize_activations(inputs[i], q->sizes[0], q->a_scales[0],
+							 x + (long)i * q->strides[0]);
+	}
+	for (l = 0; l < q->n_layers - 1; l++) {
+		rows = q->sizes[l+1];
+		last = (l == q->n_layers - 2);
+		in_scale = q->a_scales[l];
+		out_scale = q->a_scales[l+1];
+		int8_gemm(q->weights[l], rows, q->strides[l], x, n, acc);
+		if (!last) {
+			memset(next_x, 0, (long)n * q->strides[l+1]);
+		}
+		/* Dequantize, add the bias, apply the sigmoid and requantize for
+		 * the next layer in one pass. */
+		for (i = 0; i < n; i++) {
+			for (r = 0; r < rows; r++) {
+				z = acc[(long)i * rows + r] * (q->w_scales[l][r] * in_scale) +
+					q->biases[l][r];
+				a = 1.0f / (1.0f + expf(-z));
+				if (last) {
+					outputs[i][r] = a;
+				} else {
+					v = lrintf(a / out_scale);
+					next_x[(long)i * q->strides[l+1] + r] =
+						v > INT8_MAX_ACTIVATION ? INT8_MAX_ACTIVATION : v;
+				}
+			}
+		}
+		tmp = x;
+		x = next_x;
+		next_x = tmp;
+	}
+}
+
+/* Batched int8 inference: outputs[i] (arrays of sizes[n_layers-1]
+ * doubles) gets the output of the network for inputs[i].
+ */
+void quantized_feedforward_batch(QuantizedNetwork *q, double **inputs,
+								 int n, double **outputs)
+{
+	int l, start, chunk;
+	int max_stride = 0, max_size = 0;
+	uint8_t *x, *next_x;
+	int32_t *acc;
+	for (l = 0; l < q->n_layers; l++) {
+		max_stride = q->strides[l] > max_stride ? q->strides[l] : max_stride;
+		max_size = q->sizes[l] > max_size ? q->sizes[l] : max_size;
+	}
+	chunk = n < QUANTIZED_BATCH ? n : QUANTIZED_BATCH;
+	x = int8_alloc((long)chunk * max_stride);
+	next_x = int8_alloc((long)chunk * max_stride);
+	acc = malloc(sizeof(int32_t) * chunk * max_size);
+	for (start = 0; start < n; start += chunk) {
+		if (n - start < chunk) {
+			chunk = n - start;
+		}
+		feedforward_chunk(q, inputs + start, chunk, outputs + start,
+						  x, next_x, acc);
+	}
+	free(x);
+	free(next_x);
+	free(acc);
+}
+
+/* Int8 inference of a single input; output gets sizes[n_layers-1]
+ * doubles.
+ */
+void quantized_feedforward(QuantizedNetwork *q, double *input,
+						   double *output)
+{
+	quantized_feedforward_batch(q, &input, 1, &output);
+}
+
+/* Like test_accuracy, for a quantized network. */
+double quantized_test_accuracy(QuantizedNetwork *q, TrainData *data)
+{
+	int i, n_ok = 0;
+	int s = q->sizes[q->n_layers - 1];
+	double **outputs = malloc(sizeof(double *) * data->n_test);
+	for (i = 0; i < data->n_test; i++) {
+		outputs[i] = malloc(sizeof(double) * s);
+	}
+	quantized_feedforward_batch(q, data->inputs_testing, data->n_test,
+								outputs);
+	for (i = 0; i < data->n_test; i++) {
+		if (argmax(outputs[i], s) == argmax(data->labels_testing[i], s)) {
+			n_ok += 1;
+		}
+		free(outputs[i]);
+	}
+	free(outputs);
+	return ((double)n_ok) / ((double)(data->n_test));
+}
+
+/* Bytes taken by the parameters of a quantized network (weights
+ * without the row padding, plus scales and biases).
+ */
+long quantized_network_bytes(QuantizedNetwork *q)
+{
+	int l;
+	long bytes = sizeof(float) * q->n_layers;
+	for (l = 0; l < q->n_layers - 1; l++) {
+		bytes += (long)q->sizes[l+1] * q->sizes[l];
+		bytes += 2 * sizeof(float) * q->sizes[l+1];
+	}
+	return bytes;
+}
+
+/* Save a quantized network: a "GLQ8" magic, the number of layers, their
+ * sizes and activation scales, then for every layer its weight scales,
+ * biases and (unpadded) int8 weights. Returns 1 on success, 0 on error.
+ */
+int save_quantized_network(QuantizedNetwork *q, char *path)
+{
+	int32_t n_layers = q->n_layers, size;
+	int l, r, ok;
+	FILE *stream = fopen(path, "wb");
+	if (!stream) {
+		fprintf(stderr, "Could not write file %s.\n", path);
+		return 0;
+	}
+	ok = fwrite(QUANTIZED_FILE_MAGIC, 4, 1, stream) == 1;
+	ok = ok && fwrite(&n_layers, 4, 1, stream) == 1;
+	for (l = 0; l < n_layers; l++) {
+		size = q->sizes[l];
+		ok = ok && fwrite(&size, 4, 1, stream) == 1;
+	}
+	ok = ok && fwrite(q->a_scales, sizeof(float), n_layers, stream) ==
+			   (size_t)n_layers;
+	for (l = 0; ok && l < n_layers - 1; l++) {
+		ok = fwrite(q->w_scales[l], sizeof(float), q->sizes[l+1], stream) ==
+			 (size_t)q->sizes[l+1];
+		ok = ok && fwrite(q->biases[l], sizeof(float), q->sizes[l+1],
+						  stream) == (size_t)q->sizes[l+1];
+		for (r = 0; ok && r < q->sizes[l+1]; r++) {
+			ok = fwrite(q->weights[l] + (long)r * q->strides[l], 1,
+						q->sizes[l], stream) == (size_t)q->sizes[l];
+		}
+	}
+	ok = (fclose(stream) == 0) && ok;
+	if (!ok) {
+		fprintf(stderr, "Error writing file %s.\n", path);
+	}
+	return ok;
+}
+
+/* Load a network saved with save_quantized_network. Returns NULL on
+ * error.
+ */
+QuantizedNetwork *load_quantized_network(char *path)
+{
+	char magic[4];
+	int32_t n_layers;
+	int l, r, ok;
+	QuantizedNetwork *q = NULL;
+	FILE *stream = fopen(path, "rb");
+	if (!stream) {
+		fprintf(stderr, "Could not load file %s.\n", path);
+		return NULL;
+	}
+	ok = fread(magic, 4, 1, stream) == 1 &&
+		 memcmp(magic, QUANTIZED_FILE_MAGIC, 4) == 0 &&
+		 fread(&n_layers, 4, 1, stream) == 1 &&
+		 n_layers >= 2 && n_layers <= 255;
+	if (ok) {
+		int32_t sizes[n_layers];
+		ok = fread(sizes, 4, n_layers, stream) == (size_t)n_layers;
+		for (l = 0; ok && l < n_layers; l++) {
+			ok = sizes[l] > 0;
+		}
+		if (ok) {
+			q = alloc_quantized_network(n_layers, sizes);
+			ok = fread(q->a_scales, sizeof(float), n_layers, stream) ==
+				 (size_t)n_layers;
+		}
+		for (l = 0; ok && l < n_layers - 1; l++) {
+			ok = fread(q->w_scales[l], sizeof(float), sizes[l+1], stream) ==
+				 (size_t)sizes[l+1];
+			ok = ok && fread(q->biases[l], sizeof(float), sizes[l+1],
+							 stream) == (size_t)sizes[l+1];
+			for (r = 0; ok && r < sizes[l+1]; r++) {
+				ok = fread(q->weights[l] + (long)r * q->strides[l], 1,
+						   sizes[l], stream) == (size_t)sizes[l];
+			}
+		}
+	}
+	fclose(stream);
+	if (!ok) {
+		fprintf(stderr, "%s is not a valid quantized network file.\n", path);
+		destroy_quantized_network(q);
+		return NULL;
+	}
+	return q;
+}
@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <neuron.h>
+
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#define QUANTIZED_FILE_MAGIC "GLQ8"
+
+/* Int8 version of a trained network, for inference only. Must be freed
+ * with destroy_quantized_network(the_network);
+ *
+ * Weights are quantized symmetrically to int8 with one scale per output
+ * neuron. Activations (the inputs of every layer) are quantized to
+ * [0, INT8_MAX_ACTIVATION] with one scale per layer, calibrated on
+ * training data; inputs are assumed non-negative, which holds for the
+ * sigmoid activations and for normalized pixels. Products are
+ * accumulated in int32, then rescaled to float, biased and passed
+ * through the sigmoid.
+ */
+typedef struct {
+	int n_layers;
+	int *sizes;
+	/* row length of the weights of each layer: sizes[l] padded */
+	int *strides;
+	/* weights[l]: sizes[l+1] rows of strides[l] int8 */
+	int8_t **weights;
+	/* real weight = weights[l][r][c] * w_scales[l][r] */
+	float **w_scales;
+	float **biases;
+	/* real input of layer l = quantized input * a_scales[l] */
+	float *a_scales;
+} QuantizedNetwork;
+
+QuantizedNetwork *quantize_network(Network *net, TrainData *calib,
+								   int n_calib);
+
+void destroy_quantized_network(QuantizedNetwork *q);
+
+void quantized_feedforward(QuantizedNetwork *q, double *input,
+						   double *output);
+
+void quantized_feedforward_batch(QuantizedNetwork *q, double **inputs,
+								 int n, double **outputs);
+
+double quantized_test_accuracy(QuantizedNetwork *q, TrainData *data);
+
+long quantized_network_bytes(QuantizedNetwork *q);
+
+int save_quantized_network(QuantizedNetwork *q, char *path);
+
+QuantizedNetwork *load_quantized_network(char *path);
+
+#endif // QUANTIZE_H
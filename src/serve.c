@@ -0,0 +1,527 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <serve.h>
+#include <numa.h>
+
+struct ServeConnection {
+	int fd;
+	/* the lane running its requests */
+	ServeLane *lane;
+	/* the reader and the requests not answered yet */
+	atomic_int refs;
+	/* set once a reply could not be sent: the others are not */
+	atomic_int dropped;
+	ServeConnection *next;
+};
+
+struct ServeRequest {
+	ServeConnection *conn;
+	long arrival_ns;
+	ServeRequest *next;
+	/* inputs_size doubles */
+	double input[];
+};
+
+typedef struct {
+	Server *server;
+	ServeConnection *conn;
+} ReaderArgs;
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Read or write exactly n bytes; returns 0 on error or end of file. */
+static int read_full(int fd, void *buf, long n)
+{
+	long r;
+	char *p = buf;
+	while (n > 0) {
+		r = read(fd, p, n);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return 0;
+		}
+		p += r;
+		n -= r;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const void *buf, long n)
+{
+	long r;
+	const char *p = buf;
+	while (n > 0) {
+		/* no SIGPIPE when the peer went away */
+		r = send(fd, p, n, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return 0;
+		}
+		p += r;
+		n -= r;
+	}
+	return 1;
+}
+
+/* Stop serving a connection whose client does not read its replies (or
+ * went away): its reader sees end of file, and its remaining replies are
+ * not sent. */
+static void drop_connection(ServeConnection *conn)
+{
+	if (!atomic_exchange(&conn->dropped, 1)) {
+		shutdown(conn->fd, SHUT_RDWR);
+	}
+}
+
+static void release_connection(ServeConnection *conn)
+{
+	if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+		close(conn->fd);
+		free(conn);
+	}
+}
+
+/* Queue the requests read from one connection, until it is closed. */
+static void *reader_main(void *arg)
+{
+	ReaderArgs *a = arg;
+	Server *s = a->server;
+	ServeConnection *conn = a->conn, **p;
+	ServeLane *lane = conn->lane;
+	int n = s->net->sizes[0];
+	int32_t sizes[2] = {n, s->net->sizes[s->net->n_layers - 1]};
+	ServeRequest *req = NULL;
+	free(a);
+
+	if (write_full(conn->fd, sizes, sizeof(sizes))) {
+		for (;;) {
+			req = malloc(sizeof(ServeRequest) + sizeof(double) * n);
+			if (!read_full(conn->fd, req->input, sizeof(double) * n)) {
+				break;
+			}
+			req->arrival_ns = now_ns();
+			req->conn = conn;
+			req->next = NULL;
+			atomic_fetch_add(&conn->refs, 1);
+			pthread_mutex_lock(&s->lock);
+			while (lane->n_queued >= SERVE_MAX_QUEUED && !s->stop) {
+				pthread_cond_wait(&s->space, &s->lock);
+			}
+			if (lane->tail != NULL) {
+				lane->tail->next = req;
+			} else {
+				lane->head = req;
+			}
+			lane->tail = req;
+			lane->n_queued++;
+			/* The batcher only needs waking up for the first request of a
+			 * batch and when one is full */
+			if (lane->n_queued == 1 || lane->n_queued >= s->opts.max_batch) {
+				pthread_cond_signal(&lane->queued);
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+		free(req);
+	}
+
+	pthread_mutex_lock(&s->lock);
+	for (p = &s->connections; *p != NULL; p = &(*p)->next) {
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	}
+	s->n_readers--;
+	pthread_cond_broadcast(&s->closed);
+	pthread_mutex_unlock(&s->lock);
+	release_connection(conn);
+	return NULL;
+}
+
+static void *acceptor_main(void *arg)
+{
+	Server *s = arg;
+	int fd;
+	pthread_t thread;
+	ServeConnection *conn;
+	ReaderArgs *a;
+	struct timeval timeout = {s->opts.send_timeout_ms / 1000,
+							  s->opts.send_timeout_ms % 1000 * 1000};
+	for (;;) {
+		fd = accept(s->listen_fd, NULL, NULL);
+		if (fd < 0 && errno == EINTR) {
+			continue;
+		}
+		if (fd < 0) {
+			/* destroy_server shut the socket down */
+			break;
+		}
+		/* The batcher gives up on a reply after the timeout */
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		conn = malloc(sizeof(ServeConnection));
+		conn->fd = fd;
+		atomic_init(&conn->refs, 1);
+		atomic_init(&conn->dropped, 0);
+		a = malloc(sizeof(ReaderArgs));
+		a->server = s;
+		a->conn = conn;
+		pthread_mutex_lock(&s->lock);
+		conn->lane = &s->lanes[s->n_accepted++ % s->n_lanes];
+		if (s->stop || pthread_create(&thread, NULL, reader_main, a) != 0) {
+			pthread_mutex_unlock(&s->lock);
+			close(fd);
+			free(conn);
+			free(a);
+			continue;
+		}
+		pthread_detach(thread);
+		conn->next = s->connections;
+		s->connections = conn;
+		s->n_readers++;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+}
+
+/* Run a batch of n requests of a lane and send the replies. */
+static void run_batch(ServeLane *lane, ServeRequest **batch, int n)
+{
+	int i, j;
+	Server *s = lane->server;
+	int n_in = s->net->sizes[0];
+	int n_out = s->net->sizes[s->net->n_layers - 1];
+	long t0, t1, done;
+	double *reply = malloc(sizeof(double) * n_out);
+	Matrix *inputs = create_matrix(n_in, n), *outputs;
+	Network *net = lane->net;
+	/* One input per column */
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < n_in; i++) {
+			inputs->data[i][j] = batch[j]->input[i];
+		}
+	}
+	t0 = now_ns();
+	if (lane->reader != NULL) {
+		net = online_read_begin(s->opts.online, lane->reader);
+	}
+	outputs = feedforward_batch(net, inputs);
+	if (lane->reader != NULL) {
+		online_read_end(lane->reader);
+	}
+	t1 = now_ns();
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < n_out; i++) {
+			reply[i] = outputs->data[i][j];
+		}
+		/* A client that went away or does not read its replies only
+		 * loses its own */
+		if (!atomic_load(&batch[j]->conn->dropped) &&
+			!write_full(batch[j]->conn->fd, reply, sizeof(double) * n_out)) {
+			drop_connection(batch[j]->conn);
+		}
+	}
+	done = now_ns();
+
+	pthread_mutex_lock(&s->lock);
+	for (j = 0; j < n; j++) {
+		latency_record(&s->stats.latency,
+					   (done - batch[j]->arrival_ns) / 1e3);
+	}
+	s->stats.n_requests += n;
+	s->stats.n_batches++;
+	s->stats.busy_s += (t1 - t0) / 1e9;
+	if (n > s->stats.max_batch) {
+		s->stats.max_batch = n;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	for (j = 0; j < n; j++) {
+		release_connection(batch[j]->conn);
+		free(batch[j]);
+	}
+	free_matrix(inputs);
+	free_matrix(outputs);
+	free(reply);
+}
+
+/* Take batches off the queue of a lane: wait for a first request, then
+ * for the batch to fill up or the first request's deadline, whichever
+ * comes first. Runs until the server stops and the queue is empty.
+ */
+static void *batcher_main(void *arg)
+{
+	ServeLane *lane = arg;
+	Server *s = lane->server;
+	int n;
+	long deadline;
+	struct timespec ts;
+	ServeRequest **batch = malloc(sizeof(ServeRequest *) * s->opts.max_batch);
+	if (lane->node >= 0) {
+		numa_pin_node(lane->node);
+	}
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (lane->head == NULL && !s->stop) {
+			pthread_cond_wait(&lane->queued, &s->lock);
+		}
+		if (lane->head == NULL) {
+			break;
+		}
+		deadline = lane->head->arrival_ns + s->opts.max_wait_us * 1000;
+		ts.tv_sec = deadline / 1000000000L;
+		ts.tv_nsec = deadline % 1000000000L;
+		while (lane->n_queued < s->opts.max_batch && !s->stop) {
+			if (pthread_cond_timedwait(&lane->queued, &s->lock, &ts) ==
+				ETIMEDOUT) {
+				break;
+			}
+		}
+		for (n = 0; n < s->opts.max_batch && lane->head != NULL; n++) {
+			batch[n] = lane->head;
+			lane->head = lane->head->next;
+		}
+		if (lane->head == NULL) {
+			lane->tail = NULL;
+		}
+		lane->n_queued -= n;
+		pthread_cond_broadcast(&s->space);
+		pthread_mutex_unlock(&s->lock);
+		run_batch(lane, batch, n);
+		pthread_mutex_lock(&s->lock);
+	}
+	pthread_mutex_unlock(&s->lock);
+	free(batch);
+	return NULL;
+}
+
+/* Serve net on a Unix socket at 'path' (replaced if it exists), with the
+ * batching of opts (NULL for the defaults), from background threads.
+ * net must not be modified until destroy_server. Returns NULL on error.
+ */
+Server *create_server(Network *net, char *path, ServeOptions *opts)
+{
+	int i;
+	ServeLane *lane;
+	struct sockaddr_un addr;
+	pthread_condattr_t attr;
+	Server *s;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "create_server ERROR: socket path too long: %s\n",
+				path);
+		return NULL;
+	}
+	s = calloc(1, sizeof(Server));
+	s->net = net;
+	s->opts.max_batch = opts != NULL && opts->max_batch > 0 ?
+		opts->max_batch : SERVE_MAX_BATCH;
+	s->opts.max_wait_us = opts != NULL && opts->max_wait_us >= 0 ?
+		opts->max_wait_us : SERVE_MAX_WAIT_US;
+	s->opts.online = opts != NULL ? opts->online : NULL;
+	s->opts.replicate = opts != NULL && opts->replicate &&
+		s->opts.online == NULL;
+	s->opts.send_timeout_ms = opts != NULL && opts->send_timeout_ms > 0 ?
+		opts->send_timeout_ms : SERVE_SEND_TIMEOUT_MS;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	s->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s->listen_fd < 0 ||
+		bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(s->listen_fd, 128) < 0) {
+		fprintf(stderr, "create_server ERROR: cannot listen on %s: %s\n",
+				path, strerror(errno));
+		if (s->listen_fd >= 0) {
+			close(s->listen_fd);
+		}
+		free(s);
+		return NULL;
+	}
+	s->path = strdup(path);
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->space, NULL);
+	pthread_cond_init(&s->closed, NULL);
+	s->stats_start_ns = now_ns();
+	if (s->opts.replicate) {
+		s->replicas = create_network_replicas(net, 0);
+	}
+	s->n_lanes = s->replicas != NULL ? s->replicas->n_replicas : 1;
+	s->lanes = calloc(s->n_lanes, sizeof(ServeLane));
+	/* Batch deadlines are on the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	for (i = 0; i < s->n_lanes; i++) {
+		lane = &s->lanes[i];
+		lane->server = s;
+		lane->net = s->replicas != NULL ? s->replicas->nets[i] : net;
+		lane->node = s->replicas != NULL ? i % numa_node_count() : -1;
+		lane->reader = s->opts.online != NULL ?
+			online_reader(s->opts.online) : NULL;
+		pthread_cond_init(&lane->queued, &attr);
+		pthread_create(&lane->batcher, NULL, batcher_main, lane);
+	}
+	pthread_condattr_destroy(&attr);
+	pthread_create(&s->acceptor, NULL, acceptor_main, s);
+	return s;
+}
+
+/* Stop serving: shut the connections down, run the requests already
+ * queued (their replies are not sent) and free the server (not its
+ * network).
+ */
+void destroy_server(Server *s)
+{
+	int i;
+	ServeConnection *conn;
+	if (s == NULL) {
+		return;
+	}
+	shutdown(s->listen_fd, SHUT_RDWR);
+	pthread_join(s->acceptor, NULL);
+	pthread_mutex_lock(&s->lock);
+	/* The readers see end of file and exit; the batchers' sends fail at
+	 * once rather than blocking on clients that do not read */
+	for (conn = s->connections; conn != NULL; conn = conn->next) {
+		drop_connection(conn);
+	}
+	while (s->n_readers > 0) {
+		pthread_cond_wait(&s->closed, &s->lock);
+	}
+	s->stop = 1;
+	for (i = 0; i < s->n_lanes; i++) {
+		pthread_cond_signal(&s->lanes[i].queued);
+	}
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < s->n_lanes; i++) {
+		pthread_join(s->lanes[i].batcher, NULL);
+		pthread_cond_destroy(&s->lanes[i].queued);
+		online_reader_release(s->lanes[i].reader);
+	}
+	close(s->listen_fd);
+	unlink(s->path);
+	free(s->lanes);
+	destroy_network_replicas(s->replicas);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->space);
+	pthread_cond_destroy(&s->closed);
+	free(s->path);
+	free(s);
+}
+
+/* Copy the stats of the server to 'stats', and start new ones if
+ * reset != 0.
+ */
+void server_stats(Server *s, ServeStats *stats, int reset)
+{
+	long now;
+	pthread_mutex_lock(&s->lock);
+	now = now_ns();
+	*stats = s->stats;
+	stats->elapsed_s = (now - s->stats_start_ns) / 1e9;
+	if (reset) {
+		memset(&s->stats, 0, sizeof(ServeStats));
+		s->stats_start_ns = now;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Connect to the server at 'path' and get the sizes of its network's
+ * inputs and outputs. Returns the socket, or -1 on error.
+ */
+int serve_connect(char *path, int *inputs_size, int *outputs_size)
+{
+	int fd;
+	int32_t sizes[2];
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		!read_full(fd, sizes, sizeof(sizes))) {
+		fprintf(stderr, "serve_connect ERROR: cannot connect to %s: %s\n",
+				path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	*inputs_size = sizes[0];
+	*outputs_size = sizes[1];
+	return fd;
+}
+
+/* Send one request; returns 0 on error. */
+int serve_send(int fd, double *input, int inputs_size)
+{
+	return write_full(fd, input, sizeof(double) * inputs_size);
+}
+
+/* Receive the reply to the oldest request not answered yet; returns 0 on
+ * error.
+ */
+int serve_recv(int fd, double *output, int outputs_size)
+{
+	return read_full(fd, output, sizeof(double) * outputs_size);
+}
+
+void latency_record(LatencyHistogram *h, double us)
+{
+	int i = us > 1 ? (int)(LATENCY_BUCKETS_PER_OCTAVE * log2(us)) : 0;
+	h->buckets[i < LATENCY_BUCKETS ? i : LATENCY_BUCKETS - 1]++;
+	h->count++;
+	h->sum_us += us;
+	if (us > h->max_us) {
+		h->max_us = us;
+	}
+}
+
+void latency_merge(LatencyHistogram *dst, LatencyHistogram *src)
+{
+	int i;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum_us += src->sum_us;
+	if (src->max_us > dst->max_us) {
+		dst->max_us = src->max_us;
+	}
+}
+
+/* Latency below which a fraction p of the recorded ones are, in us: the
+ * upper bound of its bucket (at most 9% above), capped by the maximum.
+ */
+double latency_percentile(LatencyHistogram *h, double p)
+{
+	int i;
+	long seen = 0;
+	double bound;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > 0 && seen >= p * h->count) {
+			bound = exp2((double)(i + 1) / LATENCY_BUCKETS_PER_OCTAVE);
+			return bound < h->max_us ? bound : h->max_us;
+		}
+	}
+	return h->max_us;
+}
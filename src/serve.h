@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <neuron.h>
+#include <online.h>
+
+#ifndef SERVE_H
+#define SERVE_H
+
+/*
+ * Inference server: answers feedforward requests sent over a Unix domain
+ * socket, coalescing the concurrent ones into batches run through
+ * feedforward_batch.
+ *
+ * Protocol (native byte order, the clients run on the same host): on
+ * connection the server sends two int32, the input and output sizes of
+ * its network. Each request is then an input of inputs_size doubles,
+ * answered by the outputs_size doubles of the network's output. A client
+ * may send several requests before reading the replies, which come back
+ * in order.
+ *
+ * With ServeOptions.replicate the batching runs in one lane per NUMA
+ * node: a batcher pinned to the node, with its own queue and its own
+ * replica of the network in the node's memory (see NetworkReplicas).
+ * Each connection is served by one lane, so its replies stay in order.
+ *
+ * With ServeOptions.online the server answers with the latest network
+ * published by an OnlineModel, which keeps learning meanwhile.
+ */
+
+/* Defaults of ServeOptions. */
+#define SERVE_MAX_BATCH 64
+#define SERVE_MAX_WAIT_US 1000
+#define SERVE_SEND_TIMEOUT_MS 1000
+
+/* Requests queued at most: connections stop being read beyond. */
+#define SERVE_MAX_QUEUED 4096
+
+/* Buckets of a LatencyHistogram: LATENCY_BUCKETS_PER_OCTAVE per doubling
+ * from 1 us, up to about half a minute. */
+#define LATENCY_BUCKETS 200
+#define LATENCY_BUCKETS_PER_OCTAVE 8
+
+/* LatencyHistogram struct. Latencies in microseconds, on a log scale. */
+typedef struct {
+	long count;
+	double sum_us;
+	double max_us;
+	long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/* ServeOptions struct. A batch is run as soon as it has max_batch
+ * requests or its oldest request has waited max_wait_us microseconds.
+ * If replicate is nonzero, there is one lane per NUMA node (see above).
+ * If online is not NULL, each batch is run through the network it last
+ * published (and replicate is ignored). A reply that cannot be sent
+ * within send_timeout_ms milliseconds, to a client that does not read
+ * its replies, drops the connection instead of stalling the lane.
+ */
+typedef struct {
+	int max_batch;
+	long max_wait_us;
+	int replicate;
+	OnlineModel *online;
+	long send_timeout_ms;
+} ServeOptions;
+
+/* ServeStats struct. Counters of a Server since it started or since its
+ * stats were last reset.
+ */
+typedef struct {
+	long n_requests;
+	long n_batches;
+	/* largest batch run */
+	int max_batch;
+	/* time spent in feedforward_batch */
+	double busy_s;
+	/* time covered by these stats */
+	double elapsed_s;
+	/* from the arrival of each request to its reply being sent */
+	LatencyHistogram latency;
+} ServeStats;
+
+typedef struct ServeRequest ServeRequest;
+typedef struct ServeConnection ServeConnection;
+typedef struct server Server;
+
+/* ServeLane struct. A queue of requests and the thread running them in
+ * batches through its network.
+ */
+typedef struct {
+	Server *server;
+	Network *net;
+	/* NUMA node the batcher is pinned to, -1 if it is not */
+	int node;
+	/* reader of ServeOptions.online, or NULL */
+	OnlineReader *reader;
+	pthread_t batcher;
+	/* the fields below are protected by the server's lock */
+	/* signaled when requests are queued, or the server stops */
+	pthread_cond_t queued;
+	ServeRequest *head;
+	ServeRequest *tail;
+	int n_queued;
+} ServeLane;
+
+/* Server struct. Serves one network on a socket, with a thread accepting
+ * connections, one reading each connection and one running the batches
+ * of each lane. Must be stopped with destroy_server(the_server);
+ */
+struct server {
+	Network *net;
+	ServeOptions opts;
+	int listen_fd;
+	char *path;
+	pthread_t acceptor;
+	int n_lanes;
+	ServeLane *lanes;
+	/* NULL unless opts.replicate */
+	NetworkReplicas *replicas;
+	/* protects everything below, and the queues of the lanes */
+	pthread_mutex_t lock;
+	/* signaled when space frees up in a queue */
+	pthread_cond_t space;
+	/* signaled when a connection's reader exits */
+	pthread_cond_t closed;
+	/* connections accepted so far, to spread them over the lanes */
+	long n_accepted;
+	/* connections still being read */
+	ServeConnection *connections;
+	int n_readers;
+	int stop;
+	ServeStats stats;
+	long stats_start_ns;
+};
+
+Server *create_server(Network *net, char *path, ServeOptions *opts);
+
+void destroy_server(Server *server);
+
+void server_stats(Server *server, ServeStats *stats, int reset);
+
+int serve_connect(char *path, int *inputs_size, int *outputs_size);
+
+int serve_send(int fd, double *input, int inputs_size);
+
+int serve_recv(int fd, double *output, int outputs_size);
+
+void latency_record(LatencyHistogram *h, double us);
+
+void latency_merge(LatencyHistogram *dst, LatencyHistogram *src);
+
+double latency_percentile(LatencyHistogram *h, double p);
+
+#endif // SERVE_H
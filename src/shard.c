@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <shard.h>
+#include <pool.h>
+#include <numa.h>
+
+/* Compress n codes with ZRLE (see shard.h) into dst, which must hold
+ * n + n / 128 + 1 bytes. Returns the compressed size.
+ */
+static long zrle_encode(const uint8_t *src, long n, uint8_t *dst)
+{
+	long i = 0, o = 0, run, lit;
+	while (i < n) {
+		for (run = 0; i + run < n && run < 128 && src[i + run] == 0; run++)
+			;
+		if (run >= 2) {
+			dst[o++] = 127 + run;
+			i += run;
+			continue;
+		}
+		/* Literals up to the next run of at least 2 zeros */
+		for (lit = 1; i + lit < n && lit < 128 &&
+				 !(src[i + lit] == 0 && i + lit + 1 < n &&
+				   src[i + lit + 1] == 0); lit++)
+			;
+		dst[o++] = lit - 1;
+		memcpy(dst + o, src + i, lit);
+		o += lit;
+		i += lit;
+	}
+	return o;
+}
+
+/* Decode the n_src bytes of a ZRLE stream into the n values it codes,
+ * looked up in table. Returns 0 if the stream is corrupt.
+ */
+static int zrle_decode(const uint8_t *restrict src, long n_src,
+					   const double *restrict table, double *restrict dst,
+					   long n)
+{
+	long i = 0, j, k;
+	const uint8_t *end = src + n_src;
+	double zero = table[0];
+	while (i < n && src < end) {
+		if (*src < 128) {
+			k = *src++ + 1;
+			if (i + k > n || src + k > end) {
+				return 0;
+			}
+			for (j = 0; j < k; j++) {
+				dst[i + j] = table[src[j]];
+			}
+			src += k;
+		} else {
+			k = *src++ - 127;
+			if (i + k > n) {
+				return 0;
+			}
+			for (j = 0; j < k; j++) {
+				dst[i + j] = zero;
+			}
+		}
+		i += k;
+	}
+	return i == n && src == end;
+}
+
+/* Compress n codes with MASK (see shard.h) into dst, which must hold
+ * n + (n + 7) / 8 bytes. Returns the compressed size.
+ */
+static long mask_encode(const uint8_t *src, long n, uint8_t *dst)
+{
+	long i, o = (n + 7) / 8;
+	if (n <= 0) {
+		return 0;
+	}
+	memset(dst, 0, o);
+	for (i = 0; i < n; i++) {
+		if (src[i] != 0) {
+			dst[i / 8] |= 1 << (i % 8);
+			dst[o++] = src[i];
+		}
+	}
+	return o;
+}
+
+/* Decode the n_src bytes of a MASK stream into the n values it codes,
+ * looked up in table. Returns 0 if the stream is corrupt. No branch
+ * depends on the data: a value whose bit is clear looks up code 0.
+ */
+static int mask_decode(const uint8_t *restrict src, long n_src,
+					   const double *restrict table, double *restrict dst,
+					   long n)
+{
+	long g, i, k = 0, n_masks = (n + 7) / 8, n_codes = 0;
+	const uint8_t *codes = src + n_masks;
+	unsigned m, bit;
+	if (n_src < n_masks) {
+		return 0;
+	}
+	for (g = 0; g < n_masks; g++) {
+		n_codes += __builtin_popcount(src[g]);
+	}
+	if (n_codes != n_src - n_masks) {
+		return 0;
+	}
+	/* Whole groups of 8 while 8 codes can be read ahead */
+	for (g = 0; g < n / 8 && k + 8 <= n_codes; g++) {
+		m = src[g];
+		for (i = 0; i < 8; i++) {
+			bit = m >> i & 1;
+			dst[8 * g + i] = table[codes[k] & -bit];
+			k += bit;
+		}
+	}
+	for (i = 8 * g; i < n; i++) {
+		bit = src[i / 8] >> (i % 8) & 1;
+		dst[i] = table[(k < n_codes ? codes[k] : 0) & -bit];
+		k += bit;
+	}
+	return 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Distinct input values, hashed by their bits (with linear probing):
+ * with at most 256 of them in 1024 slots, a lookup takes about one probe.
+ */
+#define LEVEL_SLOTS 1024
+
+typedef struct {
+	uint64_t bits[LEVEL_SLOTS];
+	/* code of the value, -1 for an empty slot */
+	int code[LEVEL_SLOTS];
+} LevelHash;
+
+/* Slot of v: the one holding it, or the empty one where it would go. */
+static int level_slot(LevelHash *h, double v)
+{
+	uint64_t bits;
+	int i;
+	memcpy(&bits, &v, sizeof(bits));
+	i = (bits * 0x9e3779b97f4a7c15ULL) >> 54;
+	while (h->code[i] >= 0 && h->bits[i] != bits) {
+		i = (i + 1) % LEVEL_SLOTS;
+	}
+	h->bits[i] = bits;
+	return i;
+}
+
+/* Fill table with the distinct input values, sorted, and h with their
+ * codes; returns how many there are, or 0 if there are more than 256.
+ */
+static int exact_levels(double **inputs, int n, int inputs_size,
+						double *table, LevelHash *h)
+{
+	int i, j, k, n_levels = 0;
+	for (k = 0; k < LEVEL_SLOTS; k++) {
+		h->code[k] = -1;
+	}
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < inputs_size; j++) {
+			k = level_slot(h, inputs[i][j]);
+			if (h->code[k] < 0) {
+				if (n_levels == 256) {
+					return 0;
+				}
+				h->code[k] = n_levels;
+				table[n_levels++] = inputs[i][j];
+			}
+		}
+	}
+	qsort(table, n_levels, sizeof(double), cmp_double);
+	for (k = 0; k < n_levels; k++) {
+		h->code[level_slot(h, table[k])] = k;
+	}
+	return n_levels;
+}
+
+/* Write zero bytes up to the next multiple of SHARD_ALIGN. */
+static void pad(FILE *f, long *pos)
+{
+	static const char zeros[SHARD_ALIGN];
+	long n = (SHARD_ALIGN - *pos % SHARD_ALIGN) % SHARD_ALIGN;
+	fwrite(zeros, 1, n, f);
+	*pos += n;
+}
+
+/* Write the n samples (inputs, one-hot labels) to a shard file at path,
+ * chunk_size per chunk (SHARD_CHUNK_SIZE if <= 0). If max_error is not
+ * NULL, it gets the largest difference between an input and its stored
+ * value (0 if the table is exact). Returns 1 on success, 0 on error.
+ */
+int shard_write(char *path, double **inputs, double **labels, int n,
+				int inputs_size, int outputs_size, int chunk_size,
+				double *max_error)
+{
+	int c, i, j, k, cls, n_c, n_levels, ok = 1;
+	long size, pos;
+	double v, lo = 0, hi = 0, step = 1, err = 0, table[256] = {0};
+	LevelHash *levels = malloc(sizeof(LevelHash));
+	uint8_t *codes, *packed, *packed2, *classes, *out;
+	ShardHeader h;
+	ShardChunk *index;
+	FILE *f;
+	if (outputs_size > 256) {
+		fprintf(stderr, "shard_write ERROR: more than 256 classes.\n");
+		free(levels);
+		return 0;
+	}
+	chunk_size = chunk_size > 0 ? chunk_size : SHARD_CHUNK_SIZE;
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "shard_write ERROR: cannot open %s: %s\n", path,
+				strerror(errno));
+		free(levels);
+		return 0;
+	}
+
+	n_levels = exact_levels(inputs, n, inputs_size, table, levels);
+	if (n == 0) {
+		n_levels = 1;
+	} else if (n_levels > 0) {
+		for (k = n_levels; k < 256; k++) {
+			table[k] = table[n_levels - 1];
+		}
+	} else {
+		lo = hi = inputs[0][0];
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < inputs_size; j++) {
+				lo = inputs[i][j] < lo ? inputs[i][j] : lo;
+				hi = inputs[i][j] > hi ? inputs[i][j] : hi;
+			}
+		}
+		step = hi > lo ? (hi - lo) / 255 : 1;
+		for (k = 0; k < 256; k++) {
+			table[k] = lo + k * step;
+		}
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SHARD_MAGIC, 4);
+	h.version = SHARD_VERSION;
+	h.n_samples = n;
+	h.inputs_size = inputs_size;
+	h.outputs_size = outputs_size;
+	h.chunk_size = chunk_size;
+	h.n_chunks = (n + chunk_size - 1) / chunk_size;
+	h.exact = n_levels > 0;
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(table, sizeof(double), 256, f);
+	pos = sizeof(h) + sizeof(table);
+
+	size = (long)chunk_size * inputs_size;
+	codes = malloc(size > 0 ? size : 1);
+	packed = malloc(size + size / 128 + 1);
+	packed2 = malloc(size + (size + 7) / 8 + 1);
+	classes = malloc(chunk_size);
+	index = malloc(sizeof(ShardChunk) * (h.n_chunks > 0 ? h.n_chunks : 1));
+	for (c = 0; ok && c < h.n_chunks; c++) {
+		n_c = n - c * chunk_size < chunk_size ? n - c * chunk_size : chunk_size;
+		for (i = 0; i < n_c; i++) {
+			double *x = inputs[c * chunk_size + i];
+			double *y = labels[c * chunk_size + i];
+			for (j = 0; j < inputs_size; j++) {
+				if (h.exact) {
+					k = levels->code[level_slot(levels, x[j])];
+				} else {
+					k = (int)lround((x[j] - lo) / step);
+					v = fabs(table[k] - x[j]);
+					err = v > err ? v : err;
+				}
+				codes[(long)i * inputs_size + j] = k;
+			}
+			for (cls = 0, j = 1; j < outputs_size; j++) {
+				cls = y[j] > y[cls] ? j : cls;
+			}
+			for (j = 0; j < outputs_size; j++) {
+				ok = ok && y[j] == (j == cls);
+			}
+			classes[i] = cls;
+		}
+		if (!ok) {
+			fprintf(stderr, "shard_write ERROR: labels are not one-hot.\n");
+			break;
+		}
+		pad(f, &pos);
+		index[c].offset = pos;
+		/* The smallest of the codecs */
+		size = (long)n_c * inputs_size;
+		index[c].codec = SHARD_CODEC_RAW;
+		out = codes;
+		k = zrle_encode(codes, (long)n_c * inputs_size, packed);
+		if (k < size) {
+			size = k;
+			index[c].codec = SHARD_CODEC_ZRLE;
+			out = packed;
+		}
+		k = mask_encode(codes, (long)n_c * inputs_size, packed2);
+		if (k < size) {
+			size = k;
+			index[c].codec = SHARD_CODEC_MASK;
+			out = packed2;
+		}
+		fwrite(out, 1, size, f);
+		index[c].size = size;
+		fwrite(classes, 1, n_c, f);
+		pos += size + n_c;
+	}
+	if (ok) {
+		pad(f, &pos);
+		h.index_offset = pos;
+		fwrite(index, sizeof(ShardChunk), h.n_chunks, f);
+		fseek(f, 0, SEEK_SET);
+		fwrite(&h, sizeof(h), 1, f);
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "shard_write ERROR: cannot write %s\n", path);
+		ok = 0;
+	}
+	ok = fclose(f) == 0 && ok;
+	if (ok && max_error != NULL) {
+		*max_error = err;
+	}
+	free(codes);
+	free(packed);
+	free(packed2);
+	free(classes);
+	free(levels);
+	free(index);
+	return ok;
+}
+
+/* Read exactly n bytes at offset; returns 0 on error or end of file. */
+static int read_at(int fd, void *buf, long n, long offset)
+{
+	long r;
+	char *p = buf;
+	while (n > 0) {
+		r = pread(fd, p, n, offset);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			return 0;
+		}
+		p += r;
+		n -= r;
+		offset += r;
+	}
+	return 1;
+}
+
+/* Open the shard file at path and read its header and index. Returns
+ * NULL on error.
+ */
+Shard *shard_open(char *path)
+{
+	int c;
+	ShardHeader *h;
+	Shard *s = calloc(1, sizeof(Shard));
+	h = &s->header;
+	s->fd = open(path, O_RDONLY);
+	if (s->fd < 0) {
+		fprintf(stderr, "shard_open ERROR: cannot open %s: %s\n", path,
+				strerror(errno));
+		free(s);
+		return NULL;
+	}
+	if (!read_at(s->fd, h, sizeof(*h), 0) ||
+		memcmp(h->magic, SHARD_MAGIC, 4) != 0 ||
+		h->version != SHARD_VERSION || h->n_samples < 0 ||
+		h->inputs_size <= 0 || h->outputs_size <= 0 ||
+		h->outputs_size > 256 || h->chunk_size <= 0 ||
+		h->n_chunks != (h->n_samples + h->chunk_size - 1) / h->chunk_size ||
+		!read_at(s->fd, s->table, sizeof(s->table), sizeof(*h))) {
+		fprintf(stderr, "shard_open ERROR: %s is not a valid shard.\n",
+				path);
+		shard_close(s);
+		return NULL;
+	}
+	s->index = malloc(sizeof(ShardChunk) *
+					  (h->n_chunks > 0 ? h->n_chunks : 1));
+	if (!read_at(s->fd, s->index, sizeof(ShardChunk) * h->n_chunks,
+				 h->index_offset)) {
+		fprintf(stderr, "shard_open ERROR: cannot read the index of %s.\n",
+				path);
+		shard_close(s);
+		return NULL;
+	}
+	for (c = 0; c < h->n_chunks; c++) {
+		if (s->index[c].size < 0 || s->index[c].offset < 0 ||
+			s->index[c].codec < SHARD_CODEC_RAW ||
+			s->index[c].codec > SHARD_CODEC_MASK) {
+			fprintf(stderr, "shard_open ERROR: bad chunk %d in %s.\n", c,
+					path);
+			shard_close(s);
+			return NULL;
+		}
+	}
+	return s;
+}
+
+void shard_close(Shard *s)
+{
+	if (s == NULL) {
+		return;
+	}
+	if (s->fd >= 0) {
+		close(s->fd);
+	}
+	free(s->index);
+	free(s);
+}
+
+/* Decode chunk 'chunk' of s: the inputs of its samples, one after the
+ * other, to 'inputs', and their one-hot labels to 'labels'. Thread-safe.
+ * Returns 1 on success, 0 on error.
+ */
+int shard_read_chunk(Shard *s, int chunk, double *inputs, double *labels)
+{
+	int i, ok;
+	ShardHeader *h = &s->header;
+	ShardChunk *c;
+	long j, n_values;
+	int n_c;
+	uint8_t *buf, *classes;
+	if (chunk < 0 || chunk >= h->n_chunks) {
+		return 0;
+	}
+	c = &s->index[chunk];
+	n_c = h->n_samples - chunk * h->chunk_size < h->chunk_size ?
+		h->n_samples - chunk * h->chunk_size : h->chunk_size;
+	n_values = (long)n_c * h->inputs_size;
+	buf = malloc(c->size + n_c);
+	ok = read_at(s->fd, buf, c->size + n_c, c->offset);
+	if (ok && c->codec == SHARD_CODEC_ZRLE) {
+		ok = zrle_decode(buf, c->size, s->table, inputs, n_values);
+	} else if (ok && c->codec == SHARD_CODEC_MASK) {
+		ok = mask_decode(buf, c->size, s->table, inputs, n_values);
+	} else if (ok) {
+		ok = c->size == n_values;
+		for (j = 0; ok && j < n_values; j++) {
+			inputs[j] = s->table[buf[j]];
+		}
+	}
+	classes = buf + c->size;
+	memset(labels, 0, sizeof(double) * n_c * h->outputs_size);
+	for (i = 0; ok && i < n_c; i++) {
+		ok = classes[i] < h->outputs_size;
+		if (ok) {
+			labels[(long)i * h->outputs_size + classes[i]] = 1.0;
+		}
+	}
+	free(buf);
+	if (!ok) {
+		fprintf(stderr, "shard_read_chunk ERROR: chunk %d is corrupt.\n",
+				chunk);
+	}
+	return ok;
+}
+
+/* Decoding of the shards of a data set, by chunks. */
+typedef struct {
+	Shard *shards[2];
+	double *inputs[2];
+	double *labels[2];
+	atomic_int failed;
+} LoadArgs;
+
+/* Chunks [begin, end) of the training shard followed by the testing one. */
+static void load_chunks(void *arg, long begin, long end)
+{
+	LoadArgs *a = arg;
+	Shard *s;
+	int k, chunk, n_first = a->shards[0]->header.n_chunks;
+	long c, first;
+	for (c = begin; c < end; c++) {
+		k = c >= n_first;
+		s = a->shards[k];
+		chunk = c - k * n_first;
+		first = (long)chunk * s->header.chunk_size;
+		if (!shard_read_chunk(s, chunk,
+							  a->inputs[k] + first * s->header.inputs_size,
+							  a->labels[k] + first * s->header.outputs_size)) {
+			atomic_store(&a->failed, 1);
+		}
+	}
+}
+
+/* Load a data set from the shard of its training samples and that of its
+ * testing ones (none if test_path is NULL), decoding their chunks in
+ * parallel over the thread pool. The samples live in a single block (see
+ * TrainData.block). Returns NULL on error. Must be freed with
+ * free_training_data(the_data);
+ */
+TrainData *shard_load(char *train_path, char *test_path)
+{
+	int i, k, n[2];
+	long isz, osz, n_chunks;
+	double *p;
+	LoadArgs a;
+	TrainData *data;
+	a.shards[0] = shard_open(train_path);
+	a.shards[1] = test_path != NULL ? shard_open(test_path) : NULL;
+	if (a.shards[0] == NULL || (test_path != NULL && a.shards[1] == NULL) ||
+		(a.shards[1] != NULL &&
+		 (a.shards[1]->header.inputs_size != a.shards[0]->header.inputs_size ||
+		  a.shards[1]->header.outputs_size !=
+		  a.shards[0]->header.outputs_size))) {
+		if (a.shards[0] != NULL && a.shards[1] != NULL) {
+			fprintf(stderr, "shard_load ERROR: %s and %s do not match.\n",
+					train_path, test_path);
+		}
+		shard_close(a.shards[0]);
+		shard_close(a.shards[1]);
+		return NULL;
+	}
+	isz = a.shards[0]->header.inputs_size;
+	osz = a.shards[0]->header.outputs_size;
+	n[0] = a.shards[0]->header.n_samples;
+	n[1] = a.shards[1] != NULL ? a.shards[1]->header.n_samples : 0;
+
+	data = malloc(sizeof(TrainData));
+	data->n_train = n[0];
+	data->n_test = n[1];
+	data->inputs_size = isz;
+	data->outputs_size = osz;
+	data->sparse_inputs_training = NULL;
+	/* Inputs then labels, of the training samples then the testing ones */
+	data->block = numa_alloc_huge(sizeof(double) * (isz + osz) *
+								  ((long)n[0] + n[1]));
+	p = data->block;
+	for (k = 0; k < 2; k++) {
+		a.inputs[k] = p;
+		a.labels[k] = p + n[k] * isz;
+		p += n[k] * (isz + osz);
+	}
+	atomic_init(&a.failed, 0);
+	n_chunks = a.shards[0]->header.n_chunks +
+		(a.shards[1] != NULL ? a.shards[1]->header.n_chunks : 0);
+	parallel_for(0, n_chunks, 1, load_chunks, &a);
+	shard_close(a.shards[0]);
+	shard_close(a.shards[1]);
+
+	data->inputs_training = malloc(sizeof(double *) * (n[0] + 1));
+	data->labels_training = malloc(sizeof(double *) * (n[0] + 1));
+	data->inputs_testing = malloc(sizeof(double *) * (n[1] + 1));
+	data->labels_testing = malloc(sizeof(double *) * (n[1] + 1));
+	for (i = 0; i < n[0]; i++) {
+		data->inputs_training[i] = a.inputs[0] + i * isz;
+		data->labels_training[i] = a.labels[0] + i * osz;
+	}
+	for (i = 0; i < n[1]; i++) {
+		data->inputs_testing[i] = a.inputs[1] + i * isz;
+		data->labels_testing[i] = a.labels[1] + i * osz;
+	}
+	if (atomic_load(&a.failed)) {
+		free_training_data(data);
+		return NULL;
+	}
+	return data;
+}
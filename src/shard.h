@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <neuron.h>
+
+#ifndef SHARD_H
+#define SHARD_H
+
+/*
+ * Shards: a compressed binary format for data sets, decoded in parallel
+ * straight into the doubles of a TrainData.
+ *
+ * Layout of a file (native byte order, like the network files):
+ *
+ *   ShardHeader                      64 bytes
+ *   table                            256 doubles
+ *   chunk 0, chunk 1, ...            each starting on a SHARD_ALIGN boundary
+ *   index                            n_chunks ShardChunk
+ *
+ * Inputs are stored pre-normalized, as one byte per value: the code of
+ * the value in 'table', which is decoded by a lookup. A set with at most
+ * 256 distinct input values (such as the k / 255 of MNIST) is stored
+ * exactly; otherwise the values are rounded to 256 levels evenly spread
+ * between the smallest and the largest. Labels must be one-hot, and are
+ * stored as the byte of their class.
+ *
+ * A chunk holds chunk_size samples (the last one fewer): the codes of
+ * their inputs, compressed with the chunk's codec, then their class
+ * bytes. The index gives the offset, compressed size and codec of every
+ * chunk, so that chunks can be read in any order, and by several threads
+ * at once.
+ */
+
+#define SHARD_MAGIC "GLSH"
+#define SHARD_VERSION 1
+
+/* Alignment of the chunks in the file. */
+#define SHARD_ALIGN 64
+
+/* Default number of samples per chunk. */
+#define SHARD_CHUNK_SIZE 1024
+
+/* Codecs of the inputs of a chunk, the smallest being picked for each.
+ * Both compress code 0 (the smallest value: 0 for images).
+ *
+ * ZRLE, for long runs of zeros: a token byte t < 128 is followed by
+ * t + 1 literal codes; t >= 128 stands for t - 127 codes 0.
+ *
+ * MASK, for scattered zeros: one byte per 8 values, whose bit i is set
+ * if value i is not code 0, then the codes of those values. Decoding has
+ * no data-dependent branch.
+ */
+#define SHARD_CODEC_RAW 0
+#define SHARD_CODEC_ZRLE 1
+#define SHARD_CODEC_MASK 2
+
+typedef struct {
+	char magic[4];
+	int32_t version;
+	int32_t n_samples;
+	int32_t inputs_size;
+	int32_t outputs_size;
+	int32_t chunk_size;
+	int32_t n_chunks;
+	/* 1 if the table holds every input value exactly */
+	int32_t exact;
+	int64_t index_offset;
+	char reserved[24];
+} ShardHeader;
+
+typedef struct {
+	int64_t offset;
+	/* bytes of the compressed inputs, followed by the class bytes */
+	int32_t size;
+	int32_t codec;
+} ShardChunk;
+
+/* Shard struct. An open shard file. Must be closed with
+ * shard_close(the_shard);
+ */
+typedef struct {
+	int fd;
+	ShardHeader header;
+	double table[256];
+	ShardChunk *index;
+} Shard;
+
+int shard_write(char *path, double **inputs, double **labels, int n,
+		int inputs_size, int outputs_size, int chunk_size,
+		double *max_error);
+
+Shard *shard_open(char *path);
+
+void shard_close(Shard *s);
+
+int shard_read_chunk(Shard *s, int chunk, double *inputs, double *labels);
+
+TrainData *shard_load(char *train_path, char *test_path);
+
+#endif // SHARD_H
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <specialize.h>
+
+/* Offsets of the weights and biases of each layer in the parameters. */
+typedef struct {
+	int n_layers;
+	int *sizes;
+	long w_off[256];
+	long b_off[256];
+	long n_weights;
+	long n_params;
+} Layout;
+
+static void layout(Layout *l, int n_layers, int *sizes)
+{
+	int i;
+	long off = 0;
+	l->n_layers = n_layers;
+	l->sizes = sizes;
+	for (i = 0; i < n_layers - 1; i++) {
+		l->w_off[i] = off;
+		off += (long)sizes[i+1] * sizes[i];
+	}
+	l->n_weights = off;
+	for (i = 0; i < n_layers - 1; i++) {
+		l->b_off[i] = off;
+		off += sizes[i+1];
+	}
+	l->n_params = off;
+}
+
+/* Statements setting 'dst' to the dot product of the n doubles at w and
+ * at x (C expressions), over up to SPECIALIZE_LANES accumulators: a loop
+ * over the whole groups, then the tail unrolled.
+ */
+static void emit_dot(FILE *f, char *indent, char *dst, char *w, char *x,
+					 int n)
+{
+	int k, lanes = n < SPECIALIZE_LANES ? n : SPECIALIZE_LANES;
+	int whole = n - n % lanes;
+	fprintf(f, "%s{\n", indent);
+	for (k = 0; k < lanes; k++) {
+		fprintf(f, "%s\tdouble s%d = 0.0;\n", indent, k);
+	}
+	if (whole > lanes) {
+		fprintf(f, "%s\tfor (j = 0; j < %d; j += %d) {\n", indent, whole,
+				lanes);
+		for (k = 0; k < lanes; k++) {
+			fprintf(f, "%s\t\ts%d += %s[j + %d] * %s[j + %d];\n", indent, k,
+					w, k, x, k);
+		}
+		fprintf(f, "%s\t}\n", indent);
+	} else {
+		for (k = 0; k < lanes; k++) {
+			fprintf(f, "%s\ts%d += %s[%d] * %s[%d];\n", indent, k, w, k, x, k);
+		}
+	}
+	for (k = whole; k < n; k++) {
+		fprintf(f, "%s\ts%d += %s[%d] * %s[%d];\n", indent, k - whole, w, k,
+				x, k);
+	}
+	/* Pairwise sum of the accumulators */
+	for (k = 1; k < lanes; k *= 2) {
+		int m;
+		for (m = 0; m + k < lanes; m += 2 * k) {
+			fprintf(f, "%s\ts%d += s%d;\n", indent, m, m + k);
+		}
+	}
+	fprintf(f, "%s\t%s = s0;\n", indent, dst);
+	fprintf(f, "%s}\n", indent);
+}
+
+/* The forward pass of layer i, from a<i> to a<i+1> (x and out for the
+ * input and output layers). */
+static void emit_layer_forward(FILE *f, Layout *l, int i, char *params)
+{
+	char in[16], out[16];
+	int n_in = l->sizes[i], n_out = l->sizes[i+1];
+	snprintf(in, sizeof(in), i == 0 ? "x" : "a%d", i);
+	snprintf(out, sizeof(out), i == l->n_layers - 2 ? "out" : "a%d", i + 1);
+	fprintf(f, "\t/* Layer %d: %d -> %d */\n", i + 1, n_in, n_out);
+	fprintf(f, "\tfor (i = 0; i < %d; i++) {\n", n_out);
+	fprintf(f, "\t\tconst double *restrict w = %s + %ld + i * %d;\n", params,
+			l->w_off[i], n_in);
+	fprintf(f, "\t\tdouble z;\n");
+	emit_dot(f, "\t\t", "z", "w", in, n_in);
+	fprintf(f, "\t\t%s[i] = 1.0 / (1.0 + exp(-(z + %s[%ld + i])));\n", out,
+			params, l->b_off[i]);
+	fprintf(f, "\t}\n");
+}
+
+/* Declarations of the activations of the hidden layers. */
+static void emit_activations(FILE *f, Layout *l)
+{
+	int i;
+	for (i = 1; i < l->n_layers - 1; i++) {
+		fprintf(f, "\tdouble a%d[%d];\n", i, l->sizes[i]);
+	}
+}
+
+static void emit_forward(FILE *f, Layout *l, char *prefix)
+{
+	int i;
+	fprintf(f, "static inline void %s_forward(const double *restrict p,\n"
+			"\t\tconst double *restrict x, double *restrict out)\n{\n",
+			prefix);
+	fprintf(f, "\tint i, j;\n");
+	emit_activations(f, l);
+	fprintf(f, "\t(void)j;\n");
+	for (i = 0; i < l->n_layers - 1; i++) {
+		emit_layer_forward(f, l, i, "p");
+	}
+	fprintf(f, "}\n\n");
+	fprintf(f, "void %s_feedforward(const double *params, const double "
+			"*input,\n\t\tdouble *output)\n{\n", prefix);
+	fprintf(f, "\t%s_forward(params, input, output);\n}\n\n", prefix);
+}
+
+static void emit_backprop(FILE *f, Layout *l, char *prefix)
+{
+	int i, last = l->n_layers - 1;
+	char in[16];
+	fprintf(f, "void %s_backprop(const double *restrict p,\n"
+			"\t\tconst double *restrict x, const double *restrict y,\n"
+			"\t\tdouble *restrict nabla)\n{\n", prefix);
+	fprintf(f, "\tint i, j;\n");
+	emit_activations(f, l);
+	fprintf(f, "\tdouble a%d[%d];\n", last, l->sizes[last]);
+	for (i = 1; i <= last; i++) {
+		fprintf(f, "\tdouble d%d[%d];\n", i, l->sizes[i]);
+	}
+	fprintf(f, "\t(void)j;\n");
+	fprintf(f, "\t{\n\t\tdouble *restrict out = a%d;\n", last);
+	for (i = 0; i < last; i++) {
+		emit_layer_forward(f, l, i, "p");
+	}
+	fprintf(f, "\t}\n");
+	fprintf(f, "\t/* Errors of the output layer (cross-entropy cost) */\n");
+	fprintf(f, "\tfor (i = 0; i < %d; i++) {\n", l->sizes[last]);
+	fprintf(f, "\t\td%d[i] = a%d[i] - y[i];\n\t}\n", last, last);
+	for (i = last - 1; i >= 1; i--) {
+		/* d<i> = W<i>^T d<i+1> * sigmoid'(z<i>), row by row of W<i> */
+		fprintf(f, "\t/* Errors of layer %d */\n", i);
+		fprintf(f, "\tfor (j = 0; j < %d; j++) {\n\t\td%d[j] = 0.0;\n\t}\n",
+				l->sizes[i], i);
+		fprintf(f, "\tfor (i = 0; i < %d; i++) {\n", l->sizes[i+1]);
+		fprintf(f, "\t\tconst double *restrict w = p + %ld + i * %d;\n",
+				l->w_off[i], l->sizes[i]);
+		fprintf(f, "\t\tfor (j = 0; j < %d; j++) {\n", l->sizes[i]);
+		fprintf(f, "\t\t\td%d[j] += w[j] * d%d[i];\n\t\t}\n\t}\n", i, i + 1);
+		fprintf(f, "\tfor (j = 0; j < %d; j++) {\n", l->sizes[i]);
+		fprintf(f, "\t\td%d[j] *= a%d[j] * (1.0 - a%d[j]);\n\t}\n", i, i, i);
+	}
+	fprintf(f, "\t/* Gradient: nabla_b += d, nabla_w += d a^T */\n");
+	for (i = 0; i < last; i++) {
+		snprintf(in, sizeof(in), i == 0 ? "x" : "a%d", i);
+		fprintf(f, "\tfor (i = 0; i < %d; i++) {\n", l->sizes[i+1]);
+		fprintf(f, "\t\tdouble *restrict g = nabla + %ld + i * %d;\n",
+				l->w_off[i], l->sizes[i]);
+		fprintf(f, "\t\tnabla[%ld + i] += d%d[i];\n", l->b_off[i], i + 1);
+		fprintf(f, "\t\tfor (j = 0; j < %d; j++) {\n", l->sizes[i]);
+		fprintf(f, "\t\t\tg[j] += d%d[i] * %s[j];\n\t\t}\n\t}\n", i + 1,
+				in);
+	}
+	fprintf(f, "}\n\n");
+}
+
+/* Write to out the C source of the kernels of a network of n_layers
+ * layers of the given sizes, their functions named after prefix (see
+ * specialize.h). If embed is not NULL, its parameters are written as
+ * constants, with a forward pass reading them. Returns 1 on success, 0
+ * on error.
+ */
+int specialize_network(FILE *out, int n_layers, int *sizes, char *prefix,
+					   Network *embed)
+{
+	int i;
+	long k;
+	Layout l;
+	if (n_layers < 2 || n_layers > 256) {
+		fprintf(stderr, "specialize_network ERROR: %d layers.\n", n_layers);
+		return 0;
+	}
+	for (i = 0; i < n_layers; i++) {
+		if (sizes[i] < 1) {
+			fprintf(stderr, "specialize_network ERROR: layer %d has %d "
+					"units.\n", i, sizes[i]);
+			return 0;
+		}
+	}
+	if (embed != NULL && (embed->n_layers != n_layers ||
+						  memcmp(embed->sizes, sizes,
+								 sizeof(int) * n_layers))) {
+		fprintf(stderr, "specialize_network ERROR: the network to embed "
+				"has another topology.\n");
+		return 0;
+	}
+	layout(&l, n_layers, sizes);
+
+	fprintf(out, "/* Generated by specialize_network for ");
+	for (i = 0; i < n_layers; i++) {
+		fprintf(out, "%s%d", i ? "-" : "", sizes[i]);
+	}
+	fprintf(out, " (sigmoid)%s. Do not edit. */\n\n",
+			embed != NULL ? ", weights embedded" : "");
+	fprintf(out, "#include <math.h>\n\n");
+	fprintf(out, "#define %s_N_LAYERS %d\n", prefix, n_layers);
+	fprintf(out, "#define %s_SIZES {", prefix);
+	for (i = 0; i < n_layers; i++) {
+		fprintf(out, "%s%d", i ? ", " : "", sizes[i]);
+	}
+	fprintf(out, "}\n");
+	fprintf(out, "#define %s_N_WEIGHTS %ld\n", prefix, l.n_weights);
+	fprintf(out, "#define %s_N_PARAMS %ld\n\n", prefix, l.n_params);
+	fprintf(out, "void %s_feedforward(const double *params, const double "
+			"*input,\n\t\tdouble *output);\n", prefix);
+	fprintf(out, "void %s_backprop(const double *restrict p,\n"
+			"\t\tconst double *restrict x, const double *restrict y,\n"
+			"\t\tdouble *restrict nabla);\n", prefix);
+	if (embed != NULL) {
+		fprintf(out, "void %s_feedforward_embedded(const double *input, "
+				"double *output);\n", prefix);
+		fprintf(out, "\nconst double %s_params[%ld] = {", prefix,
+				l.n_params);
+		for (k = 0; k < l.n_params; k++) {
+			fprintf(out, "%s%.17g,", k % 4 ? " " : "\n\t",
+					embed->params->data[k]);
+		}
+		fprintf(out, "\n};\n");
+	}
+	fprintf(out, "\n");
+	emit_forward(out, &l, prefix);
+	if (embed != NULL) {
+		fprintf(out, "void %s_feedforward_embedded(const double *input, "
+				"double *output)\n{\n", prefix);
+		fprintf(out, "\t%s_forward(%s_params, input, output);\n}\n\n",
+				prefix, prefix);
+	}
+	emit_backprop(out, &l, prefix);
+	return !ferror(out);
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <neuron.h>
+
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+
+/*
+ * Code generator for networks of a fixed topology (sigmoid layers, the
+ * cost of SGD): writes the C source of a forward and a backward pass in
+ * which every size is a constant, every dot product is split over up to
+ * SPECIALIZE_LANES accumulators with its tail unrolled, and the offsets
+ * of the parameters are folded in. The source only needs <math.h>, so it
+ * can be compiled into a dedicated inference or training binary.
+ *
+ * For a prefix P it defines:
+ *
+ *   P_N_LAYERS, P_N_PARAMS, P_N_WEIGHTS
+ *   P_SIZES (the initializer {sizes[0], ...})
+ *   void P_feedforward(const double *params, const double *input,
+ *                      double *output);
+ *   void P_backprop(const double *params, const double *input,
+ *                   const double *target, double *nabla);
+ *
+ * params and nabla are laid out as ParamBuffer->data (every weight, then
+ * every bias). P_backprop adds the gradient of the sample to nabla, like
+ * backpropagate_accumulate. With embedded weights it also defines
+ *
+ *   const double P_params[P_N_PARAMS];
+ *   void P_feedforward_embedded(const double *input, double *output);
+ *
+ * the latter reading the constant weights directly.
+ *
+ * The sums are associated differently from matrix_prod_optim, so the
+ * results differ from the generic path by a few ulps.
+ */
+
+/* Accumulators of the generated dot products: a vector register's worth
+ * of doubles with AVX-512, two with AVX2. */
+#define SPECIALIZE_LANES 8
+
+int specialize_network(FILE *out, int n_layers, int *sizes, char *prefix,
+		Network *embed);
+
+#endif // SPECIALIZE_H
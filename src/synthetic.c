@@ -0,0 +1,91 @@
+#include <stdlib.h>
+
+#include <random.h>
+#include <synthetic.h>
+
+/* Fill 'input' with a noisy copy of 'prototype': each pixel of the
+ * prototype is kept with probability 0.6 and jittered, and some random
+ * pixels are switched on. Values are in [0, 1], like normalized MNIST.
+ */
+static void make_sample(double *input, double *prototype, int n,
+						double density, long *seed)
+{
+	int i;
+	double v;
+	for (i = 0; i < n; i++) {
+		v = 0.0;
+		if (prototype[i] > 0 && rand0(seed) < 0.6) {
+			v = prototype[i] * (0.7 + 0.3 * rand0(seed));
+		} else if (rand0(seed) < density) {
+			v = rand0(seed);
+		}
+		input[i] = v;
+	}
+}
+
+/* Create a synthetic data set shaped like MNIST (by default 784 inputs
+ * in [0, 1] and 10 one-hot outputs), so training can be benchmarked
+ * without the real data set.
+ *
+ * Every class has a random prototype with a fraction 'density' of
+ * nonzero inputs, most of which are shared by all the classes; samples
+ * are noisy copies of the prototype of their class, so a network can
+ * learn them, but not instantly. The same seed always
+ * produces the same data.
+ *
+ * Must be freed with free_training_data(data).
+ */
+TrainData *create_synthetic_data(int n_train, int n_test, int inputs_size,
+								 int outputs_size, double density,
+								 long seed)
+{
+	int i, j, label;
+	double **prototypes, *base;
+	TrainData *data = malloc(sizeof(TrainData));
+	data->n_train = n_train;
+	data->n_test = n_test;
+	data->inputs_size = inputs_size;
+	data->outputs_size = outputs_size;
+	data->inputs_training = malloc(sizeof(double *) * n_train);
+	data->labels_training = malloc(sizeof(double *) * n_train);
+	data->inputs_testing = malloc(sizeof(double *) * n_test);
+	data->labels_testing = malloc(sizeof(double *) * n_test);
+	data->sparse_inputs_training = NULL;
+	data->block = NULL;
+
+	base = malloc(sizeof(double) * inputs_size);
+	for (j = 0; j < inputs_size; j++) {
+		base[j] = rand0(&seed) < density ? rand0(&seed) : 0.0;
+	}
+	prototypes = malloc(sizeof(double *) * outputs_size);
+	for (i = 0; i < outputs_size; i++) {
+		prototypes[i] = malloc(sizeof(double) * inputs_size);
+		for (j = 0; j < inputs_size; j++) {
+			if (rand0(&seed) < 0.85) {
+				prototypes[i][j] = base[j];
+			} else {
+				prototypes[i][j] = rand0(&seed) < density ? rand0(&seed) : 0.0;
+			}
+		}
+	}
+	for (i = 0; i < n_train + n_test; i++) {
+		double *input = malloc(sizeof(double) * inputs_size);
+		double *label_v = calloc(outputs_size, sizeof(double));
+		label = (int)(rand0(&seed) * outputs_size) % outputs_size;
+		make_sample(input, prototypes[label], inputs_size, density, &seed);
+		label_v[label] = 1.0;
+		if (i < n_train) {
+			data->inputs_training[i] = input;
+			data->labels_training[i] = label_v;
+		} else {
+			data->inputs_testing[i - n_train] = input;
+			data->labels_testing[i - n_train] = label_v;
+		}
+	}
+	for (i = 0; i < outputs_size; i++) {
+		free(prototypes[i]);
+	}
+	free(prototypes);
+	free(base);
+	return data;
+}
@@ -0,0 +1,10 @@
+#include <neuron.h>
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+TrainData *create_synthetic_data(int n_train, int n_test, int inputs_size,
+								 int outputs_size, double density,
+								 long seed);
+
+#endif // SYNTHETIC_H
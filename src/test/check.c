@@ -0,0 +1,2250 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <math.h>
+#include <matrix.h>
+#include <vector.h>
+#include <test_utils.c>
+#include <neuron.h>
+#include <int8.h>
+#include <quantize.h>
+#include <halfnet.h>
+#include <prune.h>
+#include <synthetic.h>
+#include <dist.h>
+#include <serve.h>
+#include <online.h>
+#include <shard.h>
+#include <pool.h>
+#include <augment.h>
+#include <numa.h>
+#include <strassen.h>
+#include <expr.h>
+#include <tune.h>
+#include <sys/wait.h>
+
+/*
+ * Correctness harness for the optimized code paths, run by 'make check':
+ *
+ * - every fast kernel is compared against its reference implementation
+ *   (matrix_prod, or a plain scalar loop) on randomized shapes;
+ * - backpropagate is checked against finite differences of the
+ *   cross-entropy cost;
+ * - network_update_mini_batch is checked against the textbook update
+ *   computed layer by layer;
+ * - the int8 and sparse inference paths, and the batched one, are
+ *   checked against feedforward.
+ *
+ * Usage: check [seed]
+ */
+
+#define N_SHAPES 40
+/* Step and tolerance of the finite-differences gradient check. */
+#define GRAD_EPS 1e-5
+#define GRAD_TOL 1e-6
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static int rand_dim(int max)
+{
+	return 1 + rand() % max;
+}
+
+static Matrix *random_matrix(int n_rows, int n_cols)
+{
+	int i, j;
+	Matrix *m = create_matrix(n_rows, n_cols);
+	for (i = 0; i < n_rows; i++) {
+		for (j = 0; j < n_cols; j++) {
+			m->data[i][j] = 2.0 * rand() / RAND_MAX - 1.0;
+		}
+	}
+	return m;
+}
+
+static void random_array(double *x, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		x[i] = 2.0 * rand() / RAND_MAX - 1.0;
+	}
+}
+
+/* Largest difference between a and b, relative to max(1, |a|, |b|).
+ * Returns INFINITY if the shapes differ.
+ */
+static double max_rel_diff(Matrix *a, Matrix *b)
+{
+	int i, j;
+	double d, scale, worst = 0.0;
+	if (a->n_rows != b->n_rows || a->n_cols != b->n_cols) {
+		return INFINITY;
+	}
+	for (i = 0; i < a->n_rows; i++) {
+		for (j = 0; j < a->n_cols; j++) {
+			scale = MAX(1.0, MAX(fabs(a->data[i][j]), fabs(b->data[i][j])));
+			d = fabs(a->data[i][j] - b->data[i][j]) / scale;
+			worst = MAX(worst, d);
+		}
+	}
+	return worst;
+}
+
+static double max_rel_diff_array(double *a, double *b, long n)
+{
+	long i;
+	double d, worst = 0.0;
+	for (i = 0; i < n; i++) {
+		d = fabs(a[i] - b[i]) / MAX(1.0, MAX(fabs(a[i]), fabs(b[i])));
+		worst = MAX(worst, d);
+	}
+	return worst;
+}
+
+/*** Kernel equivalence ***/
+
+void check_matrix_prod()
+{
+	printf("\n** BLOCK matrix products vs matrix_prod **\n");
+	int t, n, m, k;
+	double err = 0.0;
+	Matrix *a, *b, *ref, *res;
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(70);
+		k = rand_dim(70);
+		/* Half of the cases are matrix-vector products, like in the net */
+		m = t % 2 ? 1 : rand_dim(70);
+		a = random_matrix(n, k);
+		b = random_matrix(k, m);
+		ref = matrix_prod(a, b);
+		res = matrix_prod_optim(a, b);
+		err = MAX(err, max_rel_diff(ref, res));
+		free_matrix(a);
+		free_matrix(b);
+		free_matrix(ref);
+		free_matrix(res);
+	}
+	ASSERT("matrix_prod_optim matches matrix_prod", err < 1e-12);
+}
+
+/* Strassen-Winograd, down to small crossovers so that several levels
+ * and the peeling of odd dimensions are exercised, and the blocked
+ * kernel it ends in; matrix_prod_optim must use it once enabled.
+ */
+void check_strassen()
+{
+	printf("\n** BLOCK Strassen-Winograd and blocked products **\n");
+	int t, n, m, k;
+	long ws, bound = 0;
+	double err = 0.0, err_blocked = 0.0, err_optim;
+	Matrix *a, *b, *ref, *res;
+	for (t = 0; t < N_SHAPES; t++) {
+		n = 16 + rand_dim(150);
+		k = 16 + rand_dim(150);
+		m = 16 + rand_dim(150);
+		a = random_matrix(n, k);
+		b = random_matrix(k, m);
+		ref = matrix_prod(a, b);
+		res = matrix_prod_strassen(a, b, 8 + t % 8);
+		err = MAX(err, max_rel_diff(ref, res));
+		free_matrix(res);
+		res = matrix_prod_blocked(a, b);
+		err_blocked = MAX(err_blocked, max_rel_diff(ref, res));
+		free_matrix(res);
+		ws = strassen_workspace_size(n, m, k, 8);
+		if (3 * ws > (long)n * MAX(k, m) + (long)k * m) {
+			bound = ws;
+		}
+		free_matrix(a);
+		free_matrix(b);
+		free_matrix(ref);
+	}
+	printf("max relative error: Strassen %g, blocked %g\n", err,
+		   err_blocked);
+	ASSERT("matrix_prod_strassen matches matrix_prod", err < 1e-11);
+	ASSERT("matrix_prod_blocked matches matrix_prod", err_blocked < 1e-12);
+	ASSERT("the Strassen workspace is within its bound", bound == 0);
+
+	a = random_matrix(101, 67);
+	b = random_matrix(67, 90);
+	ref = matrix_prod(a, b);
+	strassen_set_crossover(16);
+	res = matrix_prod_optim(a, b);
+	strassen_set_crossover(0);
+	err_optim = max_rel_diff(ref, res);
+	ASSERT("matrix_prod_optim uses Strassen once enabled",
+		   err_optim < 1e-11 && err_optim > 0 && strassen_crossover() == 0);
+	free_matrix(a);
+	free_matrix(b);
+	free_matrix(ref);
+	free_matrix(res);
+}
+
+/* Deferred expressions, evaluated in one fused pass after the product,
+ * must give exactly the results of the eager calls they replace.
+ */
+void check_expr()
+{
+	printf("\n** BLOCK fused expressions vs eager calls **\n");
+	int t, n, m, k, node, same_layer = 1, same_mixed = 1, same_update = 1;
+	double alpha;
+	Matrix *w, *x, *b, *d, *ref, *res, *tmp;
+	ExprGraph g;
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(70);
+		k = rand_dim(70);
+		m = rand_dim(70);
+		w = random_matrix(n, k);
+		x = random_matrix(k, m);
+		b = random_matrix(n, 1);
+		d = random_matrix(n, k);
+
+		/* A layer: sigmoid(w x + b) */
+		tmp = matrix_prod_optim(w, x);
+		matrix_add_columnwise(tmp, b);
+		ref = sigmoid_vect(tmp);
+		free_matrix(tmp);
+		expr_reset(&g);
+		res = expr_eval(&g, expr_sigmoid(&g, expr_add_columnwise(&g,
+					expr_prod(&g, expr_matrix(&g, w), expr_matrix(&g, x)),
+					expr_matrix(&g, b))));
+		same_layer = same_layer && matrix_cmp(ref, res) &&
+			max_rel_diff(ref, res) == 0;
+		free_matrix(ref);
+		free_matrix(res);
+
+		/* (sigmoid_prime(w) * (w - d)) * alpha, w shared */
+		alpha = 0.5 + t;
+		ref = sigmoid_prime_vect(w);
+		tmp = matrix_copy(w);
+		matrix_substract(tmp, d);
+		matrix_entrywise_product(ref, tmp);
+		matrix_multiply(ref, alpha);
+		free_matrix(tmp);
+		expr_reset(&g);
+		node = expr_matrix(&g, w);
+		res = expr_eval(&g, expr_scale(&g, expr_mul(&g,
+					expr_sigmoid_prime(&g, node),
+					expr_sub(&g, node, expr_matrix(&g, d))), alpha));
+		same_mixed = same_mixed && max_rel_diff(ref, res) == 0;
+		free_matrix(ref);
+		free_matrix(res);
+
+		/* An update in place: w = w * alpha + d * -0.1 */
+		ref = matrix_copy(w);
+		matrix_multiply(ref, alpha);
+		tmp = matrix_copy(d);
+		matrix_multiply(tmp, -0.1);
+		matrix_add(ref, tmp);
+		free_matrix(tmp);
+		expr_reset(&g);
+		node = expr_matrix(&g, w);
+		same_update = same_update &&
+			expr_eval_into(&g, expr_add(&g, expr_scale(&g, node, alpha),
+							expr_scale(&g, expr_matrix(&g, d), -0.1)), w) &&
+			max_rel_diff(ref, w) == 0;
+		free_matrix(ref);
+
+		free_matrix(w);
+		free_matrix(x);
+		free_matrix(b);
+		free_matrix(d);
+	}
+	ASSERT("a fused layer gives the bits of the eager calls", same_layer);
+	ASSERT("a fused tree with a shared leaf gives the eager bits",
+		   same_mixed);
+	ASSERT("expr_eval_into updates in place like the eager calls",
+		   same_update);
+
+	w = random_matrix(3, 4);
+	expr_reset(&g);
+	node = expr_add(&g, expr_prod(&g, expr_matrix(&g, w),
+								  expr_matrix(&g, w)),
+					expr_matrix(&g, w));
+	ASSERT("a mismatched shape gives -1 through the whole expression",
+		   node == -1 && expr_eval(&g, node) == NULL);
+	free_matrix(w);
+}
+
+void check_sparse_prod()
+{
+	printf("\n** BLOCK sparse_prod vs matrix_prod **\n");
+	int t, i, j, n, m, k;
+	double err = 0.0, err_dense = 0.0;
+	Matrix *a, *b, *ref, *res, *back;
+	SparseMatrix *sp;
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(70);
+		k = rand_dim(70);
+		m = t % 2 ? 1 : rand_dim(70);
+		a = random_matrix(n, k);
+		/* ~80% zeros */
+		for (i = 0; i < n; i++)
+			for (j = 0; j < k; j++)
+				if (rand() % 5)
+					a->data[i][j] = 0.0;
+		b = random_matrix(k, m);
+		sp = matrix_to_sparse(a);
+		back = sparse_to_matrix(sp);
+		err_dense = MAX(err_dense, max_rel_diff(a, back));
+		ref = matrix_prod(a, b);
+		res = sparse_prod(sp, b);
+		err = MAX(err, max_rel_diff(ref, res));
+		free_sparse_matrix(sp);
+		free_matrix(a);
+		free_matrix(b);
+		free_matrix(back);
+		free_matrix(ref);
+		free_matrix(res);
+	}
+	ASSERT("matrix_to_sparse/sparse_to_matrix round-trip", err_dense == 0);
+	ASSERT("sparse_prod matches matrix_prod", err < 1e-12);
+
+	a = create_matrix(0, 5);
+	b = random_matrix(5, 3);
+	sp = matrix_to_sparse(a);
+	res = sparse_prod(sp, b);
+	ASSERT("sparse_prod of a matrix with no rows is empty",
+		   res->n_rows == 0 && res->n_cols == 3);
+	free_matrix(res);
+	free_matrix(b);
+	b = random_matrix(4, 3);
+	ASSERT("sparse_prod returns NULL if the shapes do not match",
+		   sparse_prod(sp, b) == NULL);
+	free_sparse_matrix(sp);
+	free_matrix(a);
+	free_matrix(b);
+}
+
+void check_elementwise()
+{
+	printf("\n** BLOCK elementwise kernels vs scalar loops **\n");
+	int t, i, j, n, m;
+	double err_add = 0, err_sub = 0, err_mul = 0, err_t = 0, err_sig = 0;
+	Matrix *a, *b, *ref, *res, *tmp;
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(50);
+		m = rand_dim(50);
+		a = random_matrix(n, m);
+		b = random_matrix(n, m);
+		ref = create_matrix(n, m);
+
+		res = matrix_copy(a);
+		matrix_add(res, b);
+		for (i = 0; i < n; i++)
+			for (j = 0; j < m; j++)
+				ref->data[i][j] = a->data[i][j] + b->data[i][j];
+		err_add = MAX(err_add, max_rel_diff(ref, res));
+		free_matrix(res);
+
+		res = matrix_copy(a);
+		matrix_substract(res, b);
+		for (i = 0; i < n; i++)
+			for (j = 0; j < m; j++)
+				ref->data[i][j] = a->data[i][j] - b->data[i][j];
+		err_sub = MAX(err_sub, max_rel_diff(ref, res));
+		free_matrix(res);
+
+		res = matrix_copy(a);
+		matrix_entrywise_product(res, b);
+		for (i = 0; i < n; i++)
+			for (j = 0; j < m; j++)
+				ref->data[i][j] = a->data[i][j] * b->data[i][j];
+		err_mul = MAX(err_mul, max_rel_diff(ref, res));
+		free_matrix(res);
+
+		tmp = transpose(a);
+		res = transpose(tmp);
+		err_t = MAX(err_t, max_rel_diff(a, res));
+		for (i = 0; i < n; i++)
+			for (j = 0; j < m; j++)
+				err_t = MAX(err_t, fabs(tmp->data[j][i] - a->data[i][j]));
+		free_matrix(tmp);
+		free_matrix(res);
+
+		/* sigma'(z) computed from sigma(z) must match sigma'(z) */
+		tmp = sigmoid_vect(a);
+		res = sigmoid_prime_from_sigmoid_vect(tmp);
+		free_matrix(tmp);
+		tmp = sigmoid_prime_vect(a);
+		err_sig = MAX(err_sig, max_rel_diff(tmp, res));
+		for (i = 0; i < n; i++)
+			for (j = 0; j < m; j++)
+				ref->data[i][j] = sigmoid_prime(a->data[i][j]);
+		err_sig = MAX(err_sig, max_rel_diff(ref, tmp));
+		free_matrix(tmp);
+		free_matrix(res);
+
+		free_matrix(a);
+		free_matrix(b);
+		free_matrix(ref);
+	}
+	ASSERT("matrix_add matches scalar loop", err_add == 0);
+	ASSERT("matrix_substract matches scalar loop", err_sub == 0);
+	ASSERT("matrix_entrywise_product matches scalar loop", err_mul == 0);
+	ASSERT("transpose matches scalar loop", err_t == 0);
+	ASSERT("sigmoid kernels match sigmoid_prime", err_sig < 1e-12);
+}
+
+void check_vector()
+{
+	printf("\n** BLOCK vector kernels vs scalar loops **\n");
+	int t;
+	long i, n;
+	double a, dot, ref_dot, err = 0, err_dot = 0;
+	double *x, *y, *ref, *srcs[3];
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(5000);
+		a = 2.0 * rand() / RAND_MAX - 1.0;
+		x = malloc(sizeof(double) * n);
+		y = malloc(sizeof(double) * n);
+		ref = malloc(sizeof(double) * n);
+		random_array(x, n);
+		random_array(y, n);
+
+		for (i = 0; i < n; i++)
+			ref[i] = y[i] + a * x[i];
+		vector_axpy(y, a, x, n);
+		err = MAX(err, max_rel_diff_array(ref, y, n));
+
+		for (i = 0; i < n; i++)
+			ref[i] = y[i] * a;
+		vector_scale(y, a, n);
+		err = MAX(err, max_rel_diff_array(ref, y, n));
+
+		ref_dot = 0;
+		for (i = 0; i < n; i++)
+			ref_dot += x[i] * y[i];
+		dot = vector_dot(x, y, n);
+		err_dot = MAX(err_dot, fabs(dot - ref_dot) / MAX(1.0, fabs(ref_dot)));
+
+		for (i = 0; i < n; i++)
+			ref[i] = (y[i] + 2 * x[i]) / 3;
+		srcs[0] = y;
+		srcs[1] = x;
+		srcs[2] = x;
+		vector_average(y, srcs, 3, n);
+		err = MAX(err, max_rel_diff_array(ref, y, n));
+
+		free(x);
+		free(y);
+		free(ref);
+	}
+	ASSERT("vector_axpy, vector_scale & vector_average match scalar loops",
+		   err < 1e-14);
+	ASSERT("vector_dot matches scalar loop", err_dot < 1e-12);
+}
+
+void check_int8()
+{
+	printf("\n** BLOCK int8 kernels vs scalar reference **\n");
+	int t, i, n_rows, n_cols, stride, n, ok_gemv = 1, ok_gemm = 1;
+	int8_t *w;
+	uint8_t *x;
+	int32_t *ref, *out;
+	for (t = 0; t < N_SHAPES; t++) {
+		n_rows = rand_dim(100);
+		n_cols = rand_dim(900);
+		n = rand_dim(8);
+		stride = int8_stride(n_cols);
+		w = int8_alloc((long)n_rows * stride);
+		x = int8_alloc((long)n * stride);
+		ref = malloc(sizeof(int32_t) * n_rows * n);
+		out = malloc(sizeof(int32_t) * n_rows * n);
+		/* Extreme values included: the kernels must not saturate */
+		for (i = 0; i < n_rows * stride; i++) {
+			w[i] = (i % stride) < n_cols ? rand() % 256 - 128 : 0;
+		}
+		for (i = 0; i < n * stride; i++) {
+			x[i] = (i % stride) < n_cols ?
+				   rand() % (INT8_MAX_ACTIVATION + 1) : 0;
+		}
+		x[0] = INT8_MAX_ACTIVATION;
+		x[1] = INT8_MAX_ACTIVATION;
+		w[0] = -128;
+		w[1] = -128;
+		for (i = 0; i < n; i++) {
+			int8_gemv_scalar(w, n_rows, stride, x + (long)i * stride,
+							 ref + (long)i * n_rows);
+		}
+		int8_gemv(w, n_rows, stride, x, out);
+		ok_gemv = ok_gemv && !memcmp(ref, out, sizeof(int32_t) * n_rows);
+		int8_gemm(w, n_rows, stride, x, n, out);
+		ok_gemm = ok_gemm && !memcmp(ref, out, sizeof(int32_t) * n_rows * n);
+		free(w);
+		free(x);
+		free(ref);
+		free(out);
+	}
+	printf("int8 kernel: %s\n", int8_kernel_name());
+	ASSERT("int8_gemv matches int8_gemv_scalar exactly", ok_gemv);
+	ASSERT("int8_gemm matches int8_gemv_scalar exactly", ok_gemm);
+}
+
+/* Random TrainData with n training samples and no testing samples. */
+static TrainData *random_batch(int n, int inputs_size, int outputs_size);
+
+void check_quantized_network()
+{
+	printf("\n** BLOCK quantized network vs double network **\n");
+	int i, j, n = 50;
+	double out_q[6], out_l[6], err = 0.0, err_file = 0.0;
+	char path[] = "/tmp/glia_check_XXXXXX";
+	Network *net = create_network(3, 40, 20, 6);
+	TrainData *data = random_batch(n, 40, 6);
+	QuantizedNetwork *q, *loaded;
+	Matrix *out;
+	/* Inputs in [0, 1], like normalized pixels */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < 40; j++) {
+			data->inputs_training[i][j] = fabs(data->inputs_training[i][j]);
+		}
+	}
+	q = quantize_network(net, data, n);
+	for (i = 0; i < n; i++) {
+		out = feedforward(net, data->inputs_training[i]);
+		quantized_feedforward(q, data->inputs_training[i], out_q);
+		for (j = 0; j < 6; j++) {
+			err = MAX(err, fabs(out->data[j][0] - out_q[j]));
+		}
+		free_matrix(out);
+	}
+	ASSERT("int8 outputs are within 0.05 of the double outputs", err < 0.05);
+
+	close(mkstemp(path));
+	save_quantized_network(q, path);
+	loaded = load_quantized_network(path);
+	unlink(path);
+	for (i = 0; loaded != NULL && i < n; i++) {
+		quantized_feedforward(q, data->inputs_training[i], out_q);
+		quantized_feedforward(loaded, data->inputs_training[i], out_l);
+		for (j = 0; j < 6; j++) {
+			err_file = MAX(err_file, fabs(out_q[j] - out_l[j]));
+		}
+	}
+	ASSERT("save/load_quantized_network round-trips",
+		   loaded != NULL && err_file == 0);
+
+	destroy_quantized_network(q);
+	destroy_quantized_network(loaded);
+	free_training_data(data);
+	destroy_network(net);
+}
+
+void check_half()
+{
+	printf("\n** BLOCK 16-bit float conversions and kernels **\n");
+	int t, i, c, n_rows, n_cols, stride, n, ok_trip = 1, ok_vec = 1;
+	HalfFormat f;
+	uint16_t *w, h[40];
+	float *x, *out;
+	double d[40], ref, err, max_err = 0.0;
+	/* Every non-NaN 16-bit value goes to float and back unchanged */
+	for (f = HALF_FP16; f <= HALF_BF16; f++) {
+		for (i = 0; i < 65536; i++) {
+			float v = half_to_float(f, i);
+			ok_trip = ok_trip && (v != v || float_to_half(f, v) == i);
+		}
+	}
+	ASSERT("16-bit values round-trip through float", ok_trip);
+	ASSERT("fp16 rounding: 1, largest, overflow, smallest subnormal",
+		   float_to_half(HALF_FP16, 1.0f) == 0x3c00 &&
+		   float_to_half(HALF_FP16, 65504.0f) == 0x7bff &&
+		   float_to_half(HALF_FP16, 65520.0f) == 0x7c00 &&
+		   float_to_half(HALF_FP16, 5.9604645e-8f) == 0x0001 &&
+		   float_to_half(HALF_FP16, 1.0f + 1.0f / 2048) == 0x3c00 &&
+		   float_to_half(HALF_FP16, 1.0f + 3.0f / 2048) == 0x3c02);
+	ASSERT("bf16 rounding: ties to even",
+		   float_to_half(HALF_BF16, 1.0f) == 0x3f80 &&
+		   float_to_half(HALF_BF16, 1.0f + 1.0f / 256) == 0x3f80 &&
+		   float_to_half(HALF_BF16, 1.0f + 3.0f / 256) == 0x3f82);
+	/* Vector conversions match the scalar ones */
+	for (f = HALF_FP16; f <= HALF_BF16; f++) {
+		random_array(d, 40);
+		half_from_doubles(f, d, h, 40);
+		for (i = 0; i < 40; i++) {
+			ok_vec = ok_vec && h[i] == float_to_half(f, (float)d[i]);
+		}
+	}
+	ASSERT("half_from_doubles matches float_to_half", ok_vec);
+
+	for (t = 0; t < N_SHAPES; t++) {
+		f = t % 2 ? HALF_BF16 : HALF_FP16;
+		n_rows = rand_dim(100);
+		n_cols = rand_dim(300);
+		n = rand_dim(9);
+		stride = half_stride(n_cols);
+		w = half_alloc(2L * n_rows * stride);
+		x = half_alloc(4L * n * stride);
+		out = malloc(sizeof(float) * n_rows * n);
+		for (i = 0; i < n_rows; i++) {
+			for (c = 0; c < n_cols; c++) {
+				w[(long)i * stride + c] = float_to_half(f,
+											(float)rand() / RAND_MAX - 0.5f);
+			}
+		}
+		for (i = 0; i < n; i++) {
+			for (c = 0; c < n_cols; c++) {
+				x[(long)i * stride + c] = (float)rand() / RAND_MAX;
+			}
+		}
+		half_gemm(f, w, n_rows, stride, x, n, out);
+		/* Against double sums of the same 16-bit weights, relative to the
+		 * sum of the magnitudes */
+		for (i = 0; i < n * n_rows; i++) {
+			int r = i % n_rows, k = i / n_rows;
+			double mag = 1e-30;
+			ref = 0.0;
+			for (c = 0; c < n_cols; c++) {
+				double p = (double)half_to_float(f, w[(long)r * stride + c]) *
+						   x[(long)k * stride + c];
+				ref += p;
+				mag += fabs(p);
+			}
+			err = fabs(out[i] - ref) / mag;
+			max_err = MAX(max_err, err);
+		}
+		free(w);
+		free(x);
+		free(out);
+	}
+	printf("half kernel: %s, max relative error %g\n", half_kernel_name(),
+		   max_err);
+	ASSERT("half_gemm accumulates in float precision", max_err < 1e-5);
+}
+
+void check_half_network()
+{
+	printf("\n** BLOCK 16-bit network vs double network **\n");
+	int i, j, n = 50;
+	double out_h[6], err[2] = {0.0, 0.0};
+	Network *net = create_network(3, 40, 20, 6);
+	TrainData *data = random_batch(n, 40, 6);
+	HalfNetwork *h;
+	HalfFormat f;
+	Matrix *out;
+	for (f = HALF_FP16; f <= HALF_BF16; f++) {
+		h = create_half_network(net, f);
+		for (i = 0; i < n; i++) {
+			out = feedforward(net, data->inputs_training[i]);
+			half_feedforward(h, data->inputs_training[i], out_h);
+			for (j = 0; j < 6; j++) {
+				err[f] = MAX(err[f], fabs(out->data[j][0] - out_h[j]));
+			}
+			free_matrix(out);
+		}
+		/* The master weights move: the copy follows them */
+		vector_scale(net->params->data, 0.5, net->params->n_weights);
+		half_network_update(h, net);
+		out = feedforward(net, data->inputs_training[0]);
+		half_feedforward(h, data->inputs_training[0], out_h);
+		err[f] = MAX(err[f], fabs(out->data[0][0] - out_h[0]));
+		free_matrix(out);
+		vector_scale(net->params->data, 2.0, net->params->n_weights);
+		destroy_half_network(h);
+	}
+	printf("max error fp16 %g, bf16 %g\n", err[HALF_FP16], err[HALF_BF16]);
+	ASSERT("fp16 outputs are within 0.005 of the double outputs",
+		   err[HALF_FP16] < 0.005);
+	ASSERT("bf16 outputs are within 0.02 of the double outputs",
+		   err[HALF_BF16] < 0.02);
+	free_training_data(data);
+	destroy_network(net);
+}
+
+void check_batched_and_sparse_network()
+{
+	printf("\n** BLOCK batched & sparse feedforward vs feedforward **\n");
+	int i, j, n = 9;
+	long k;
+	double err_batch = 0.0, err_sparse = 0.0, pruned_alive = 0.0;
+	Network *net = create_network(4, 12, 10, 8, 5);
+	TrainData *data = random_batch(n, 12, 5);
+	Matrix *inputs = create_matrix(12, n);
+	Matrix *out, *batch_out, *sparse_out;
+	SparseNetwork *snet;
+	double *mask = malloc(sizeof(double) * net->params->n_weights);
+	SGDOptions opts = {0};
+
+	for (i = 0; i < 12; i++)
+		for (j = 0; j < n; j++)
+			inputs->data[i][j] = data->inputs_training[j][i];
+
+	prune_network(net, 0.0, 0.6, mask);
+	ASSERT("prune_network zeroes the requested fraction of weights",
+		   fabs(network_sparsity(net) - 0.6) < 0.01);
+
+	snet = sparsify_network(net);
+	batch_out = feedforward_batch(net, inputs);
+	sparse_out = sparse_feedforward_batch(snet, inputs);
+	for (j = 0; j < n; j++) {
+		out = feedforward(net, data->inputs_training[j]);
+		for (i = 0; i < 5; i++) {
+			err_batch = MAX(err_batch,
+							fabs(out->data[i][0] - batch_out->data[i][j]));
+			err_sparse = MAX(err_sparse,
+							 fabs(out->data[i][0] - sparse_out->data[i][j]));
+		}
+		free_matrix(out);
+	}
+	ASSERT("feedforward_batch matches feedforward", err_batch < 1e-12);
+	ASSERT("sparse_feedforward_batch matches feedforward", err_sparse < 1e-12);
+
+	/* Fine-tuning with the mask must keep pruned weights at zero */
+	opts.weight_mask = mask;
+	SGD_with_options(net, data, 1, 3, 0.5, 1.0, &opts);
+	for (k = 0; k < net->params->n_weights; k++) {
+		if (mask[k] == 0.0) {
+			pruned_alive = MAX(pruned_alive, fabs(net->params->data[k]));
+		}
+	}
+	ASSERT("SGD with weight_mask keeps pruned weights at zero",
+		   pruned_alive == 0.0);
+
+	free(mask);
+	free_matrix(inputs);
+	free_matrix(batch_out);
+	free_matrix(sparse_out);
+	destroy_sparse_network(snet);
+	free_training_data(data);
+	destroy_network(net);
+}
+
+void check_save_network()
+{
+	printf("\n** BLOCK save/load network **\n");
+	char path[] = "/tmp/glia_check_XXXXXX";
+	Network *net = create_network(4, 7, 6, 5, 3);
+	Network *loaded;
+	close(mkstemp(path));
+	save_network(net, path);
+	loaded = load_network(path);
+	unlink(path);
+	ASSERT("save/load_network round-trips",
+		   loaded != NULL && loaded->n_layers == 4 &&
+		   loaded->sizes[1] == 6 && loaded->sizes[3] == 3 &&
+		   !memcmp(loaded->params->data, net->params->data,
+				   sizeof(double) * net->params->size));
+	destroy_network(net);
+	destroy_network(loaded);
+}
+
+/*** Gradients ***/
+
+/* Cross-entropy cost of the network for one sample: the cost whose
+ * derivative cost_derivative implements.
+ */
+static double cost(Network *net, double *x, double *y)
+{
+	int i, n = net->sizes[net->n_layers - 1];
+	double c = 0.0, a;
+	Matrix *out = feedforward(net, x);
+	for (i = 0; i < n; i++) {
+		a = out->data[i][0];
+		c -= y[i] * log(a) + (1 - y[i]) * log(1 - a);
+	}
+	free_matrix(out);
+	return c;
+}
+
+/* Compare the gradients from backpropagate with centered finite
+ * differences of the cost, for every weight and bias of the network.
+ * Returns the worst error, relative to GRAD_TOL.
+ */
+static double gradient_check(Network *net, double *x, double *y)
+{
+	int l;
+	long i;
+	double old, c_plus, c_minus, numeric, err, worst = 0.0;
+	int n_layers = net->n_layers;
+	MatrixList dw = malloc(sizeof(Matrix *) * (n_layers - 1));
+	MatrixList db = malloc(sizeof(Matrix *) * (n_layers - 1));
+	ParamBuffer *grad = create_param_buffer(n_layers, net->sizes);
+
+	backpropagate(net, x, y, dw, db);
+	for (l = 0; l < n_layers - 1; l++) {
+		matrix_add(grad->weights[l], dw[l]);
+		matrix_add(grad->biases[l], db[l]);
+		free_matrix(dw[l]);
+		free_matrix(db[l]);
+	}
+	/* grad has the same layout as net->params */
+	for (i = 0; i < net->params->size; i++) {
+		old = net->params->data[i];
+		net->params->data[i] = old + GRAD_EPS;
+		c_plus = cost(net, x, y);
+		net->params->data[i] = old - GRAD_EPS;
+		c_minus = cost(net, x, y);
+		net->params->data[i] = old;
+		numeric = (c_plus - c_minus) / (2 * GRAD_EPS);
+		err = fabs(numeric - grad->data[i]) /
+			  (GRAD_TOL * MAX(1.0, fabs(numeric)));
+		worst = MAX(worst, err);
+	}
+	free_param_buffer(grad);
+	free(dw);
+	free(db);
+	return worst;
+}
+
+void check_backpropagate()
+{
+	printf("\n** BLOCK backpropagate vs finite differences **\n");
+	int t, n_out;
+	double worst = 0.0;
+	double x[8], y[8];
+	Network *nets[3];
+	nets[0] = create_network(2, 5, 3);
+	nets[1] = create_network(3, 6, 5, 4);
+	nets[2] = create_network(4, 7, 6, 5, 3);
+	for (t = 0; t < 3; t++) {
+		n_out = nets[t]->sizes[nets[t]->n_layers - 1];
+		random_array(x, nets[t]->sizes[0]);
+		random_array(y, n_out);
+		/* Labels in [0, 1], like one-hot targets */
+		for (int i = 0; i < n_out; i++) {
+			y[i] = (y[i] + 1) / 2;
+		}
+		worst = MAX(worst, gradient_check(nets[t], x, y));
+		destroy_network(nets[t]);
+	}
+	ASSERT("backpropagate gradients match finite differences", worst < 1.0);
+}
+
+/* Random TrainData with n training samples and no testing samples. */
+static TrainData *random_batch(int n, int inputs_size, int outputs_size)
+{
+	int i;
+	TrainData *data = malloc(sizeof(TrainData));
+	data->n_train = n;
+	data->n_test = 0;
+	data->inputs_size = inputs_size;
+	data->outputs_size = outputs_size;
+	data->inputs_training = malloc(sizeof(double *) * n);
+	data->labels_training = malloc(sizeof(double *) * n);
+	data->inputs_testing = NULL;
+	data->labels_testing = NULL;
+	data->sparse_inputs_training = NULL;
+	data->block = NULL;
+	for (i = 0; i < n; i++) {
+		data->inputs_training[i] = malloc(sizeof(double) * inputs_size);
+		data->labels_training[i] = calloc(outputs_size, sizeof(double));
+		random_array(data->inputs_training[i], inputs_size);
+		data->labels_training[i][rand() % outputs_size] = 1.0;
+	}
+	return data;
+}
+
+/* network_update_mini_batch must match the update computed layer by
+ * layer with the reference kernels:
+ * W = (1 - eta*lambda/N_total)*W - (eta/n)*sum(dW),  B = B - (eta/n)*sum(dB)
+ */
+/* The update of network_update_mini_batch computed layer by layer with
+ * the reference kernels, applied to ref:
+ * W = (1 - eta*lambda/N_total)*W - (eta/n)*sum(dW),  B = B - (eta/n)*sum(dB)
+ */
+static void reference_update(Network *ref, TrainData *batch, double eta,
+							 double lambda, int N_total)
+{
+	int i, l, n = batch->n_train, n_layers = ref->n_layers;
+	MatrixList dw = malloc(sizeof(Matrix *) * (n_layers - 1));
+	MatrixList db = malloc(sizeof(Matrix *) * (n_layers - 1));
+	ParamBuffer *nabla = create_param_buffer(n_layers, ref->sizes);
+	Matrix *w, *b;
+
+	for (i = 0; i < n; i++) {
+		backpropagate(ref, batch->inputs_training[i],
+					  batch->labels_training[i], dw, db);
+		for (l = 0; l < n_layers - 1; l++) {
+			matrix_add(nabla->weights[l], dw[l]);
+			matrix_add(nabla->biases[l], db[l]);
+			free_matrix(dw[l]);
+			free_matrix(db[l]);
+		}
+	}
+	for (l = 0; l < n_layers - 1; l++) {
+		w = ref->weights[l];
+		b = ref->biases[l];
+		matrix_multiply(w, 1 - eta * lambda / N_total);
+		matrix_multiply(nabla->weights[l], -eta / n);
+		matrix_add(w, nabla->weights[l]);
+		matrix_multiply(nabla->biases[l], -eta / n);
+		matrix_add(b, nabla->biases[l]);
+	}
+	free_param_buffer(nabla);
+	free(dw);
+	free(db);
+}
+
+void check_update_mini_batch()
+{
+	printf("\n** BLOCK network_update_mini_batch vs reference update **\n");
+	int n = 7, N_total = 100;
+	double eta = 0.3, lambda = 2.0;
+	Network *net = create_network(4, 9, 8, 6, 4);
+	Network *ref = create_network(4, 9, 8, 6, 4);
+	TrainData *batch = random_batch(n, 9, 4);
+
+	vector_copy(ref->params->data, net->params->data, net->params->size);
+	network_update_mini_batch(net, batch, eta, lambda, N_total, 0);
+	reference_update(ref, batch, eta, lambda, N_total);
+	ASSERT("network_update_mini_batch matches the reference update",
+		   max_rel_diff_array(net->params->data, ref->params->data,
+							  net->params->size) < 1e-12);
+
+	free_training_data(batch);
+	destroy_network(net);
+	destroy_network(ref);
+}
+
+/* Zero ~80% of the entries of x. */
+static void sparsify_array(double *x, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		if (rand() % 5) {
+			x[i] = 0.0;
+		}
+	}
+}
+
+/* The sparse-input kernels and backpropagation path must match the
+ * dense ones on inputs with many zeros.
+ */
+void check_sparse_input()
+{
+	printf("\n** BLOCK sparse input path vs dense path **\n");
+	int t, l, n, k, n_layers, N_total = 100;
+	int sizes[4] = {60, 12, 7, 4};
+	double err_prod = 0, err_outer = 0, err_bp = 0;
+	double eta = 0.3, lambda = 2.0;
+	double x[70];
+	Matrix *a, *xm, *x_T, *y, *ref, *res, *tmp;
+	SparseVector *sv;
+	Network *net, *ref_net, *net_c;
+	TrainData *batch;
+	MatrixList dw = malloc(sizeof(Matrix *) * 3);
+	MatrixList db = malloc(sizeof(Matrix *) * 3);
+	MatrixList sdw = malloc(sizeof(Matrix *) * 3);
+	MatrixList sdb = malloc(sizeof(Matrix *) * 3);
+
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(50);
+		k = rand_dim(70);
+		a = random_matrix(n, k);
+		random_array(x, k);
+		sparsify_array(x, k);
+		sv = array_to_sparse_vector(x, k);
+		xm = array_to_matrix(x, k);
+		/* a x x */
+		ref = matrix_prod(a, xm);
+		res = matrix_prod_sparse_vector(a, sv);
+		err_prod = MAX(err_prod, max_rel_diff(ref, res));
+		free_matrix(ref);
+		free_matrix(res);
+		/* a + 0.7 * (y x x^T) */
+		y = random_matrix(n, 1);
+		x_T = transpose(xm);
+		tmp = matrix_prod(y, x_T);
+		matrix_multiply(tmp, 0.7);
+		ref = matrix_copy(a);
+		matrix_add(ref, tmp);
+		res = matrix_copy(a);
+		matrix_add_outer_sparse(res, 0.7, y, sv);
+		err_outer = MAX(err_outer, max_rel_diff(ref, res));
+		free_matrix(ref);
+		free_matrix(res);
+		free_matrix(tmp);
+		free_matrix(x_T);
+		free_matrix(y);
+		free_matrix(xm);
+		free_matrix(a);
+		free_sparse_vector(sv);
+	}
+	ASSERT("matrix_prod_sparse_vector matches matrix_prod", err_prod < 1e-12);
+	ASSERT("matrix_add_outer_sparse matches the dense outer product",
+		   err_outer < 1e-12);
+
+	/* backpropagate_sparse, with the sparse layer in the middle of the
+	 * network and as its only layer */
+	for (n_layers = 2; n_layers <= 4; n_layers += 2) {
+		net = create_network_from_sizes(n_layers, sizes);
+		random_array(x, sizes[0]);
+		sparsify_array(x, sizes[0]);
+		sv = array_to_sparse_vector(x, sizes[0]);
+		y = random_matrix(net->sizes[n_layers - 1], 1);
+		backpropagate(net, x, y->data[0], dw, db);
+		backpropagate_sparse(net, sv, y->data[0], sdw, sdb);
+		for (l = 0; l < n_layers - 1; l++) {
+			err_bp = MAX(err_bp, max_rel_diff(dw[l], sdw[l]));
+			err_bp = MAX(err_bp, max_rel_diff(db[l], sdb[l]));
+			free_matrix(dw[l]);
+			free_matrix(db[l]);
+			free_matrix(sdw[l]);
+			free_matrix(sdb[l]);
+		}
+		free_matrix(y);
+		free_sparse_vector(sv);
+		destroy_network(net);
+	}
+	ASSERT("backpropagate_sparse matches backpropagate", err_bp < 1e-12);
+
+	/* network_update_mini_batch on sparse inputs, detected on the fly or
+	 * compressed beforehand */
+	net = create_network_from_sizes(4, sizes);
+	net_c = create_network_from_sizes(4, sizes);
+	ref_net = create_network_from_sizes(4, sizes);
+	vector_copy(net_c->params->data, net->params->data, net->params->size);
+	vector_copy(ref_net->params->data, net->params->data, net->params->size);
+	batch = random_batch(7, sizes[0], sizes[3]);
+	for (t = 0; t < batch->n_train; t++) {
+		sparsify_array(batch->inputs_training[t], sizes[0]);
+	}
+	network_update_mini_batch(net, batch, eta, lambda, N_total, 0);
+	reference_update(ref_net, batch, eta, lambda, N_total);
+	ASSERT("network_update_mini_batch on sparse inputs matches the "
+		   "reference update",
+		   max_rel_diff_array(net->params->data, ref_net->params->data,
+							  net->params->size) < 1e-12);
+	ASSERT("compress_training_inputs accepts ~20% dense inputs",
+		   compress_training_inputs(batch, SPARSE_INPUT_MAX_DENSITY));
+	network_update_mini_batch(net_c, batch, eta, lambda, N_total, 0);
+	ASSERT("network_update_mini_batch on compressed inputs matches the "
+		   "reference update",
+		   max_rel_diff_array(net_c->params->data, ref_net->params->data,
+							  net->params->size) < 1e-12);
+
+	free_training_data(batch);
+	destroy_network(net);
+	destroy_network(net_c);
+	destroy_network(ref_net);
+	free(dw);
+	free(db);
+	free(sdw);
+	free(sdb);
+}
+
+/* matrix_ger and backpropagate_accumulate must add the same gradients
+ * as the outer product and backpropagate.
+ */
+void check_backpropagate_accumulate()
+{
+	printf("\n** BLOCK fused gradient accumulation vs backpropagate **\n");
+	int t, i, l, n, m;
+	int sizes[4] = {40, 12, 7, 4};
+	double err_ger = 0, err_acc = 0, x[40];
+	Matrix *a, *u, *v, *v_T, *ref, *res, *y;
+	SparseVector *sv;
+	Network *net = create_network_from_sizes(4, sizes);
+	ParamBuffer *nabla = create_param_buffer(4, sizes);
+	ParamBuffer *ref_nabla = create_param_buffer(4, sizes);
+	MatrixList dw = malloc(sizeof(Matrix *) * 3);
+	MatrixList db = malloc(sizeof(Matrix *) * 3);
+
+	for (t = 0; t < N_SHAPES; t++) {
+		n = rand_dim(70);
+		m = rand_dim(70);
+		a = random_matrix(n, m);
+		u = random_matrix(n, 1);
+		v = random_matrix(m, 1);
+		v_T = transpose(v);
+		ref = matrix_prod(u, v_T);
+		matrix_multiply(ref, -1.5);
+		matrix_add(ref, a);
+		res = matrix_copy(a);
+		matrix_ger(res, -1.5, u, v);
+		err_ger = MAX(err_ger, max_rel_diff(ref, res));
+		free_matrix(a);
+		free_matrix(u);
+		free_matrix(v);
+		free_matrix(v_T);
+		free_matrix(ref);
+		free_matrix(res);
+	}
+	ASSERT("matrix_ger matches the outer product", err_ger < 1e-12);
+
+	/* Sum of the gradients of dense and sparse inputs, alternately */
+	for (i = 0; i < 6; i++) {
+		random_array(x, sizes[0]);
+		if (i % 2) {
+			sparsify_array(x, sizes[0]);
+		}
+		sv = i % 2 ? array_to_sparse_vector(x, sizes[0]) : NULL;
+		y = random_matrix(sizes[3], 1);
+		backpropagate_accumulate(net, x, sv, y->data[0], nabla);
+		backpropagate(net, x, y->data[0], dw, db);
+		for (l = 0; l < 3; l++) {
+			matrix_add(ref_nabla->weights[l], dw[l]);
+			matrix_add(ref_nabla->biases[l], db[l]);
+			free_matrix(dw[l]);
+			free_matrix(db[l]);
+		}
+		free_matrix(y);
+		free_sparse_vector(sv);
+	}
+	err_acc = max_rel_diff_array(nabla->data, ref_nabla->data, nabla->size);
+	ASSERT("backpropagate_accumulate matches the sum of backpropagate",
+		   err_acc < 1e-12);
+
+	free(dw);
+	free(db);
+	free_param_buffer(nabla);
+	free_param_buffer(ref_nabla);
+	destroy_network(net);
+}
+
+/* Hogwild SGD (several threads updating the weights without locks) must
+ * still learn: compare its accuracy with serial SGD from the same start.
+ */
+void check_hogwild()
+{
+	printf("\n** BLOCK Hogwild SGD vs serial SGD **\n");
+	long i, pruned_nonzero = 0;
+	double acc_serial, acc_hogwild, *mask;
+	SGDOptions opts = {0};
+	TrainData *data = create_synthetic_data(6000, 1000, 784, 10, 0.2, 77);
+	Network *net = create_network(3, 784, 30, 10);
+	Network *hog = create_network(3, 784, 30, 10);
+	vector_copy(hog->params->data, net->params->data, net->params->size);
+	SGD(net, data, 3, 10, 0.5, 5.0);
+	acc_serial = test_accuracy(net, data);
+	opts.n_threads = 4;
+	SGD_with_options(hog, data, 3, 10, 0.5, 5.0, &opts);
+	acc_hogwild = test_accuracy(hog, data);
+	printf("accuracy serial %.2f%%, Hogwild (4 threads) %.2f%%\n",
+		   100 * acc_serial, 100 * acc_hogwild);
+	ASSERT("Hogwild SGD learns as well as serial SGD",
+		   acc_hogwild > acc_serial - 0.05);
+
+	/* The decay and the mask deferred by the sparse updates are applied
+	 * by the end of the epoch: pruned weights stay at zero */
+	mask = malloc(sizeof(double) * hog->params->n_weights);
+	for (i = 0; i < hog->params->n_weights; i++) {
+		mask[i] = i % 3 != 0;
+	}
+	opts.weight_mask = mask;
+	SGD_with_options(hog, data, 1, 10, 0.5, 5.0, &opts);
+	for (i = 0; i < hog->params->n_weights; i++) {
+		pruned_nonzero += mask[i] == 0 && hog->params->data[i] != 0;
+	}
+	ASSERT("Hogwild SGD keeps the masked weights at zero",
+		   pruned_nonzero == 0);
+	free(mask);
+	destroy_network(net);
+	destroy_network(hog);
+	free_training_data(data);
+}
+
+/* Asynchronous evaluation: the accuracy reported for the last epoch
+ * must be that of the trained network, and training must learn as well
+ * as with the evaluation between the epochs.
+ */
+void check_async_eval()
+{
+	printf("\n** BLOCK asynchronous evaluation vs synchronous **\n");
+	double acc_sync[3], acc_async[3] = {-1, -1, -1};
+	SGDOptions opts = {0};
+	TrainData *data = create_synthetic_data(3000, 1000, 784, 10, 0.2, 81);
+	Network *net = create_network(3, 784, 30, 10);
+	Network *async = create_network(3, 784, 30, 10);
+	vector_copy(async->params->data, net->params->data, net->params->size);
+	opts.accuracies = acc_sync;
+	SGD_with_options(net, data, 3, 10, 0.5, 5.0, &opts);
+	opts.accuracies = acc_async;
+	opts.async_eval = 1;
+	SGD_with_options(async, data, 3, 10, 0.5, 5.0, &opts);
+	printf("accuracies synchronous %.2f%% %.2f%% %.2f%%, asynchronous "
+		   "%.2f%% %.2f%% %.2f%%\n", 100 * acc_sync[0], 100 * acc_sync[1],
+		   100 * acc_sync[2], 100 * acc_async[0], 100 * acc_async[1],
+		   100 * acc_async[2]);
+	ASSERT("asynchronous evaluation reports the accuracies of every epoch",
+		   acc_async[0] >= 0 && acc_async[1] >= 0 &&
+		   acc_async[2] == test_accuracy(async, data));
+	ASSERT("training with asynchronous evaluation learns as well",
+		   acc_async[2] > acc_sync[2] - 0.05);
+	destroy_network(net);
+	destroy_network(async);
+	free_training_data(data);
+}
+
+/* The augmentation: with every option at zero it must copy the image,
+ * the noise must have the requested standard deviation, a small warp
+ * must keep a blob in [0, 1] with about the same mass, and SGD must
+ * still learn with augmented mini batches, leaving the data untouched.
+ */
+void check_augment()
+{
+	printf("\n** BLOCK data augmentation **\n");
+	int i;
+	double err, mean = 0, var = 0, mass_in = 0, mass_out = 0, acc;
+	double lo = 1, hi = 0, sum_u = 0;
+	double src[784], dst[784], copy[784], *sample;
+	float u[1000];
+	Rng rng;
+	AugmentOptions none = {28, 28, 0, 0, 0, 0, 0, 0, 0};
+	AugmentOptions noise = none, warp = none, opts = none;
+	SGDOptions sgd = {0};
+	Augmenter *a;
+	TrainData *data = create_synthetic_data(3000, 500, 784, 10, 0.2, 79);
+	Network *net = create_network(3, 784, 30, 10);
+
+	rng_seed(&rng, 1);
+	rng_uniform(&rng, u, 1000);
+	for (i = 0; i < 1000; i++) {
+		lo = u[i] < lo ? u[i] : lo;
+		hi = u[i] > hi ? u[i] : hi;
+		sum_u += u[i];
+	}
+	ASSERT("rng_uniform is uniform in [0, 1)",
+		   lo >= 0 && hi < 1 && fabs(sum_u / 1000 - 0.5) < 0.05);
+
+	random_array(src, 784);
+	for (i = 0; i < 784; i++) {
+		src[i] = fabs(src[i]) / 2;
+	}
+	a = create_augmenter(&none, 1);
+	augment_image(a, src, dst);
+	err = max_rel_diff_array(src, dst, 784);
+	destroy_augmenter(a);
+	ASSERT("augment_image with no options copies the image", err < 1e-6);
+
+	noise.noise = 0.1;
+	a = create_augmenter(&noise, 2);
+	for (i = 0; i < 784; i++) {
+		src[i] = 0.5;
+	}
+	augment_image(a, src, dst);
+	for (i = 0; i < 784; i++) {
+		mean += dst[i] / 784;
+	}
+	for (i = 0; i < 784; i++) {
+		var += (dst[i] - mean) * (dst[i] - mean) / 783;
+	}
+	destroy_augmenter(a);
+	printf("noise 0.1: mean %g, standard deviation %g\n", mean, sqrt(var));
+	ASSERT("augment_image adds noise of the requested deviation",
+		   fabs(mean - 0.5) < 0.02 && fabs(sqrt(var) - 0.1) < 0.02);
+
+	/* A centred disc, warped by a little of everything */
+	warp.max_shift = 2;
+	warp.max_rotation = 15;
+	warp.max_scale = 0.05;
+	warp.max_shear = 0.1;
+	warp.elastic_alpha = 8;
+	warp.elastic_sigma = 4;
+	a = create_augmenter(&warp, 3);
+	for (i = 0; i < 784; i++) {
+		src[i] = hypot(i % 28 - 13.5, i / 28 - 13.5) < 7 ? 1.0 : 0.0;
+		mass_in += src[i];
+	}
+	augment_image(a, src, dst);
+	lo = 1;
+	hi = 0;
+	for (i = 0; i < 784; i++) {
+		mass_out += dst[i];
+		lo = dst[i] < lo ? dst[i] : lo;
+		hi = dst[i] > hi ? dst[i] : hi;
+	}
+	destroy_augmenter(a);
+	printf("mass of the disc %g, warped %g\n", mass_in, mass_out);
+	ASSERT("augment_image warps within [0, 1], keeping the mass",
+		   lo >= 0 && hi <= 1 && fabs(mass_out - mass_in) < 0.25 * mass_in);
+
+	/* Mild augmentation of synthetic data, on 4 threads (SGD shuffles the
+	 * samples, so follow one of them) */
+	sample = data->inputs_training[0];
+	memcpy(copy, sample, sizeof(copy));
+	opts.noise = 0.05;
+	sgd.n_threads = 4;
+	sgd.augment = &opts;
+	SGD_with_options(net, data, 3, 10, 0.5, 5.0, &sgd);
+	acc = test_accuracy(net, data);
+	printf("accuracy with augmentation %.2f%%\n", 100 * acc);
+	ASSERT("SGD with augmentation leaves the data untouched",
+		   memcmp(copy, sample, sizeof(copy)) == 0);
+	ASSERT("SGD with augmentation learns", acc > 0.5);
+
+	/* Images whose size is not the size of the inputs are rejected */
+	opts.width = 27;
+	memcpy(copy, net->params->data, sizeof(double) * 784);
+	SGD_with_options(net, data, 1, 10, 0.5, 5.0, &sgd);
+	ASSERT("SGD rejects an augmentation of the wrong image size",
+		   memcmp(copy, net->params->data, sizeof(double) * 784) == 0);
+	destroy_network(net);
+	free_training_data(data);
+}
+
+/* Bit i of a dropout mask. */
+static int mask_bit(uint64_t *mask, int i)
+{
+	return (mask[i / 64] >> (i % 64)) & 1;
+}
+
+/* Dropout: rng_mask must keep the requested fraction of units; with
+ * rates of zero the gradient must be the plain one; otherwise it must be
+ * the gradient of the network with the same units removed (the dropped
+ * inputs zeroed, the weights out of dropped hidden units zeroed, the
+ * kept ones scaled) with respect to the kept weights. And SGD with
+ * dropout must learn.
+ */
+void check_dropout()
+{
+	printf("\n** BLOCK dropout vs the thinned network **\n");
+	int i, l, r, c, kept = 0, sizes[4] = {40, 30, 20, 5};
+	double rates[3] = {0.2, 0.5, 0.3}, zeros[3] = {0, 0, 0};
+	double err_zero, err = 0, acc, f;
+	uint64_t mask[4];
+	Rng rng;
+	Network *net = create_network_from_sizes(4, sizes);
+	Network *thin = create_network_from_sizes(4, sizes);
+	ParamBuffer *nabla = create_param_buffer(4, sizes);
+	ParamBuffer *ref = create_param_buffer(4, sizes);
+	TrainData *batch = random_batch(1, 40, 5);
+	Dropout *d;
+	double x[40];
+	SGDOptions opts = {0};
+	double sgd_rates[2] = {0.0, 0.2};
+	TrainData *data;
+
+	rng_seed(&rng, 5);
+	rng_mask(&rng, mask, 200, 0.7);
+	for (i = 0; i < 200; i++) {
+		kept += mask_bit(mask, i);
+	}
+	printf("rng_mask kept %d of 200 units (p = 0.7)\n", kept);
+	ASSERT("rng_mask keeps the requested fraction, clears the tail",
+		   abs(kept - 140) < 25 && (mask[3] >> 8) == 0);
+
+	d = create_dropout(net, zeros, 1);
+	network_gradient_dropout(net, batch, nabla, d);
+	network_gradient(net, batch, ref);
+	err_zero = max_rel_diff_array(nabla->data, ref->data, nabla->size);
+	destroy_dropout(d);
+	ASSERT("dropout with rates of 0 gives the plain gradient", err_zero == 0);
+
+	d = create_dropout(net, rates, 2);
+	vector_zero(nabla->data, nabla->size);
+	vector_zero(ref->data, ref->size);
+	backpropagate_dropout(net, batch->inputs_training[0], NULL,
+						  batch->labels_training[0], nabla, d);
+	/* The thinned network, scaled by the masks left in d */
+	vector_copy(thin->params->data, net->params->data, net->params->size);
+	for (c = 0; c < 40; c++) {
+		x[c] = batch->inputs_training[0][c] * mask_bit(d->masks[0], c) /
+			(1 - rates[0]);
+	}
+	for (l = 1; l < 3; l++) {
+		for (r = 0; r < sizes[l+1]; r++) {
+			for (c = 0; c < sizes[l]; c++) {
+				thin->weights[l]->data[r][c] *= mask_bit(d->masks[l], c) /
+					(1 - rates[l]);
+			}
+		}
+	}
+	backpropagate_accumulate(thin, x, NULL, batch->labels_training[0], ref);
+	/* Gradients with respect to the weights of net: the chain rule
+	 * through the scaling */
+	for (l = 1; l < 3; l++) {
+		for (r = 0; r < sizes[l+1]; r++) {
+			for (c = 0; c < sizes[l]; c++) {
+				ref->weights[l]->data[r][c] *= mask_bit(d->masks[l], c) /
+					(1 - rates[l]);
+			}
+		}
+	}
+	for (i = 0; i < nabla->size; i++) {
+		f = fabs(nabla->data[i] - ref->data[i]) /
+			MAX(1e-3, fabs(ref->data[i]));
+		err = MAX(err, f);
+	}
+	printf("max relative difference with the thinned network %g\n", err);
+	ASSERT("dropout gradient matches the thinned network", err < 1e-12);
+	destroy_dropout(d);
+
+	rates[0] = 1.0;
+	ASSERT("create_dropout rejects a rate of 1",
+		   create_dropout(net, rates, 3) == NULL);
+
+	data = create_synthetic_data(3000, 500, 784, 10, 0.2, 80);
+	destroy_network(net);
+	net = create_network(3, 784, 30, 10);
+	opts.dropout = sgd_rates;
+	SGD_with_options(net, data, 3, 10, 0.5, 5.0, &opts);
+	acc = test_accuracy(net, data);
+	printf("accuracy with dropout %.2f%%\n", 100 * acc);
+	ASSERT("SGD with dropout learns", acc > 0.5);
+
+	free_training_data(data);
+	free_training_data(batch);
+	free_param_buffer(nabla);
+	free_param_buffer(ref);
+	destroy_network(net);
+	destroy_network(thin);
+}
+
+/* NUMA placement, which must work (as a single node) on any machine. */
+void check_numa()
+{
+	printf("\n** BLOCK NUMA placement **\n");
+	int i, node, ok = 1, n_nodes = numa_node_count(), cpus[1024];
+	int n_cpus = numa_node_cpus(0, cpus, 1024);
+	long n_bytes = NUMA_HUGE_MIN + 1000;
+	double *p, diff = 0;
+	void *affinity;
+	Matrix *out, *ref;
+	Network *net = create_network(3, 20, 9, 4);
+	NetworkReplicas *replicas;
+	TrainData *data = create_synthetic_data(3000, 500, 784, 10, 0.2, 81);
+	TrainData *copy;
+	SGDOptions opts = {0};
+	double acc;
+
+	printf("%d node(s), %d CPU(s) on node 0\n", n_nodes, n_cpus);
+	for (i = 0; i < (n_cpus < 1024 ? n_cpus : 1024); i++) {
+		ok = ok && numa_node_of_cpu(cpus[i]) == 0;
+	}
+	ASSERT("The topology has nodes with CPUs, node_of_cpu agrees",
+		   n_nodes >= 1 && n_cpus >= 1 && ok);
+
+	affinity = numa_save_affinity();
+	node = numa_pin_thread(1);
+	ASSERT("numa_pin_thread runs the thread on its node",
+		   node == 1 % n_nodes && numa_current_node() == node);
+	numa_restore_affinity(affinity);
+	ASSERT("numa_pin_node rejects a node that does not exist",
+		   !numa_pin_node(n_nodes));
+
+	p = numa_alloc_huge(n_bytes);
+	memset(p, 1, n_bytes);
+	ASSERT("numa_alloc_huge aligns large blocks to huge pages",
+		   (unsigned long)p % NUMA_HUGE_PAGE == 0);
+	ASSERT("numa_bind and numa_interleave succeed",
+		   numa_bind(p, n_bytes, 0) && numa_interleave(p, n_bytes) &&
+		   ((char *)p)[n_bytes - 1] == 1);
+	free(p);
+
+	copy = copy_training_data(data, 1);
+	ok = copy->n_train == data->n_train && copy->n_test == data->n_test;
+	for (i = 0; ok && i < data->n_train; i++) {
+		ok = !memcmp(copy->inputs_training[i], data->inputs_training[i],
+					 sizeof(double) * 784) &&
+			!memcmp(copy->labels_training[i], data->labels_training[i],
+					sizeof(double) * 10);
+	}
+	for (i = 0; ok && i < data->n_test; i++) {
+		ok = !memcmp(copy->inputs_testing[i], data->inputs_testing[i],
+					 sizeof(double) * 784);
+	}
+	ASSERT("copy_training_data copies every sample", ok);
+
+	replicas = create_network_replicas(net, 2);
+	for (i = 0; i < 10; i++) {
+		ref = feedforward(net, data->inputs_testing[i] + 100);
+		out = feedforward(network_replica(replicas, i),
+						  data->inputs_testing[i] + 100);
+		diff = MAX(diff, max_rel_diff(out, ref));
+		free_matrix(out);
+		free_matrix(ref);
+	}
+	ASSERT("Replicas give the outputs of their network",
+		   replicas->nets[0] != net && diff == 0);
+	net->params->data[0] += 1;
+	network_replicas_update(replicas);
+	ASSERT("network_replicas_update copies the new weights",
+		   replicas->nets[1]->params->data[0] == net->params->data[0]);
+	destroy_network_replicas(replicas);
+
+	destroy_network(net);
+	net = create_network(3, 784, 30, 10);
+	opts.n_threads = 2;
+	opts.pin_threads = 1;
+	SGD_with_options(net, copy, 2, 10, 0.5, 5.0, &opts);
+	acc = test_accuracy(net, copy);
+	printf("accuracy of pinned threads %.2f%%\n", 100 * acc);
+	ASSERT("SGD with pinned threads learns", acc > 0.5);
+
+	free_training_data(copy);
+	free_training_data(data);
+	destroy_network(net);
+}
+
+/* Largest difference between the samples of two data sets. */
+static double max_data_diff(TrainData *a, TrainData *b)
+{
+	int i, j;
+	double d = 0;
+	for (i = 0; i < a->n_train; i++) {
+		for (j = 0; j < a->inputs_size; j++) {
+			d = MAX(d, fabs(a->inputs_training[i][j] -
+							b->inputs_training[i][j]));
+		}
+		for (j = 0; j < a->outputs_size; j++) {
+			d = MAX(d, fabs(a->labels_training[i][j] -
+							b->labels_training[i][j]));
+		}
+	}
+	for (i = 0; i < a->n_test; i++) {
+		for (j = 0; j < a->inputs_size; j++) {
+			d = MAX(d, fabs(a->inputs_testing[i][j] -
+							b->inputs_testing[i][j]));
+		}
+	}
+	return d;
+}
+
+/* Shards: exact and lossy round trips, the codecs picked per chunk,
+ * random chunk access and the parallel decoder.
+ */
+void check_shard()
+{
+	printf("\n** BLOCK shards: write, then decode in parallel **\n");
+	int i, j, ok;
+	char train_path[] = "/tmp/glia_check_shard_XXXXXX";
+	char test_path[] = "/tmp/glia_check_shard_XXXXXX";
+	double err, d, chunk_in[10 * 50], chunk_lab[10 * 10];
+	TrainData *data = create_synthetic_data(500, 100, 50, 10, 0.3, 83);
+	TrainData *loaded, *loaded4;
+	Shard *shard;
+	FILE *f;
+	close(mkstemp(train_path));
+	close(mkstemp(test_path));
+
+	/* 8-bit values, like MNIST: stored exactly */
+	for (i = 0; i < data->n_train + data->n_test; i++) {
+		double *x = i < data->n_train ? data->inputs_training[i] :
+			data->inputs_testing[i - data->n_train];
+		for (j = 0; j < data->inputs_size; j++) {
+			x[j] = round(x[j] * 255) / 255;
+		}
+	}
+	/* Chunk 0 mostly zeros, chunk 1 scattered zeros, chunk 2 none */
+	for (i = 0; i < 30; i++) {
+		for (j = 0; j < 50; j++) {
+			data->inputs_training[i][j] =
+				i < 10 ? (j == 25) * 128 / 255.0 :
+				i < 20 ? (j % 3 != 0) * (j + 1) / 255.0 : (j + 1) / 255.0;
+		}
+	}
+	ok = shard_write(train_path, data->inputs_training,
+					 data->labels_training, data->n_train, 50, 10, 10, &err) &&
+		shard_write(test_path, data->inputs_testing, data->labels_testing,
+					data->n_test, 50, 10, 7, NULL);
+	loaded = ok ? shard_load(train_path, test_path) : NULL;
+	ASSERT("8-bit data is stored exactly", loaded != NULL && err == 0 &&
+		   loaded->n_train == 500 && loaded->n_test == 100 &&
+		   max_data_diff(data, loaded) == 0);
+
+	shard = shard_open(train_path);
+	ok = shard != NULL && shard->header.exact && shard->header.n_chunks == 50;
+	ASSERT("Each chunk gets the smallest codec (ZRLE, MASK, raw)", ok &&
+		   shard->index[0].codec == SHARD_CODEC_ZRLE &&
+		   shard->index[1].codec == SHARD_CODEC_MASK &&
+		   shard->index[2].codec == SHARD_CODEC_RAW);
+	ok = ok && shard_read_chunk(shard, 37, chunk_in, chunk_lab);
+	for (i = 0; ok && i < 10; i++) {
+		ok = !memcmp(chunk_in + i * 50, data->inputs_training[370 + i],
+					 sizeof(double) * 50) &&
+			!memcmp(chunk_lab + i * 10, data->labels_training[370 + i],
+					sizeof(double) * 10);
+	}
+	ASSERT("A chunk can be read on its own", ok &&
+		   !shard_read_chunk(shard, 50, chunk_in, chunk_lab));
+	ASSERT("Every chunk starts aligned", shard != NULL &&
+		   shard->index[1].offset % SHARD_ALIGN == 0 &&
+		   shard->index[49].offset % SHARD_ALIGN == 0);
+	shard_close(shard);
+
+	pool_set_threads(4);
+	loaded4 = shard_load(train_path, test_path);
+	pool_set_threads(0);
+	ASSERT("4 decoding threads give the same data", loaded4 != NULL &&
+		   max_data_diff(loaded, loaded4) == 0);
+	free_training_data(loaded4);
+	free_training_data(loaded);
+
+	/* Continuous values: rounded to 256 levels */
+	for (i = 0; i < data->n_train; i++) {
+		for (j = 0; j < data->inputs_size; j++) {
+			data->inputs_training[i][j] = 2.0 * rand() / RAND_MAX - 1;
+		}
+	}
+	ok = shard_write(train_path, data->inputs_training,
+					 data->labels_training, data->n_train, 50, 10, 64, &err);
+	loaded = ok ? shard_load(train_path, NULL) : NULL;
+	data->n_test = 0;
+	d = loaded != NULL ? max_data_diff(data, loaded) : 1;
+	data->n_test = 100;
+	printf("max quantization error %g (bound %g), max difference %g\n",
+		   err, 2.0 / 510, d);
+	ASSERT("Other data is rounded to 256 levels", loaded != NULL &&
+		   err <= 2.0 / 510 + 1e-12 && d <= err);
+	free_training_data(loaded);
+
+	data->labels_training[3][0] = 0.5;
+	ASSERT("Labels that are not one-hot are rejected",
+		   !shard_write(train_path, data->inputs_training,
+						data->labels_training, data->n_train, 50, 10, 64,
+						NULL));
+	f = fopen(train_path, "wb");
+	fputs("not a shard", f);
+	fclose(f);
+	ASSERT("A file that is not a shard is rejected",
+		   shard_open(train_path) == NULL &&
+		   shard_load(train_path, test_path) == NULL);
+
+	unlink(train_path);
+	unlink(test_path);
+	free_training_data(data);
+}
+
+typedef struct {
+	Network **nets;
+	SGDWorkspace **ws;
+	TrainData *data;
+} SweepArgs;
+
+/* Two epochs of each run in [begin, end) of a SweepArgs. */
+static void sweep_runs(void *arg, long begin, long end)
+{
+	SweepArgs *s = arg;
+	long i;
+	for (i = begin; i < end; i++) {
+		SGD_epoch(s->nets[i], s->data, s->ws[i], 0.5, 5.0, 0);
+		SGD_epoch(s->nets[i], s->data, s->ws[i], 0.5, 5.0, 0);
+	}
+}
+
+void check_sgd_epoch()
+{
+	printf("\n** BLOCK Concurrent SGD_epoch runs on shared data **\n");
+	int i, same_data = 1;
+	double diff = 0, acc;
+	TrainData *data = create_synthetic_data(3000, 500, 784, 10, 0.2, 78);
+	double **inputs = malloc(sizeof(double *) * data->n_train);
+	Network *nets[4], *seq[4];
+	SGDWorkspace *ws[4];
+	SweepArgs args = {nets, ws, data};
+	compress_training_inputs(data, SPARSE_INPUT_MAX_DENSITY);
+	memcpy(inputs, data->inputs_training, sizeof(double *) * data->n_train);
+	nets[0] = create_network(3, 784, 30, 10);
+	for (i = 0; i < 4; i++) {
+		if (i > 0) {
+			nets[i] = create_network_from_sizes(3, nets[0]->sizes);
+			vector_copy(nets[i]->params->data, nets[0]->params->data,
+						nets[0]->params->size);
+		}
+		seq[i] = create_network_from_sizes(3, nets[0]->sizes);
+		vector_copy(seq[i]->params->data, nets[0]->params->data,
+					nets[0]->params->size);
+	}
+	/* Same start, different shuffles: run them sequentially first */
+	for (i = 0; i < 4; i++) {
+		ws[i] = create_sgd_workspace(seq[i], data, 10 + 5 * i, i + 1);
+		SGD_epoch(seq[i], data, ws[i], 0.5, 5.0, 0);
+		SGD_epoch(seq[i], data, ws[i], 0.5, 5.0, 0);
+		free_sgd_workspace(ws[i]);
+		ws[i] = create_sgd_workspace(nets[i], data, 10 + 5 * i, i + 1);
+	}
+	pool_set_threads(4);
+	parallel_for(0, 4, 1, sweep_runs, &args);
+	pool_set_threads(0);
+	for (i = 0; i < data->n_train; i++) {
+		same_data = same_data && inputs[i] == data->inputs_training[i];
+	}
+	for (i = 0; i < 4; i++) {
+		double d = max_rel_diff_array(nets[i]->params->data,
+									  seq[i]->params->data,
+									  nets[i]->params->size);
+		diff = d > diff ? d : diff;
+	}
+	acc = test_accuracy(nets[0], data);
+	printf("max relative difference %g, accuracy of run 0 %.2f%%\n", diff,
+		   100 * acc);
+	ASSERT("SGD_epoch leaves the training data in place", same_data);
+	ASSERT("Concurrent runs match the same runs done one after the other",
+		   diff == 0);
+	ASSERT("SGD_epoch learns", acc > 0.5);
+	for (i = 0; i < 4; i++) {
+		free_sgd_workspace(ws[i]);
+		destroy_network(nets[i]);
+		destroy_network(seq[i]);
+	}
+	free(inputs);
+	free_training_data(data);
+}
+
+/* Worker of check_distributed: all-reduce a vector that depends on the
+ * rank, then do a distributed update of net with the samples
+ * [rank * n, (rank+1) * n) of batch; compare both with the serial
+ * results. Returns 1 if they match.
+ */
+static int distributed_worker(char *dir, int rank, int n_ranks,
+							  Network *net, Network *ref, TrainData *batch)
+{
+	int i, ok;
+	long n = 1000;
+	double x[1000], expected;
+	int per_rank = batch->n_train / n_ranks;
+	Ring *ring = ring_connect(dir, rank, n_ranks);
+	TrainData *shard;
+	ParamBuffer *nabla;
+	if (ring == NULL) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		x[i] = rank * 1000 + i;
+	}
+	ok = ring_allreduce(ring, x, n);
+	for (i = 0; ok && i < n; i++) {
+		/* sum over the ranks r of r * 1000 + i */
+		expected = 1000.0 * n_ranks * (n_ranks - 1) / 2 + (double)i * n_ranks;
+		ok = x[i] == expected;
+	}
+	/* rank 0's parameters everywhere */
+	if (rank != 0) {
+		vector_zero(net->params->data, net->params->size);
+	}
+	ok = ring_broadcast(ring, net->params->data, net->params->size, 0) &&
+		 ok && max_rel_diff_array(net->params->data, ref->params->data,
+								  net->params->size) == 0;
+	shard = subset_training_data(batch, rank * per_rank, per_rank);
+	nabla = create_param_buffer(net->n_layers, net->sizes);
+	ok = distributed_update_mini_batch(ring, net, shard, nabla, 0.3, 2.0,
+									   100, 0) >= 0 && ok;
+	network_update_mini_batch(ref, batch, 0.3, 2.0, 100, 0);
+	ok = ok && max_rel_diff_array(net->params->data, ref->params->data,
+								  net->params->size) < 1e-12;
+	free_param_buffer(nabla);
+	free(shard);
+	ring_close(ring);
+	return ok;
+}
+
+/* A ring of 3 processes on this host: ring_allreduce and ring_broadcast
+ * must be exact, and a data-parallel update must equal the serial update
+ * of the whole mini batch.
+ */
+void check_distributed()
+{
+	printf("\n** BLOCK ring all-reduce & distributed update vs serial **\n");
+	int i, status, n_ranks = 3, n_started = 0, ok = 1;
+	char dir[] = "/tmp/glia_check_ring_XXXXXX";
+	pid_t pids[3];
+	Network *net = create_network(3, 20, 9, 4);
+	Network *ref = create_network(3, 20, 9, 4);
+	TrainData *batch = random_batch(12, 20, 4);
+	vector_copy(ref->params->data, net->params->data, net->params->size);
+	if (mkdtemp(dir) == NULL) {
+		ok = 0;
+	}
+	fflush(stdout);
+	for (i = 0; ok && i < n_ranks; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			_exit(!distributed_worker(dir, i, n_ranks, net, ref, batch));
+		}
+		ok = pids[i] > 0;
+		n_started += ok;
+	}
+	for (i = 0; i < n_started; i++) {
+		waitpid(pids[i], &status, 0);
+		ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+	rmdir(dir);
+	ASSERT("3 ranks: all-reduce, broadcast and distributed update match",
+		   ok);
+	free_training_data(batch);
+	destroy_network(net);
+	destroy_network(ref);
+}
+
+typedef struct {
+	char *path;
+	Network *net;
+	TrainData *batch;
+	double max_diff;
+	int ok;
+} ServeClient;
+
+/* Client of check_serve: send the whole batch, then check the replies. */
+static void *serve_client(void *arg)
+{
+	ServeClient *c = arg;
+	int i, n_in, n_out;
+	double out[4], d;
+	Matrix *expected;
+	int fd = serve_connect(c->path, &n_in, &n_out);
+	c->ok = fd >= 0 && n_in == 20 && n_out == 4;
+	for (i = 0; c->ok && i < c->batch->n_train; i++) {
+		c->ok = serve_send(fd, c->batch->inputs_training[i], n_in);
+	}
+	for (i = 0; c->ok && i < c->batch->n_train; i++) {
+		c->ok = serve_recv(fd, out, n_out);
+		expected = feedforward(c->net, c->batch->inputs_training[i]);
+		d = max_rel_diff_array(out, expected->data[0], n_out);
+		c->max_diff = d > c->max_diff ? d : c->max_diff;
+		free_matrix(expected);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return NULL;
+}
+
+/* Client of check_serve that sends requests without ever reading the
+ * replies, until the server drops it (ok) or it gave up. */
+static void *stalled_client(void *arg)
+{
+	ServeClient *c = arg;
+	int i, n_in, n_out;
+	int fd = serve_connect(c->path, &n_in, &n_out);
+	c->ok = 0;
+	for (i = 0; fd >= 0 && i < 1000000; i++) {
+		if (!serve_send(fd, c->batch->inputs_training[i % 30], n_in)) {
+			c->ok = 1;
+			break;
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return NULL;
+}
+
+void check_serve()
+{
+	printf("\n** BLOCK inference server vs feedforward **\n");
+	int i, ok = 1;
+	double diff = 0;
+	char path[] = "/tmp/glia_check_serve_XXXXXX";
+	ServeOptions opts = {.max_batch = 8, .max_wait_us = 20000};
+	ServeStats stats;
+	ServeClient clients[4];
+	pthread_t threads[4];
+	Network *net = create_network(3, 20, 9, 4);
+	TrainData *batch = random_batch(30, 20, 4);
+	Server *server;
+	int fd = mkstemp(path);
+	close(fd);
+	server = create_server(net, path, &opts);
+	if (server == NULL) {
+		ASSERT("server started", 0);
+		return;
+	}
+	for (i = 0; i < 4; i++) {
+		clients[i] = (ServeClient){path, net, batch, 0, 0};
+		pthread_create(&threads[i], NULL, serve_client, &clients[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		ok = ok && clients[i].ok;
+		diff = clients[i].max_diff > diff ? clients[i].max_diff : diff;
+	}
+	server_stats(server, &stats, 0);
+	destroy_server(server);
+	printf("%ld requests in %ld batches (max %d), max relative "
+		   "difference %g\n", stats.n_requests, stats.n_batches,
+		   stats.max_batch, diff);
+	ASSERT("4 clients get all their replies, in order", ok &&
+		   stats.n_requests == 120 && stats.latency.count == 120);
+	ASSERT("Replies match feedforward", diff < 1e-12);
+	ASSERT("Requests are batched, up to max_batch",
+		   stats.n_batches < stats.n_requests && stats.max_batch <= 8);
+
+	/* A client that never reads its replies must not stall the others */
+	opts.send_timeout_ms = 50;
+	server = create_server(net, path, &opts);
+	clients[0] = (ServeClient){path, net, batch, 0, 0};
+	clients[1] = (ServeClient){path, net, batch, 0, 0};
+	pthread_create(&threads[0], NULL, stalled_client, &clients[0]);
+	usleep(100000);
+	pthread_create(&threads[1], NULL, serve_client, &clients[1]);
+	pthread_join(threads[1], NULL);
+	pthread_join(threads[0], NULL);
+	destroy_server(server);
+	ASSERT("A client not reading its replies is dropped, the others served",
+		   clients[0].ok && clients[1].ok);
+	free_training_data(batch);
+	destroy_network(net);
+}
+
+typedef struct {
+	OnlineModel *model;
+	atomic_int *stop;
+	atomic_long *n_reads;
+	int ok;
+} OnlineClient;
+
+/* Reader of check_online: every network it gets must hold a single
+ * value, which never decreases.
+ */
+static void *online_client(void *arg)
+{
+	OnlineClient *c = arg;
+	OnlineReader *r = online_reader(c->model);
+	Network *net;
+	long i;
+	double v, last = 0;
+	c->ok = r != NULL;
+	while (c->ok && !atomic_load(c->stop)) {
+		net = online_read_begin(c->model, r);
+		v = net->params->data[0];
+		for (i = 1; i < net->params->size; i++) {
+			c->ok = c->ok && net->params->data[i] == v;
+		}
+		c->ok = c->ok && v >= last;
+		last = v;
+		online_read_end(r);
+		atomic_fetch_add(c->n_reads, 1);
+		sched_yield();
+	}
+	online_reader_release(r);
+	return NULL;
+}
+
+/* Online learning: readers never see torn weights, a network being read
+ * is not reused, the model learns, and the server answers with it.
+ */
+void check_online()
+{
+	printf("\n** BLOCK online learning with lock-free publication **\n");
+	int i, k, ok = 1, n_published = 0;
+	double v, diff = 0, acc;
+	atomic_int stop;
+	atomic_long n_reads;
+	char path[] = "/tmp/glia_check_online_XXXXXX";
+	OnlineOptions opts = {0};
+	OnlineClient clients[3];
+	pthread_t threads[3];
+	OnlineModel *m;
+	OnlineReader *r;
+	Network *net = create_network(3, 20, 9, 4), *held;
+	TrainData *data, *batch = random_batch(30, 20, 4);
+	ServeOptions serve_opts = {.max_batch = 8, .max_wait_us = 20000};
+	ServeClient client = {path, NULL, batch, 0, 0};
+	Server *server;
+	int fd;
+
+	m = create_online_model(net, NULL);
+	atomic_init(&stop, 0);
+	atomic_init(&n_reads, 0);
+	for (i = 0; i < 3; i++) {
+		clients[i] = (OnlineClient){m, &stop, &n_reads, 0};
+	}
+	vector_zero(m->shadow->params->data, m->shadow->params->size);
+	online_publish(m);
+	for (i = 0; i < 3; i++) {
+		pthread_create(&threads[i], NULL, online_client, &clients[i]);
+	}
+	/* Yield so that the readers get to run even on a single CPU */
+	for (k = 1; k <= 500 || atomic_load(&n_reads) < 5000; k++) {
+		for (i = 0; i < m->shadow->params->size; i++) {
+			m->shadow->params->data[i] = k;
+		}
+		online_publish(m);
+		sched_yield();
+	}
+	atomic_store(&stop, 1);
+	for (i = 0; i < 3; i++) {
+		pthread_join(threads[i], NULL);
+		ok = ok && clients[i].ok;
+	}
+	printf("%d publications, %ld reads by 3 readers\n", k - 1,
+		   atomic_load(&n_reads));
+	ASSERT("Readers never see torn or older weights", ok);
+
+	r = online_reader(m);
+	held = online_read_begin(m, r);
+	v = held->params->data[0];
+	online_publish(m);
+	online_publish(m);
+	ok = m->retired != NULL && atomic_load(&m->current) != held;
+	for (i = 0; i < held->params->size; i++) {
+		ok = ok && held->params->data[i] == v;
+	}
+	ASSERT("A network being read is kept, untouched", ok);
+	online_read_end(r);
+	online_reader_release(r);
+	online_publish(m);
+	ASSERT("Retired networks are reclaimed once nobody reads them",
+		   m->retired == NULL && m->spare != NULL);
+	destroy_online_model(m);
+
+	data = create_synthetic_data(3000, 500, 784, 10, 0.2, 82);
+	destroy_network(net);
+	net = create_network(3, 784, 30, 10);
+	opts.publish_every = 10;
+	m = create_online_model(net, &opts);
+	for (k = 0; k < 3; k++) {
+		for (i = 0; i < data->n_train; i++) {
+			n_published += online_learn(m, data->inputs_training[i],
+										data->labels_training[i]);
+		}
+	}
+	acc = test_accuracy(atomic_load(&m->current), data);
+	printf("%ld updates, %d publications, accuracy %.2f%%\n",
+		   m->n_updates, n_published, 100 * acc);
+	ASSERT("Publications follow the cadence",
+		   m->n_updates == 900 && n_published == 90);
+	ASSERT("The published network learns", acc > 0.5);
+	destroy_online_model(m);
+
+	destroy_network(net);
+	net = create_network(3, 20, 9, 4);
+	m = create_online_model(net, NULL);
+	fd = mkstemp(path);
+	close(fd);
+	serve_opts.online = m;
+	server = create_server(net, path, &serve_opts);
+	/* The published copy has the weights of net */
+	client.net = net;
+	if (server != NULL) {
+		serve_client(&client);
+		destroy_server(server);
+	}
+	diff = client.max_diff;
+	ASSERT("The server answers with the published network",
+		   server != NULL && client.ok && diff < 1e-12);
+	destroy_online_model(m);
+
+	free_training_data(data);
+	free_training_data(batch);
+	destroy_network(net);
+}
+
+static void mark_range(void *arg, long begin, long end)
+{
+	int *visits = arg;
+	long i;
+	for (i = begin; i < end; i++) {
+		visits[i]++;
+	}
+}
+
+typedef struct {
+	int n;
+	long result;
+} FibTask;
+
+/* Fibonacci with nested fork/join. */
+static void fib_task(void *arg)
+{
+	FibTask *t = arg, a, b;
+	PoolGroup group;
+	if (t->n < 2) {
+		t->result = t->n;
+		return;
+	}
+	a.n = t->n - 1;
+	b.n = t->n - 2;
+	pool_group_init(&group);
+	pool_fork(&group, fib_task, &a);
+	fib_task(&b);
+	pool_join(&group);
+	t->result = a.result + b.result;
+}
+
+/* The thread pool: parallel_for must visit each index once, nested
+ * fork/join must complete, and the kernels it splits must give the same
+ * results with 4 threads as with 1.
+ */
+void check_pool()
+{
+	printf("\n** BLOCK thread pool: 4 threads vs 1 **\n");
+	int i, n = 100000, ok = 1;
+	int *visits = calloc(n, sizeof(int));
+	FibTask fib = {20, 0};
+	Matrix *a = random_matrix(300, 200), *b = random_matrix(200, 50);
+	Matrix *u = random_matrix(300, 1), *v = random_matrix(200, 1);
+	Matrix *ref_prod, *prod, *ref_ger, *ger, *ref_sp, *sp_res;
+	Matrix *ref_ew[4], *ew[4];
+	SparseMatrix *sp;
+
+	pool_set_threads(1);
+	ref_prod = matrix_prod_optim(a, b);
+	ref_ger = matrix_copy(a);
+	matrix_ger(ref_ger, 0.5, u, v);
+	sp = matrix_to_sparse(a);
+	ref_sp = sparse_prod(sp, b);
+	ref_ew[0] = matrix_copy(a);
+	ref_ew[1] = transpose(a);
+	ref_ew[2] = sigmoid_vect(a);
+	ref_ew[3] = create_matrix(300, 200);
+	srand(7);
+	matrix_fill_random(ref_ew[3]);
+
+	pool_set_threads(4);
+	ASSERT("pool_set_threads(4) gives 4 threads", pool_threads() == 4);
+	parallel_for(0, n, 100, mark_range, visits);
+	for (i = 0; i < n; i++) {
+		ok = ok && visits[i] == 1;
+	}
+	ASSERT("parallel_for visits every index exactly once", ok);
+	fib_task(&fib);
+	ASSERT("nested fork/join computes fib(20)", fib.result == 6765);
+	prod = matrix_prod_optim(a, b);
+	ger = matrix_copy(a);
+	matrix_ger(ger, 0.5, u, v);
+	sp_res = sparse_prod(sp, b);
+	ew[0] = matrix_copy(a);
+	ew[1] = transpose(a);
+	ew[2] = sigmoid_vect(a);
+	ew[3] = create_matrix(300, 200);
+	srand(7);
+	matrix_fill_random(ew[3]);
+	for (i = 0; i < 4; i++) {
+		ok = ok && max_rel_diff(ref_ew[i], ew[i]) == 0;
+	}
+	ASSERT("matrix_copy, transpose, sigmoid_vect and matrix_fill_random "
+		   "are the same with 4 threads", ok && ew[0]->data[7][9] ==
+		   a->data[7][9] && ew[1]->data[9][7] == a->data[7][9]);
+	ASSERT("matrix_prod_optim is the same with 4 threads",
+		   max_rel_diff(ref_prod, prod) == 0);
+	ASSERT("matrix_ger is the same with 4 threads",
+		   max_rel_diff(ref_ger, ger) == 0);
+	ASSERT("sparse_prod is the same with 4 threads",
+		   max_rel_diff(ref_sp, sp_res) == 0);
+	pool_set_threads(0);
+
+	free(visits);
+	free_sparse_matrix(sp);
+	free_matrix(a);
+	free_matrix(b);
+	free_matrix(u);
+	free_matrix(v);
+	free_matrix(ref_prod);
+	free_matrix(prod);
+	free_matrix(ref_ger);
+	free_matrix(ger);
+	free_matrix(ref_sp);
+	free_matrix(sp_res);
+	for (i = 0; i < 4; i++) {
+		free_matrix(ref_ew[i]);
+		free_matrix(ew[i]);
+	}
+}
+
+/* The tuned kernels give the results of the default ones, the tuner
+ * leaves its winners in use, and the cache round-trips them per shape.
+ */
+void check_tune()
+{
+	printf("\n** BLOCK autotuning and its cache **\n");
+	char dir[] = "/tmp/glia_tune_XXXXXX", path[64], sub[64];
+	int ok;
+	double err_blocked, err_batch;
+	Matrix *a, *b, *ref, *res;
+	Network *net = create_network(3, 20, 8, 4), *other;
+	TuneConfig initial, tuned, current, found;
+	tune_current(&initial);
+
+	a = random_matrix(37, 53);
+	b = random_matrix(53, 29);
+	ref = matrix_prod(a, b);
+	gemm_set_blocking(8, 24);
+	matrix_prod_set_blocked(4);
+	res = matrix_prod_optim(a, b);
+	err_blocked = max_rel_diff(ref, res);
+	free_matrix(ref);
+	free_matrix(res);
+	free_matrix(b);
+	b = random_matrix(20, 12);
+	ref = feedforward_batch(net, b);
+	feedforward_set_batch_crossover(13);
+	res = feedforward_batch(net, b);
+	err_batch = max_rel_diff(ref, res);
+	tune_apply(&initial);
+	ASSERT("matrix_prod_optim matches matrix_prod with the blocked kernel",
+		   err_blocked < 1e-12);
+	ASSERT("feedforward_batch by sample matches the batched one",
+		   err_batch < 1e-12);
+
+	ok = tune_network(net, 0.003, &tuned);
+	tune_current(&current);
+	ASSERT("tune_network leaves its settings in use",
+		   ok && !memcmp(&tuned, &current, sizeof(TuneConfig)));
+	ASSERT("tune_network picks settings among its candidates",
+		   tuned.n_threads >= 1 && tuned.block_k >= 32 &&
+		   tuned.block_n >= 64 && tuned.blocked_min_cols >= 0 &&
+		   tuned.batch_crossover >= 0 && tuned.mini_batch_size >= 1);
+	tune_apply(&initial);
+
+	mkdtemp(dir);
+	snprintf(sub, sizeof(sub), "%s/sub", dir);
+	snprintf(path, sizeof(path), "%s/tune", sub);
+	other = create_network(4, 20, 8, 8, 4);
+	current = tuned;
+	current.mini_batch_size++;
+	ok = tune_cache_store(path, net, &initial) &&
+		tune_cache_store(path, other, &current) &&
+		tune_cache_store(path, net, &tuned);
+	ASSERT("tune_cache_store creates the cache", ok);
+	ok = tune_cache_lookup(path, net, &found) &&
+		!memcmp(&found, &tuned, sizeof(TuneConfig));
+	ok = ok && tune_cache_lookup(path, other, &found) &&
+		!memcmp(&found, &current, sizeof(TuneConfig));
+	ASSERT("the cache keeps the latest settings of each shape", ok);
+	destroy_network(other);
+	other = create_network(3, 20, 9, 4);
+	ASSERT("other shapes are not in the cache",
+		   !tune_cache_lookup(path, other, &found));
+
+	setenv("GLIA_TUNE_CACHE", path, 1);
+	ok = tune_load(net);
+	tune_current(&current);
+	ok = ok && !memcmp(&current, &tuned, sizeof(TuneConfig));
+	tune_apply(&initial);
+	setenv("GLIA_TUNE", "0", 1);
+	ASSERT("tune_load applies the cached settings unless GLIA_TUNE=0",
+		   ok && !tune_load(net));
+	unsetenv("GLIA_TUNE");
+	unsetenv("GLIA_TUNE_CACHE");
+	tune_apply(&initial);
+
+	unlink(path);
+	rmdir(sub);
+	rmdir(dir);
+	free_matrix(a);
+	free_matrix(b);
+	free_matrix(ref);
+	free_matrix(res);
+	destroy_network(net);
+	destroy_network(other);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned seed = argc > 1 ? atoi(argv[1]) : 12345;
+	printf("check: seed %u\n", seed);
+	srand(seed);
+	check_matrix_prod();
+	check_strassen();
+	check_expr();
+	check_sparse_prod();
+	check_pool();
+	check_elementwise();
+	check_vector();
+	check_backpropagate();
+	check_update_mini_batch();
+	check_sparse_input();
+	check_backpropagate_accumulate();
+	check_int8();
+	check_quantized_network();
+	check_half();
+	check_half_network();
+	check_batched_and_sparse_network();
+	check_save_network();
+	check_hogwild();
+	check_async_eval();
+	check_augment();
+	check_dropout();
+	check_numa();
+	check_shard();
+	check_sgd_epoch();
+	check_distributed();
+	check_serve();
+	check_online();
+	check_tune();
+	return test_failures != 0;
+}
@@ -2,6 +2,7 @@
 #include <matrix.h>
 #include <test_utils.c>
 #include <neuron.h>
+#include <vector.h>
 
 #define ABS(X) ((X) >= 0 ? (X) : -(X))
 #define CMP(A, B) (ABS(A - (B)) < 1e-15)
@@ -139,6 +140,32 @@ void test_feed_forward()
 	destroy_network(net);
 }
 
+void test_param_buffer()
+{
+	printf("\n** BLOCK param_buffer **\n");
+
+	int sizes[3] = {3, 4, 2};
+	ParamBuffer *buf = create_param_buffer(3, sizes);
+	ASSERT("ParamBuffer has room for all weights and biases",
+		   buf->n_weights == 3*4 + 4*2 && buf->size == buf->n_weights + 4 + 2);
+	buf->weights[1]->data[1][3] = 5.0;
+	buf->biases[0]->data[3][0] = 7.0;
+	ASSERT("Weight views point into the flat buffer",
+		   CMP(buf->data[12 + 1*4 + 3], 5.0));
+	ASSERT("Bias views come after all the weights",
+		   CMP(buf->data[buf->n_weights + 3], 7.0));
+
+	vector_zero(buf->data, buf->size);
+	buf->data[0] = 3.0;
+	buf->data[buf->size - 1] = 4.0;
+	ASSERT("vector_clip_norm returns the norm before clipping",
+		   CMP(vector_clip_norm(buf->data, 1.0, buf->size), 5.0));
+	ASSERT("vector_clip_norm rescales to max_norm",
+		   CMP(vector_norm(buf->data, buf->size), 1.0) &&
+		   CMP(buf->biases[1]->data[1][0], 0.8));
+	free_param_buffer(buf);
+}
+
 int main(int argc, char *argv[])
 {
 	test_matrix_assign();
@@ -147,5 +174,6 @@ int main(int argc, char *argv[])
 	test_matrix_addition();
 	test_matrix_to_array();
 	test_feed_forward();
-	return 0;
+	test_param_buffer();
+	return test_failures != 0;
 }
@@ -23,6 +23,8 @@ int main()
 	labels_training[0][0] = 1.0;
 	data->inputs_training = inputs_training;
 	data->labels_training = labels_training;
+	data->sparse_inputs_training = NULL;
+	data->block = NULL;
 
 	Network *net = create_network(3, 2, 2, 1);
 	fprintf(stderr, "%d %d %d\n", net->sizes[0], net->sizes[1], net->sizes[2]);
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <neuron.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <dist.h>
+#include <numa.h>
+#include <tune.h>
+
+/*
+ * Coordinator of a data-parallel training on this host: loads the data
+ * once, forks one worker process per rank (they share the data
+ * copy-on-write), lets them train with SGD_distributed over a ring of
+ * Unix sockets, waits for them and reports the result saved by rank 0.
+ *
+ * With --rank R it runs a single worker instead, which joins the ring in
+ * --dir; start one per rank, with the same --workers and --dir.
+ *
+ * Each worker is pinned to a NUMA node (rank modulo the number of nodes),
+ * so that its network and its copy of its shard live there.
+ */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --workers N     number of processes (default 2)\n"
+			"  --mnist DIR     MNIST directory (default: synthetic data)\n"
+			"  --epochs N      epochs (default 3)\n"
+			"  --batch N       mini batch size per worker (default 0: the\n"
+			"                  tuned size, 10 if not tuned)\n"
+			"  --hidden N      hidden layer size (default 30)\n"
+			"  --out FILE      save the trained network to FILE\n"
+			"  --rank R        run only the worker of rank R\n"
+			"  --dir DIR       socket directory (required with --rank)\n",
+			prog);
+}
+
+/* Run the worker of one rank, with the tuned mini batch size if batch is
+ * 0; rank 0 saves the network to out_path. */
+static int worker(TrainData *data, int rank, int n_workers, char *dir,
+				  int epochs, int batch, int hidden, char *out_path)
+{
+	int ok;
+	Network *net;
+	Ring *ring;
+	TuneConfig tuned;
+	numa_pin_node(rank % numa_node_count());
+	net = create_network(3, data->inputs_size, hidden, 10);
+	tune_load(net);
+	if (batch == 0) {
+		tune_current(&tuned);
+		batch = tuned.mini_batch_size;
+	}
+	ring = ring_connect(dir, rank, n_workers);
+	if (ring == NULL) {
+		destroy_network(net);
+		return 0;
+	}
+	/* Each step averages n_workers times more samples: scale the learning
+	 * rate linearly to keep the progress per epoch */
+	ok = SGD_distributed(ring, net, data, epochs, batch, 0.5 * n_workers,
+						 5.0);
+	if (ok && rank == 0 && out_path != NULL) {
+		ok = save_network(net, out_path);
+	}
+	ring_close(ring);
+	destroy_network(net);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, status, n_workers = 2, epochs = 3, batch = 0, hidden = 30;
+	int rank = -1, failed = 0, aborted = 0;
+	char *mnist_path = NULL, *out_path = NULL, *dir = NULL;
+	char tmp_dir[] = "/tmp/glia-ring-XXXXXX", net_path[64];
+	double t0, t;
+	pid_t pids[256];
+	TrainData *data;
+	Network *net;
+	TuneConfig tuned;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			n_workers = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--epochs") && i + 1 < argc) {
+			epochs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+			batch = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--hidden") && i + 1 < argc) {
+			hidden = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			out_path = argv[++i];
+		} else if (!strcmp(argv[i], "--rank") && i + 1 < argc) {
+			rank = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--dir") && i + 1 < argc) {
+			dir = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (n_workers < 1 || n_workers > 256 || batch < 0 ||
+		(rank >= 0 && (dir == NULL || rank >= n_workers))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+	} else {
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+	}
+	if (rank >= 0) {
+		return !worker(data, rank, n_workers, dir, epochs, batch, hidden,
+					   out_path);
+	}
+
+	if (mkdtemp(tmp_dir) == NULL) {
+		fprintf(stderr, "Could not create a directory for the sockets.\n");
+		return 1;
+	}
+	if (out_path == NULL) {
+		snprintf(net_path, sizeof(net_path), "%s/net", tmp_dir);
+		out_path = net_path;
+	}
+	t0 = now_ns();
+	for (i = 0; i < n_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			_exit(!worker(data, i, n_workers, tmp_dir, epochs, batch,
+						  hidden, out_path));
+		}
+		if (pids[i] < 0) {
+			fprintf(stderr, "Could not start worker %d.\n", i);
+			n_workers = i;
+			failed = aborted = 1;
+			/* The others wait for it in the ring handshake */
+			for (i = 0; i < n_workers; i++) {
+				kill(pids[i], SIGTERM);
+			}
+			break;
+		}
+	}
+	for (i = 0; i < n_workers; i++) {
+		waitpid(pids[i], &status, 0);
+		if (!aborted && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+			fprintf(stderr, "Worker %d failed.\n", i);
+			failed = 1;
+		}
+	}
+	t = (now_ns() - t0) / 1e9;
+
+	net = failed ? NULL : load_network(out_path);
+	if (net != NULL) {
+		/* As the workers did */
+		tune_load(net);
+		if (batch == 0) {
+			tune_current(&tuned);
+			batch = tuned.mini_batch_size;
+		}
+		printf("workers:    %d (mini batch %d per worker, %d in total)\n",
+			   n_workers, batch, batch * n_workers);
+		printf("time:       %.3f s for %d epochs (%.0f samples/s)\n", t,
+			   epochs, (double)epochs * data->n_train / t);
+		printf("accuracy:   %.2f%%\n", 100 * test_accuracy(net, data));
+		destroy_network(net);
+	}
+	if (out_path == net_path) {
+		unlink(net_path);
+	}
+	rmdir(tmp_dir);
+	free_training_data(data);
+	return net == NULL;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <neuron.h>
+#include <vector.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <tune.h>
+
+/*
+ * Hogwild benchmark: trains the same network serially and with lock-free
+ * parallel SGD (1, 2, 4, ... threads) from the same initial weights, and
+ * reports for each the time and number of epochs it takes to reach a
+ * target test accuracy, and its training throughput.
+ */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --mnist DIR       MNIST directory (default: synthetic data)\n"
+			"  --threads N       largest number of threads (default 4)\n"
+			"  --target ACC      target test accuracy (default 0.9)\n"
+			"  --max-epochs N    give up after N epochs (default 10)\n"
+			"  --hidden N        hidden layer size (default 30)\n"
+			"  --augment         augment the 28x28 training images\n"
+			"  --dropout P       dropout rate of the hidden layer\n"
+			"  --pin             pin the threads over the NUMA nodes, the\n"
+			"                    data interleaved over their memory\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, epoch, threads, max_threads = 4, max_epochs = 10, hidden = 30;
+	double target = 0.9, t, t_serial = 0, acc;
+	char *mnist_path = NULL;
+	TrainData *data, *copy;
+	Network *init, *net;
+	SGDOptions opts = {0};
+	AugmentOptions augment = {28, 28, 2.0, 10.0, 0.1, 0.1, 34.0, 4.0, 0.0};
+	double dropout[2] = {0.0, 0.0};
+	TuneConfig tuned;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			max_threads = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--target") && i + 1 < argc) {
+			target = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-epochs") && i + 1 < argc) {
+			max_epochs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--hidden") && i + 1 < argc) {
+			hidden = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--augment")) {
+			opts.augment = &augment;
+		} else if (!strcmp(argv[i], "--dropout") && i + 1 < argc) {
+			dropout[1] = atof(argv[++i]);
+			opts.dropout = dropout;
+		} else if (!strcmp(argv[i], "--pin")) {
+			opts.pin_threads = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+	} else {
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+	}
+	if (opts.pin_threads) {
+		/* Read by all the threads: spread over all the nodes */
+		copy = copy_training_data(data, 1);
+		free_training_data(data);
+		data = copy;
+	}
+	init = create_network(3, data->inputs_size, hidden,
+						  data->outputs_size);
+	tune_load(init);
+	tune_current(&tuned);
+
+	printf("target accuracy %.2f%%, %d-%d-%d, %d training samples%s, "
+		   "mini batch %d, dropout %g%s\n", 100 * target, data->inputs_size,
+		   hidden, data->outputs_size, data->n_train,
+		   opts.augment != NULL ? ", augmented" : "",
+		   tuned.mini_batch_size, dropout[1],
+		   opts.pin_threads ? ", pinned" : "");
+	printf("%-8s %8s %8s %12s %10s %14s %10s\n", "mode", "threads",
+		   "epochs", "time (s)", "speedup", "samples/s", "accuracy");
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		net = create_network(3, data->inputs_size, hidden,
+							  data->outputs_size);
+		vector_copy(net->params->data, init->params->data,
+					net->params->size);
+		opts.n_threads = threads;
+		t = 0;
+		acc = 0;
+		/* The time to target includes the evaluation SGD does after each
+		 * epoch, the same for every mode, but not ours */
+		for (epoch = 1; epoch <= max_epochs && acc < target; epoch++) {
+			double t0 = now_ns();
+			SGD_with_options(net, data, 1, tuned.mini_batch_size, 0.5, 5.0,
+							 &opts);
+			t += (now_ns() - t0) / 1e9;
+			acc = test_accuracy(net, data);
+		}
+		if (threads == 1) {
+			t_serial = t;
+		}
+		printf("%-8s %8d %8d %12.3f %9.2fx %14.0f %9.2f%%%s\n",
+			   threads == 1 ? "serial" : "hogwild", threads, epoch - 1, t,
+			   t_serial / t, (epoch - 1) * (double)data->n_train / t,
+			   100 * acc, acc < target ? " (target not reached)" : "");
+		destroy_network(net);
+	}
+
+	destroy_network(init);
+	free_training_data(data);
+	return 0;
+}
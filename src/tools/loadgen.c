@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <neuron.h>
+#include <utils.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <serve.h>
+
+/*
+ * Load generator for the serve daemon: each client thread opens its own
+ * connection and keeps --depth requests in flight (closed loop), sending
+ * test samples for --duration seconds. Reports throughput, the latencies
+ * seen by the clients and the accuracy of the replies.
+ */
+
+typedef struct {
+	char *path;
+	TrainData *data;
+	int depth;
+	int offset;
+	long end_ns;
+	long n_requests;
+	long n_ok;
+	int failed;
+	LatencyHistogram latency;
+} Client;
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void *client_main(void *arg)
+{
+	Client *c = arg;
+	int i, fd, n_in, n_out, sample, n_sent = 0, n_recv = 0;
+	double *output;
+	/* send times of the requests in flight, a ring of 'depth' */
+	long *sent_ns = malloc(sizeof(long) * c->depth);
+	int *samples = malloc(sizeof(int) * c->depth);
+
+	fd = serve_connect(c->path, &n_in, &n_out);
+	if (fd < 0 || n_in != c->data->inputs_size ||
+		n_out != c->data->outputs_size) {
+		if (fd >= 0) {
+			fprintf(stderr, "The server's network is %d-...-%d, the data "
+					"%d-...-%d.\n", n_in, n_out, c->data->inputs_size,
+					c->data->outputs_size);
+			close(fd);
+		}
+		c->failed = 1;
+		free(sent_ns);
+		free(samples);
+		return NULL;
+	}
+	output = malloc(sizeof(double) * n_out);
+	for (;;) {
+		/* Keep 'depth' requests in flight until the end */
+		while (n_sent - n_recv < c->depth && now_ns() < c->end_ns) {
+			sample = (c->offset + n_sent) % c->data->n_test;
+			i = n_sent % c->depth;
+			samples[i] = sample;
+			sent_ns[i] = now_ns();
+			if (!serve_send(fd, c->data->inputs_testing[sample], n_in)) {
+				c->failed = 1;
+				break;
+			}
+			n_sent++;
+		}
+		if (n_recv == n_sent || c->failed) {
+			break;
+		}
+		if (!serve_recv(fd, output, n_out)) {
+			c->failed = 1;
+			break;
+		}
+		i = n_recv % c->depth;
+		latency_record(&c->latency, (now_ns() - sent_ns[i]) / 1e3);
+		if (argmax(output, n_out) ==
+			argmax(c->data->labels_testing[samples[i]], n_out)) {
+			c->n_ok++;
+		}
+		n_recv++;
+	}
+	c->n_requests = n_recv;
+	close(fd);
+	free(output);
+	free(sent_ns);
+	free(samples);
+	return NULL;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --socket PATH     server socket (default /tmp/glia.sock)\n"
+			"  --mnist DIR       send MNIST test samples (default: the\n"
+			"                    synthetic ones the server trains on)\n"
+			"  --clients N       concurrent connections (default 8)\n"
+			"  --depth N         requests in flight per client (default 1)\n"
+			"  --duration S      seconds (default 5)\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, n_clients = 8, depth = 1, failed = 0;
+	double duration = 5, t;
+	long t0, n_requests = 0, n_ok = 0;
+	char *path = "/tmp/glia.sock", *mnist_path = NULL;
+	TrainData *data;
+	Client *clients;
+	pthread_t *threads;
+	LatencyHistogram latency;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+			path = argv[++i];
+		} else if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--clients") && i + 1 < argc) {
+			n_clients = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--depth") && i + 1 < argc) {
+			depth = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+			duration = atof(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (n_clients < 1 || depth < 1 || duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+	} else {
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+	}
+	clients = calloc(n_clients, sizeof(Client));
+	threads = malloc(sizeof(pthread_t) * n_clients);
+	t0 = now_ns();
+	for (i = 0; i < n_clients; i++) {
+		clients[i].path = path;
+		clients[i].data = data;
+		clients[i].depth = depth;
+		clients[i].offset = i * (data->n_test / n_clients);
+		clients[i].end_ns = t0 + (long)(duration * 1e9);
+		pthread_create(&threads[i], NULL, client_main, &clients[i]);
+	}
+	memset(&latency, 0, sizeof(latency));
+	for (i = 0; i < n_clients; i++) {
+		pthread_join(threads[i], NULL);
+		failed |= clients[i].failed;
+		n_requests += clients[i].n_requests;
+		n_ok += clients[i].n_ok;
+		latency_merge(&latency, &clients[i].latency);
+	}
+	t = (now_ns() - t0) / 1e9;
+
+	printf("clients:     %d x %d in flight\n", n_clients, depth);
+	printf("requests:    %ld in %.2f s (%.0f req/s)%s\n", n_requests, t,
+		   n_requests / t, failed ? ", some clients failed" : "");
+	if (latency.count > 0) {
+		printf("latency us:  mean %.0f, p50 %.0f, p90 %.0f, p99 %.0f, "
+			   "max %.0f\n", latency.sum_us / latency.count,
+			   latency_percentile(&latency, 0.5),
+			   latency_percentile(&latency, 0.9),
+			   latency_percentile(&latency, 0.99), latency.max_us);
+		printf("accuracy:    %.2f%%\n", 100.0 * n_ok / n_requests);
+	}
+	free(clients);
+	free(threads);
+	free_training_data(data);
+	return failed;
+}
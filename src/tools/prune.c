@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <neuron.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <prune.h>
+
+/*
+ * Magnitude pruning tool: prunes a trained network, optionally
+ * fine-tunes it with SGD keeping the pruned weights at zero, and reports
+ * accuracy, model size and the inference throughput of the sparse (CSR)
+ * path against the dense one, one sample at a time and batched.
+ */
+
+#define BATCH 64
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The test inputs [start, start + n) as the columns of a matrix. */
+static Matrix *inputs_batch(TrainData *data, int start, int n)
+{
+	int i, j;
+	Matrix *m = create_matrix(data->inputs_size, n);
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < data->inputs_size; i++) {
+			m->data[i][j] = data->inputs_testing[start + j][i];
+		}
+	}
+	return m;
+}
+
+/* Samples per second over the test set, of the dense network (snet ==
+ * NULL) or of the sparse one; batched or one sample at a time.
+ */
+static double throughput(Network *net, SparseNetwork *snet, TrainData *data,
+						 int batched)
+{
+	int i, n;
+	double t = 0, t0;
+	Matrix *in, *out;
+	for (i = 0; i < data->n_test; i += n) {
+		if (batched) {
+			n = data->n_test - i < BATCH ? data->n_test - i : BATCH;
+			in = inputs_batch(data, i, n);
+			t0 = now_ns();
+			out = snet ? sparse_feedforward_batch(snet, in) :
+				  feedforward_batch(net, in);
+			t += now_ns() - t0;
+			free_matrix(in);
+		} else {
+			n = 1;
+			t0 = now_ns();
+			out = snet ? sparse_feedforward(snet, data->inputs_testing[i]) :
+				  feedforward(net, data->inputs_testing[i]);
+			t += now_ns() - t0;
+		}
+		free_matrix(out);
+	}
+	return data->n_test / (t / 1e9);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --net FILE       trained network (see save_network); without it\n"
+			"                   a 784-100-10 network is trained first\n"
+			"  --mnist DIR      MNIST directory (default: synthetic data)\n"
+			"  --sparsity S     fraction of the weights to prune (default 0.9)\n"
+			"  --threshold T    prune weights below T instead\n"
+			"  --finetune N     fine-tuning epochs after pruning (default 1)\n"
+			"  --epochs N       epochs when training (default 3)\n"
+			"  --out FILE       save the pruned network to FILE\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, epochs = 3, finetune = 1;
+	double sparsity = 0.9, threshold = 0.0;
+	char *net_path = NULL, *mnist_path = NULL, *out_path = NULL;
+	double acc_dense, acc_pruned, acc_tuned, acc_sparse;
+	double tp_d1, tp_s1, tp_db, tp_sb;
+	double *mask;
+	long bytes_d, bytes_s;
+	TrainData *data;
+	Network *net;
+	SparseNetwork *snet;
+	SGDOptions opts = {0};
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--net") && i + 1 < argc) {
+			net_path = argv[++i];
+		} else if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--sparsity") && i + 1 < argc) {
+			sparsity = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+			threshold = atof(argv[++i]);
+			sparsity = 0.0;
+		} else if (!strcmp(argv[i], "--finetune") && i + 1 < argc) {
+			finetune = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--epochs") && i + 1 < argc) {
+			epochs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			out_path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+	} else {
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+	}
+	if (net_path != NULL) {
+		net = load_network(net_path);
+		if (net == NULL) {
+			return 1;
+		}
+	} else {
+		net = create_network(3, data->inputs_size, 100, 10);
+		SGD(net, data, epochs, 10, 0.5, 5.0);
+	}
+	acc_dense = test_accuracy(net, data);
+	bytes_d = net->params->size * sizeof(double);
+	tp_d1 = throughput(net, NULL, data, 0);
+	tp_db = throughput(net, NULL, data, 1);
+
+	mask = malloc(sizeof(double) * net->params->n_weights);
+	threshold = prune_network(net, threshold, sparsity, mask);
+	acc_pruned = test_accuracy(net, data);
+	opts.weight_mask = mask;
+	SGD_with_options(net, data, finetune, 10, 0.5, 5.0, &opts);
+	acc_tuned = test_accuracy(net, data);
+	if (out_path != NULL && !save_network(net, out_path)) {
+		return 1;
+	}
+
+	snet = sparsify_network(net);
+	acc_sparse = sparse_test_accuracy(snet, data);
+	bytes_s = sparse_network_bytes(snet);
+	tp_s1 = throughput(net, snet, data, 0);
+	tp_sb = throughput(net, snet, data, 1);
+
+	printf("threshold:           %g\n", threshold);
+	printf("sparsity:            %.2f%% of the weights are zero\n",
+		   100 * network_sparsity(net));
+	printf("accuracy dense:      %.2f%%\n", 100 * acc_dense);
+	printf("accuracy pruned:     %.2f%% (delta %+.2f points)\n",
+		   100 * acc_pruned, 100 * (acc_pruned - acc_dense));
+	printf("accuracy fine-tuned: %.2f%% (delta %+.2f points, %d epochs)\n",
+		   100 * acc_tuned, 100 * (acc_tuned - acc_dense), finetune);
+	printf("accuracy sparse:     %.2f%%\n", 100 * acc_sparse);
+	printf("model size:          %ld -> %ld bytes (%.1fx smaller)\n",
+		   bytes_d, bytes_s, (double)bytes_d / bytes_s);
+	printf("throughput dense:    %.0f samples/s, batched %.0f samples/s\n",
+		   tp_d1, tp_db);
+	printf("throughput sparse:   %.0f samples/s (%.1fx), "
+		   "batched %.0f samples/s (%.1fx)\n",
+		   tp_s1, tp_s1 / tp_d1, tp_sb, tp_sb / tp_db);
+
+	free(mask);
+	destroy_sparse_network(snet);
+	destroy_network(net);
+	free_training_data(data);
+	return 0;
+}
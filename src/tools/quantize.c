@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <neuron.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <int8.h>
+#include <quantize.h>
+#include <halfnet.h>
+
+/*
+ * Post-training quantization tool: quantizes a trained network to int8
+ * and reports the accuracy delta, the model size and the inference
+ * throughput of the int8 path against the double precision one, then
+ * the same for 16-bit (fp16 and bf16) weights.
+ */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Samples per second of feedforward over the whole test set. */
+static double float_throughput(Network *net, TrainData *data)
+{
+	int i;
+	double t0 = now_ns();
+	for (i = 0; i < data->n_test; i++) {
+		free_matrix(feedforward(net, data->inputs_testing[i]));
+	}
+	return data->n_test / ((now_ns() - t0) / 1e9);
+}
+
+/* Samples per second of the int8 path, one sample at a time (batch 1)
+ * or batched.
+ */
+static double int8_throughput(QuantizedNetwork *q, TrainData *data,
+							  int batched)
+{
+	int i, s = q->sizes[q->n_layers - 1];
+	double t0, t;
+	double **outputs = malloc(sizeof(double *) * data->n_test);
+	for (i = 0; i < data->n_test; i++) {
+		outputs[i] = malloc(sizeof(double) * s);
+	}
+	t0 = now_ns();
+	if (batched) {
+		quantized_feedforward_batch(q, data->inputs_testing, data->n_test,
+									outputs);
+	} else {
+		for (i = 0; i < data->n_test; i++) {
+			quantized_feedforward(q, data->inputs_testing[i], outputs[i]);
+		}
+	}
+	t = now_ns() - t0;
+	for (i = 0; i < data->n_test; i++) {
+		free(outputs[i]);
+	}
+	free(outputs);
+	return data->n_test / (t / 1e9);
+}
+
+/* Samples per second of the batched 16-bit path. */
+static double half_throughput(HalfNetwork *h, TrainData *data)
+{
+	int i, s = h->sizes[h->n_layers - 1];
+	double t0, t;
+	double **outputs = malloc(sizeof(double *) * data->n_test);
+	for (i = 0; i < data->n_test; i++) {
+		outputs[i] = malloc(sizeof(double) * s);
+	}
+	t0 = now_ns();
+	half_feedforward_batch(h, data->inputs_testing, data->n_test, outputs);
+	t = now_ns() - t0;
+	for (i = 0; i < data->n_test; i++) {
+		free(outputs[i]);
+	}
+	free(outputs);
+	return data->n_test / (t / 1e9);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --net FILE     trained network (see save_network); without it\n"
+			"                 a 784-30-10 network is trained first\n"
+			"  --mnist DIR    MNIST directory (default: synthetic data)\n"
+			"  --calib N      calibration samples (default 1000)\n"
+			"  --epochs N     epochs when training (default 3)\n"
+			"  --out FILE     write the quantized network to FILE\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, n_calib = 1000, epochs = 3;
+	char *net_path = NULL, *mnist_path = NULL, *out_path = NULL;
+	double acc_f, acc_q, acc_h, tp_f, tp_q1, tp_qb, tp_h;
+	long bytes_f, bytes_q;
+	TrainData *data;
+	Network *net;
+	QuantizedNetwork *q;
+	HalfNetwork *h;
+	HalfFormat format;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--net") && i + 1 < argc) {
+			net_path = argv[++i];
+		} else if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--calib") && i + 1 < argc) {
+			n_calib = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--epochs") && i + 1 < argc) {
+			epochs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			out_path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+	} else {
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+	}
+	if (net_path != NULL) {
+		net = load_network(net_path);
+		if (net == NULL) {
+			return 1;
+		}
+	} else {
+		net = create_network(3, data->inputs_size, 30, 10);
+		SGD(net, data, epochs, 10, 0.5, 5.0);
+	}
+
+	q = quantize_network(net, data, n_calib);
+	if (out_path != NULL && !save_quantized_network(q, out_path)) {
+		return 1;
+	}
+
+	acc_f = test_accuracy(net, data);
+	acc_q = quantized_test_accuracy(q, data);
+	bytes_f = net->params->size * sizeof(double);
+	bytes_q = quantized_network_bytes(q);
+	tp_f = float_throughput(net, data);
+	tp_q1 = int8_throughput(q, data, 0);
+	tp_qb = int8_throughput(q, data, 1);
+
+	printf("int8 kernel:         %s\n", int8_kernel_name());
+	printf("calibration samples: %d\n", n_calib < data->n_train ?
+										n_calib : data->n_train);
+	printf("accuracy double:     %.2f%%\n", 100 * acc_f);
+	printf("accuracy int8:       %.2f%% (delta %+.2f points)\n",
+		   100 * acc_q, 100 * (acc_q - acc_f));
+	printf("model size:          %ld -> %ld bytes (%.1fx smaller)\n",
+		   bytes_f, bytes_q, (double)bytes_f / bytes_q);
+	printf("throughput double:   %.0f samples/s\n", tp_f);
+	printf("throughput int8:     %.0f samples/s (%.1fx)\n", tp_q1,
+		   tp_q1 / tp_f);
+	printf("throughput batched:  %.0f samples/s (%.1fx)\n", tp_qb,
+		   tp_qb / tp_f);
+	for (format = HALF_FP16; format <= HALF_BF16; format++) {
+		h = create_half_network(net, format);
+		acc_h = half_test_accuracy(h, data);
+		tp_h = half_throughput(h, data);
+		printf("%s (%s): accuracy %.2f%% (delta %+.2f points), %ld "
+			   "bytes, %.0f samples/s batched (%.1fx)\n",
+			   half_format_name(format), half_kernel_name(),
+			   100 * acc_h, 100 * (acc_h - acc_f), half_network_bytes(h),
+			   tp_h, tp_h / tp_f);
+		destroy_half_network(h);
+	}
+
+	destroy_quantized_network(q);
+	destroy_network(net);
+	free_training_data(data);
+	return 0;
+}
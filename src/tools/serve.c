@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <neuron.h>
+#include <synthetic.h>
+#include <serve.h>
+#include <tune.h>
+
+/*
+ * Inference daemon: serves a trained network on a Unix socket (see
+ * serve.h for the protocol), batching concurrent requests, and prints
+ * its throughput and latencies every few seconds until interrupted.
+ * Try it with the loadgen tool.
+ */
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+static void print_stats(ServeStats *st)
+{
+	LatencyHistogram *h = &st->latency;
+	printf("%8.0f req/s  %7.0f batches/s  batch %5.1f (max %3d)  busy "
+		   "%3.0f%%  latency us: mean %6.0f p50 %6.0f p99 %6.0f max %6.0f\n",
+		   st->n_requests / st->elapsed_s, st->n_batches / st->elapsed_s,
+		   st->n_batches > 0 ? (double)st->n_requests / st->n_batches : 0.0,
+		   st->max_batch, 100 * st->busy_s / st->elapsed_s,
+		   h->count > 0 ? h->sum_us / h->count : 0.0,
+		   latency_percentile(h, 0.5), latency_percentile(h, 0.99),
+		   h->max_us);
+	fflush(stdout);
+}
+
+static void add_stats(ServeStats *total, ServeStats *st)
+{
+	total->n_requests += st->n_requests;
+	total->n_batches += st->n_batches;
+	if (st->max_batch > total->max_batch) {
+		total->max_batch = st->max_batch;
+	}
+	total->busy_s += st->busy_s;
+	total->elapsed_s += st->elapsed_s;
+	latency_merge(&total->latency, &st->latency);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --net FILE        trained network (see save_network); without\n"
+			"                    it a 784-30-10 network is trained on\n"
+			"                    synthetic data first\n"
+			"  --socket PATH     socket to listen on (default /tmp/glia.sock)\n"
+			"  --max-batch N     largest batch (default %d)\n"
+			"  --max-wait-us N   longest wait for a batch to fill up, in\n"
+			"                    microseconds (default %d)\n"
+			"  --stats S         print stats every S seconds (default 5)\n"
+			"  --replicate       one batcher and network copy per NUMA node\n",
+			prog, SERVE_MAX_BATCH, SERVE_MAX_WAIT_US);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, interval = 5, waited = 0;
+	char *net_path = NULL, *path = "/tmp/glia.sock";
+	ServeOptions opts = {.max_batch = SERVE_MAX_BATCH,
+						 .max_wait_us = SERVE_MAX_WAIT_US};
+	ServeStats st, total;
+	struct sigaction sa;
+	TrainData *data;
+	Network *net;
+	Server *server;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--net") && i + 1 < argc) {
+			net_path = argv[++i];
+		} else if (!strcmp(argv[i], "--socket") && i + 1 < argc) {
+			path = argv[++i];
+		} else if (!strcmp(argv[i], "--max-batch") && i + 1 < argc) {
+			opts.max_batch = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-wait-us") && i + 1 < argc) {
+			opts.max_wait_us = atol(argv[++i]);
+		} else if (!strcmp(argv[i], "--stats") && i + 1 < argc) {
+			interval = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--replicate")) {
+			opts.replicate = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opts.max_batch < 1 || opts.max_wait_us < 0 || interval < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (net_path != NULL) {
+		net = load_network(net_path);
+		if (net == NULL) {
+			return 1;
+		}
+	} else {
+		fprintf(stderr, "Training a network on synthetic data...\n");
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+		net = create_network(3, data->inputs_size, 30, 10);
+		SGD(net, data, 3, 10, 0.5, 5.0);
+		free_training_data(data);
+	}
+	if (tune_load(net)) {
+		fprintf(stderr, "Using the tuned settings of %s.\n",
+				tune_cache_path());
+	}
+
+	server = create_server(net, path, &opts);
+	if (server == NULL) {
+		destroy_network(net);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	fprintf(stderr, "Serving a %d-input network on %s (batches of up to "
+			"%d, %ld us wait).\n", net->sizes[0], path, opts.max_batch,
+			opts.max_wait_us);
+
+	memset(&total, 0, sizeof(total));
+	while (!stopping) {
+		sleep(1);
+		if (++waited < interval) {
+			continue;
+		}
+		waited = 0;
+		server_stats(server, &st, 1);
+		if (st.n_requests > 0) {
+			print_stats(&st);
+		}
+		add_stats(&total, &st);
+	}
+	/* What was served since the last report */
+	server_stats(server, &st, 1);
+	add_stats(&total, &st);
+	destroy_server(server);
+	if (total.n_requests > 0) {
+		printf("total:\n");
+		print_stats(&total);
+	}
+	destroy_network(net);
+	return 0;
+}
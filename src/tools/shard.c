@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <neuron.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <shard.h>
+#include <pool.h>
+
+/*
+ * Shard conversion tool: writes a data set (MNIST, or synthetic data
+ * rounded to 8 bits like it) to a training and a testing shard (see
+ * shard.h), loads them back with the parallel decoder, checks that the
+ * samples are the same and reports the sizes and the decode throughput,
+ * against loading the IDX files.
+ */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long file_size(char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+/* Largest difference between the samples of a and b, infinite if they
+ * do not have the same shape.
+ */
+static double max_diff(TrainData *a, TrainData *b)
+{
+	int i, j;
+	double d = 0;
+	if (a->n_train != b->n_train || a->n_test != b->n_test ||
+		a->inputs_size != b->inputs_size ||
+		a->outputs_size != b->outputs_size) {
+		return INFINITY;
+	}
+	for (i = 0; i < a->n_train + a->n_test; i++) {
+		double *x = i < a->n_train ? a->inputs_training[i] :
+			a->inputs_testing[i - a->n_train];
+		double *y = i < a->n_train ? b->inputs_training[i] :
+			b->inputs_testing[i - a->n_train];
+		double *l = i < a->n_train ? a->labels_training[i] :
+			a->labels_testing[i - a->n_train];
+		double *m = i < a->n_train ? b->labels_training[i] :
+			b->labels_testing[i - a->n_train];
+		for (j = 0; j < a->inputs_size; j++) {
+			d = fmax(d, fabs(x[j] - y[j]));
+		}
+		for (j = 0; j < a->outputs_size; j++) {
+			d = fmax(d, fabs(l[j] - m[j]));
+		}
+	}
+	return d;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --mnist DIR     MNIST directory (default: synthetic data)\n"
+			"  --out PREFIX    write PREFIX-train.shard and PREFIX-test.shard\n"
+			"                  (default /tmp/glia)\n"
+			"  --chunk N       samples per chunk (default %d)\n"
+			"  --repeat N      decode N times, report the best (default 5)\n",
+			prog, SHARD_CHUNK_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, chunk = SHARD_CHUNK_SIZE, repeat = 5;
+	char *mnist_path = NULL, *prefix = "/tmp/glia";
+	char train_path[4096], test_path[4096];
+	double t0, t_idx = 0, t_write, t, t_best = INFINITY;
+	double err_train, err_test, diff;
+	long n_values, shard_bytes, idx_bytes;
+	TrainData *data, *loaded;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+			prefix = argv[++i];
+		} else if (!strcmp(argv[i], "--chunk") && i + 1 < argc) {
+			chunk = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+			repeat = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (chunk < 1 || repeat < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	snprintf(train_path, sizeof(train_path), "%s-train.shard", prefix);
+	snprintf(test_path, sizeof(test_path), "%s-test.shard", prefix);
+
+	t0 = now_ns();
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+		t_idx = (now_ns() - t0) / 1e9;
+	} else {
+		data = create_synthetic_data(60000, 10000, 784, 10, 0.2, 1234);
+		for (i = 0; i < data->n_train + data->n_test; i++) {
+			double *x = i < data->n_train ? data->inputs_training[i] :
+				data->inputs_testing[i - data->n_train];
+			for (j = 0; j < data->inputs_size; j++) {
+				x[j] = round(x[j] * 255) / 255;
+			}
+		}
+	}
+	n_values = (long)(data->n_train + data->n_test) * data->inputs_size;
+
+	t0 = now_ns();
+	if (!shard_write(train_path, data->inputs_training,
+					 data->labels_training, data->n_train, data->inputs_size,
+					 data->outputs_size, chunk, &err_train) ||
+		!shard_write(test_path, data->inputs_testing, data->labels_testing,
+					 data->n_test, data->inputs_size, data->outputs_size,
+					 chunk, &err_test)) {
+		free_training_data(data);
+		return 1;
+	}
+	t_write = (now_ns() - t0) / 1e9;
+	shard_bytes = file_size(train_path) + file_size(test_path);
+	/* IDX: one byte per pixel and per label, plus the headers */
+	idx_bytes = n_values + data->n_train + data->n_test + 2 * (16 + 8);
+
+	for (i = 0; i < repeat; i++) {
+		t0 = now_ns();
+		loaded = shard_load(train_path, test_path);
+		t = (now_ns() - t0) / 1e9;
+		t_best = t < t_best ? t : t_best;
+		if (loaded == NULL) {
+			free_training_data(data);
+			return 1;
+		}
+		if (i < repeat - 1) {
+			free_training_data(loaded);
+		}
+	}
+	diff = max_diff(data, loaded);
+
+	printf("%d training + %d testing samples of %d inputs, chunks of %d\n",
+		   data->n_train, data->n_test, data->inputs_size, chunk);
+	printf("%-24s %12s %10s\n", "", "bytes", "vs IDX");
+	printf("%-24s %12ld %9.2fx\n", "IDX (uint8)", idx_bytes, 1.0);
+	printf("%-24s %12ld %9.2fx\n", "doubles in memory",
+		   n_values * (long)sizeof(double), (double)n_values * 8 / idx_bytes);
+	printf("%-24s %12ld %9.2fx\n", "shards", shard_bytes,
+		   (double)shard_bytes / idx_bytes);
+	printf("written in %.3f s, max quantization error %g\n", t_write,
+		   fmax(err_train, err_test));
+	printf("decoded in %.3f s with %d threads: %.0f MB/s of shards in, "
+		   "%.0f MB/s of doubles out\n", t_best, pool_threads(),
+		   shard_bytes / t_best / 1e6, n_values * 8.0 / t_best / 1e6);
+	if (mnist_path != NULL) {
+		printf("IDX load (mnist_load) took %.3f s: %.1fx faster from "
+			   "shards\n", t_idx, t_idx / t_best);
+	}
+	printf("max difference with the source data %g\n", diff);
+
+	free_training_data(loaded);
+	free_training_data(data);
+	return diff > fmax(err_train, err_test);
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <neuron.h>
+#include <specialize.h>
+
+/*
+ * Kernel generator tool: writes the C source of the forward and backward
+ * passes specialized for one topology (see specialize.h), optionally
+ * with the weights of a network embedded as constants.
+ */
+
+#define MAX_LAYERS 256
+
+/* Parse a comma separated list of layer sizes; returns how many. */
+static int parse_sizes(char *s, int *sizes)
+{
+	int n = 0;
+	char *tok = strtok(s, ",");
+	while (tok != NULL && n < MAX_LAYERS) {
+		sizes[n++] = atoi(tok);
+		tok = strtok(NULL, ",");
+	}
+	return n;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --sizes LIST     layer sizes (default 784,30,10)\n"
+			"  --net FILE       network (see save_network) whose topology to\n"
+			"                   use and whose weights to embed\n"
+			"  --embed          embed the weights of a new random network\n"
+			"                   when there is no --net\n"
+			"  --prefix P       prefix of the generated names (default net)\n"
+			"  -o FILE          output file (default: standard output)\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ok, n_layers = 3, embed = 0;
+	int sizes[MAX_LAYERS] = {784, 30, 10};
+	char *net_path = NULL, *prefix = "net", *out_path = NULL;
+	Network *net = NULL;
+	FILE *out = stdout;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--sizes") && i + 1 < argc) {
+			n_layers = parse_sizes(argv[++i], sizes);
+		} else if (!strcmp(argv[i], "--net") && i + 1 < argc) {
+			net_path = argv[++i];
+		} else if (!strcmp(argv[i], "--embed")) {
+			embed = 1;
+		} else if (!strcmp(argv[i], "--prefix") && i + 1 < argc) {
+			prefix = argv[++i];
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			out_path = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (net_path != NULL) {
+		net = load_network(net_path);
+		if (net == NULL) {
+			return 1;
+		}
+		n_layers = net->n_layers;
+		memcpy(sizes, net->sizes, sizeof(int) * n_layers);
+	} else if (embed) {
+		if (n_layers < 2) {
+			usage(argv[0]);
+			return 1;
+		}
+		net = create_network_from_sizes(n_layers, sizes);
+	}
+	if (out_path != NULL) {
+		out = fopen(out_path, "w");
+		if (out == NULL) {
+			perror(out_path);
+			return 1;
+		}
+	}
+	ok = specialize_network(out, n_layers, sizes, prefix, net);
+	if (out != stdout && fclose(out) != 0) {
+		ok = 0;
+	}
+	if (!ok && out_path != NULL) {
+		remove(out_path);
+	}
+	if (net != NULL) {
+		destroy_network(net);
+	}
+	return !ok;
+}
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <neuron.h>
+#include <vector.h>
+#include <mnist.h>
+#include <synthetic.h>
+#include <pool.h>
+#include <tune.h>
+
+/*
+ * Hyperparameter sweep: trains one network per combination of mini batch
+ * size, learning rate and lambda, concurrently over the thread pool, all
+ * sharing a single read-only copy of the data (each run has its own
+ * SGDWorkspace). Successive halving stops the losers early: after each
+ * rung only the best 1/eta of the runs, by accuracy on a validation
+ * split of the training set, go on and train eta times longer.
+ */
+
+#define MAX_VALUES 16
+
+typedef struct {
+	int mini_batch_size;
+	double learning_rate;
+	double lambda;
+	Network *net;
+	SGDWorkspace *ws;
+	int epochs;
+	double val_acc;
+	double test_acc;
+	double train_s;
+	/* rung at which it was stopped, -1 if it never was */
+	int stopped;
+} Trial;
+
+/* One rung: train the trials to 'epochs' epochs and validate them. */
+typedef struct {
+	Trial **trials;
+	int epochs;
+	TrainData *fit;
+	TrainData *val;
+} Rung;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void train_trials(void *arg, long begin, long end)
+{
+	Rung *rung = arg;
+	Trial *t;
+	double t0;
+	long i;
+	for (i = begin; i < end; i++) {
+		t = rung->trials[i];
+		t0 = now_ns();
+		for (; t->epochs < rung->epochs; t->epochs++) {
+			SGD_epoch(t->net, rung->fit, t->ws, t->learning_rate,
+					  t->lambda, 0);
+		}
+		t->train_s += (now_ns() - t0) / 1e9;
+		t->val_acc = test_accuracy(t->net, rung->val);
+	}
+}
+
+/* Best validation accuracy first; runs still going before stopped ones. */
+static int cmp_trials(const void *a, const void *b)
+{
+	const Trial *x = *(Trial * const *)a, *y = *(Trial * const *)b;
+	int x_alive = x->stopped < 0, y_alive = y->stopped < 0;
+	if (x_alive != y_alive) {
+		return y_alive - x_alive;
+	}
+	if (x->stopped != y->stopped) {
+		return y->stopped - x->stopped;
+	}
+	return (y->val_acc > x->val_acc) - (y->val_acc < x->val_acc);
+}
+
+/* Parse a comma separated list of numbers; returns how many. */
+static int parse_list(char *s, double *values)
+{
+	int n = 0;
+	char *tok = strtok(s, ",");
+	while (tok != NULL && n < MAX_VALUES) {
+		values[n++] = atof(tok);
+		tok = strtok(NULL, ",");
+	}
+	return n;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --mnist DIR        MNIST directory (default: synthetic data)\n"
+			"  --batch LIST       mini batch sizes (default: the tuned size\n"
+			"                     and 3 times it, 10,30 if not tuned)\n"
+			"  --lr LIST          learning rates (default 0.1,0.5,3)\n"
+			"  --lambda LIST      L2 regularization (default 0,5)\n"
+			"  --hidden N         hidden layer size (default 30)\n"
+			"  --min-epochs N     epochs of the first rung (default 1)\n"
+			"  --max-epochs N     epochs of the last rung (default 8)\n"
+			"  --eta N            keep 1/eta of the runs per rung (default 2)\n"
+			"  --val N            validation samples taken from the\n"
+			"                     training set (default 1/10 of it)\n"
+			"  --threads N        threads (default: all CPUs)\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, j, k, n_trials, n_alive, rung_i, n_val = -1, threads = 0;
+	int hidden = 30, min_epochs = 1, max_epochs = 8, eta = 2;
+	double batches[MAX_VALUES], lrs[MAX_VALUES] = {0.1, 0.5, 3};
+	double lambdas[MAX_VALUES] = {0, 5};
+	/* n_batches < 0: the tuned mini batch size and 3 times it */
+	int n_batches = -1, n_lrs = 3, n_lambdas = 2;
+	char *mnist_path = NULL;
+	double t0, t_end;
+	TrainData *data, fit, val;
+	Network *init;
+	Trial *trials, **order;
+	Rung rung;
+	TuneConfig tuned;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--mnist") && i + 1 < argc) {
+			mnist_path = argv[++i];
+		} else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+			n_batches = parse_list(argv[++i], batches);
+		} else if (!strcmp(argv[i], "--lr") && i + 1 < argc) {
+			n_lrs = parse_list(argv[++i], lrs);
+		} else if (!strcmp(argv[i], "--lambda") && i + 1 < argc) {
+			n_lambdas = parse_list(argv[++i], lambdas);
+		} else if (!strcmp(argv[i], "--hidden") && i + 1 < argc) {
+			hidden = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--min-epochs") && i + 1 < argc) {
+			min_epochs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-epochs") && i + 1 < argc) {
+			max_epochs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--eta") && i + 1 < argc) {
+			eta = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--val") && i + 1 < argc) {
+			n_val = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	/* Every mini batch size must be at least 1 */
+	for (i = 0; i < n_batches && batches[i] >= 1; i++);
+	if (n_batches == 0 || i < n_batches || n_lrs < 1 || n_lambdas < 1 ||
+		min_epochs < 1 || eta < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Load once; from here on the data is only read */
+	if (mnist_path != NULL) {
+		data = mnist_load(mnist_path);
+	} else {
+		data = create_synthetic_data(20000, 2000, 784, 10, 0.2, 1234);
+	}
+	compress_training_inputs(data, SPARSE_INPUT_MAX_DENSITY);
+	if (n_val < 0 || n_val >= data->n_train) {
+		n_val = data->n_train / 10;
+	}
+	/* Views: fit on the start of the training set, validate on its end */
+	fit = *data;
+	fit.n_train = data->n_train - n_val;
+	val = *data;
+	val.n_test = n_val;
+	val.inputs_testing = data->inputs_training + fit.n_train;
+	val.labels_testing = data->labels_training + fit.n_train;
+
+	/* Every run starts from the same weights */
+	init = create_network(3, data->inputs_size, hidden, data->outputs_size);
+	tune_load(init);
+	if (threads > 0) {
+		pool_set_threads(threads);
+	}
+	if (n_batches < 0) {
+		tune_current(&tuned);
+		batches[0] = tuned.mini_batch_size;
+		batches[1] = 3 * tuned.mini_batch_size;
+		n_batches = 2;
+	}
+	n_trials = n_batches * n_lrs * n_lambdas;
+	trials = calloc(n_trials, sizeof(Trial));
+	order = malloc(sizeof(Trial *) * n_trials);
+	for (i = 0; i < n_trials; i++) {
+		Trial *t = &trials[i];
+		t->mini_batch_size = (int)batches[i / (n_lrs * n_lambdas)];
+		t->learning_rate = lrs[i / n_lambdas % n_lrs];
+		t->lambda = lambdas[i % n_lambdas];
+		t->net = create_network_from_sizes(init->n_layers, init->sizes);
+		vector_copy(t->net->params->data, init->params->data,
+					init->params->size);
+		t->ws = create_sgd_workspace(t->net, &fit, t->mini_batch_size, i + 1);
+		t->stopped = -1;
+		order[i] = t;
+	}
+
+	fprintf(stderr, "%d configurations, %d threads, %d training and %d "
+			"validation samples\n", n_trials, pool_threads(), fit.n_train,
+			n_val);
+	t0 = now_ns();
+	rung.trials = order;
+	rung.fit = &fit;
+	rung.val = &val;
+	rung.epochs = min_epochs;
+	n_alive = n_trials;
+	for (rung_i = 0; ; rung_i++) {
+		if (rung.epochs > max_epochs) {
+			rung.epochs = max_epochs;
+		}
+		/* One task per run: the runs are long and independent */
+		parallel_for(0, n_alive, 1, train_trials, &rung);
+		qsort(order, n_alive, sizeof(Trial *), cmp_trials);
+		k = n_alive / eta > 0 ? n_alive / eta : 1;
+		fprintf(stderr, "rung %d: %d runs at %d epochs, best %.2f%%, "
+				"keeping %d\n", rung_i, n_alive, rung.epochs,
+				100 * order[0]->val_acc,
+				rung.epochs >= max_epochs ? n_alive : k);
+		if (n_alive == 1 || rung.epochs >= max_epochs) {
+			break;
+		}
+		for (j = k; j < n_alive; j++) {
+			order[j]->stopped = rung_i;
+		}
+		n_alive = k;
+		rung.epochs *= eta;
+	}
+	t_end = now_ns();
+	for (i = 0; i < n_trials; i++) {
+		trials[i].test_acc = test_accuracy(trials[i].net, data);
+	}
+	qsort(order, n_trials, sizeof(Trial *), cmp_trials);
+
+	printf("%4s %6s %8s %8s %7s %9s %9s %9s  %s\n", "rank", "batch", "lr",
+		   "lambda", "epochs", "val acc", "test acc", "train s", "status");
+	for (i = 0; i < n_trials; i++) {
+		Trial *t = order[i];
+		char status[32];
+		if (t->stopped < 0) {
+			snprintf(status, sizeof(status), i == 0 ? "best" : "finished");
+		} else {
+			snprintf(status, sizeof(status), "stopped at rung %d",
+					 t->stopped);
+		}
+		printf("%4d %6d %8g %8g %7d %8.2f%% %8.2f%% %9.2f  %s\n", i + 1,
+			   t->mini_batch_size, t->learning_rate, t->lambda, t->epochs,
+			   100 * t->val_acc, 100 * t->test_acc, t->train_s, status);
+	}
+	for (i = 0, j = 0; i < n_trials; i++) {
+		j += trials[i].epochs;
+	}
+	printf("sweep time: %.2f s, %d epochs trained in total (a full grid: "
+		   "%d)\n", (t_end - t0) / 1e9, j, n_trials * max_epochs);
+
+	for (i = 0; i < n_trials; i++) {
+		free_sgd_workspace(trials[i].ws);
+		destroy_network(trials[i].net);
+	}
+	free(trials);
+	free(order);
+	destroy_network(init);
+	free_training_data(data);
+	return 0;
+}
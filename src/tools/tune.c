@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <neuron.h>
+#include <tune.h>
+
+/*
+ * Autotuning tool: tunes the kernels for the layer shapes of a network
+ * on this host (see tune.h), stores the settings in the tuning cache, and
+ * reports the time of a few batch sizes through feedforward_batch with
+ * the settings it started with and with the tuned ones.
+ */
+
+#define MAX_LAYERS 256
+
+static const int report_batches[] = {1, 4, 16, 64, 256};
+#define N_REPORT (int)(sizeof(report_batches) / sizeof(report_batches[0]))
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Microseconds per sample of feedforward_batch for batches of n, over
+ * about min_time seconds. */
+static double batch_time(Network *net, int n, double min_time)
+{
+	int i, j;
+	long calls = 0;
+	double start, t;
+	Matrix *inputs = create_matrix(net->sizes[0], n);
+	for (i = 0; i < inputs->n_rows; i++) {
+		for (j = 0; j < n; j++) {
+			inputs->data[i][j] = (double)rand() / RAND_MAX;
+		}
+	}
+	free_matrix(feedforward_batch(net, inputs));
+	start = now_ns();
+	do {
+		free_matrix(feedforward_batch(net, inputs));
+		calls++;
+		t = now_ns() - start;
+	} while (t < min_time * 1e9);
+	free_matrix(inputs);
+	return t / 1e3 / calls / n;
+}
+
+static void print_config(char *name, TuneConfig *c)
+{
+	printf("%-8s threads %d, blocking %dx%d, ", name, c->n_threads,
+		   c->block_k, c->block_n);
+	if (c->blocked_min_cols > 0) {
+		printf("blocked from %d columns, ", c->blocked_min_cols);
+	} else {
+		printf("never blocked, ");
+	}
+	if (c->batch_crossover > 0) {
+		printf("batches below %d by sample, ", c->batch_crossover);
+	} else {
+		printf("always batched, ");
+	}
+	printf("mini batch %d\n", c->mini_batch_size);
+}
+
+/* Parse a comma separated list of layer sizes; returns how many. */
+static int parse_sizes(char *s, int *sizes)
+{
+	int n = 0;
+	char *tok = strtok(s, ",");
+	while (tok != NULL && n < MAX_LAYERS) {
+		sizes[n++] = atoi(tok);
+		tok = strtok(NULL, ",");
+	}
+	return n;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --sizes LIST     layer sizes (default 784,30,10)\n"
+			"  --net FILE       network (see save_network) to tune for\n"
+			"  --min-time S     seconds per candidate (default %g)\n"
+			"  --cache FILE     tuning cache (default %s)\n"
+			"  --no-store       only report, leave the cache alone\n",
+			prog, TUNE_MIN_TIME, tune_cache_path());
+}
+
+int main(int argc, char *argv[])
+{
+	int i, n_layers = 3, store = 1;
+	int sizes[MAX_LAYERS] = {784, 30, 10};
+	double min_time = TUNE_MIN_TIME, before[N_REPORT], after;
+	char *net_path = NULL, *cache = tune_cache_path();
+	TuneConfig start, tuned;
+	Network *net;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--sizes") && i + 1 < argc) {
+			n_layers = parse_sizes(argv[++i], sizes);
+		} else if (!strcmp(argv[i], "--net") && i + 1 < argc) {
+			net_path = argv[++i];
+		} else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+			min_time = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+			cache = argv[++i];
+		} else if (!strcmp(argv[i], "--no-store")) {
+			store = 0;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (net_path != NULL) {
+		net = load_network(net_path);
+		if (net == NULL) {
+			return 1;
+		}
+	} else if (n_layers >= 2) {
+		net = create_network_from_sizes(n_layers, sizes);
+	} else {
+		usage(argv[0]);
+		return 1;
+	}
+
+	tune_current(&start);
+	if (tune_cache_lookup(cache, net, &tuned)) {
+		print_config("cached", &tuned);
+	}
+	print_config("initial", &start);
+	for (i = 0; i < N_REPORT; i++) {
+		before[i] = batch_time(net, report_batches[i], min_time);
+	}
+	if (!tune_network(net, min_time, &tuned)) {
+		destroy_network(net);
+		return 1;
+	}
+	print_config("tuned", &tuned);
+
+	printf("\n%-6s %14s %14s %8s\n", "batch", "initial us/s", "tuned us/s",
+		   "speedup");
+	for (i = 0; i < N_REPORT; i++) {
+		after = batch_time(net, report_batches[i], min_time);
+		printf("%-6d %14.2f %14.2f %7.2fx\n", report_batches[i], before[i],
+			   after, before[i] / after);
+	}
+
+	if (store) {
+		if (!tune_cache_store(cache, net, &tuned)) {
+			destroy_network(net);
+			return 1;
+		}
+		printf("\nStored in %s\n", cache);
+	}
+	destroy_network(net);
+	return 0;
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <tune.h>
+#include <matrix.h>
+#include <pool.h>
+#include <strassen.h>
+#include <synthetic.h>
+
+/* The SIMD variant of this build, part of the cache key */
+#if defined(__AVX512F__)
+#define TUNE_SIMD "avx512f"
+#elif defined(__AVX2__)
+#define TUNE_SIMD "avx2"
+#elif defined(__AVX__)
+#define TUNE_SIMD "avx"
+#elif defined(__SSE2__)
+#define TUNE_SIMD "sse2"
+#else
+#define TUNE_SIMD "scalar"
+#endif
+
+/* Inputs of the batched candidates, samples of the training ones */
+#define TUNE_BATCH 256
+#define TUNE_SAMPLES 1000
+
+#define LINE_MAX_LEN 1024
+#define PATH_MAX_LEN 4096
+
+#define ARRAY_LEN(a) (int)(sizeof(a) / sizeof((a)[0]))
+
+static const int block_k_candidates[] = {32, 64, 128, 256};
+static const int block_n_candidates[] = {64, 128, 256, 512};
+static const int cols_candidates[] = {2, 4, 8, 16, 32, 64, 128, 256};
+static const int batch_candidates[] = {2, 4, 8, 16, 32, 64};
+static const int mini_batch_candidates[] = {1, 2, 5, 10, 20, 50, 100};
+
+/* The mini_batch_size of tune_current, for the callers of SGD */
+static int mini_batch_size = 10;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The settings in use, in *c. */
+void tune_current(TuneConfig *c)
+{
+	c->n_threads = pool_threads();
+	gemm_blocking(&c->block_k, &c->block_n);
+	c->blocked_min_cols = matrix_prod_blocked_min_cols();
+	c->batch_crossover = feedforward_batch_crossover();
+	c->mini_batch_size = mini_batch_size;
+}
+
+/* Use the settings of c from now on. */
+void tune_apply(TuneConfig *c)
+{
+	if (c->n_threads > 0 && c->n_threads != pool_threads()) {
+		pool_set_threads(c->n_threads);
+	}
+	gemm_set_blocking(c->block_k, c->block_n);
+	matrix_prod_set_blocked(c->blocked_min_cols);
+	feedforward_set_batch_crossover(c->batch_crossover);
+	if (c->mini_batch_size > 0) {
+		mini_batch_size = c->mini_batch_size;
+	}
+}
+
+/*********************** Benchmarks ***********************/
+
+/* What the candidates run on: a copy of the network, TUNE_BATCH inputs
+ * of every layer (as columns), TUNE_SAMPLES training samples. Only the
+ * shapes matter, not the values. */
+typedef struct {
+	Network *net;
+	Matrix **inputs;
+	TrainData *data;
+	ParamBuffer *nabla;
+	/* columns of the products and batches, or mini batch size */
+	int n;
+} Bench;
+
+static Matrix *random_inputs(int n_rows)
+{
+	int i, j;
+	Matrix *m = create_matrix(n_rows, TUNE_BATCH);
+	for (i = 0; i < n_rows; i++) {
+		for (j = 0; j < TUNE_BATCH; j++) {
+			m->data[i][j] = (double)rand() / RAND_MAX;
+		}
+	}
+	return m;
+}
+
+static void create_bench(Bench *b, Network *net)
+{
+	int l, last = net->n_layers - 1;
+	b->net = create_network_from_sizes(net->n_layers, net->sizes);
+	memcpy(b->net->params->data, net->params->data,
+		   sizeof(double) * net->params->size);
+	b->inputs = malloc(sizeof(Matrix *) * last);
+	for (l = 0; l < last; l++) {
+		b->inputs[l] = random_inputs(net->sizes[l]);
+	}
+	b->data = create_synthetic_data(TUNE_SAMPLES, 0, net->sizes[0],
+									net->sizes[last], 0.2, 1234);
+	b->nabla = create_param_buffer(net->n_layers, net->sizes);
+}
+
+static void free_bench(Bench *b)
+{
+	int l;
+	for (l = 0; l < b->net->n_layers - 1; l++) {
+		free_matrix(b->inputs[l]);
+	}
+	free(b->inputs);
+	free_training_data(b->data);
+	free_param_buffer(b->nabla);
+	destroy_network(b->net);
+}
+
+/* The first rows x n doubles of m, as a matrix. */
+static Matrix *first_columns(Matrix *m, int n)
+{
+	return create_matrix_view(m->data[0], m->n_rows, n);
+}
+
+/* The product of every layer's weights by n of its inputs. */
+static void run_products(Bench *b)
+{
+	int l;
+	Matrix *x;
+	for (l = 0; l < b->net->n_layers - 1; l++) {
+		x = first_columns(b->inputs[l], b->n);
+		free_matrix(matrix_prod_optim(b->net->weights[l], x));
+		free_matrix_view(x);
+	}
+}
+
+/* feedforward_batch of n inputs. */
+static void run_batch(Bench *b)
+{
+	Matrix *x = first_columns(b->inputs[0], b->n);
+	free_matrix(feedforward_batch(b->net, x));
+	free_matrix_view(x);
+}
+
+/* An epoch of SGD over the training samples, in mini batches of n. */
+static void run_training(Bench *b)
+{
+	int k;
+	TrainData *batch;
+	for (k = 0; k + b->n <= b->data->n_train; k += b->n) {
+		batch = subset_training_data(b->data, k, b->n);
+		memset(b->nabla->data, 0, sizeof(double) * b->nabla->size);
+		network_gradient(b->net, batch, b->nabla);
+		network_apply_gradient(b->net, b->nabla, b->n, 0.1, 0.0,
+							   b->data->n_train, 0.0);
+		free(batch);
+	}
+}
+
+/* Nanoseconds per call of fn on n: the best of three runs of at least
+ * min_time / 3 seconds each, after a warm-up call. */
+static double time_call(void (*fn)(Bench *), Bench *b, int n,
+						double min_time)
+{
+	int rep;
+	long calls;
+	double start, t, best = 0.0;
+	b->n = n;
+	fn(b);
+	for (rep = 0; rep < 3; rep++) {
+		calls = 0;
+		start = now_ns();
+		do {
+			fn(b);
+			calls++;
+			t = now_ns() - start;
+		} while (t < min_time * 1e9 / 3);
+		if (rep == 0 || t / calls < best) {
+			best = t / calls;
+		}
+	}
+	return best;
+}
+
+/* The smallest of the n candidates from which 'wins' holds for all the
+ * larger ones too; 'none' if it does not hold for the largest. */
+static int winning_tail(const int *candidates, int *wins, int n, int none)
+{
+	int i = n;
+	while (i > 0 && wins[i-1]) {
+		i--;
+	}
+	return i == n ? none : candidates[i];
+}
+
+/* Benchmark the candidate settings (see tune.h) on the layer shapes of
+ * net, each for about min_time seconds (<= 0 for TUNE_MIN_TIME), and
+ * leave the best ones in use and in *best. net itself is not modified.
+ * Takes a few seconds with the default min_time. Returns 1 on success, 0
+ * on error.
+ */
+int tune_network(Network *net, double min_time, TuneConfig *best)
+{
+	int i, j, t, max_threads, wins[16];
+	double time, best_time;
+	double times[ARRAY_LEN(mini_batch_candidates)];
+	TuneConfig c;
+	Bench b;
+	if (net->n_layers < 2) {
+		fprintf(stderr, "tune_network ERROR: %d layers.\n", net->n_layers);
+		return 0;
+	}
+	if (min_time <= 0.0) {
+		min_time = TUNE_MIN_TIME;
+	}
+	tune_current(&c);
+	create_bench(&b, net);
+
+	/* Threads, on a whole batch: 1, 2, 4... and all the CPUs */
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	best_time = -1.0;
+	for (t = 1; ; t = 2 * t < max_threads ? 2 * t : max_threads) {
+		pool_set_threads(t);
+		time = time_call(run_batch, &b, TUNE_BATCH, min_time);
+		if (best_time < 0.0 || time < best_time) {
+			best_time = time;
+			c.n_threads = t;
+		}
+		if (t >= max_threads) {
+			break;
+		}
+	}
+	tune_apply(&c);
+
+	/* Blocking of the blocked kernel, on products of a whole batch */
+	matrix_prod_set_blocked(1);
+	best_time = -1.0;
+	for (i = 0; i < ARRAY_LEN(block_k_candidates); i++) {
+		for (j = 0; j < ARRAY_LEN(block_n_candidates); j++) {
+			gemm_set_blocking(block_k_candidates[i], block_n_candidates[j]);
+			time = time_call(run_products, &b, TUNE_BATCH, min_time);
+			if (best_time < 0.0 || time < best_time) {
+				best_time = time;
+				c.block_k = block_k_candidates[i];
+				c.block_n = block_n_candidates[j];
+			}
+		}
+	}
+	gemm_set_blocking(c.block_k, c.block_n);
+
+	/* Row kernel against blocked kernel, by columns */
+	for (i = 0; i < ARRAY_LEN(cols_candidates); i++) {
+		matrix_prod_set_blocked(0);
+		time = time_call(run_products, &b, cols_candidates[i], min_time);
+		matrix_prod_set_blocked(1);
+		wins[i] = time_call(run_products, &b, cols_candidates[i],
+							min_time) < time;
+	}
+	c.blocked_min_cols = winning_tail(cols_candidates, wins,
+									  ARRAY_LEN(cols_candidates), 0);
+	matrix_prod_set_blocked(c.blocked_min_cols);
+
+	/* Batched against sample by sample, by batch size: if the samples
+	 * win even for the largest, batches up to twice that go by sample */
+	for (i = 0; i < ARRAY_LEN(batch_candidates); i++) {
+		feedforward_set_batch_crossover(batch_candidates[i] + 1);
+		time = time_call(run_batch, &b, batch_candidates[i], min_time);
+		feedforward_set_batch_crossover(0);
+		wins[i] = time_call(run_batch, &b, batch_candidates[i],
+							min_time) < time;
+	}
+	c.batch_crossover = winning_tail(batch_candidates, wins,
+			ARRAY_LEN(batch_candidates),
+			2 * batch_candidates[ARRAY_LEN(batch_candidates) - 1]);
+	if (c.batch_crossover == batch_candidates[0]) {
+		c.batch_crossover = 0;
+	}
+	feedforward_set_batch_crossover(c.batch_crossover);
+
+	/* Mini batch size, by training throughput */
+	best_time = -1.0;
+	for (i = 0; i < ARRAY_LEN(mini_batch_candidates); i++) {
+		t = mini_batch_candidates[i];
+		times[i] = time_call(run_training, &b, t, min_time) /
+			(TUNE_SAMPLES - TUNE_SAMPLES % t);
+		if (best_time < 0.0 || times[i] < best_time) {
+			best_time = times[i];
+		}
+	}
+	i = 0;
+	while (times[i] > best_time * (1.0 + TUNE_BATCH_SLACK)) {
+		i++;
+	}
+	c.mini_batch_size = mini_batch_candidates[i];
+
+	tune_apply(&c);
+	free_bench(&b);
+	*best = c;
+	return 1;
+}
+
+/************************* Cache *************************/
+
+/* The path of the tuning cache (see tune.h), in a static buffer. */
+char *tune_cache_path(void)
+{
+	static char path[PATH_MAX_LEN];
+	char *env = getenv("GLIA_TUNE_CACHE");
+	if (env != NULL && *env) {
+		snprintf(path, sizeof(path), "%s", env);
+	} else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env) {
+		snprintf(path, sizeof(path), "%s/glia/tune", env);
+	} else {
+		env = getenv("HOME");
+		snprintf(path, sizeof(path), "%s/.cache/glia/tune",
+				 env != NULL ? env : ".");
+	}
+	return path;
+}
+
+/* The CPU model, as in /proc/cpuinfo ("unknown" if not found). */
+static void cpu_model(char *model, int size)
+{
+	char line[LINE_MAX_LEN], *p;
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	snprintf(model, size, "unknown");
+	if (f == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "model name", 10) == 0 &&
+			(p = strchr(line, ':')) != NULL) {
+			p += strspn(p + 1, " \t") + 1;
+			p[strcspn(p, "\n")] = '\0';
+			snprintf(model, size, "%s", p);
+			break;
+		}
+	}
+	fclose(f);
+	/* Tabs separate the fields */
+	for (p = model; *p; p++) {
+		if (*p == '\t') {
+			*p = ' ';
+		}
+	}
+}
+
+/* The key of net on this host, up to its last tab. */
+static void cache_key(Network *net, char *key, int size)
+{
+	int i, len;
+	char model[256];
+	cpu_model(model, sizeof(model));
+	len = snprintf(key, size, "cpu=%s\tsimd=%s\tsizes=", model, TUNE_SIMD);
+	for (i = 0; i < net->n_layers && len < size; i++) {
+		len += snprintf(key + len, size - len, "%s%d", i ? "-" : "",
+						net->sizes[i]);
+	}
+	if (len < size) {
+		snprintf(key + len, size - len, "\t");
+	}
+}
+
+/* Parse the settings after the key of a cache line. Returns 1 if they are
+ * all there. */
+static int parse_settings(char *s, TuneConfig *c)
+{
+	return sscanf(s, "threads=%d\tblock_k=%d\tblock_n=%d\t"
+				  "blocked_min_cols=%d\tbatch_crossover=%d\t"
+				  "mini_batch_size=%d", &c->n_threads, &c->block_k,
+				  &c->block_n, &c->blocked_min_cols, &c->batch_crossover,
+				  &c->mini_batch_size) == 6;
+}
+
+/* Look net up in the cache at path, for this host. Returns 1 and fills
+ * *c if found, else 0 (also if there is no cache). */
+int tune_cache_lookup(char *path, Network *net, TuneConfig *c)
+{
+	char key[LINE_MAX_LEN], line[LINE_MAX_LEN];
+	int found = 0, key_len;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+	cache_key(net, key, sizeof(key));
+	key_len = strlen(key);
+	while (!found && fgets(line, sizeof(line), f) != NULL) {
+		found = strncmp(line, key, key_len) == 0 &&
+			parse_settings(line + key_len, c);
+	}
+	fclose(f);
+	return found;
+}
+
+/* Create the directories leading to path. */
+static void make_parents(char *path)
+{
+	char dir[PATH_MAX_LEN], *p;
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+}
+
+/* Store c as the settings of net on this host in the cache at path,
+ * replacing those it had. The file is rewritten to a temporary one
+ * renamed over it, so readers never see it half written. Returns 1 on
+ * success, 0 on error.
+ */
+int tune_cache_store(char *path, Network *net, TuneConfig *c)
+{
+	char key[LINE_MAX_LEN], line[LINE_MAX_LEN], tmp[PATH_MAX_LEN];
+	int ok, key_len;
+	FILE *in, *out;
+	cache_key(net, key, sizeof(key));
+	key_len = strlen(key);
+	make_parents(path);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		fprintf(stderr, "tune_cache_store ERROR: could not write %s: %s.\n",
+				tmp, strerror(errno));
+		return 0;
+	}
+	in = fopen(path, "r");
+	if (in != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (strncmp(line, key, key_len) != 0) {
+				fputs(line, out);
+			}
+		}
+		fclose(in);
+	}
+	fprintf(out, "%sthreads=%d\tblock_k=%d\tblock_n=%d\t"
+			"blocked_min_cols=%d\tbatch_crossover=%d\tmini_batch_size=%d\n",
+			key, c->n_threads, c->block_k, c->block_n, c->blocked_min_cols,
+			c->batch_crossover, c->mini_batch_size);
+	ok = !ferror(out);
+	ok = fclose(out) == 0 && ok;
+	if (ok && rename(tmp, path) != 0) {
+		ok = 0;
+	}
+	if (!ok) {
+		fprintf(stderr, "tune_cache_store ERROR: could not write %s.\n",
+				path);
+		remove(tmp);
+	}
+	return ok;
+}
+
+/* Apply the cached settings of net for this host, if any, unless the
+ * GLIA_TUNE environment variable is 0. For programs to call at startup,
+ * before any parallel work. Returns 1 if settings were applied.
+ */
+int tune_load(Network *net)
+{
+	TuneConfig c;
+	char *env = getenv("GLIA_TUNE");
+	if (env != NULL && strcmp(env, "0") == 0) {
+		return 0;
+	}
+	if (!tune_cache_lookup(tune_cache_path(), net, &c)) {
+		return 0;
+	}
+	tune_apply(&c);
+	return 1;
+}
@@ -0,0 +1,74 @@
+#include <neuron.h>
+
+#ifndef TUNE_H
+#define TUNE_H
+
+/*
+ * Per-machine autotuning of the kernels for the layer shapes of a
+ * network, with a persisted cache of the results.
+ *
+ * tune_network benchmarks candidate settings one knob after the other,
+ * each with the best ones found so far, on the products and passes of
+ * the network itself:
+ *
+ *   - the threads of the pool (pool_set_threads),
+ *   - the blocking of gemm_blocked (gemm_set_blocking),
+ *   - the columns from which matrix_prod_optim uses gemm_blocked rather
+ *     than the row kernel (matrix_prod_set_blocked),
+ *   - the batch size below which feedforward_batch runs sample by sample
+ *     (feedforward_set_batch_crossover),
+ *   - the smallest mini_batch_size within TUNE_BATCH_SLACK of the best
+ *     training throughput (of network_gradient + network_apply_gradient).
+ *
+ * The SIMD variant is chosen at compile time (MARCH), so it is part of
+ * the key the results are cached under, with the CPU model (as in
+ * /proc/cpuinfo) and the layer sizes. The cache is a text file, one line
+ * per key:
+ *
+ *   cpu=<model>\tsimd=<variant>\tsizes=784-30-10\tthreads=4\t...
+ *
+ * at $GLIA_TUNE_CACHE, else $XDG_CACHE_HOME/glia/tune, else
+ * $HOME/.cache/glia/tune. Programs call tune_load at startup, which
+ * applies the cached settings for their network if there are any (unless
+ * the GLIA_TUNE environment variable is 0); the tune tool fills the
+ * cache.
+ *
+ * The settings are process-wide: tune_apply, like pool_set_threads, must
+ * not be called while parallel work is running.
+ */
+
+/* Mini batch sizes whose throughput is within this fraction of the best
+ * are as good: the smallest of them is kept, as it converges in fewer
+ * epochs. */
+#define TUNE_BATCH_SLACK 0.05
+
+/* Default time spent measuring each candidate, in seconds. */
+#define TUNE_MIN_TIME 0.05
+
+/* TuneConfig struct. The tuned settings; see above. */
+typedef struct {
+	int n_threads;
+	int block_k;
+	int block_n;
+	/* 0: never blocked */
+	int blocked_min_cols;
+	/* 0: always batched */
+	int batch_crossover;
+	int mini_batch_size;
+} TuneConfig;
+
+void tune_current(TuneConfig *config);
+
+void tune_apply(TuneConfig *config);
+
+int tune_network(Network *net, double min_time, TuneConfig *best);
+
+char *tune_cache_path(void);
+
+int tune_cache_lookup(char *path, Network *net, TuneConfig *config);
+
+int tune_cache_store(char *path, Network *net, TuneConfig *config);
+
+int tune_load(Network *net);
+
+#endif // TUNE_H